@@ -17,6 +17,7 @@
 #include "dir.h"
 #include "gettext.h"
 #include "path.h"
+#include "pattern-matcher.h"
 #include "utf8.h"
 #include "quote.h"
 #include "read-cache-ll.h"
@@ -434,6 +435,7 @@ struct attr_stack {
 	unsigned num_matches;
 	unsigned alloc;
 	struct match_attr **attrs;
+	struct pattern_matcher *matcher;
 };
 
 static void attr_stack_free(struct attr_stack *e)
@@ -457,6 +459,7 @@ static void attr_stack_free(struct attr_stack *e)
 		free(a);
 	}
 	free(e->attrs);
+	pattern_matcher_free(e->matcher);
 	free(e);
 }
 
@@ -894,6 +897,28 @@ int git_attr_system_is_enabled(void)
 
 static GIT_PATH_FUNC(git_path_info_attributes, INFOATTRIBUTES_FILE)
 
+/*
+ * Index the patterns of a long attributes file, now that we know
+ * which directory they are relative to.
+ */
+static void build_attr_matcher(struct attr_stack *e)
+{
+	unsigned i;
+
+	if (e->matcher || !pattern_matcher_wanted(e->num_matches))
+		return;
+	e->matcher = pattern_matcher_new();
+	for (i = 0; i < e->num_matches; i++) {
+		const struct match_attr *a = e->attrs[i];
+
+		if (a->is_macro)
+			continue;
+		pattern_matcher_add(e->matcher, i, e->origin, e->originlen,
+				    a->u.pat.pattern, a->u.pat.patternlen,
+				    a->u.pat.nowildcardlen, a->u.pat.flags);
+	}
+}
+
 static void push_stack(struct attr_stack **attr_stack_p,
 		       struct attr_stack *elem, char *origin, size_t originlen)
 {
@@ -901,6 +926,7 @@ static void push_stack(struct attr_stack **attr_stack_p,
 		elem->origin = origin;
 		if (origin)
 			elem->originlen = originlen;
+		build_attr_matcher(elem);
 		elem->prev = *attr_stack_p;
 		*attr_stack_p = elem;
 	}
@@ -1085,6 +1111,44 @@ static int fill_one(struct all_attrs_item *all_attrs,
 	return rem;
 }
 
+struct attr_match_data {
+	const char *path;
+	int pathlen;
+	int basename_offset;
+	const struct attr_stack *stack;
+};
+
+static int attr_pattern_matches(int pos, void *data_)
+{
+	struct attr_match_data *data = data_;
+	const struct match_attr *a = data->stack->attrs[pos];
+
+	return path_matches(data->path, data->pathlen, data->basename_offset,
+			    &a->u.pat, data->stack->origin ? data->stack->origin : "",
+			    data->stack->originlen);
+}
+
+static int fill_from_matcher(const char *path, int pathlen, int basename_offset,
+			     const struct attr_stack *stack,
+			     struct all_attrs_item *all_attrs, int rem)
+{
+	struct attr_match_data data = {
+		.path = path,
+		.pathlen = pathlen,
+		.basename_offset = basename_offset,
+		.stack = stack,
+	};
+	int isdir = (pathlen && path[pathlen - 1] == '/');
+	int i = stack->num_matches;
+
+	while (rem > 0 &&
+	       (i = pattern_matcher_find(stack->matcher, path, pathlen - isdir,
+					 basename_offset, i,
+					 attr_pattern_matches, &data)) >= 0)
+		rem = fill_one(all_attrs, stack->attrs[i], rem);
+	return rem;
+}
+
 static int fill(const char *path, int pathlen, int basename_offset,
 		const struct attr_stack *stack,
 		struct all_attrs_item *all_attrs, int rem)
@@ -1093,6 +1157,12 @@ static int fill(const char *path, int pathlen, int basename_offset,
 		unsigned i;
 		const char *base = stack->origin ? stack->origin : "";
 
+		if (stack->matcher) {
+			rem = fill_from_matcher(path, pathlen, basename_offset,
+						stack, all_attrs, rem);
+			continue;
+		}
+
 		for (i = stack->num_matches; 0 < rem && 0 < i; i--) {
 			const struct match_attr *a = stack->attrs[i - 1];
 			if (a->is_macro)
@@ -0,0 +1,250 @@
+#include "git-compat-util.h"
+#include "batch-stat.h"
+#include "gettext.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#ifndef IO_URING_OP_SUPPORTED
+/* headers from before statx requests could be probed for */
+#undef HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+/*
+ * The number of requests kept in flight at once.
+ */
+#define STAT_BATCH_DEPTH 1024
+
+struct stat_batch {
+	int fd;
+	unsigned sq_entries;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	/* one statx buffer per request in flight, and who it is for */
+	struct statx *buf;
+	size_t *slot_req;
+	unsigned *free_slots;
+	unsigned free_nr;
+};
+
+static int statx_supported(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t nr_ops = IORING_OP_STATX + 1;
+	int ret;
+
+	probe = xcalloc(1, st_add(sizeof(*probe),
+				  st_mult(nr_ops, sizeof(probe->ops[0]))));
+	ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		      probe, nr_ops);
+	ret = !ret && probe->last_op >= IORING_OP_STATX &&
+	      (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ret;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+struct stat_batch *stat_batch_new(void)
+{
+	struct io_uring_params p = { 0 };
+	struct stat_batch *sb;
+	unsigned i;
+	int fd;
+
+	fd = syscall(__NR_io_uring_setup, STAT_BATCH_DEPTH, &p);
+	if (fd < 0)
+		return NULL;
+	if (!statx_supported(fd)) {
+		close(fd);
+		return NULL;
+	}
+
+	CALLOC_ARRAY(sb, 1);
+	sb->fd = fd;
+	sb->sq_entries = p.sq_entries;
+	sb->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	sb->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sb->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (sb->cq_ring_size > sb->sq_ring_size)
+			sb->sq_ring_size = sb->cq_ring_size;
+		sb->cq_ring_size = 0;
+		sb->sq_ring = sb->cq_ring = map_ring(fd, sb->sq_ring_size,
+						     IORING_OFF_SQ_RING);
+	} else {
+		sb->sq_ring = map_ring(fd, sb->sq_ring_size, IORING_OFF_SQ_RING);
+		sb->cq_ring = map_ring(fd, sb->cq_ring_size, IORING_OFF_CQ_RING);
+	}
+	sb->sqes = map_ring(fd, sb->sqes_size, IORING_OFF_SQES);
+	if (!sb->sq_ring || !sb->cq_ring || !sb->sqes) {
+		stat_batch_free(sb);
+		return NULL;
+	}
+
+	sb->sq_head = (unsigned *)((char *)sb->sq_ring + p.sq_off.head);
+	sb->sq_tail = (unsigned *)((char *)sb->sq_ring + p.sq_off.tail);
+	sb->sq_mask = (unsigned *)((char *)sb->sq_ring + p.sq_off.ring_mask);
+	sb->sq_array = (unsigned *)((char *)sb->sq_ring + p.sq_off.array);
+	sb->cq_head = (unsigned *)((char *)sb->cq_ring + p.cq_off.head);
+	sb->cq_tail = (unsigned *)((char *)sb->cq_ring + p.cq_off.tail);
+	sb->cq_mask = (unsigned *)((char *)sb->cq_ring + p.cq_off.ring_mask);
+	sb->cqes = (struct io_uring_cqe *)((char *)sb->cq_ring + p.cq_off.cqes);
+
+	ALLOC_ARRAY(sb->buf, sb->sq_entries);
+	ALLOC_ARRAY(sb->slot_req, sb->sq_entries);
+	ALLOC_ARRAY(sb->free_slots, sb->sq_entries);
+	for (i = 0; i < sb->sq_entries; i++)
+		sb->free_slots[sb->free_nr++] = i;
+	return sb;
+}
+
+void stat_batch_free(struct stat_batch *sb)
+{
+	if (!sb)
+		return;
+	if (sb->sqes)
+		munmap(sb->sqes, sb->sqes_size);
+	if (sb->cq_ring && sb->cq_ring != sb->sq_ring)
+		munmap(sb->cq_ring, sb->cq_ring_size);
+	if (sb->sq_ring)
+		munmap(sb->sq_ring, sb->sq_ring_size);
+	close(sb->fd);
+	free(sb->buf);
+	free(sb->slot_req);
+	free(sb->free_slots);
+	free(sb);
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/*
+ * Queue as many of the requests from "*next" on as there are free
+ * slots.
+ */
+static void queue_requests(struct stat_batch *sb, struct lstat_request *req,
+			   size_t nr, size_t *next)
+{
+	unsigned tail = *sb->sq_tail;
+
+	while (*next < nr && sb->free_nr) {
+		unsigned idx = tail & *sb->sq_mask;
+		unsigned slot = sb->free_slots[--sb->free_nr];
+		struct io_uring_sqe *sqe = &sb->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)req[*next].path;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (uintptr_t)&sb->buf[slot];
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe->user_data = slot;
+		sb->slot_req[slot] = (*next)++;
+
+		sb->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(sb->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+static size_t reap_completions(struct stat_batch *sb, struct lstat_request *req)
+{
+	unsigned head = *sb->cq_head;
+	unsigned tail = __atomic_load_n(sb->cq_tail, __ATOMIC_ACQUIRE);
+	size_t done = 0;
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &sb->cqes[head & *sb->cq_mask];
+		unsigned slot = cqe->user_data;
+		struct lstat_request *r = &req[sb->slot_req[slot]];
+
+		if (cqe->res < 0) {
+			r->err = -cqe->res;
+		} else {
+			r->err = 0;
+			statx_to_stat(&sb->buf[slot], &r->st);
+		}
+		sb->free_slots[sb->free_nr++] = slot;
+		done++;
+	}
+	__atomic_store_n(sb->cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+void stat_batch_run(struct stat_batch *sb, struct lstat_request *req, size_t nr)
+{
+	size_t next = 0, done = 0;
+
+	while (done < nr) {
+		unsigned to_submit;
+
+		queue_requests(sb, req, nr, &next);
+		to_submit = *sb->sq_tail -
+			__atomic_load_n(sb->sq_head, __ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter, sb->fd, to_submit, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			/*
+			 * Requests still in flight point into our
+			 * buffers, so we cannot just give up on them.
+			 */
+			die_errno(_("io_uring_enter failed"));
+		done += reap_completions(sb, req);
+	}
+}
+
+#else
+
+struct stat_batch *stat_batch_new(void)
+{
+	return NULL;
+}
+
+void stat_batch_free(struct stat_batch *sb UNUSED)
+{
+}
+
+void stat_batch_run(struct stat_batch *sb UNUSED,
+		    struct lstat_request *req UNUSED, size_t nr UNUSED)
+{
+	BUG("stat_batch_run() without io_uring");
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef BATCH_STAT_H
+#define BATCH_STAT_H
+
+/*
+ * Check many paths at once, keeping lots of lstat() calls in flight
+ * instead of waiting for each one in turn. This pays off where stat
+ * latency is high, e.g. on network file systems.
+ *
+ * The requests are handed to the kernel through io_uring (statx);
+ * stat_batch_new() returns NULL where that is not available (not
+ * Linux, too old a kernel, or io_uring disabled), and the caller
+ * should fall back to calling lstat() from several threads.
+ */
+struct stat_batch;
+
+struct lstat_request {
+	const char *path;
+
+	/* filled in by stat_batch_run() */
+	struct stat st;
+	int err;	/* 0, or the errno lstat() would have failed with */
+};
+
+struct stat_batch *stat_batch_new(void);
+void stat_batch_free(struct stat_batch *sb);
+
+/*
+ * lstat() the "path" of each of the "nr" requests, relative to the
+ * current directory. The paths must stay valid until this returns.
+ */
+void stat_batch_run(struct stat_batch *sb, struct lstat_request *req, size_t nr);
+
+#endif
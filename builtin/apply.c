@@ -38,6 +38,12 @@ int cmd_apply(int argc,
 	if (check_apply_state(&state, force_apply))
 		exit(128);
 
+	/* only applying to the index has been taught about a sparse index */
+	if (the_repository->gitdir && state.check_index && !state.threeway) {
+		prepare_repo_settings(the_repository);
+		the_repository->settings.command_requires_full_index = 0;
+	}
+
 	ret = apply_all_patches(&state, argc, argv, options);
 
 	clear_apply_state(&state);
@@ -105,6 +105,7 @@ static void worker_loop(struct checkout *state)
 		report_result(pc_item);
 		release_pc_item_data(pc_item);
 	}
+	finish_writing_pc_items();
 
 	packet_flush(1);
 
@@ -182,6 +182,9 @@ static inline void oe_set_delta_size(struct packing_data *pack,
 #define SET_DELTA_SIZE(obj, val) oe_set_delta_size(&to_pack, obj, val)
 #define SET_DELTA_CHILD(obj, val) oe_set_delta_child(&to_pack, obj, val)
 #define SET_DELTA_SIBLING(obj, val) oe_set_delta_sibling(&to_pack, obj, val)
+#define DELTA_DATA(obj) oe_delta_data(&to_pack, obj)
+#define SET_DELTA_DATA(obj, val) oe_set_delta_data(&to_pack, obj, val)
+#define IN_PACK_OFFSET(obj) oe_in_pack_offset(&to_pack, obj)
 
 static const char *const pack_usage[] = {
 	N_("git pack-objects --stdout [<options>] [< <ref-list> | < <object-list>]"),
@@ -247,10 +250,12 @@ static int exclude_promisor_objects_best_effort;
 static int use_delta_islands;
 
 static unsigned long delta_cache_size = 0;
+static unsigned long peak_delta_cache_size;
 static unsigned long max_delta_cache_size = DEFAULT_DELTA_CACHE_SIZE;
 static unsigned long cache_max_small_delta_size = 1000;
 
 static unsigned long window_memory_limit = 0;
+static unsigned long delta_index_cache_limit = DEFAULT_DELTA_INDEX_CACHE_LIMIT;
 
 static struct string_list uri_protocols = STRING_LIST_INIT_NODUP;
 
@@ -312,7 +317,7 @@ static inline uint32_t pack_name_hash_fn(const char *name)
  * stats
  */
 static uint32_t written, written_delta;
-static uint32_t reused, reused_delta;
+static uint32_t reused, reused_delta, reused_ref_deltas;
 
 /*
  * Indexed commits
@@ -337,6 +342,7 @@ static void *get_delta(struct object_entry *entry)
 	void *buf, *base_buf, *delta_buf;
 	enum object_type type;
 
+	packing_data_lock(&to_pack);
 	buf = repo_read_object_file(the_repository, &entry->idx.oid, &type,
 				    &size);
 	if (!buf)
@@ -344,6 +350,7 @@ static void *get_delta(struct object_entry *entry)
 	base_buf = repo_read_object_file(the_repository,
 					 &DELTA(entry)->idx.oid, &type,
 					 &base_size);
+	packing_data_unlock(&to_pack);
 	if (!base_buf)
 		die("unable to read %s",
 		    oid_to_hex(&DELTA(entry)->idx.oid));
@@ -399,7 +406,9 @@ static unsigned long write_large_blob_data(struct git_istream *st, struct hashfi
 	for (;;) {
 		ssize_t readlen;
 		int zret = Z_OK;
+		packing_data_lock(&to_pack);
 		readlen = read_istream(st, ibuf, sizeof(ibuf));
+		packing_data_unlock(&to_pack);
 		if (readlen == -1)
 			die(_("unable to read %s"), oid_to_hex(oid));
 
@@ -425,6 +434,37 @@ static unsigned long write_large_blob_data(struct git_istream *st, struct hashfi
 	return olen;
 }
 
+/*
+ * Pack windows are shared with the threads of the write pipeline
+ * (see below), which read objects while we write; only hold the lock
+ * while mapping and releasing windows, not while copying from them.
+ */
+static unsigned char *use_pack_locked(struct packed_git *p,
+				      struct pack_window **w_curs,
+				      off_t offset, unsigned long *left)
+{
+	unsigned char *in;
+
+	packing_data_lock(&to_pack);
+	in = use_pack(p, w_curs, offset, left);
+	packing_data_unlock(&to_pack);
+	return in;
+}
+
+static void unuse_pack_locked(struct pack_window **w_curs)
+{
+	packing_data_lock(&to_pack);
+	unuse_pack(w_curs);
+	packing_data_unlock(&to_pack);
+}
+
+static void close_istream_locked(struct git_istream *st)
+{
+	packing_data_lock(&to_pack);
+	close_istream(st);
+	packing_data_unlock(&to_pack);
+}
+
 /*
  * we are going to reuse the existing object data as is.  make
  * sure it is not corrupt.
@@ -442,7 +482,7 @@ static int check_pack_inflate(struct packed_git *p,
 	memset(&stream, 0, sizeof(stream));
 	git_inflate_init(&stream);
 	do {
-		in = use_pack(p, w_curs, offset, &stream.avail_in);
+		in = use_pack_locked(p, w_curs, offset, &stream.avail_in);
 		stream.next_in = in;
 		stream.next_out = fakebuf;
 		stream.avail_out = sizeof(fakebuf);
@@ -455,6 +495,86 @@ static int check_pack_inflate(struct packed_git *p,
 		stream.total_in == len) ? 0 : -1;
 }
 
+/*
+ * Copying runs of at least this many bytes from an existing pack to
+ * stdout is done with sendfile(), so that the data does not have to
+ * be copied to our buffer and then to the pipe or socket.
+ */
+#define ZERO_COPY_MIN (64 * 1024)
+static int zero_copy = 1;
+
+/*
+ * The packfile code closes the descriptor of a pack once the whole
+ * pack is mapped, so keep our own for the pack we are sending from.
+ */
+static struct packed_git *send_pack;
+static int send_pack_fd = -1;
+
+static void send_pack_close(void)
+{
+	if (send_pack_fd >= 0)
+		close(send_pack_fd);
+	send_pack_fd = -1;
+	send_pack = NULL;
+}
+
+static int send_pack_open(struct packed_git *p)
+{
+	if (send_pack == p)
+		return send_pack_fd;
+	send_pack_close();
+	send_pack = p;
+	send_pack_fd = git_open(p->pack_name);
+	return send_pack_fd;
+}
+
+/*
+ * Send "len" bytes at "offset" in "p" to "f" with sendfile(),
+ * accounting for them in the checksum from the mmap'd window (the
+ * pack trailer needs them hashed either way). Returns the number of
+ * bytes sent, which is short only if sendfile() turned out to be
+ * unusable and the caller must copy the rest.
+ */
+static off_t send_pack_data(struct hashfile *f,
+			    struct packed_git *p,
+			    struct pack_window **w_curs,
+			    off_t offset,
+			    off_t len)
+{
+	off_t done = 0;
+	int fd = send_pack_open(p);
+
+	if (fd < 0)
+		return 0;
+
+	hashflush(f);
+	while (done < len) {
+		unsigned char *in;
+		unsigned long avail;
+		ssize_t sent;
+
+		in = use_pack_locked(p, w_curs, offset + done, &avail);
+		if (avail > len - done)
+			avail = (unsigned long)(len - done);
+
+		sent = xsendfile(f->fd, fd, offset + done, avail);
+		if (sent < 0) {
+			if (errno == EINVAL || errno == ENOSYS ||
+			    errno == EOPNOTSUPP) {
+				zero_copy = 0;
+				break;
+			}
+			die_errno(_("unable to send pack data"));
+		}
+		if (!sent)
+			die(_("unexpected end of file in '%s'"), p->pack_name);
+
+		hashfile_account(f, in, sent);
+		done += sent;
+	}
+	return done;
+}
+
 static void copy_pack_data(struct hashfile *f,
 		struct packed_git *p,
 		struct pack_window **w_curs,
@@ -464,8 +584,14 @@ static void copy_pack_data(struct hashfile *f,
 	unsigned char *in;
 	unsigned long avail;
 
+	if (pack_to_stdout && zero_copy && len >= ZERO_COPY_MIN) {
+		off_t sent = send_pack_data(f, p, w_curs, offset, len);
+		offset += sent;
+		len -= sent;
+	}
+
 	while (len) {
-		in = use_pack(p, w_curs, offset, &avail);
+		in = use_pack_locked(p, w_curs, offset, &avail);
 		if (avail > len)
 			avail = (unsigned long)len;
 		hashwrite(f, in, avail);
@@ -485,9 +611,25 @@ static inline int oe_size_greater_than(struct packing_data *pack,
 	return oe_get_size_slow(pack, lhs) > rhs;
 }
 
-/* Return 0 if we will bust the pack-size limit */
+/*
+ * An object compressed ahead of time by the write pipeline (see
+ * write_pipeline_start() below).
+ */
+struct compressed_object {
+	void *data;
+	unsigned long size;
+	unsigned long datalen;
+	enum object_type type;
+	unsigned usable_delta:1;
+};
+
+/*
+ * Return 0 if we will bust the pack-size limit.  If "co" is given,
+ * it holds the compressed object data, which is consumed.
+ */
 static unsigned long write_no_reuse_object(struct hashfile *f, struct object_entry *entry,
-					   unsigned long limit, int usable_delta)
+					   unsigned long limit, int usable_delta,
+					   struct compressed_object *co)
 {
 	unsigned long size, datalen;
 	unsigned char header[MAX_PACK_OBJECT_HEADER],
@@ -498,31 +640,43 @@ static unsigned long write_no_reuse_object(struct hashfile *f, struct object_ent
 	struct git_istream *st = NULL;
 	const unsigned hashsz = the_hash_algo->rawsz;
 
-	if (!usable_delta) {
+	if (co) {
+		buf = co->data;
+		size = co->size;
+		type = co->type;
+		if (usable_delta)
+			type = (allow_ofs_delta && DELTA(entry)->idx.offset) ?
+				OBJ_OFS_DELTA : OBJ_REF_DELTA;
+		free(DELTA_DATA(entry));
+		SET_DELTA_DATA(entry, NULL);
+		entry->z_delta_size = 0;
+	} else if (!usable_delta) {
+		packing_data_lock(&to_pack);
 		if (oe_type(entry) == OBJ_BLOB &&
 		    oe_size_greater_than(&to_pack, entry,
 					 repo_settings_get_big_file_threshold(the_repository)) &&
 		    (st = open_istream(the_repository, &entry->idx.oid, &type,
 				       &size, NULL)) != NULL)
 			buf = NULL;
-		else {
+		else
 			buf = repo_read_object_file(the_repository,
 						    &entry->idx.oid, &type,
 						    &size);
-			if (!buf)
-				die(_("unable to read %s"),
-				    oid_to_hex(&entry->idx.oid));
-		}
+		packing_data_unlock(&to_pack);
+		if (!st && !buf)
+			die(_("unable to read %s"),
+			    oid_to_hex(&entry->idx.oid));
 		/*
 		 * make sure no cached delta data remains from a
 		 * previous attempt before a pack split occurred.
 		 */
-		FREE_AND_NULL(entry->delta_data);
+		free(DELTA_DATA(entry));
+		SET_DELTA_DATA(entry, NULL);
 		entry->z_delta_size = 0;
-	} else if (entry->delta_data) {
+	} else if (DELTA_DATA(entry)) {
 		size = DELTA_SIZE(entry);
-		buf = entry->delta_data;
-		entry->delta_data = NULL;
+		buf = DELTA_DATA(entry);
+		SET_DELTA_DATA(entry, NULL);
 		type = (allow_ofs_delta && DELTA(entry)->idx.offset) ?
 			OBJ_OFS_DELTA : OBJ_REF_DELTA;
 	} else {
@@ -532,7 +686,9 @@ static unsigned long write_no_reuse_object(struct hashfile *f, struct object_ent
 			OBJ_OFS_DELTA : OBJ_REF_DELTA;
 	}
 
-	if (st)	/* large blob case, just assume we don't compress well */
+	if (co)
+		datalen = co->datalen;
+	else if (st)	/* large blob case, just assume we don't compress well */
 		datalen = size;
 	else if (entry->z_delta_size)
 		datalen = entry->z_delta_size;
@@ -559,7 +715,7 @@ static unsigned long write_no_reuse_object(struct hashfile *f, struct object_ent
 			dheader[--pos] = 128 | (--ofs & 127);
 		if (limit && hdrlen + sizeof(dheader) - pos + datalen + hashsz >= limit) {
 			if (st)
-				close_istream(st);
+				close_istream_locked(st);
 			free(buf);
 			return 0;
 		}
@@ -573,7 +729,7 @@ static unsigned long write_no_reuse_object(struct hashfile *f, struct object_ent
 		 */
 		if (limit && hdrlen + hashsz + datalen + hashsz >= limit) {
 			if (st)
-				close_istream(st);
+				close_istream_locked(st);
 			free(buf);
 			return 0;
 		}
@@ -583,7 +739,7 @@ static unsigned long write_no_reuse_object(struct hashfile *f, struct object_ent
 	} else {
 		if (limit && hdrlen + datalen + hashsz >= limit) {
 			if (st)
-				close_istream(st);
+				close_istream_locked(st);
 			free(buf);
 			return 0;
 		}
@@ -591,7 +747,7 @@ static unsigned long write_no_reuse_object(struct hashfile *f, struct object_ent
 	}
 	if (st) {
 		datalen = write_large_blob_data(st, f, &entry->idx.oid);
-		close_istream(st);
+		close_istream_locked(st);
 	} else {
 		hashwrite(f, buf, datalen);
 		free(buf);
@@ -615,6 +771,7 @@ static off_t write_reuse_object(struct hashfile *f, struct object_entry *entry,
 	unsigned hdrlen;
 	const unsigned hashsz = the_hash_algo->rawsz;
 	unsigned long entry_size = SIZE(entry);
+	int bad_crc;
 
 	if (DELTA(entry))
 		type = (allow_ofs_delta && DELTA(entry)->idx.offset) ?
@@ -622,20 +779,23 @@ static off_t write_reuse_object(struct hashfile *f, struct object_entry *entry,
 	hdrlen = encode_in_pack_object_header(header, sizeof(header),
 					      type, entry_size);
 
-	offset = entry->in_pack_offset;
+	offset = IN_PACK_OFFSET(entry);
+	packing_data_lock(&to_pack);
 	if (offset_to_pack_pos(p, offset, &pos) < 0)
 		die(_("write_reuse_object: could not locate %s, expected at "
 		      "offset %"PRIuMAX" in pack %s"),
 		    oid_to_hex(&entry->idx.oid), (uintmax_t)offset,
 		    p->pack_name);
 	datalen = pack_pos_to_offset(p, pos + 1) - offset;
-	if (!pack_to_stdout && p->index_version > 1 &&
-	    check_pack_crc(p, &w_curs, offset, datalen,
-			   pack_pos_to_index(p, pos))) {
+	bad_crc = !pack_to_stdout && p->index_version > 1 &&
+		check_pack_crc(p, &w_curs, offset, datalen,
+			       pack_pos_to_index(p, pos));
+	packing_data_unlock(&to_pack);
+	if (bad_crc) {
 		error(_("bad packed object CRC for %s"),
 		      oid_to_hex(&entry->idx.oid));
-		unuse_pack(&w_curs);
-		return write_no_reuse_object(f, entry, limit, usable_delta);
+		unuse_pack_locked(&w_curs);
+		return write_no_reuse_object(f, entry, limit, usable_delta, NULL);
 	}
 
 	offset += entry->in_pack_header_size;
@@ -645,8 +805,8 @@ static off_t write_reuse_object(struct hashfile *f, struct object_entry *entry,
 	    check_pack_inflate(p, &w_curs, offset, datalen, entry_size)) {
 		error(_("corrupt packed object for %s"),
 		      oid_to_hex(&entry->idx.oid));
-		unuse_pack(&w_curs);
-		return write_no_reuse_object(f, entry, limit, usable_delta);
+		unuse_pack_locked(&w_curs);
+		return write_no_reuse_object(f, entry, limit, usable_delta, NULL);
 	}
 
 	if (type == OBJ_OFS_DELTA) {
@@ -656,7 +816,7 @@ static off_t write_reuse_object(struct hashfile *f, struct object_entry *entry,
 		while (ofs >>= 7)
 			dheader[--pos] = 128 | (--ofs & 127);
 		if (limit && hdrlen + sizeof(dheader) - pos + datalen + hashsz >= limit) {
-			unuse_pack(&w_curs);
+			unuse_pack_locked(&w_curs);
 			return 0;
 		}
 		hashwrite(f, header, hdrlen);
@@ -665,7 +825,7 @@ static off_t write_reuse_object(struct hashfile *f, struct object_entry *entry,
 		reused_delta++;
 	} else if (type == OBJ_REF_DELTA) {
 		if (limit && hdrlen + hashsz + datalen + hashsz >= limit) {
-			unuse_pack(&w_curs);
+			unuse_pack_locked(&w_curs);
 			return 0;
 		}
 		hashwrite(f, header, hdrlen);
@@ -674,17 +834,353 @@ static off_t write_reuse_object(struct hashfile *f, struct object_entry *entry,
 		reused_delta++;
 	} else {
 		if (limit && hdrlen + datalen + hashsz >= limit) {
-			unuse_pack(&w_curs);
+			unuse_pack_locked(&w_curs);
 			return 0;
 		}
 		hashwrite(f, header, hdrlen);
 	}
 	copy_pack_data(f, p, &w_curs, offset, datalen);
-	unuse_pack(&w_curs);
+	unuse_pack_locked(&w_curs);
 	reused++;
 	return hdrlen + datalen;
 }
 
+static int want_reuse(struct object_entry *entry, int usable_delta)
+{
+	if (!reuse_object)
+		return 0;	/* explicit */
+	else if (!IN_PACK(entry))
+		return 0;	/* can't reuse what we don't have */
+	else if (oe_type(entry) == OBJ_REF_DELTA ||
+		 oe_type(entry) == OBJ_OFS_DELTA)
+				/* check_object() decided it for us ... */
+		return usable_delta;
+				/* ... but pack split may override that */
+	else if (oe_type(entry) != entry->in_pack_type)
+		return 0;	/* pack has delta which is unusable */
+	else if (DELTA(entry))
+		return 0;	/* we want to pack afresh */
+	else
+		return 1;	/* we have it in-pack undeltified,
+				 * and we do not need to deltify it.
+				 */
+}
+
+/*
+ * The write pipeline compresses objects that cannot be reused
+ * verbatim on worker threads, ahead of write_one().  Objects are taken
+ * in write order, a batch at a time: while the main thread writes out
+ * one batch, the workers compress the next one.  The main thread
+ * never touches an entry of the batch being compressed until that
+ * batch is complete, so workers can read entries without locking; the
+ * object database and its pack windows are protected by
+ * packing_data_lock(), which the main thread also takes whenever it
+ * reads objects or maps pack windows itself (but not while it
+ * compresses or writes).
+ *
+ * Only the common case of an unsplit pack is handled, since splitting
+ * changes which deltas are usable while the pack is written.
+ */
+#define WRITE_BATCH_OBJECTS 4096
+#define WRITE_BATCH_BYTES (32 * 1024 * 1024)
+
+struct write_batch {
+	uint32_t start, end;
+	struct compressed_object *objs;
+};
+
+static struct write_pipeline {
+	int active;
+	struct object_entry **order;
+	uint32_t nr;
+	/* write order position of each entry of to_pack.objects */
+	uint32_t *pos;
+	unsigned long big_file_threshold;
+
+	/* "ready" is being written out, "next" is being compressed */
+	struct write_batch batches[2];
+	struct write_batch *ready, *next;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, done_cond;
+	uint32_t next_todo, nr_done;
+	int stop;
+	pthread_t *threads;
+	int nr_threads;
+
+	unsigned compressed;
+} write_pipeline;
+
+static void compress_ahead(struct write_batch *batch, uint32_t pos)
+{
+	struct object_entry *entry = write_pipeline.order[pos];
+	struct compressed_object *co = &batch->objs[pos - batch->start];
+	int usable_delta = !!DELTA(entry);
+	void *buf;
+
+	co->data = NULL;
+	if (entry->idx.offset || entry->preferred_base ||
+	    want_reuse(entry, usable_delta))
+		return;
+
+	if (usable_delta) {
+		if (entry->z_delta_size)
+			return; /* compressed during the delta search */
+		if (DELTA_DATA(entry))
+			buf = xmemdupz(DELTA_DATA(entry), DELTA_SIZE(entry));
+		else
+			buf = get_delta(entry);
+		co->size = DELTA_SIZE(entry);
+	} else {
+		if (oe_type(entry) == OBJ_BLOB &&
+		    oe_size_greater_than(&to_pack, entry,
+					 write_pipeline.big_file_threshold))
+			return; /* streamed by write_no_reuse_object() */
+
+		packing_data_lock(&to_pack);
+		buf = repo_read_object_file(the_repository, &entry->idx.oid,
+					    &co->type, &co->size);
+		packing_data_unlock(&to_pack);
+		if (!buf)
+			return; /* let the main thread report it */
+	}
+
+	co->datalen = do_compress(&buf, co->size);
+	co->data = buf;
+	co->usable_delta = usable_delta;
+}
+
+static void *write_pipeline_worker(void *arg UNUSED)
+{
+	struct write_pipeline *wp = &write_pipeline;
+
+	pthread_mutex_lock(&wp->mutex);
+	for (;;) {
+		struct write_batch *batch = wp->next;
+		uint32_t pos;
+
+		if (wp->stop)
+			break;
+		if (!batch || wp->next_todo >= batch->end) {
+			pthread_cond_wait(&wp->work_cond, &wp->mutex);
+			continue;
+		}
+
+		pos = wp->next_todo++;
+		pthread_mutex_unlock(&wp->mutex);
+
+		compress_ahead(batch, pos);
+
+		pthread_mutex_lock(&wp->mutex);
+		if (++wp->nr_done == batch->end - batch->start)
+			pthread_cond_signal(&wp->done_cond);
+	}
+	pthread_mutex_unlock(&wp->mutex);
+	return NULL;
+}
+
+static unsigned long write_size_estimate(struct object_entry *entry)
+{
+	if (DELTA(entry))
+		return DELTA_SIZE(entry);
+	if (entry->size_valid)
+		return entry->size_;
+	return to_pack.oe_size_limit;
+}
+
+/*
+ * Hand the objects following "batch" to the workers.  Called with
+ * the mutex held.
+ */
+static void queue_next_batch(struct write_batch *batch, uint32_t start)
+{
+	struct write_pipeline *wp = &write_pipeline;
+	unsigned long bytes = 0;
+	uint32_t end = start;
+
+	while (end < wp->nr && end - start < WRITE_BATCH_OBJECTS &&
+	       bytes < WRITE_BATCH_BYTES)
+		bytes += write_size_estimate(wp->order[end++]);
+
+	batch->start = start;
+	batch->end = end;
+	wp->next = batch;
+	wp->next_todo = start;
+	wp->nr_done = 0;
+	pthread_cond_broadcast(&wp->work_cond);
+}
+
+static void wait_for_next_batch(void)
+{
+	struct write_pipeline *wp = &write_pipeline;
+
+	while (wp->nr_done < wp->next->end - wp->next->start)
+		pthread_cond_wait(&wp->done_cond, &wp->mutex);
+}
+
+static void release_batch(struct write_batch *batch)
+{
+	uint32_t i;
+
+	for (i = 0; i < batch->end - batch->start; i++)
+		free(batch->objs[i].data);
+	batch->start = batch->end = 0;
+}
+
+static void write_pipeline_start(struct object_entry **order, uint32_t nr)
+{
+	struct write_pipeline *wp = &write_pipeline;
+	uint32_t i;
+	int ret;
+
+	if (delta_search_threads <= 1 || pack_size_limit ||
+	    nr < WRITE_BATCH_OBJECTS / 16)
+		return;
+
+	wp->active = 1;
+	wp->order = order;
+	wp->nr = nr;
+	wp->big_file_threshold =
+		repo_settings_get_big_file_threshold(the_repository);
+	ALLOC_ARRAY(wp->pos, to_pack.nr_objects);
+	for (i = 0; i < nr; i++)
+		wp->pos[order[i] - to_pack.objects] = i;
+	for (i = 0; i < ARRAY_SIZE(wp->batches); i++)
+		CALLOC_ARRAY(wp->batches[i].objs, WRITE_BATCH_OBJECTS);
+	wp->ready = &wp->batches[1];
+	wp->compressed = 0;
+
+	pthread_mutex_init(&wp->mutex, NULL);
+	pthread_cond_init(&wp->work_cond, NULL);
+	pthread_cond_init(&wp->done_cond, NULL);
+
+	pthread_mutex_lock(&wp->mutex);
+	queue_next_batch(&wp->batches[0], 0);
+	pthread_mutex_unlock(&wp->mutex);
+
+	wp->nr_threads = delta_search_threads;
+	CALLOC_ARRAY(wp->threads, wp->nr_threads);
+	for (i = 0; i < wp->nr_threads; i++) {
+		ret = pthread_create(&wp->threads[i], NULL,
+				     write_pipeline_worker, NULL);
+		if (ret)
+			die(_("unable to create thread: %s"), strerror(ret));
+	}
+}
+
+/*
+ * Called before writing the object at "pos" in write order: once the
+ * previous batch has been written out, wait for the next one and
+ * start compressing the one after it.
+ */
+static void write_pipeline_advance(uint32_t pos)
+{
+	struct write_pipeline *wp = &write_pipeline;
+	struct write_batch *done;
+
+	if (!wp->active || pos < wp->ready->end)
+		return;
+
+	pthread_mutex_lock(&wp->mutex);
+	wait_for_next_batch();
+	done = wp->ready;
+	release_batch(done);
+	wp->ready = wp->next;
+	wp->next = NULL;
+	if (wp->ready->end < wp->nr)
+		queue_next_batch(done, wp->ready->end);
+	pthread_mutex_unlock(&wp->mutex);
+}
+
+/*
+ * Make sure no worker is looking at "entry" before the main thread
+ * modifies it, which write_one() does for bases that come later in
+ * the write order than their deltas.
+ */
+static void write_pipeline_claim(struct object_entry *entry)
+{
+	struct write_pipeline *wp = &write_pipeline;
+	uint32_t pos;
+
+	if (!wp->active)
+		return;
+	pos = wp->pos[entry - to_pack.objects];
+
+	pthread_mutex_lock(&wp->mutex);
+	if (wp->next && pos >= wp->next->start && pos < wp->next->end)
+		wait_for_next_batch();
+	pthread_mutex_unlock(&wp->mutex);
+}
+
+/*
+ * Hand over the data compressed ahead for "entry", if any.  Data
+ * compressed for another choice of delta than the one now being
+ * written is discarded.
+ */
+static int write_pipeline_take(struct object_entry *entry, int usable_delta,
+			       struct compressed_object *out)
+{
+	struct write_pipeline *wp = &write_pipeline;
+	struct compressed_object *co = NULL;
+	uint32_t pos, i;
+
+	if (!wp->active)
+		return 0;
+	write_pipeline_claim(entry);
+	pos = wp->pos[entry - to_pack.objects];
+
+	for (i = 0; i < ARRAY_SIZE(wp->batches); i++) {
+		struct write_batch *batch = &wp->batches[i];
+
+		if (pos >= batch->start && pos < batch->end)
+			co = &batch->objs[pos - batch->start];
+	}
+	if (!co || !co->data)
+		return 0;
+	if (co->usable_delta != !!usable_delta) {
+		FREE_AND_NULL(co->data);
+		return 0;
+	}
+
+	*out = *co;
+	co->data = NULL;
+	wp->compressed++;
+	return 1;
+}
+
+static void write_pipeline_finish(void)
+{
+	struct write_pipeline *wp = &write_pipeline;
+	uint32_t i;
+
+	if (!wp->active)
+		return;
+
+	pthread_mutex_lock(&wp->mutex);
+	if (wp->next)
+		wait_for_next_batch();
+	wp->stop = 1;
+	pthread_cond_broadcast(&wp->work_cond);
+	pthread_mutex_unlock(&wp->mutex);
+
+	for (i = 0; i < wp->nr_threads; i++)
+		pthread_join(wp->threads[i], NULL);
+
+	for (i = 0; i < ARRAY_SIZE(wp->batches); i++) {
+		release_batch(&wp->batches[i]);
+		free(wp->batches[i].objs);
+	}
+	pthread_cond_destroy(&wp->work_cond);
+	pthread_cond_destroy(&wp->done_cond);
+	pthread_mutex_destroy(&wp->mutex);
+	free(wp->threads);
+	free(wp->pos);
+
+	trace2_data_intmax("pack-objects", the_repository,
+			   "write_pack_file/compressed_ahead", wp->compressed);
+	memset(wp, 0, sizeof(*wp));
+}
+
 /* Return 0 if we will bust the pack-size limit */
 static off_t write_object(struct hashfile *f,
 			  struct object_entry *entry,
@@ -720,28 +1216,20 @@ static off_t write_object(struct hashfile *f,
 	else
 		usable_delta = 0;	/* base could end up in another pack */
 
-	if (!reuse_object)
-		to_reuse = 0;	/* explicit */
-	else if (!IN_PACK(entry))
-		to_reuse = 0;	/* can't reuse what we don't have */
-	else if (oe_type(entry) == OBJ_REF_DELTA ||
-		 oe_type(entry) == OBJ_OFS_DELTA)
-				/* check_object() decided it for us ... */
-		to_reuse = usable_delta;
-				/* ... but pack split may override that */
-	else if (oe_type(entry) != entry->in_pack_type)
-		to_reuse = 0;	/* pack has delta which is unusable */
-	else if (DELTA(entry))
-		to_reuse = 0;	/* we want to pack afresh */
-	else
-		to_reuse = 1;	/* we have it in-pack undeltified,
-				 * and we do not need to deltify it.
-				 */
+	to_reuse = want_reuse(entry, usable_delta);
 
-	if (!to_reuse)
-		len = write_no_reuse_object(f, entry, limit, usable_delta);
-	else
+	if (!to_reuse) {
+		struct compressed_object co;
+
+		if (write_pipeline_take(entry, usable_delta, &co))
+			len = write_no_reuse_object(f, entry, limit,
+						    usable_delta, &co);
+		else
+			len = write_no_reuse_object(f, entry, limit,
+						    usable_delta, NULL);
+	} else {
 		len = write_reuse_object(f, entry, limit, usable_delta);
+	}
 	if (!len)
 		return 0;
 
@@ -782,6 +1270,8 @@ static enum write_one_status write_one(struct hashfile *f,
 		return WRITE_ONE_SKIP;
 	}
 
+	write_pipeline_claim(e);
+
 	/* if we are deltified, write out base object first. */
 	if (DELTA(e)) {
 		e->idx.offset = 1; /* now recurse */
@@ -1059,23 +1549,75 @@ static off_t find_reused_offset(off_t where)
 	return reused_chunks[lo-1].difference;
 }
 
-static void write_reused_pack_one(struct packed_git *reuse_packfile,
+/*
+ * Reused objects that need no rewriting are not copied one by one, but
+ * collected into runs of adjacent objects, each copied in one go.
+ */
+struct reused_run {
+	off_t start, end;
+};
+
+static void flush_reused_run(struct packed_git *reuse_packfile,
+			     struct reused_run *run, struct hashfile *out,
+			     struct pack_window **w_curs)
+{
+	if (run->end > run->start)
+		copy_pack_data(out, reuse_packfile, w_curs, run->start,
+			       run->end - run->start);
+	run->start = run->end = 0;
+}
+
+static void add_to_reused_run(struct packed_git *reuse_packfile,
+			      struct reused_run *run, struct hashfile *out,
+			      struct pack_window **w_curs,
+			      off_t offset, off_t next)
+{
+	if (run->end != offset)
+		flush_reused_run(reuse_packfile, run, out, w_curs);
+	if (run->start == run->end)
+		run->start = offset;
+	run->end = next;
+}
+
+/*
+ * Whether the copy of the base at "base_offset" in the pack is reused,
+ * too. With a MIDX, it may not be: the MIDX may have picked the base
+ * from another pack, or the base may be sent after the delta. Then the
+ * delta has to refer to the base by name.
+ */
+static int reused_base_in_pack(struct bitmapped_pack *reuse_packfile,
+			       off_t base_offset)
+{
+	uint32_t base_pos;
+
+	if (!reuse_packfile->from_midx)
+		return 1; /* try_partial_reuse() made sure */
+	if (midx_pair_to_pack_pos(reuse_packfile->from_midx,
+				  reuse_packfile->pack_int_id, base_offset,
+				  &base_pos) < 0)
+		return 0;
+	return bitmap_get(reuse_packfile_bitmap, base_pos);
+}
+
+static void write_reused_pack_one(struct bitmapped_pack *reuse_packfile,
 				  size_t pos, struct hashfile *out,
-				  off_t pack_start,
+				  off_t pack_start, struct reused_run *run,
 				  struct pack_window **w_curs)
 {
+	struct packed_git *p = reuse_packfile->p;
 	off_t offset, next, cur;
 	enum object_type type;
 	unsigned long size;
 
-	offset = pack_pos_to_offset(reuse_packfile, pos);
-	next = pack_pos_to_offset(reuse_packfile, pos + 1);
+	offset = pack_pos_to_offset(p, pos);
+	next = pack_pos_to_offset(p, pos + 1);
 
 	record_reused_object(offset,
-			     offset - (hashfile_total(out) - pack_start));
+			     offset - (hashfile_total(out) +
+				       (run->end - run->start) - pack_start));
 
 	cur = offset;
-	type = unpack_object_header(reuse_packfile, w_curs, &cur, &size);
+	type = unpack_object_header(p, w_curs, &cur, &size);
 	assert(type >= 0);
 
 	if (type == OBJ_OFS_DELTA) {
@@ -1085,28 +1627,31 @@ static void write_reused_pack_one(struct packed_git *reuse_packfile,
 		unsigned char header[MAX_PACK_OBJECT_HEADER];
 		unsigned len;
 
-		base_offset = get_delta_base(reuse_packfile, w_curs, &cur, type, offset);
+		base_offset = get_delta_base(p, w_curs, &cur, type, offset);
 		assert(base_offset != 0);
 
 		/* Convert to REF_DELTA if we must... */
-		if (!allow_ofs_delta) {
+		if (!allow_ofs_delta ||
+		    !reused_base_in_pack(reuse_packfile, base_offset)) {
 			uint32_t base_pos;
 			struct object_id base_oid;
 
-			if (offset_to_pack_pos(reuse_packfile, base_offset, &base_pos) < 0)
+			if (offset_to_pack_pos(p, base_offset, &base_pos) < 0)
 				die(_("expected object at offset %"PRIuMAX" "
 				      "in pack %s"),
-				    (uintmax_t)base_offset,
-				    reuse_packfile->pack_name);
+				    (uintmax_t)base_offset, p->pack_name);
 
-			nth_packed_object_id(&base_oid, reuse_packfile,
-					     pack_pos_to_index(reuse_packfile, base_pos));
+			nth_packed_object_id(&base_oid, p,
+					     pack_pos_to_index(p, base_pos));
 
+			flush_reused_run(p, run, out, w_curs);
 			len = encode_in_pack_object_header(header, sizeof(header),
 							   OBJ_REF_DELTA, size);
 			hashwrite(out, header, len);
 			hashwrite(out, base_oid.hash, the_hash_algo->rawsz);
-			copy_pack_data(out, reuse_packfile, w_curs, cur, next - cur);
+			copy_pack_data(out, p, w_curs, cur, next - cur);
+			if (allow_ofs_delta)
+				reused_ref_deltas++;
 			return;
 		}
 
@@ -1118,6 +1663,7 @@ static void write_reused_pack_one(struct packed_git *reuse_packfile,
 			unsigned i, ofs_len;
 			off_t ofs = offset - base_offset - fixup;
 
+			flush_reused_run(p, run, out, w_curs);
 			len = encode_in_pack_object_header(header, sizeof(header),
 							   OBJ_OFS_DELTA, size);
 
@@ -1130,14 +1676,14 @@ static void write_reused_pack_one(struct packed_git *reuse_packfile,
 
 			hashwrite(out, header, len);
 			hashwrite(out, ofs_header + sizeof(ofs_header) - ofs_len, ofs_len);
-			copy_pack_data(out, reuse_packfile, w_curs, cur, next - cur);
+			copy_pack_data(out, p, w_curs, cur, next - cur);
 			return;
 		}
 
 		/* ...otherwise we have no fixup, and can write it verbatim */
 	}
 
-	copy_pack_data(out, reuse_packfile, w_curs, offset, next - offset);
+	add_to_reused_run(p, run, out, w_curs, offset, next);
 }
 
 static size_t write_reused_pack_verbatim(struct bitmapped_pack *reuse_packfile,
@@ -1209,6 +1755,7 @@ static void write_reused_pack(struct bitmapped_pack *reuse_packfile,
 	uint32_t offset;
 	off_t pack_start = hashfile_total(f) - sizeof(struct pack_header);
 	struct pack_window *w_curs = NULL;
+	struct reused_run run = { 0 };
 
 	if (allow_ofs_delta)
 		i = write_reused_pack_verbatim(reuse_packfile, f, &w_curs);
@@ -1260,13 +1807,14 @@ static void write_reused_pack(struct bitmapped_pack *reuse_packfile,
 				pack_pos = pos + offset;
 			}
 
-			write_reused_pack_one(reuse_packfile->p, pack_pos, f,
-					      pack_start, &w_curs);
+			write_reused_pack_one(reuse_packfile, pack_pos, f,
+					      pack_start, &run, &w_curs);
 			display_progress(progress_state, ++written);
 		}
 	}
 
 done:
+	flush_reused_run(reuse_packfile->p, &run, f, &w_curs);
 	unuse_pack(&w_curs);
 }
 
@@ -1331,9 +1879,17 @@ static void write_pack_file(void)
 			offset = hashfile_total(f);
 		}
 
+		/*
+		 * Start compressing only now, as the verbatim reuse above
+		 * reads packs without taking packing_data_lock().
+		 */
+		write_pipeline_start(write_order, to_pack.nr_objects);
+
 		nr_written = 0;
 		for (; i < to_pack.nr_objects; i++) {
 			struct object_entry *e = write_order[i];
+
+			write_pipeline_advance(i);
 			if (write_one(f, e, &offset) == WRITE_ONE_BREAK)
 				break;
 			display_progress(progress_state, written);
@@ -1452,6 +2008,8 @@ static void write_pack_file(void)
 		nr_remaining -= nr_written;
 	} while (nr_remaining && i < to_pack.nr_objects);
 
+	write_pipeline_finish();
+	send_pack_close();
 	free(written_list);
 	free(write_order);
 	stop_progress(&progress_state);
@@ -1778,7 +2336,7 @@ static struct object_entry *create_object_entry(const struct object_id *oid,
 		nr_result++;
 	if (found_pack) {
 		oe_set_in_pack(&to_pack, entry, found_pack);
-		entry->in_pack_offset = found_offset;
+		oe_set_in_pack_offset(&to_pack, entry, found_offset);
 	}
 
 	entry->no_try_delta = no_try_delta;
@@ -2184,8 +2742,9 @@ static void check_object(struct object_entry *entry, uint32_t object_index)
 		unsigned char *buf, c;
 		enum object_type type;
 		unsigned long in_pack_size;
+		off_t in_pack_offset = IN_PACK_OFFSET(entry);
 
-		buf = use_pack(p, &w_curs, entry->in_pack_offset, &avail);
+		buf = use_pack(p, &w_curs, in_pack_offset, &avail);
 
 		/*
 		 * We want in_pack_type even if we do not reuse delta
@@ -2220,7 +2779,7 @@ static void check_object(struct object_entry *entry, uint32_t object_index)
 			if (reuse_delta && !entry->preferred_base) {
 				oidread(&base_ref,
 					use_pack(p, &w_curs,
-						 entry->in_pack_offset + used,
+						 in_pack_offset + used,
 						 NULL),
 					the_repository->hash_algo);
 				have_base = 1;
@@ -2229,7 +2788,7 @@ static void check_object(struct object_entry *entry, uint32_t object_index)
 			break;
 		case OBJ_OFS_DELTA:
 			buf = use_pack(p, &w_curs,
-				       entry->in_pack_offset + used, NULL);
+				       in_pack_offset + used, NULL);
 			used_0 = 0;
 			c = buf[used_0++];
 			ofs = c & 127;
@@ -2243,8 +2802,8 @@ static void check_object(struct object_entry *entry, uint32_t object_index)
 				c = buf[used_0++];
 				ofs = (ofs << 7) + (c & 127);
 			}
-			ofs = entry->in_pack_offset - ofs;
-			if (ofs <= 0 || ofs >= entry->in_pack_offset) {
+			ofs = in_pack_offset - ofs;
+			if (ofs <= 0 || ofs >= in_pack_offset) {
 				error(_("delta base offset out of bound for %s"),
 				      oid_to_hex(&entry->idx.oid));
 				goto give_up;
@@ -2287,7 +2846,7 @@ static void check_object(struct object_entry *entry, uint32_t object_index)
 			 * final object type is.  Let's extract the actual
 			 * object size from the delta header.
 			 */
-			delta_pos = entry->in_pack_offset + entry->in_pack_header_size;
+			delta_pos = in_pack_offset + entry->in_pack_header_size;
 			canonical_size = get_size_from_delta(p, &w_curs, delta_pos);
 			if (canonical_size == 0)
 				goto give_up;
@@ -2344,8 +2903,8 @@ static int pack_offset_sort(const void *_a, const void *_b)
 		return -1;
 	if (a_in_pack > b_in_pack)
 		return 1;
-	return a->in_pack_offset < b->in_pack_offset ? -1 :
-			(a->in_pack_offset > b->in_pack_offset);
+	return IN_PACK_OFFSET(a) < IN_PACK_OFFSET(b) ? -1 :
+			(IN_PACK_OFFSET(a) > IN_PACK_OFFSET(b));
 }
 
 /*
@@ -2381,7 +2940,7 @@ static void drop_reused_delta(struct object_entry *entry)
 
 	oi.sizep = &size;
 	oi.typep = &type;
-	if (packed_object_info(the_repository, IN_PACK(entry), entry->in_pack_offset, &oi) < 0) {
+	if (packed_object_info(the_repository, IN_PACK(entry), IN_PACK_OFFSET(entry), &oi) < 0) {
 		/*
 		 * We failed to get the info from this pack for some reason;
 		 * fall back to oid_object_info, which may find another copy.
@@ -2602,6 +3161,8 @@ struct unpacked {
 	struct object_entry *entry;
 	void *data;
 	struct delta_index *index;
+	/* set when "data" and "index" are borrowed from the index cache */
+	struct cached_delta_index *cached;
 	unsigned depth;
 };
 
@@ -2621,11 +3182,226 @@ static int delta_cacheable(unsigned long src_size, unsigned long trg_size,
 	return 0;
 }
 
-/* Protect delta_cache_size */
+/* Protect delta_cache_size and the delta index cache */
 static pthread_mutex_t cache_mutex;
 #define cache_lock()		pthread_mutex_lock(&cache_mutex)
 #define cache_unlock()		pthread_mutex_unlock(&cache_mutex)
 
+/*
+ * Delta indexes of bases that have left a search window, together with
+ * the object data they point into. A window that reaches the same base
+ * again, in this thread or another one, borrows them from here instead
+ * of reading and indexing the object a second time.
+ *
+ * Entries borrowed by a window are pinned. The others are kept in
+ * least-recently-released order and dropped from the front of that
+ * list to keep the cache within pack.deltaIndexCacheLimit, and, with
+ * a window memory limit, within what the windows of all threads leave
+ * of it.
+ *
+ * Each object enters only one window, so a base is only reached again
+ * where the lists of two threads overlap (see window_seed()); the
+ * cache is not used by a single-threaded search.
+ */
+struct cached_delta_index {
+	struct hashmap_entry ent;
+	struct list_head lru;
+	struct object_entry *entry;
+	void *data;
+	struct delta_index *index;
+	unsigned long size;
+	unsigned users;
+};
+
+static int delta_index_cache_enabled;
+static struct hashmap delta_index_cache;
+static LIST_HEAD(delta_index_lru);
+static unsigned long delta_index_cache_size;
+static unsigned long window_memory_budget, window_memory_used;
+static uint64_t delta_index_cache_hits;
+static uint64_t delta_indexes_built;
+
+static int cached_delta_index_cmp(const void *cmp_data UNUSED,
+				  const struct hashmap_entry *eptr,
+				  const struct hashmap_entry *entry_or_key UNUSED,
+				  const void *keydata)
+{
+	const struct cached_delta_index *c =
+		container_of(eptr, const struct cached_delta_index, ent);
+	return c->entry != keydata;
+}
+
+static void init_delta_index_cache(int nr_threads)
+{
+	delta_index_cache_enabled = delta_index_cache_limit && nr_threads > 1;
+	hashmap_init(&delta_index_cache, cached_delta_index_cmp, NULL, 0);
+	delta_index_cache_size = 0;
+	window_memory_used = 0;
+	if (window_memory_limit &&
+	    unsigned_mult_overflows(window_memory_limit, nr_threads))
+		window_memory_budget = ULONG_MAX;
+	else
+		window_memory_budget = window_memory_limit * nr_threads;
+	delta_index_cache_hits = 0;
+	delta_indexes_built = 0;
+}
+
+static void drop_cached_delta_index(struct cached_delta_index *c)
+{
+	hashmap_remove(&delta_index_cache, &c->ent, c->entry);
+	list_del(&c->lru);
+	delta_index_cache_size -= c->size;
+	free_delta_index(c->index);
+	free(c->data);
+	free(c);
+}
+
+/*
+ * The memory the cache may use: its own limit, or what the windows of
+ * all threads leave of the window memory limit if that is less.
+ * Called with cache_lock() held.
+ */
+static unsigned long delta_index_cache_room(void)
+{
+	unsigned long left;
+
+	if (!window_memory_budget)
+		return delta_index_cache_limit;
+	left = window_memory_budget > window_memory_used ?
+		window_memory_budget - window_memory_used : 0;
+	return left < delta_index_cache_limit ? left : delta_index_cache_limit;
+}
+
+/* Called with cache_lock() held. */
+static void prune_delta_index_cache(void)
+{
+	unsigned long room = delta_index_cache_room();
+
+	while (delta_index_cache_size > room &&
+	       !list_empty(&delta_index_lru))
+		drop_cached_delta_index(list_first_entry(&delta_index_lru,
+							 struct cached_delta_index,
+							 lru));
+}
+
+static void clear_delta_index_cache(void)
+{
+	struct list_head *pos, *tmp;
+
+	trace2_data_intmax("pack-objects", the_repository,
+			   "delta_index_cache/hits", delta_index_cache_hits);
+	trace2_data_intmax("pack-objects", the_repository,
+			   "delta_index_cache/built", delta_indexes_built);
+
+	list_for_each_safe(pos, tmp, &delta_index_lru)
+		drop_cached_delta_index(list_entry(pos, struct cached_delta_index,
+						   lru));
+	hashmap_clear(&delta_index_cache);
+}
+
+/*
+ * Tell the cache how much memory the window of a thread now uses (the
+ * "mem_usage" of find_deltas()), so that the cache makes room for it
+ * under the window memory limit. "*reported" holds what the thread
+ * reported last.
+ */
+static void charge_window_memory(unsigned long *reported,
+				 unsigned long mem_usage)
+{
+	if (!delta_index_cache_enabled || !window_memory_budget)
+		return;
+
+	cache_lock();
+	window_memory_used -= *reported;
+	window_memory_used += mem_usage;
+	*reported = mem_usage;
+	prune_delta_index_cache();
+	cache_unlock();
+}
+
+/*
+ * Borrow the cached data and index of "u->entry", if any, releasing
+ * any data "u" had already loaded for it. Returns 1 on a hit.
+ */
+static int borrow_cached_delta_index(struct unpacked *u,
+				     unsigned long *mem_usage)
+{
+	struct cached_delta_index *c;
+
+	if (!delta_index_cache_enabled)
+		return 0;
+
+	cache_lock();
+	c = hashmap_get_entry_from_hash(&delta_index_cache,
+					oidhash(&u->entry->idx.oid), u->entry,
+					struct cached_delta_index, ent);
+	if (c) {
+		if (!c->users++)
+			list_del_init(&c->lru);
+		delta_index_cache_hits++;
+	}
+	cache_unlock();
+
+	if (!c)
+		return 0;
+
+	if (u->data)
+		free(u->data);
+	else
+		*mem_usage += SIZE(u->entry);
+	u->data = c->data;
+	u->index = c->index;
+	u->cached = c;
+	*mem_usage += sizeof_delta_index(u->index);
+	return 1;
+}
+
+/*
+ * Hand the data and index of "u" over to the cache, or give back the
+ * ones it borrowed. Returns 1 if "u" no longer owns them.
+ */
+static int release_to_delta_index_cache(struct unpacked *u)
+{
+	struct cached_delta_index *c = u->cached;
+	unsigned long size;
+
+	if (c) {
+		cache_lock();
+		if (!--c->users) {
+			list_add_tail(&c->lru, &delta_index_lru);
+			prune_delta_index_cache();
+		}
+		cache_unlock();
+		u->cached = NULL;
+		return 1;
+	}
+
+	if (!delta_index_cache_enabled || !u->index || !u->data)
+		return 0;
+	size = SIZE(u->entry) + sizeof_delta_index(u->index);
+
+	cache_lock();
+	if (size > delta_index_cache_room() ||
+	    hashmap_get_from_hash(&delta_index_cache,
+				  oidhash(&u->entry->idx.oid), u->entry)) {
+		/* too big, or another thread got there first */
+		cache_unlock();
+		return 0;
+	}
+	CALLOC_ARRAY(c, 1);
+	hashmap_entry_init(&c->ent, oidhash(&u->entry->idx.oid));
+	c->entry = u->entry;
+	c->data = u->data;
+	c->index = u->index;
+	c->size = size;
+	hashmap_add(&delta_index_cache, &c->ent);
+	list_add_tail(&c->lru, &delta_index_lru);
+	delta_index_cache_size += size;
+	prune_delta_index_cache();
+	cache_unlock();
+	return 1;
+}
+
 /*
  * Protect object list partitioning (e.g. struct thread_param) and
  * progress_state
@@ -2690,7 +3466,7 @@ unsigned long oe_get_size_slow(struct packing_data *pack,
 
 	packing_data_lock(&to_pack);
 	w_curs = NULL;
-	buf = use_pack(p, &w_curs, e->in_pack_offset, &avail);
+	buf = use_pack(p, &w_curs, IN_PACK_OFFSET(e), &avail);
 	used = unpack_object_header_buffer(buf, avail, &type, &size);
 	if (used == 0)
 		die(_("unable to parse object header of %s"),
@@ -2773,6 +3549,8 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 			    (uintmax_t)trg_size);
 		*mem_usage += sz;
 	}
+	if (!src->index)
+		borrow_cached_delta_index(src, mem_usage);
 	if (!src->data) {
 		packing_data_lock(&to_pack);
 		src->data = repo_read_object_file(the_repository,
@@ -2811,6 +3589,9 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 			return 0;
 		}
 		*mem_usage += sizeof_delta_index(src->index);
+		cache_lock();
+		delta_indexes_built++;
+		cache_unlock();
 	}
 
 	delta_buf = create_delta(src->index, trg->data, trg_size, &delta_size, max_size);
@@ -2831,18 +3612,19 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 	 * accounting lock.  Compiler will optimize the strangeness
 	 * away when NO_PTHREADS is defined.
 	 */
-	free(trg_entry->delta_data);
+	free(DELTA_DATA(trg_entry));
 	cache_lock();
-	if (trg_entry->delta_data) {
+	if (DELTA_DATA(trg_entry))
 		delta_cache_size -= DELTA_SIZE(trg_entry);
-		trg_entry->delta_data = NULL;
-	}
 	if (delta_cacheable(src_size, trg_size, delta_size)) {
 		delta_cache_size += delta_size;
+		if (peak_delta_cache_size < delta_cache_size)
+			peak_delta_cache_size = delta_cache_size;
 		cache_unlock();
-		trg_entry->delta_data = xrealloc(delta_buf, delta_size);
+		SET_DELTA_DATA(trg_entry, xrealloc(delta_buf, delta_size));
 	} else {
 		cache_unlock();
+		SET_DELTA_DATA(trg_entry, NULL);
 		free(delta_buf);
 	}
 
@@ -2869,26 +3651,45 @@ static unsigned int check_delta_limit(struct object_entry *me, unsigned int n)
 static unsigned long free_unpacked(struct unpacked *n)
 {
 	unsigned long freed_mem = sizeof_delta_index(n->index);
-	free_delta_index(n->index);
+	int kept = release_to_delta_index_cache(n);
+
+	if (!kept)
+		free_delta_index(n->index);
 	n->index = NULL;
 	if (n->data) {
 		freed_mem += SIZE(n->entry);
-		FREE_AND_NULL(n->data);
+		if (!kept)
+			free(n->data);
+		n->data = NULL;
 	}
 	n->entry = NULL;
 	n->depth = 0;
 	return freed_mem;
 }
 
-static void find_deltas(struct object_entry **list, unsigned *list_size,
-			int window, int depth, unsigned *processed)
+/*
+ * Search deltas for the objects in "list". The "seed" objects just
+ * before "list" are only used as bases: they were handed to another
+ * thread, but starting with them in the window lets the first objects
+ * here try as many bases as they would have if the list had not been
+ * split. Returns the number of objects processed.
+ */
+static unsigned find_deltas(struct object_entry **list, unsigned *list_size,
+			    unsigned seed, int window, int depth,
+			    unsigned *processed)
 {
 	uint32_t i, idx = 0, count = 0;
 	struct unpacked *array;
-	unsigned long mem_usage = 0;
+	unsigned long mem_usage = 0, reported_mem_usage = 0;
+	unsigned nr = 0;
 
 	CALLOC_ARRAY(array, window);
 
+	for (; seed; seed--) {
+		array[idx++].entry = list[-(int)seed];
+		count++;
+	}
+
 	for (;;) {
 		struct object_entry *entry;
 		struct unpacked *n = array + idx;
@@ -2904,6 +3705,7 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 		if (!entry->preferred_base) {
 			(*processed)++;
 			display_progress(progress_state, *processed);
+			nr++;
 		}
 		progress_unlock();
 
@@ -2917,6 +3719,7 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 			mem_usage -= free_unpacked(array + tail);
 			count--;
 		}
+		charge_window_memory(&reported_mem_usage, mem_usage);
 
 		/* We do not compute delta to *create* objects we are not
 		 * going to pack.
@@ -2967,10 +3770,12 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 		 * instead, as we can afford spending more time compressing
 		 * between writes at that moment.
 		 */
-		if (entry->delta_data && !pack_to_stdout) {
+		if (DELTA_DATA(entry) && !pack_to_stdout) {
+			void *delta_data = DELTA_DATA(entry);
 			unsigned long size;
 
-			size = do_compress(&entry->delta_data, DELTA_SIZE(entry));
+			size = do_compress(&delta_data, DELTA_SIZE(entry));
+			SET_DELTA_DATA(entry, delta_data);
 			if (size < (1U << OE_Z_DELTA_BITS)) {
 				entry->z_delta_size = size;
 				cache_lock();
@@ -2978,7 +3783,8 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 				delta_cache_size += entry->z_delta_size;
 				cache_unlock();
 			} else {
-				FREE_AND_NULL(entry->delta_data);
+				free(DELTA_DATA(entry));
+				SET_DELTA_DATA(entry, NULL);
 				entry->z_delta_size = 0;
 			}
 		}
@@ -3015,11 +3821,11 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 			idx = 0;
 	}
 
-	for (i = 0; i < window; ++i) {
-		free_delta_index(array[i].index);
-		free(array[i].data);
-	}
+	for (i = 0; i < window; ++i)
+		free_unpacked(array + i);
 	free(array);
+	charge_window_memory(&reported_mem_usage, 0);
+	return nr;
 }
 
 /*
@@ -3036,6 +3842,12 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
  *
  * The main thread steals half of the work from the worker that has
  * most work left to hand it to the idle worker.
+ *
+ * Lists are split wherever needed, even in the middle of a run of
+ * objects for the same path: each worker starts with the objects that
+ * precede its list in its window (see find_deltas()), so no deltas are
+ * lost at the split. As bases from another worker may end up deeper
+ * than we assumed, limit_delta_depth() enforces --depth afterwards.
  */
 
 struct thread_params {
@@ -3043,6 +3855,7 @@ struct thread_params {
 	struct object_entry **list;
 	unsigned list_size;
 	unsigned remaining;
+	unsigned seed;
 	int window;
 	int depth;
 	int working;
@@ -3075,12 +3888,17 @@ static void *threaded_find_deltas(void *arg)
 {
 	struct thread_params *me = arg;
 
+	unsigned nr_processed = 0, nr_lists = 0;
+
+	trace2_thread_start("find_deltas");
+
 	progress_lock();
 	while (me->remaining) {
 		progress_unlock();
 
-		find_deltas(me->list, &me->remaining,
-			    me->window, me->depth, me->processed);
+		nr_processed += find_deltas(me->list, &me->remaining, me->seed,
+					    me->window, me->depth, me->processed);
+		nr_lists++;
 
 		progress_lock();
 		me->working = 0;
@@ -3104,20 +3922,133 @@ static void *threaded_find_deltas(void *arg)
 		progress_lock();
 	}
 	progress_unlock();
+
+	trace2_data_intmax("pack-objects", the_repository,
+			   "find_deltas/objects", nr_processed);
+	trace2_data_intmax("pack-objects", the_repository,
+			   "find_deltas/lists", nr_lists);
+	trace2_thread_exit();
+
 	/* leave ->working 1 so that this doesn't get more work assigned */
 	return NULL;
 }
 
+/*
+ * Number of objects before "list" that fit in the window of a search
+ * starting there.
+ */
+static unsigned window_seed(struct object_entry **list_start,
+			    struct object_entry **list, int window)
+{
+	return list - list_start < window - 1 ? list - list_start : window - 1;
+}
+
+/*
+ * Make "entry" a delta against "base" instead of its current base.
+ * Returns 0 if no good enough delta can be made.
+ */
+static int rebase_delta(struct object_entry *entry, struct object_entry *base)
+{
+	void *data, *base_data, *delta;
+	enum object_type type;
+	unsigned long size, base_size, delta_size, max_size;
+
+	if (SIZE(entry) / 2 <= the_hash_algo->rawsz ||
+	    !in_same_island(&entry->idx.oid, &base->idx.oid))
+		return 0;
+	max_size = SIZE(entry) / 2 - the_hash_algo->rawsz;
+
+	data = repo_read_object_file(the_repository, &entry->idx.oid,
+				     &type, &size);
+	base_data = repo_read_object_file(the_repository, &base->idx.oid,
+					  &type, &base_size);
+	if (!data || !base_data) {
+		free(data);
+		free(base_data);
+		return 0;
+	}
+	delta = diff_delta(base_data, base_size, data, size,
+			   &delta_size, max_size);
+	free(data);
+	free(base_data);
+	if (!delta)
+		return 0;
+	free(delta);
+
+	SET_DELTA(entry, base);
+	SET_DELTA_SIZE(entry, delta_size);
+	return 1;
+}
+
+/*
+ * A worker may have made an object a delta against one of its seed
+ * bases before the worker owning that base decided how deep the base
+ * itself would be. Move the deltas that make a chain deeper than
+ * "depth" to a shallower base further up the same chain, or drop them
+ * if that does not work.
+ *
+ * Bases come before their deltas in "list", so one pass in list order
+ * sees the final depth of each base before its deltas.
+ */
+static void limit_delta_depth(struct object_entry **list, unsigned n,
+			      int depth)
+{
+	unsigned *chain_depth;
+	unsigned i, rebased = 0, dropped = 0;
+
+	CALLOC_ARRAY(chain_depth, to_pack.nr_objects);
+	for (i = 0; i < n; i++) {
+		struct object_entry *entry = list[i];
+		struct object_entry *base = DELTA(entry);
+		unsigned limit;
+
+		if (!base)
+			continue;
+		limit = check_delta_limit(entry, 0) + 1;
+		if (chain_depth[base - to_pack.objects] + limit > depth) {
+			if (DELTA_DATA(entry)) {
+				delta_cache_size -= entry->z_delta_size ?
+					entry->z_delta_size : DELTA_SIZE(entry);
+				free(DELTA_DATA(entry));
+				SET_DELTA_DATA(entry, NULL);
+			}
+			entry->z_delta_size = 0;
+
+			while (base &&
+			       chain_depth[base - to_pack.objects] + limit > depth)
+				base = DELTA(base);
+			if (base && rebase_delta(entry, base)) {
+				rebased++;
+			} else {
+				SET_DELTA(entry, NULL);
+				dropped++;
+				continue;
+			}
+		}
+		chain_depth[entry - to_pack.objects] =
+			chain_depth[base - to_pack.objects] + 1;
+	}
+	free(chain_depth);
+
+	trace2_data_intmax("pack-objects", the_repository,
+			   "find_deltas/rebased", rebased);
+	trace2_data_intmax("pack-objects", the_repository,
+			   "find_deltas/dropped", dropped);
+}
+
 static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 			   int window, int depth, unsigned *processed)
 {
 	struct thread_params *p;
+	struct object_entry **list_start = list;
 	int i, ret, active_threads = 0;
 
 	init_threaded_search();
+	init_delta_index_cache(delta_search_threads);
 
 	if (delta_search_threads <= 1) {
-		find_deltas(list, &list_size, window, depth, processed);
+		find_deltas(list, &list_size, 0, window, depth, processed);
+		clear_delta_index_cache();
 		cleanup_threaded_search();
 		return;
 	}
@@ -3130,7 +4061,7 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 	for (i = 0; i < delta_search_threads; i++) {
 		unsigned sub_size = list_size / (delta_search_threads - i);
 
-		/* don't use too small segments or no deltas will be found */
+		/* small segments are not worth a thread of their own */
 		if (sub_size < 2*window && i+1 < delta_search_threads)
 			sub_size = 0;
 
@@ -3140,15 +4071,10 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 		p[i].working = 1;
 		p[i].data_ready = 0;
 
-		/* try to split chunks on "path" boundaries */
-		while (sub_size && sub_size < list_size &&
-		       list[sub_size]->hash &&
-		       list[sub_size]->hash == list[sub_size-1]->hash)
-			sub_size++;
-
 		p[i].list = list;
 		p[i].list_size = sub_size;
 		p[i].remaining = sub_size;
+		p[i].seed = window_seed(list_start, list, window);
 
 		list += sub_size;
 		list_size -= sub_size;
@@ -3197,22 +4123,8 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 		if (victim) {
 			sub_size = victim->remaining / 2;
 			list = victim->list + victim->list_size - sub_size;
-			while (sub_size && list[0]->hash &&
-			       list[0]->hash == list[-1]->hash) {
-				list++;
-				sub_size--;
-			}
-			if (!sub_size) {
-				/*
-				 * It is possible for some "paths" to have
-				 * so many objects that no hash boundary
-				 * might be found.  Let's just steal the
-				 * exact half in that case.
-				 */
-				sub_size = victim->remaining / 2;
-				list -= sub_size;
-			}
 			target->list = list;
+			target->seed = window_seed(list_start, list, window);
 			victim->list_size -= sub_size;
 			victim->remaining -= sub_size;
 		}
@@ -3233,6 +4145,7 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 			active_threads--;
 		}
 	}
+	clear_delta_index_cache();
 	cleanup_threaded_search();
 	free(p);
 }
@@ -3353,6 +4266,8 @@ static void prepare_pack(int window, int depth)
 							nr_deltas);
 		QSORT(delta_list, n, type_size_sort);
 		ll_find_deltas(delta_list, n, window+1, depth, &nr_done);
+		if (delta_search_threads > 1)
+			limit_delta_depth(delta_list, n, depth);
 		stop_progress(&progress_state);
 		if (nr_done != nr_deltas)
 			die(_("inconsistency with delta count"));
@@ -3379,6 +4294,10 @@ static int git_pack_config(const char *k, const char *v,
 		max_delta_cache_size = git_config_int(k, v, ctx->kvi);
 		return 0;
 	}
+	if (!strcmp(k, "pack.deltaindexcachelimit")) {
+		delta_index_cache_limit = git_config_ulong(k, v, ctx->kvi);
+		return 0;
+	}
 	if (!strcmp(k, "pack.deltacachelimit")) {
 		cache_max_small_delta_size = git_config_int(k, v, ctx->kvi);
 		return 0;
@@ -4589,6 +5508,8 @@ int cmd_pack_objects(int argc,
 	disable_replace_refs();
 
 	sparse = git_env_bool("GIT_TEST_PACK_SPARSE", -1);
+	if (git_env_bool("GIT_TEST_NO_ZERO_COPY", 0))
+		zero_copy = 0;
 	if (the_repository->gitdir) {
 		prepare_repo_settings(the_repository);
 		if (sparse < 0)
@@ -4837,6 +5758,13 @@ int cmd_pack_objects(int argc,
 	trace2_data_intmax("pack-objects", the_repository, "reused/delta", reused_delta);
 	trace2_data_intmax("pack-objects", the_repository, "pack-reused", reuse_packfile_objects);
 	trace2_data_intmax("pack-objects", the_repository, "packs-reused", reuse_packfiles_used_nr);
+	trace2_data_intmax("pack-objects", the_repository, "pack-reused/ref-delta", reused_ref_deltas);
+	trace2_data_intmax("pack-objects", the_repository, "memory/entry-size",
+			   sizeof(struct object_entry));
+	trace2_data_intmax("pack-objects", the_repository, "memory/packing-data",
+			   packing_data_memory(&to_pack));
+	trace2_data_intmax("pack-objects", the_repository, "memory/delta-cache-peak",
+			   peak_delta_cache_size);
 
 cleanup:
 	clear_packing_data(&to_pack);
@@ -20,6 +20,7 @@
 #include "object-store.h"
 #include "promisor-remote.h"
 #include "shallow.h"
+#include "trace2.h"
 #include "pack.h"
 #include "pack-bitmap.h"
 #include "refs.h"
@@ -33,6 +34,7 @@
 #define RETAIN_PACK 2
 
 static int pack_everything;
+static int midx_split_factor = 2;
 static int delta_base_offset = 1;
 static int pack_kept_objects = -1;
 static int write_bitmaps = -1;
@@ -43,7 +45,7 @@ static char *packdir, *packtmp_name, *packtmp;
 static const char *const git_repack_usage[] = {
 	N_("git repack [-a] [-A] [-d] [-f] [-F] [-l] [-n] [-q] [-b] [-m]\n"
 	   "[--window=<n>] [--depth=<n>] [--threads=<n>] [--keep-pack=<pack-name>]\n"
-	   "[--write-midx] [--name-hash-version=<n>]"),
+	   "[--write-midx[=<mode>]] [--name-hash-version=<n>]"),
 	NULL
 };
 
@@ -91,6 +93,12 @@ static int repack_config(const char *var, const char *value,
 		run_update_server_info = git_config_bool(var, value);
 		return 0;
 	}
+	if (!strcmp(var, "repack.midxsplitfactor")) {
+		midx_split_factor = git_config_int(var, value, ctx->kvi);
+		if (midx_split_factor < 1)
+			return error(_("%s must be at least 1"), var);
+		return 0;
+	}
 	if (!strcmp(var, "repack.cruftwindow")) {
 		free(cruft_po_args->window);
 		return git_config_string(&cruft_po_args->window, var, value);
@@ -833,10 +841,112 @@ static void midx_included_packs(struct string_list *include,
 	strbuf_release(&buf);
 }
 
+static int pack_is_midx_idx(struct multi_pack_index *m, const char *idx_name)
+{
+	return m && midx_contains_pack(m, idx_name);
+}
+
+static int pack_not_in_midx(struct string_list_item *item, void *m)
+{
+	return !pack_is_midx_idx(m, item->string);
+}
+
+static uint32_t pack_idx_objects(const char *packdir, const char *idx_name)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct packed_git *p;
+	uint32_t nr = 0;
+
+	strbuf_addf(&path, "%s/%s", packdir, idx_name);
+	p = add_packed_git(the_repository, path.buf, path.len, 1);
+	if (p) {
+		if (!open_pack_index(p))
+			nr = p->num_objects;
+		close_pack(p);
+		free(p);
+	}
+	strbuf_release(&path);
+	return nr;
+}
+
+/*
+ * With --write-midx=incremental, keep the bottom layers of the existing
+ * MIDX chain whose packs all survive the repack, as long as the layers
+ * above them (and the packs not in any layer) together hold fewer than
+ * 1/repack.midxSplitFactor as many objects as the topmost layer kept.
+ * This keeps the layer sizes geometric, so that the chain stays short
+ * and each repack only rewrites a small part of it.
+ *
+ * The packs of the kept layers are removed from "include", which is left
+ * with the packs of the new layer. Returns the checksum of the topmost
+ * kept layer, or NULL if the MIDX has to be rewritten as a whole.
+ */
+static char *midx_incremental_base(struct string_list *include,
+				   const char *packdir)
+{
+	struct multi_pack_index *m, **layers = NULL;
+	size_t nr = 0, alloc = 0, kept, i;
+	uint64_t new_objects = 0;
+	struct string_list_item *item;
+	char *base = NULL;
+
+	/* the object store was closed before the packs were moved around */
+	reprepare_packed_git(the_repository);
+	for (m = get_local_multi_pack_index(the_repository); m; m = m->base_midx) {
+		ALLOC_GROW(layers, nr + 1, alloc);
+		layers[nr++] = m;
+	}
+
+	/* layers[nr - 1] is the bottom layer */
+	for (kept = 0; kept < nr; kept++) {
+		struct multi_pack_index *layer = layers[nr - kept - 1];
+
+		for (i = 0; i < layer->num_packs; i++)
+			if (!string_list_has_string(include, layer->pack_names[i]))
+				break;
+		if (i < layer->num_packs)
+			break;
+	}
+
+	for_each_string_list_item(item, include)
+		if (!kept || !pack_is_midx_idx(layers[nr - kept], item->string))
+			new_objects += pack_idx_objects(packdir, item->string);
+
+	while (kept &&
+	       new_objects * midx_split_factor > layers[nr - kept]->num_objects) {
+		new_objects += layers[nr - kept]->num_objects;
+		kept--;
+	}
+
+	if (kept) {
+		struct multi_pack_index *top = layers[nr - kept];
+
+		filter_string_list(include, 0, pack_not_in_midx, top);
+		/*
+		 * Layers above "top" were dropped, but there is nothing
+		 * to write a layer with in their place.
+		 */
+		if (!include->nr && kept < nr)
+			BUG("dropped MIDX layers without any pack to replace them");
+		base = xstrdup(hash_to_hex_algop(get_midx_checksum(top),
+						 the_repository->hash_algo));
+	}
+
+	trace2_data_intmax("repack", the_repository,
+			   "incremental_midx/layers_kept", kept);
+	trace2_data_intmax("repack", the_repository,
+			   "incremental_midx/new_objects", new_objects);
+
+	free(layers);
+	close_object_store(the_repository->objects);
+	return base;
+}
+
 static int write_midx_included_packs(struct string_list *include,
 				     struct pack_geometry *geometry,
 				     struct string_list *names,
 				     const char *refs_snapshot,
+				     const char *incremental_base,
 				     int show_progress, int write_bitmaps)
 {
 	struct child_process cmd = CHILD_PROCESS_INIT;
@@ -862,6 +972,23 @@ static int write_midx_included_packs(struct string_list *include,
 	if (write_bitmaps)
 		strvec_push(&cmd.args, "--bitmap");
 
+	if (incremental_base) {
+		struct strbuf idx_name = STRBUF_INIT;
+
+		strvec_push(&cmd.args, "--incremental");
+		strvec_pushf(&cmd.args, "--base=%s", incremental_base);
+
+		/* the preferred pack must be part of the new layer */
+		if (preferred) {
+			strbuf_addstr(&idx_name, pack_basename(preferred));
+			strbuf_strip_suffix(&idx_name, ".pack");
+			strbuf_addstr(&idx_name, ".idx");
+			if (!string_list_has_string(include, idx_name.buf))
+				preferred = NULL;
+			strbuf_release(&idx_name);
+		}
+	}
+
 	if (preferred)
 		strvec_pushf(&cmd.args, "--preferred-pack=%s",
 			     pack_basename(preferred));
@@ -1129,6 +1256,28 @@ static const char *find_pack_prefix(const char *packdir, const char *packtmp)
 	return pack_prefix;
 }
 
+enum write_midx_mode {
+	WRITE_MIDX_NONE = 0,
+	WRITE_MIDX_FULL,
+	WRITE_MIDX_INCREMENTAL,
+};
+
+static int option_parse_write_midx(const struct option *opt, const char *arg,
+				   int unset)
+{
+	enum write_midx_mode *mode = opt->value;
+
+	if (unset)
+		*mode = WRITE_MIDX_NONE;
+	else if (!arg || !strcmp(arg, "full"))
+		*mode = WRITE_MIDX_FULL;
+	else if (!strcmp(arg, "incremental"))
+		*mode = WRITE_MIDX_INCREMENTAL;
+	else
+		return error(_("unknown %s mode: %s"), "--write-midx", arg);
+	return 0;
+}
+
 int cmd_repack(int argc,
 	       const char **argv,
 	       const char *prefix,
@@ -1150,7 +1299,7 @@ int cmd_repack(int argc,
 	struct string_list keep_pack_list = STRING_LIST_INIT_NODUP;
 	struct pack_objects_args po_args = { 0 };
 	struct pack_objects_args cruft_po_args = { 0 };
-	int write_midx = 0;
+	enum write_midx_mode write_midx = WRITE_MIDX_NONE;
 	const char *cruft_expiration = NULL;
 	const char *expire_to = NULL;
 	const char *filter_to = NULL;
@@ -1214,8 +1363,9 @@ int cmd_repack(int argc,
 				N_("do not repack this pack")),
 		OPT_INTEGER('g', "geometric", &geometry.split_factor,
 			    N_("find a geometric progression with factor <N>")),
-		OPT_BOOL('m', "write-midx", &write_midx,
-			   N_("write a multi-pack index of the resulting packs")),
+		OPT_CALLBACK_F('m', "write-midx", &write_midx, N_("mode"),
+			       N_("write a multi-pack index of the resulting packs"),
+			       PARSE_OPT_OPTARG, option_parse_write_midx),
 		OPT_STRING(0, "expire-to", &expire_to, N_("dir"),
 			   N_("pack prefix to store a pack containing pruned objects")),
 		OPT_STRING(0, "filter-to", &filter_to, N_("dir"),
@@ -1519,16 +1669,27 @@ int cmd_repack(int argc,
 
 	if (write_midx) {
 		struct string_list include = STRING_LIST_INIT_DUP;
+		struct string_list new_layer = STRING_LIST_INIT_DUP;
+		struct string_list_item *item;
+		char *base = NULL;
+
 		midx_included_packs(&include, &existing, &names, &geometry);
 
-		ret = write_midx_included_packs(&include, &geometry, &names,
+		for_each_string_list_item(item, &include)
+			string_list_append(&new_layer, item->string);
+		if (write_midx == WRITE_MIDX_INCREMENTAL)
+			base = midx_incremental_base(&new_layer, packdir);
+
+		ret = write_midx_included_packs(&new_layer, &geometry, &names,
 						refs_snapshot ? get_tempfile_path(refs_snapshot) : NULL,
-						show_progress, write_bitmaps > 0);
+						base, show_progress, write_bitmaps > 0);
 
 		if (!ret && write_bitmaps)
 			remove_redundant_bitmaps(&include, packdir);
 
 		string_list_clear(&include, 0);
+		string_list_clear(&new_layer, 0);
+		free(base);
 
 		if (ret)
 			goto cleanup;
@@ -1562,7 +1723,7 @@ int cmd_repack(int argc,
 		if (git_env_bool(GIT_TEST_MULTI_PACK_INDEX_WRITE_INCREMENTAL, 0))
 			flags |= MIDX_WRITE_INCREMENTAL;
 		write_midx_file(the_repository, repo_get_object_directory(the_repository),
-				NULL, NULL, flags);
+				NULL, NULL, NULL, flags);
 	}
 
 cleanup:
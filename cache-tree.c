@@ -17,6 +17,10 @@
 #include "promisor-remote.h"
 #include "trace.h"
 #include "trace2.h"
+#include "config.h"
+#include "oid-array.h"
+#include "packfile.h"
+#include "thread-utils.h"
 
 #ifndef DEBUG_CACHE_TREE
 #define DEBUG_CACHE_TREE 0
@@ -254,13 +258,71 @@ static int must_check_existence(const struct cache_entry *ce)
 	return !(repo_has_promisor_remote(the_repository) && ce_skip_worktree(ce));
 }
 
-static int update_one(struct cache_tree *it,
-		      struct cache_entry **cache,
-		      int entries,
-		      const char *base,
-		      int baselen,
-		      int *skip_count,
-		      int flags)
+/*
+ * A tree to be built on a thread (see build_trees()), once the trees
+ * for its subdirectories have been.
+ */
+struct tree_build {
+	struct cache_tree *it;
+	struct cache_entry **cache;
+	int entries;
+	const char *base;
+	int baselen;
+	int parent;	/* in the queue, or -1 for the root */
+	int pending;	/* subtrees still to be built */
+	int skip;
+};
+
+struct tree_build_queue {
+	struct tree_build *tree;
+	int nr, alloc;
+	int *ready;
+	int ready_nr;
+	int done, failed;
+	int flags;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/*
+ * The number of trees to build below which another thread is not
+ * worth starting.
+ */
+#define CACHE_TREE_THREAD_COST 50
+
+static int queue_tree(struct tree_build_queue *queue, struct cache_tree *it,
+		      struct cache_entry **cache, const char *base, int baselen,
+		      int parent)
+{
+	struct tree_build *t;
+
+	ALLOC_GROW(queue->tree, queue->nr + 1, queue->alloc);
+	t = &queue->tree[queue->nr];
+	memset(t, 0, sizeof(*t));
+	t->it = it;
+	t->cache = cache;
+	t->base = base;
+	t->baselen = baselen;
+	t->parent = parent;
+	if (parent >= 0)
+		queue->tree[parent].pending++;
+	return queue->nr++;
+}
+
+/*
+ * Write out the tree object for the level "base" of the index, whose
+ * subtrees are up to date. When "quiet", do not report problems,
+ * which happens on threads.
+ */
+static int build_one(struct cache_tree *it,
+		     struct cache_entry **cache,
+		     int entries,
+		     const char *base,
+		     int baselen,
+		     int *skip_count,
+		     int flags,
+		     int quiet)
 {
 	struct strbuf buffer;
 	int missing_ok = flags & WRITE_TREE_MISSING_OK;
@@ -269,91 +331,6 @@ static int update_one(struct cache_tree *it,
 	int to_invalidate = 0;
 	int i;
 
-	assert(!(dryrun && repair));
-
-	*skip_count = 0;
-
-	/*
-	 * If the first entry of this region is a sparse directory
-	 * entry corresponding exactly to 'base', then this cache_tree
-	 * struct is a "leaf" in the data structure, pointing to the
-	 * tree OID specified in the entry.
-	 */
-	if (entries > 0) {
-		const struct cache_entry *ce = cache[0];
-
-		if (S_ISSPARSEDIR(ce->ce_mode) &&
-		    ce->ce_namelen == baselen &&
-		    !strncmp(ce->name, base, baselen)) {
-			it->entry_count = 1;
-			oidcpy(&it->oid, &ce->oid);
-			return 1;
-		}
-	}
-
-	if (0 <= it->entry_count &&
-	    has_object(the_repository, &it->oid,
-		       HAS_OBJECT_RECHECK_PACKED | HAS_OBJECT_FETCH_PROMISOR))
-		return it->entry_count;
-
-	/*
-	 * We first scan for subtrees and update them; we start by
-	 * marking existing subtrees -- the ones that are unmarked
-	 * should not be in the result.
-	 */
-	for (i = 0; i < it->subtree_nr; i++)
-		it->down[i]->used = 0;
-
-	/*
-	 * Find the subtrees and update them.
-	 */
-	i = 0;
-	while (i < entries) {
-		const struct cache_entry *ce = cache[i];
-		struct cache_tree_sub *sub;
-		const char *path, *slash;
-		int pathlen, sublen, subcnt, subskip;
-
-		path = ce->name;
-		pathlen = ce_namelen(ce);
-		if (pathlen <= baselen || memcmp(base, path, baselen))
-			break; /* at the end of this level */
-
-		slash = strchr(path + baselen, '/');
-		if (!slash) {
-			i++;
-			continue;
-		}
-		/*
-		 * a/bbb/c (base = a/, slash = /c)
-		 * ==>
-		 * path+baselen = bbb/c, sublen = 3
-		 */
-		sublen = slash - (path + baselen);
-		sub = find_subtree(it, path + baselen, sublen, 1);
-		if (!sub->cache_tree)
-			sub->cache_tree = cache_tree();
-		subcnt = update_one(sub->cache_tree,
-				    cache + i, entries - i,
-				    path,
-				    baselen + sublen + 1,
-				    &subskip,
-				    flags);
-		if (subcnt < 0)
-			return subcnt;
-		if (!subcnt)
-			die("index cache-tree records empty sub-tree");
-		i += subcnt;
-		sub->count = subcnt; /* to be used in the next loop */
-		*skip_count += subskip;
-		sub->used = 1;
-	}
-
-	discard_unused_subtrees(it);
-
-	/*
-	 * Then write out the tree object for this level.
-	 */
 	strbuf_init(&buffer, 8192);
 
 	i = 0;
@@ -402,7 +379,7 @@ static int update_one(struct cache_tree *it,
 		    (!ce_missing_ok && !has_object(the_repository, oid,
 						   HAS_OBJECT_RECHECK_PACKED | HAS_OBJECT_FETCH_PROMISOR))) {
 			strbuf_release(&buffer);
-			if (expected_missing)
+			if (expected_missing || quiet)
 				return -1;
 			return error("invalid object %06o %s for '%.*s'",
 				mode, oid_to_hex(oid), entlen+baselen, path);
@@ -455,6 +432,25 @@ static int update_one(struct cache_tree *it,
 	} else if (dryrun) {
 		hash_object_file(the_hash_algo, buffer.buf, buffer.len,
 				 OBJ_TREE, &it->oid);
+	} else if (quiet) {
+		/*
+		 * Hash on this thread, and only take the lock to write
+		 * the trees we do not have yet.
+		 */
+		int ret = 0;
+
+		hash_object_file(the_hash_algo, buffer.buf, buffer.len,
+				 OBJ_TREE, &it->oid);
+		obj_read_lock();
+		if (!freshen_object(&it->oid))
+			ret = write_object_file_flags(buffer.buf, buffer.len,
+						      OBJ_TREE, &it->oid, NULL,
+						      WRITE_OBJECT_FILE_SILENT);
+		obj_read_unlock();
+		if (ret) {
+			strbuf_release(&buffer);
+			return -1;
+		}
 	} else if (write_object_file_flags(buffer.buf, buffer.len, OBJ_TREE,
 					   &it->oid, NULL, flags & WRITE_TREE_SILENT
 					   ? WRITE_OBJECT_FILE_SILENT : 0)) {
@@ -472,6 +468,342 @@ static int update_one(struct cache_tree *it,
 	return i;
 }
 
+/*
+ * Update the cache-tree "it" for the level "base" of the index. With
+ * a "queue", only bring the cache-tree into shape, and queue the trees
+ * to be built, below the one at "parent" in the queue.
+ */
+static int update_one(struct cache_tree *it,
+		      struct cache_entry **cache,
+		      int entries,
+		      const char *base,
+		      int baselen,
+		      int *skip_count,
+		      int flags,
+		      struct tree_build_queue *queue,
+		      int parent)
+{
+	int dryrun = flags & WRITE_TREE_DRY_RUN;
+	int repair = flags & WRITE_TREE_REPAIR;
+	int self = -1;
+	int i;
+
+	assert(!(dryrun && repair));
+
+	*skip_count = 0;
+
+	/*
+	 * If the first entry of this region is a sparse directory
+	 * entry corresponding exactly to 'base', then this cache_tree
+	 * struct is a "leaf" in the data structure, pointing to the
+	 * tree OID specified in the entry.
+	 */
+	if (entries > 0) {
+		const struct cache_entry *ce = cache[0];
+
+		if (S_ISSPARSEDIR(ce->ce_mode) &&
+		    ce->ce_namelen == baselen &&
+		    !strncmp(ce->name, base, baselen)) {
+			it->entry_count = 1;
+			oidcpy(&it->oid, &ce->oid);
+			return 1;
+		}
+	}
+
+	/* check_existing_trees() made sure we still have the tree */
+	if (0 <= it->entry_count)
+		return it->entry_count;
+
+	if (queue)
+		self = queue_tree(queue, it, cache, base, baselen, parent);
+
+	/*
+	 * We first scan for subtrees and update them; we start by
+	 * marking existing subtrees -- the ones that are unmarked
+	 * should not be in the result.
+	 */
+	for (i = 0; i < it->subtree_nr; i++)
+		it->down[i]->used = 0;
+
+	/*
+	 * Find the subtrees and update them.
+	 */
+	i = 0;
+	while (i < entries) {
+		const struct cache_entry *ce = cache[i];
+		struct cache_tree_sub *sub;
+		const char *path, *slash;
+		int pathlen, sublen, subcnt, subskip;
+
+		path = ce->name;
+		pathlen = ce_namelen(ce);
+		if (pathlen <= baselen || memcmp(base, path, baselen))
+			break; /* at the end of this level */
+
+		slash = strchr(path + baselen, '/');
+		if (!slash) {
+			i++;
+			continue;
+		}
+		/*
+		 * a/bbb/c (base = a/, slash = /c)
+		 * ==>
+		 * path+baselen = bbb/c, sublen = 3
+		 */
+		sublen = slash - (path + baselen);
+		sub = find_subtree(it, path + baselen, sublen, 1);
+		if (!sub->cache_tree)
+			sub->cache_tree = cache_tree();
+		subcnt = update_one(sub->cache_tree,
+				    cache + i, entries - i,
+				    path,
+				    baselen + sublen + 1,
+				    &subskip,
+				    flags, queue, self);
+		if (subcnt < 0)
+			return subcnt;
+		if (!subcnt)
+			die("index cache-tree records empty sub-tree");
+		i += subcnt;
+		sub->count = subcnt; /* to be used in the next loop */
+		*skip_count += subskip;
+		sub->used = 1;
+	}
+
+	discard_unused_subtrees(it);
+
+	if (queue) {
+		queue->tree[self].entries = i;
+		return i;
+	}
+
+	/*
+	 * Then write out the tree object for this level.
+	 */
+	return build_one(it, cache, entries, base, baselen, skip_count,
+			 flags, 0);
+}
+
+static void *build_trees_thread(void *data)
+{
+	struct tree_build_queue *queue = data;
+
+	pthread_mutex_lock(&queue->mutex);
+	for (;;) {
+		struct tree_build *t;
+		int ret;
+
+		while (!queue->ready_nr && !queue->failed &&
+		       queue->done < queue->nr)
+			pthread_cond_wait(&queue->cond, &queue->mutex);
+		if (queue->failed || queue->done == queue->nr)
+			break;
+		t = &queue->tree[queue->ready[--queue->ready_nr]];
+		pthread_mutex_unlock(&queue->mutex);
+
+		ret = build_one(t->it, t->cache, t->entries, t->base,
+				t->baselen, &t->skip, queue->flags, 1);
+
+		pthread_mutex_lock(&queue->mutex);
+		if (ret < 0) {
+			queue->failed = 1;
+			pthread_cond_broadcast(&queue->cond);
+			break;
+		}
+		queue->done++;
+		if (t->parent >= 0) {
+			struct tree_build *parent = &queue->tree[t->parent];
+
+			parent->skip += t->skip;
+			if (!--parent->pending) {
+				queue->ready[queue->ready_nr++] = t->parent;
+				pthread_cond_signal(&queue->cond);
+			}
+		}
+		if (queue->done == queue->nr)
+			pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	return NULL;
+}
+
+static int cache_tree_threads(void)
+{
+	int nr;
+
+	if (!HAVE_THREADS || repo_has_promisor_remote(the_repository))
+		return 1;
+	nr = git_env_ulong("GIT_TEST_CACHE_TREE_THREADS", 0);
+	if (!nr &&
+	    (repo_config_get_int(the_repository, "core.cachetreethreads", &nr) ||
+	     nr <= 0))
+		nr = online_cpus();
+	return nr;
+}
+
+/*
+ * Build the trees of the index which are out of date, bottom-up, with
+ * trees in different directories built on different threads. Returns
+ * 0 if it did, and -1 if it did not or ran into a problem; the caller
+ * then falls back to update_one(), which reports it the usual way.
+ * The trees built so far are valid and will not be built again.
+ */
+static int build_trees(struct index_state *istate, int flags)
+{
+	struct tree_build_queue queue = { 0 };
+	pthread_t *threads;
+	int nr_threads = cache_tree_threads();
+	int i, skip, ret, err;
+
+	if (nr_threads < 2)
+		return -1;
+
+	ret = update_one(istate->cache_tree, istate->cache, istate->cache_nr,
+			 "", 0, &skip, flags, &queue, -1);
+	if (ret < 0 || !queue.nr) {
+		free(queue.tree);
+		return ret < 0 ? ret : 0;
+	}
+	if (!git_env_ulong("GIT_TEST_CACHE_TREE_THREADS", 0) &&
+	    nr_threads > queue.nr / CACHE_TREE_THREAD_COST)
+		nr_threads = queue.nr / CACHE_TREE_THREAD_COST;
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	trace2_region_enter("cache_tree", "build", the_repository);
+	queue.flags = flags;
+	ALLOC_ARRAY(queue.ready, queue.nr);
+	for (i = 0; i < queue.nr; i++)
+		if (!queue.tree[i].pending)
+			queue.ready[queue.ready_nr++] = i;
+	pthread_mutex_init(&queue.mutex, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+
+	if (nr_threads == 1) {
+		build_trees_thread(&queue);
+	} else {
+		enable_obj_read_lock();
+		CALLOC_ARRAY(threads, nr_threads);
+		for (i = 0; i < nr_threads; i++) {
+			err = pthread_create(&threads[i], NULL,
+					     build_trees_thread, &queue);
+			if (err)
+				die(_("unable to create threaded cache-tree update: %s"),
+				    strerror(err));
+		}
+		for (i = 0; i < nr_threads; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+		disable_obj_read_lock();
+	}
+
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.mutex);
+	trace2_data_intmax("cache_tree", the_repository, "build/trees", queue.nr);
+	trace2_data_intmax("cache_tree", the_repository, "build/threads",
+			   nr_threads);
+	trace2_region_leave("cache_tree", "build", the_repository);
+
+	ret = queue.failed ? -1 : 0;
+	free(queue.ready);
+	free(queue.tree);
+	return ret;
+}
+
+struct cache_tree_list {
+	struct cache_tree **tree;
+	size_t nr, alloc;
+};
+
+/*
+ * Note the trees "it" or, where it is out of date, below it that the
+ * cache-tree claims to be up to date.
+ */
+static void collect_valid_trees(struct cache_tree *it,
+				struct cache_tree_list *list)
+{
+	int i;
+
+	if (!it)
+		return;
+	if (0 <= it->entry_count) {
+		ALLOC_GROW(list->tree, list->nr + 1, list->alloc);
+		list->tree[list->nr++] = it;
+		return;
+	}
+	for (i = 0; i < it->subtree_nr; i++)
+		collect_valid_trees(it->down[i]->cache_tree, list);
+}
+
+static int tree_oid_cmp(const void *a_, const void *b_)
+{
+	const struct cache_tree *a = *(const struct cache_tree **)a_;
+	const struct cache_tree *b = *(const struct cache_tree **)b_;
+
+	return oidcmp(&a->oid, &b->oid);
+}
+
+/*
+ * Make sure we still have the trees the cache-tree claims to be up to
+ * date, and mark the ones we do not have out of date. They are looked
+ * up all at once, in the order they are stored in, and the object
+ * store is only rescanned (and the promisor remote only asked) once
+ * for all the ones that cannot be found.
+ */
+static void check_existing_trees(struct cache_tree *root)
+{
+	struct cache_tree_list todo = { 0 }, missing = { 0 };
+	struct oid_array to_fetch = OID_ARRAY_INIT;
+	int rescanned = 0;
+	size_t i;
+	int j;
+
+	collect_valid_trees(root, &todo);
+	while (todo.nr) {
+		QSORT(todo.tree, todo.nr, tree_oid_cmp);
+		missing.nr = 0;
+		for (i = 0; i < todo.nr; i++) {
+			if (has_object(the_repository, &todo.tree[i]->oid, 0))
+				continue;
+			ALLOC_GROW(missing.tree, missing.nr + 1, missing.alloc);
+			missing.tree[missing.nr++] = todo.tree[i];
+		}
+		if (!missing.nr)
+			break;
+
+		if (!rescanned) {
+			reprepare_packed_git(the_repository);
+			rescanned = 1;
+		}
+		if (repo_has_promisor_remote(the_repository)) {
+			oid_array_clear(&to_fetch);
+			for (i = 0; i < missing.nr; i++)
+				if (!has_object(the_repository,
+						&missing.tree[i]->oid, 0))
+					oid_array_append(&to_fetch,
+							 &missing.tree[i]->oid);
+			promisor_remote_get_direct(the_repository,
+						   to_fetch.oid, to_fetch.nr);
+		}
+
+		/* look below the ones which are really gone */
+		todo.nr = 0;
+		for (i = 0; i < missing.nr; i++) {
+			struct cache_tree *it = missing.tree[i];
+
+			if (has_object(the_repository, &it->oid, 0))
+				continue;
+			it->entry_count = -1;
+			for (j = 0; j < it->subtree_nr; j++)
+				collect_valid_trees(it->down[j]->cache_tree,
+						    &todo);
+		}
+	}
+	oid_array_clear(&to_fetch);
+	free(todo.tree);
+	free(missing.tree);
+}
+
 int cache_tree_update(struct index_state *istate, int flags)
 {
 	int skip, i;
@@ -490,8 +822,11 @@ int cache_tree_update(struct index_state *istate, int flags)
 	trace_performance_enter();
 	trace2_region_enter("cache_tree", "update", the_repository);
 	begin_odb_transaction();
-	i = update_one(istate->cache_tree, istate->cache, istate->cache_nr,
-		       "", 0, &skip, flags);
+	check_existing_trees(istate->cache_tree);
+	i = build_trees(istate, flags);
+	if (i < 0)
+		i = update_one(istate->cache_tree, istate->cache, istate->cache_nr,
+			       "", 0, &skip, flags, NULL, -1);
 	end_odb_transaction();
 	trace2_region_leave("cache_tree", "update", the_repository);
 	trace_performance_leave("cache_tree_update");
@@ -215,7 +215,7 @@ static struct commit_graph *alloc_commit_graph(void)
 	return g;
 }
 
-static int commit_graph_compatible(struct repository *r)
+int commit_graph_compatible(struct repository *r)
 {
 	if (!r->gitdir)
 		return 0;
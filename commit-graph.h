@@ -143,6 +143,14 @@ int generation_numbers_enabled(struct repository *r);
  */
 int corrected_commit_dates_enabled(struct repository *r);
 
+/*
+ * Return 1 if the parents recorded in the object database are the
+ * ones Git would use, i.e. there are no replace refs, grafts or
+ * shallow boundaries rewriting history. Only then can precomputed
+ * reachability data (commit-graphs, reachability bitmaps) be used.
+ */
+int commit_graph_compatible(struct repository *r);
+
 struct bloom_filter_settings *get_bloom_filter_settings(struct repository *r);
 
 enum commit_graph_write_flags {
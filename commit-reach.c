@@ -11,6 +11,9 @@
 #include "tag.h"
 #include "commit-reach.h"
 #include "ewah/ewok.h"
+#include "pack-bitmap.h"
+#include "repository.h"
+#include "trace2.h"
 
 /* Remember to update object flag allocation in object.h */
 #define PARENT1		(1u<<16)
@@ -20,6 +23,20 @@
 
 static const unsigned all_flags = (PARENT1 | PARENT2 | STALE | RESULT);
 
+/*
+ * Return the bitmap index to answer reachability queries from, or
+ * NULL if there is none or the bitmaps cannot be trusted to agree
+ * with the history we would walk.
+ */
+static struct bitmap_index *reachability_bitmap(struct repository *r)
+{
+	prepare_repo_settings(r);
+	if (!r->settings.core_reachability_bitmaps ||
+	    !commit_graph_compatible(r))
+		return NULL;
+	return repo_reachability_bitmap(r);
+}
+
 static int compare_commits_by_gen(const void *_a, const void *_b)
 {
 	const struct commit *a = *(const struct commit * const *)_a;
@@ -499,9 +516,29 @@ int repo_is_descendant_of(struct repository *r,
 			  struct commit *commit,
 			  struct commit_list *with_commit)
 {
+	struct bitmap_index *bitmap_git;
+
 	if (!with_commit)
 		return 1;
 
+	bitmap_git = reachability_bitmap(r);
+	if (bitmap_git) {
+		struct commit_list *p;
+		int unknown = 0;
+
+		for (p = with_commit; p; p = p->next) {
+			int reachable = bitmap_commit_reachable_from(bitmap_git,
+								     p->item,
+								     commit);
+			if (reachable > 0)
+				return 1;
+			if (reachable < 0)
+				unknown = 1;
+		}
+		if (!unknown)
+			return 0;
+	}
+
 	if (generation_numbers_enabled(r)) {
 		struct commit_list *from_list = NULL;
 		int result;
@@ -532,6 +569,8 @@ int repo_in_merge_bases_many(struct repository *r, struct commit *commit,
 			     int ignore_missing_commits)
 {
 	struct commit_list *bases = NULL;
+	struct bitmap_index *bitmap_git;
+	struct commit **unknown = NULL;
 	int ret = 0, i;
 	timestamp_t generation, max_generation = GENERATION_NUMBER_ZERO;
 
@@ -550,6 +589,33 @@ int repo_in_merge_bases_many(struct repository *r, struct commit *commit,
 	if (generation > max_generation)
 		return ret;
 
+	/*
+	 * Let the bitmaps answer for every reference they can, and
+	 * only walk from the ones they cannot.
+	 */
+	bitmap_git = reachability_bitmap(r);
+	if (bitmap_git) {
+		int nr_unknown = 0;
+
+		ALLOC_ARRAY(unknown, nr_reference);
+		for (i = 0; i < nr_reference; i++) {
+			int reachable = bitmap_commit_reachable_from(bitmap_git,
+								     commit,
+								     reference[i]);
+			if (reachable > 0) {
+				ret = 1;
+				goto cleanup;
+			}
+			if (reachable < 0)
+				unknown[nr_unknown++] = reference[i];
+		}
+
+		if (!nr_unknown)
+			goto cleanup;
+		reference = unknown;
+		nr_reference = nr_unknown;
+	}
+
 	if (paint_down_to_common(r, commit,
 				 nr_reference, reference,
 				 generation, ignore_missing_commits, &bases))
@@ -559,6 +625,8 @@ int repo_in_merge_bases_many(struct repository *r, struct commit *commit,
 	clear_commit_marks(commit, all_flags);
 	clear_commit_marks_many(nr_reference, reference, all_flags);
 	free_commit_list(bases);
+cleanup:
+	free(unknown);
 	return ret;
 }
 
@@ -692,9 +760,12 @@ static int in_commit_list(const struct commit_list *want, struct commit *c)
 static enum contains_result contains_test(struct commit *candidate,
 					  const struct commit_list *want,
 					  struct contains_cache *cache,
-					  timestamp_t cutoff)
+					  timestamp_t cutoff,
+					  struct bitmap_index *bitmap_git)
 {
 	enum contains_result *cached = contains_cache_at(cache, candidate);
+	const struct commit_list *p;
+	int unknown = 0;
 
 	/* If we already have the answer cached, return that. */
 	if (*cached)
@@ -712,7 +783,24 @@ static enum contains_result contains_test(struct commit *candidate,
 	if (commit_graph_generation(candidate) < cutoff)
 		return CONTAINS_NO;
 
-	return CONTAINS_UNKNOWN;
+	if (!bitmap_git)
+		return CONTAINS_UNKNOWN;
+
+	for (p = want; p; p = p->next) {
+		int reachable = bitmap_commit_reachable_from(bitmap_git, p->item,
+							     candidate);
+		if (reachable > 0) {
+			*cached = CONTAINS_YES;
+			return CONTAINS_YES;
+		}
+		if (reachable < 0)
+			unknown = 1;
+	}
+	if (unknown)
+		return CONTAINS_UNKNOWN;
+
+	*cached = CONTAINS_NO;
+	return CONTAINS_NO;
 }
 
 static void push_to_contains_stack(struct commit *candidate, struct contains_stack *contains_stack)
@@ -730,6 +818,7 @@ static enum contains_result contains_tag_algo(struct commit *candidate,
 	enum contains_result result;
 	timestamp_t cutoff = GENERATION_NUMBER_INFINITY;
 	const struct commit_list *p;
+	struct bitmap_index *bitmap_git = reachability_bitmap(the_repository);
 
 	for (p = want; p; p = p->next) {
 		timestamp_t generation;
@@ -740,7 +829,7 @@ static enum contains_result contains_tag_algo(struct commit *candidate,
 			cutoff = generation;
 	}
 
-	result = contains_test(candidate, want, cache, cutoff);
+	result = contains_test(candidate, want, cache, cutoff, bitmap_git);
 	if (result != CONTAINS_UNKNOWN)
 		return result;
 
@@ -758,7 +847,8 @@ static enum contains_result contains_tag_algo(struct commit *candidate,
 		 * If we just popped the stack, parents->item has been marked,
 		 * therefore contains_test will return a meaningful yes/no.
 		 */
-		else switch (contains_test(parents->item, want, cache, cutoff)) {
+		else switch (contains_test(parents->item, want, cache, cutoff,
+					    bitmap_git)) {
 		case CONTAINS_YES:
 			*contains_cache_at(cache, commit) = CONTAINS_YES;
 			contains_stack.nr--;
@@ -772,7 +862,7 @@ static enum contains_result contains_tag_algo(struct commit *candidate,
 		}
 	}
 	free(contains_stack.contains_stack);
-	return contains_test(candidate, want, cache, cutoff);
+	return contains_test(candidate, want, cache, cutoff, bitmap_git);
 }
 
 int commit_contains(struct ref_filter *filter, struct commit *commit,
@@ -1149,10 +1239,51 @@ void tips_reachable_from_bases(struct repository *r,
 	size_t min_generation_index = 0;
 	timestamp_t min_generation;
 	struct commit_list *stack = NULL;
+	struct commit_list *unbitmapped = NULL;
+	struct commit **remaining = NULL;
+	struct bitmap_index *bitmap_git;
 
 	if (!bases || !tips || !tips_nr)
 		return;
 
+	/*
+	 * Mark every tip reachable from the union of the bases that have
+	 * a bitmap. Only the remaining bases need to be walked, and only
+	 * to look for the tips that were not found yet.
+	 */
+	bitmap_git = reachability_bitmap(r);
+	if (bitmap_git) {
+		struct bitmap *reach = bitmap_new();
+		struct commit_list **tail = &unbitmapped;
+		size_t remaining_nr = 0, found_nr = 0;
+
+		for (; bases; bases = bases->next)
+			if (!or_bitmap_for_commit(bitmap_git, bases->item, reach))
+				tail = &commit_list_insert(bases->item, tail)->next;
+
+		ALLOC_ARRAY(remaining, tips_nr);
+		for (size_t i = 0; i < tips_nr; i++) {
+			if (bitmap_walk_contains(bitmap_git, reach,
+						 &tips[i]->object.oid)) {
+				tips[i]->object.flags |= mark;
+				found_nr++;
+			} else {
+				remaining[remaining_nr++] = tips[i];
+			}
+		}
+		bitmap_free(reach);
+
+		trace2_data_intmax("commit-reach", r,
+				   "tips_reachable_from_bases/bitmap-found",
+				   found_nr);
+
+		bases = unbitmapped;
+		tips = remaining;
+		tips_nr = remaining_nr;
+		if (!bases || !tips_nr)
+			goto cleanup;
+	}
+
 	/*
 	 * Do a depth-first search starting at 'bases' to search for the
 	 * tips. Stop at the lowest (un-found) generation number. When
@@ -1234,6 +1365,9 @@ void tips_reachable_from_bases(struct repository *r,
 	free(commits);
 	repo_clear_commit_marks(r, SEEN);
 	free_commit_list(stack);
+cleanup:
+	free_commit_list(unbitmapped);
+	free(remaining);
 }
 
 /*
@@ -180,6 +180,15 @@ static inline uint64_t get_be64(const void *ptr)
 		(uint64_t)get_be32(&p[4]) <<  0;
 }
 
+static inline uint32_t get_le32(const void *ptr)
+{
+	const unsigned char *p = ptr;
+	return	(uint32_t)p[0] <<  0 |
+		(uint32_t)p[1] <<  8 |
+		(uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+
 static inline void put_be32(void *ptr, uint32_t value)
 {
 	unsigned char *p = ptr;
@@ -189,6 +198,15 @@ static inline void put_be32(void *ptr, uint32_t value)
 	p[3] = (value >>  0) & 0xff;
 }
 
+static inline void put_le32(void *ptr, uint32_t value)
+{
+	unsigned char *p = ptr;
+	p[0] = (value >>  0) & 0xff;
+	p[1] = (value >>  8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = (value >> 24) & 0xff;
+}
+
 static inline void put_be64(void *ptr, uint64_t value)
 {
 	unsigned char *p = ptr;
@@ -4,7 +4,8 @@ void *git_mmap(void *start, size_t length, int prot, int flags, int fd, off_t of
 {
 	size_t n = 0;
 
-	if (start != NULL || flags != MAP_PRIVATE || prot != PROT_READ)
+	if (start != NULL || flags != MAP_PRIVATE ||
+	    (prot != PROT_READ && prot != (PROT_READ | PROT_WRITE)))
 		die("Invalid usage of mmap when built with NO_MMAP");
 
 	if (length == 0) {
@@ -146,6 +146,22 @@ void hashwrite(struct hashfile *f, const void *buf, unsigned int count)
 	}
 }
 
+void hashfile_account(struct hashfile *f, const void *buf, size_t count)
+{
+	if (f->offset)
+		BUG("hashfile_account() called with buffered data");
+	if (0 <= f->check_fd)
+		BUG("hashfile_account() called on a checked hashfile");
+
+	if (f->do_crc)
+		f->crc32 = crc32(f->crc32, buf, count);
+	if (!f->skip_hash)
+		git_hash_update(&f->ctx, buf, count);
+
+	f->total += count;
+	display_throughput(f->tp, f->total);
+}
+
 struct hashfile *hashfd_check(const struct git_hash_algo *algop,
 			      const char *name)
 {
@@ -65,6 +65,14 @@ int finalize_hashfile(struct hashfile *, unsigned char *, enum fsync_component,
 void discard_hashfile(struct hashfile *);
 void hashwrite(struct hashfile *, const void *, unsigned int);
 void hashflush(struct hashfile *f);
+
+/*
+ * Account for "count" bytes that the caller has already written to
+ * f->fd by other means (e.g. sendfile()), updating the checksum, the
+ * CRC and the byte count as if they had gone through hashwrite().
+ * The caller must hashflush() first.
+ */
+void hashfile_account(struct hashfile *f, const void *buf, size_t count);
 void crc32_begin(struct hashfile *);
 uint32_t crc32_end(struct hashfile *);
 
@@ -15,6 +15,12 @@
 
 #include "git-compat-util.h"
 #include "delta.h"
+#include "parse.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DELTA_AVX2 1
+#endif
 
 /* maximum hash entry list for the same hash bucket */
 #define HASH_LIMIT 64
@@ -132,10 +138,181 @@ struct delta_index {
 	struct index_entry *hash[FLEX_ARRAY];
 };
 
+/*
+ * Number of reference blocks hashed together by create_delta_index().
+ */
+#define HASH_BATCH 16
+
+static unsigned int hash_block(const unsigned char *data)
+{
+	unsigned int i, val = 0;
+
+	for (i = 1; i <= RABIN_WINDOW; i++)
+		val = ((val << 8) | data[i]) ^ T[val >> RABIN_SHIFT];
+	return val;
+}
+
+static inline uint64_t load_word(const unsigned char *p)
+{
+	uint64_t word;
+
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+/*
+ * Kernels for index construction and match extension. Each has a
+ * portable version and, on x86, an AVX2 version selected at runtime
+ * when the CPU supports it; the deltas produced are identical either
+ * way. Setting GIT_TEST_DIFF_DELTA_NO_SIMD forces the portable
+ * versions.
+ */
+#ifdef DELTA_AVX2
+/*
+ * Hash HASH_BATCH consecutive blocks starting at "data", one block
+ * per 32-bit lane. The input bytes are gathered as the top byte of a
+ * little-endian word ending on them, so this reads up to three bytes
+ * before "data" and must not be used on the first block of a buffer.
+ * The table lookups are gathers too; two independent vectors keep
+ * more of them in flight.
+ */
+__attribute__((target("avx2")))
+static void hash_blocks_avx2(const unsigned char *data, unsigned int *val)
+{
+	const __m256i stride = _mm256_setr_epi32(
+		0 * RABIN_WINDOW, 1 * RABIN_WINDOW, 2 * RABIN_WINDOW,
+		3 * RABIN_WINDOW, 4 * RABIN_WINDOW, 5 * RABIN_WINDOW,
+		6 * RABIN_WINDOW, 7 * RABIN_WINDOW);
+	const unsigned char *hi = data + 8 * RABIN_WINDOW;
+	__m256i v = _mm256_setzero_si256(), w = v;
+	int i;
+
+	for (i = 1; i <= RABIN_WINDOW; i++) {
+		__m256i v_bytes = _mm256_i32gather_epi32((const int *)(data + i - 3),
+							 stride, 1);
+		__m256i w_bytes = _mm256_i32gather_epi32((const int *)(hi + i - 3),
+							 stride, 1);
+		__m256i v_t = _mm256_i32gather_epi32((const int *)T,
+						     _mm256_srli_epi32(v, RABIN_SHIFT), 4);
+		__m256i w_t = _mm256_i32gather_epi32((const int *)T,
+						     _mm256_srli_epi32(w, RABIN_SHIFT), 4);
+		v = _mm256_or_si256(_mm256_slli_epi32(v, 8),
+				    _mm256_srli_epi32(v_bytes, 24));
+		w = _mm256_or_si256(_mm256_slli_epi32(w, 8),
+				    _mm256_srli_epi32(w_bytes, 24));
+		v = _mm256_xor_si256(v, v_t);
+		w = _mm256_xor_si256(w, w_t);
+	}
+	_mm256_storeu_si256((__m256i *)val, v);
+	_mm256_storeu_si256((__m256i *)(val + 8), w);
+}
+
+/*
+ * Return the length of the common prefix of "src" and "ref", looking
+ * at 32 bytes at a time and no further than the last full chunk of
+ * "len".
+ */
+__attribute__((target("avx2")))
+static size_t match_forward_avx2(const unsigned char *src,
+				 const unsigned char *ref, size_t len)
+{
+	size_t n = 0;
+
+	for (; n + 32 <= len; n += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + n));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(ref + n));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+		if (mask != 0xffffffff)
+			return n + __builtin_ctz(~mask);
+	}
+	return n;
+}
+
+static int use_avx2(void)
+{
+	static int enabled = -1;
+
+	if (enabled < 0)
+		enabled = __builtin_cpu_supports("avx2") &&
+			!git_env_bool("GIT_TEST_DIFF_DELTA_NO_SIMD", 0);
+	return enabled;
+}
+#endif
+
+/*
+ * Compute the hash of blocks "first" to "first + nr - 1" of "buffer"
+ * into "val".
+ */
+static void hash_blocks(const unsigned char *buffer, size_t first,
+			unsigned int nr, unsigned int *val)
+{
+	unsigned int i;
+
+#ifdef DELTA_AVX2
+	if (nr == HASH_BATCH && first && use_avx2()) {
+		hash_blocks_avx2(buffer + first * RABIN_WINDOW, val);
+		return;
+	}
+#endif
+	if (nr == HASH_BATCH) {
+		/* interleave the blocks so their lookups can overlap */
+		const unsigned char *data = buffer + first * RABIN_WINDOW;
+		unsigned int j;
+
+		memset(val, 0, HASH_BATCH * sizeof(*val));
+		for (i = 1; i <= RABIN_WINDOW; i++)
+			for (j = 0; j < HASH_BATCH; j++)
+				val[j] = ((val[j] << 8) | data[j * RABIN_WINDOW + i])
+					 ^ T[val[j] >> RABIN_SHIFT];
+		return;
+	}
+	for (i = 0; i < nr; i++)
+		val[i] = hash_block(buffer + (first + i) * RABIN_WINDOW);
+}
+
+/*
+ * Return the number of leading bytes "src" and "ref" have in common,
+ * up to "len".
+ */
+static size_t match_forward(const unsigned char *src,
+			    const unsigned char *ref, size_t len)
+{
+	size_t n = 0;
+
+#ifdef DELTA_AVX2
+	if (len >= 32 && use_avx2())
+		n = match_forward_avx2(src, ref, len);
+#endif
+	while (n + 8 <= len && load_word(src + n) == load_word(ref + n))
+		n += 8;
+	while (n < len && src[n] == ref[n])
+		n++;
+	return n;
+}
+
+/*
+ * Return the number of bytes immediately before "src" and "ref" that
+ * they have in common, up to "len".
+ */
+static size_t match_backward(const unsigned char *src,
+			     const unsigned char *ref, size_t len)
+{
+	size_t n = 0;
+
+	while (n + 8 <= len && load_word(src - n - 8) == load_word(ref - n - 8))
+		n += 8;
+	while (n < len && src[-n - 1] == ref[-n - 1])
+		n++;
+	return n;
+}
+
 struct delta_index * create_delta_index(const void *buf, unsigned long bufsize)
 {
 	unsigned int i, hsize, hmask, entries, prev_val, *hash_count;
-	const unsigned char *data, *buffer = buf;
+	unsigned int j, nr, vals[HASH_BATCH];
+	size_t block;
+	const unsigned char *buffer = buf;
 	struct delta_index *index;
 	struct unpacked_index_entry *entry, **hash;
 	struct index_entry *packed_entry, **packed_hash;
@@ -182,24 +359,30 @@ struct delta_index * create_delta_index(const void *buf, unsigned long bufsize)
 
 	/* then populate the index */
 	prev_val = ~0;
-	for (data = buffer + entries * RABIN_WINDOW - RABIN_WINDOW;
-	     data >= buffer;
-	     data -= RABIN_WINDOW) {
-		unsigned int val = 0;
-		for (i = 1; i <= RABIN_WINDOW; i++)
-			val = ((val << 8) | data[i]) ^ T[val >> RABIN_SHIFT];
-		if (val == prev_val) {
-			/* keep the lowest of consecutive identical blocks */
-			entry[-1].entry.ptr = data + RABIN_WINDOW;
-			--entries;
-		} else {
-			prev_val = val;
-			i = val & hmask;
-			entry->entry.ptr = data + RABIN_WINDOW;
-			entry->entry.val = val;
-			entry->next = hash[i];
-			hash[i] = entry++;
-			hash_count[i]++;
+	for (block = entries; block; block -= nr) {
+		/*
+		 * Blocks are visited from the end of the buffer, but hashed
+		 * HASH_BATCH at a time.
+		 */
+		nr = block < HASH_BATCH ? block : HASH_BATCH;
+		hash_blocks(buffer, block - nr, nr, vals);
+		for (j = nr; j--; ) {
+			const unsigned char *data =
+				buffer + (block - nr + j) * RABIN_WINDOW;
+			unsigned int val = vals[j];
+			if (val == prev_val) {
+				/* keep the lowest of consecutive identical blocks */
+				entry[-1].entry.ptr = data + RABIN_WINDOW;
+				--entries;
+			} else {
+				prev_val = val;
+				i = val & hmask;
+				entry->entry.ptr = data + RABIN_WINDOW;
+				entry->entry.val = val;
+				entry->next = hash[i];
+				hash[i] = entry++;
+				hash_count[i]++;
+			}
 		}
 	}
 
@@ -380,19 +563,18 @@ create_delta(const struct delta_index *index,
 			i = val & index->hash_mask;
 			for (entry = index->hash[i]; entry < index->hash[i+1]; entry++) {
 				const unsigned char *ref = entry->ptr;
-				const unsigned char *src = data;
 				unsigned int ref_size = ref_top - ref;
+				size_t len;
 				if (entry->val != val)
 					continue;
-				if (ref_size > top - src)
-					ref_size = top - src;
+				if (ref_size > top - data)
+					ref_size = top - data;
 				if (ref_size <= msize)
 					break;
-				while (ref_size-- && *src++ == *ref)
-					ref++;
-				if (msize < ref - entry->ptr) {
+				len = match_forward(data, ref, ref_size);
+				if (msize < len) {
 					/* this is our best match so far */
-					msize = ref - entry->ptr;
+					msize = len;
 					moff = entry->ptr - ref_data;
 					if (msize >= 4096) /* good enough */
 						break;
@@ -415,17 +597,17 @@ create_delta(const struct delta_index *index,
 			unsigned char *op;
 
 			if (inscnt) {
-				while (moff && ref_data[moff-1] == data[-1]) {
-					/* we can match one byte back */
-					msize++;
-					moff--;
-					data--;
-					outpos--;
-					if (--inscnt)
-						continue;
+				/* see how far back the match extends */
+				size_t back = match_backward(data, ref_data + moff,
+							     moff < inscnt ? moff : inscnt);
+				msize += back;
+				moff -= back;
+				data -= back;
+				outpos -= back;
+				inscnt -= back;
+				if (!inscnt) {
 					outpos--;  /* remove count slot */
 					inscnt--;  /* make it -1 */
-					break;
 				}
 				out[outpos - inscnt - 1] = inscnt;
 				inscnt = 0;
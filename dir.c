@@ -23,6 +23,7 @@
 #include "repository.h"
 #include "wildmatch.h"
 #include "pathspec.h"
+#include "pattern-matcher.h"
 #include "utf8.h"
 #include "varint.h"
 #include "ewah/ewok.h"
@@ -35,6 +36,8 @@
 #include "trace2.h"
 #include "tree.h"
 #include "hex.h"
+#include "object-store.h"
+#include "thread-utils.h"
 
  /*
   * The maximum size of a pattern/exclude file. If the file exceeds this size
@@ -76,6 +79,52 @@ static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 	int check_only, int stop_at_first_file, const struct pathspec *pathspec);
 static int resolve_dtype(int dtype, struct index_state *istate,
 			 const char *path, int len);
+
+/*
+ * Without the untracked cache, the directories the traversal recurses
+ * into are independent of each other: each only adds what it finds to
+ * the result lists.  So instead of recursing, a thread may hand such a
+ * directory over to another through this queue.
+ */
+struct dir_shards {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	char **queue;
+	size_t queue_nr, queue_alloc;
+	int busy, nr_threads;
+};
+
+static inline void dir_shards_lock(struct dir_struct *dir)
+{
+	if (dir->internal.shards)
+		pthread_mutex_lock(&dir->internal.shards->mutex);
+}
+
+static inline void dir_shards_unlock(struct dir_struct *dir)
+{
+	if (dir->internal.shards)
+		pthread_mutex_unlock(&dir->internal.shards->mutex);
+}
+
+/*
+ * Queue the directory "path" for another thread, unless enough work
+ * is queued already.  Returns 1 if it was queued.
+ */
+static int dir_shards_push(struct dir_struct *dir, const char *path, size_t len)
+{
+	struct dir_shards *shards = dir->internal.shards;
+	int queued = 0;
+
+	pthread_mutex_lock(&shards->mutex);
+	if (shards->queue_nr < shards->nr_threads) {
+		ALLOC_GROW(shards->queue, shards->queue_nr + 1, shards->queue_alloc);
+		shards->queue[shards->queue_nr++] = xmemdupz(path, len);
+		pthread_cond_signal(&shards->cond);
+		queued = 1;
+	}
+	pthread_mutex_unlock(&shards->mutex);
+	return queued;
+}
 struct dirent *readdir_skip_dot_and_dotdot(DIR *dirp)
 {
 	struct dirent *e;
@@ -928,6 +977,35 @@ int hashmap_contains_parent(struct hashmap *map,
 	return 0;
 }
 
+static void matcher_add_path_pattern(struct pattern_list *pl, int pos)
+{
+	struct path_pattern *pattern = pl->patterns[pos];
+
+	pattern_matcher_add(pl->matcher, pos, pattern->base,
+			    pattern->baselen ? pattern->baselen - 1 : 0,
+			    pattern->pattern, pattern->patternlen,
+			    pattern->nowildcardlen, pattern->flags);
+}
+
+/*
+ * Index the list once it grows long enough for that to pay off,
+ * and keep the index up to date from then on.
+ */
+static void add_pattern_to_matcher(struct pattern_list *pl)
+{
+	int i;
+
+	if (pl->matcher) {
+		matcher_add_path_pattern(pl, pl->nr - 1);
+		return;
+	}
+	if (!pattern_matcher_wanted(pl->nr))
+		return;
+	pl->matcher = pattern_matcher_new();
+	for (i = 0; i < pl->nr; i++)
+		matcher_add_path_pattern(pl, i);
+}
+
 void add_pattern(const char *string, const char *base,
 		 int baselen, struct pattern_list *pl, int srcpos)
 {
@@ -949,6 +1027,7 @@ void add_pattern(const char *string, const char *base,
 	pattern->pl = pl;
 
 	add_pattern_to_hashsets(pl, pattern);
+	add_pattern_to_matcher(pl);
 }
 
 static int read_skip_worktree_file_from_index(struct index_state *istate,
@@ -979,6 +1058,7 @@ void clear_pattern_list(struct pattern_list *pl)
 	for (i = 0; i < pl->nr; i++)
 		free(pl->patterns[i]);
 	free(pl->patterns);
+	pattern_matcher_free(pl->matcher);
 	clear_pattern_entry_hashmap(&pl->recursive_hashmap);
 	clear_pattern_entry_hashmap(&pl->parent_hashmap);
 
@@ -1366,6 +1446,44 @@ int match_pathname(const char *pathname, int pathlen,
 				 WM_PATHNAME) == 0;
 }
 
+struct pattern_match_data {
+	struct pattern_list *pl;
+	const char *pathname;
+	int pathlen;
+	const char *basename;
+	int *dtype;
+	struct index_state *istate;
+};
+
+static int path_pattern_matches(int pos, void *data_)
+{
+	struct pattern_match_data *data = data_;
+	struct path_pattern *pattern = data->pl->patterns[pos];
+	const char *pathname = data->pathname;
+	int pathlen = data->pathlen;
+
+	if (pattern->flags & PATTERN_FLAG_MUSTBEDIR) {
+		*data->dtype = resolve_dtype(*data->dtype, data->istate,
+					     pathname, pathlen);
+		if (*data->dtype != DT_DIR)
+			return 0;
+	}
+
+	if (pattern->flags & PATTERN_FLAG_NODIR)
+		return match_basename(data->basename,
+				      pathlen - (data->basename - pathname),
+				      pattern->pattern, pattern->nowildcardlen,
+				      pattern->patternlen, pattern->flags);
+
+	assert(pattern->baselen == 0 ||
+	       pattern->base[pattern->baselen - 1] == '/');
+	return match_pathname(pathname, pathlen,
+			      pattern->base,
+			      pattern->baselen ? pattern->baselen - 1 : 0,
+			      pattern->pattern, pattern->nowildcardlen,
+			      pattern->patternlen);
+}
+
 /*
  * Scan the given exclude list in reverse to see whether pathname
  * should be ignored.  The first match (i.e. the last on the list), if
@@ -1379,45 +1497,30 @@ static struct path_pattern *last_matching_pattern_from_list(const char *pathname
 						       struct pattern_list *pl,
 						       struct index_state *istate)
 {
-	struct path_pattern *res = NULL; /* undecided */
+	struct pattern_match_data data = {
+		.pl = pl,
+		.pathname = pathname,
+		.pathlen = pathlen,
+		.basename = basename,
+		.dtype = dtype,
+		.istate = istate,
+	};
 	int i;
 
 	if (!pl->nr)
 		return NULL;	/* undefined */
 
-	for (i = pl->nr - 1; 0 <= i; i--) {
-		struct path_pattern *pattern = pl->patterns[i];
-		const char *exclude = pattern->pattern;
-		int prefix = pattern->nowildcardlen;
-
-		if (pattern->flags & PATTERN_FLAG_MUSTBEDIR) {
-			*dtype = resolve_dtype(*dtype, istate, pathname, pathlen);
-			if (*dtype != DT_DIR)
-				continue;
-		}
-
-		if (pattern->flags & PATTERN_FLAG_NODIR) {
-			if (match_basename(basename,
-					   pathlen - (basename - pathname),
-					   exclude, prefix, pattern->patternlen,
-					   pattern->flags)) {
-				res = pattern;
-				break;
-			}
-			continue;
-		}
-
-		assert(pattern->baselen == 0 ||
-		       pattern->base[pattern->baselen - 1] == '/');
-		if (match_pathname(pathname, pathlen,
-				   pattern->base,
-				   pattern->baselen ? pattern->baselen - 1 : 0,
-				   exclude, prefix, pattern->patternlen)) {
-			res = pattern;
-			break;
-		}
+	if (pl->matcher) {
+		i = pattern_matcher_find(pl->matcher, pathname, pathlen,
+					 basename - pathname, pl->nr,
+					 path_pattern_matches, &data);
+		return i < 0 ? NULL : pl->patterns[i];
 	}
-	return res;
+
+	for (i = pl->nr - 1; 0 <= i; i--)
+		if (path_pattern_matches(i, &data))
+			return pl->patterns[i];
+	return NULL; /* undecided */
 }
 
 /*
@@ -1969,7 +2072,10 @@ static enum path_treatment treat_directory(struct dir_struct *dir,
 		int nested_repo;
 		struct strbuf sb = STRBUF_INIT;
 		strbuf_addstr(&sb, dirname);
+		/* read_gitfile_gently() uses a static buffer */
+		dir_shards_lock(dir);
 		nested_repo = is_nonbare_repository_dir(&sb);
+		dir_shards_unlock(dir);
 
 		if (nested_repo) {
 			char *real_dirname, *real_gitdir;
@@ -2111,8 +2217,10 @@ static enum path_treatment treat_directory(struct dir_struct *dir,
 	/* Actually recurse into dirname now, we'll fixup the state later. */
 	untracked = lookup_untracked(dir->untracked, untracked,
 				     dirname + baselen, len - baselen);
+	dir->internal.nested_scan++;
 	state = read_directory_recursive(dir, istate, dirname, len, untracked,
 					 check_only, stop_early, pathspec);
+	dir->internal.nested_scan--;
 
 	/* There are a variety of reasons we may need to fixup the state... */
 	if (state == path_excluded) {
@@ -2680,6 +2788,13 @@ static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 		/* recurse into subdir if instructed by treat_path */
 		if (state == path_recurse) {
 			struct untracked_cache_dir *ud;
+
+			/* or leave it to an idle thread */
+			if (dir->internal.shards && !check_only &&
+			    !dir->internal.nested_scan &&
+			    dir_shards_push(dir, path.buf, path.len))
+				continue;
+
 			ud = lookup_untracked(dir->untracked,
 					      untracked,
 					      path.buf + baselen,
@@ -3082,6 +3197,167 @@ static void emit_traversal_statistics(struct dir_struct *dir,
 			   "opendir", dir->untracked->dir_opened);
 }
 
+/*
+ * The number of index entries below which another thread is not
+ * worth starting.
+ */
+#define DIR_SCAN_THREAD_COST 1000
+
+/*
+ * Number of threads to spread the traversal over.  The untracked cache
+ * records what each directory holds as it goes, expanding a sparse
+ * index may happen during the traversal, and attribute lookups are
+ * not thread-safe, so none of those can be spread.
+ */
+static int dir_scan_threads(struct dir_struct *dir, struct index_state *istate,
+			    const struct pathspec *pathspec)
+{
+	int nr;
+
+	if (!HAVE_THREADS || dir->untracked ||
+	    istate->sparse_index != INDEX_EXPANDED ||
+	    (pathspec && (pathspec->magic & PATHSPEC_ATTR)))
+		return 1;
+
+	nr = git_env_ulong("GIT_TEST_DIR_SCAN_THREADS", 0);
+	if (!nr) {
+		if (repo_config_get_int(istate->repo, "core.dirscanthreads", &nr) ||
+		    nr <= 0)
+			nr = online_cpus();
+		/* the tracked files stand in for the size of the working tree */
+		if (nr > istate->cache_nr / DIR_SCAN_THREAD_COST)
+			nr = istate->cache_nr / DIR_SCAN_THREAD_COST;
+	}
+	return nr;
+}
+
+struct dir_shard_worker {
+	pthread_t thread;
+	struct dir_struct dir;
+	struct index_state *istate;
+	const struct pathspec *pathspec;
+};
+
+static void *dir_shard_thread(void *data)
+{
+	struct dir_shard_worker *w = data;
+	struct dir_shards *shards = w->dir.internal.shards;
+
+	trace2_thread_start("read_directory");
+	pthread_mutex_lock(&shards->mutex);
+	for (;;) {
+		char *path;
+
+		while (!shards->queue_nr && shards->busy)
+			pthread_cond_wait(&shards->cond, &shards->mutex);
+		if (!shards->queue_nr)
+			break;
+		path = shards->queue[--shards->queue_nr];
+		shards->busy++;
+		pthread_mutex_unlock(&shards->mutex);
+
+		read_directory_recursive(&w->dir, w->istate, path, strlen(path),
+					 NULL, 0, 0, w->pathspec);
+		free(path);
+
+		pthread_mutex_lock(&shards->mutex);
+		if (!--shards->busy && !shards->queue_nr)
+			pthread_cond_broadcast(&shards->cond);
+	}
+	pthread_mutex_unlock(&shards->mutex);
+	trace2_thread_exit();
+	return NULL;
+}
+
+/*
+ * Traverse "path" like read_directory_recursive() would, over
+ * "nr_threads" threads.  Each works on its own copy of "dir", with its
+ * own stack of per-directory exclude patterns, and what they find is
+ * added to "dir" at the end; read_directory() sorts it as usual.
+ */
+static void read_directory_threaded(struct dir_struct *dir,
+				    struct index_state *istate,
+				    const char *path, int len,
+				    const struct pathspec *pathspec,
+				    int nr_threads)
+{
+	struct dir_shards shards = { .nr_threads = nr_threads };
+	struct dir_shard_worker *workers;
+	int i, err;
+
+	/* built lazily otherwise, and looked up by every thread */
+	lazy_init_name_hash(istate);
+	enable_obj_read_lock();
+
+	pthread_mutex_init(&shards.mutex, NULL);
+	pthread_cond_init(&shards.cond, NULL);
+	ALLOC_GROW(shards.queue, 1, shards.queue_alloc);
+	shards.queue[shards.queue_nr++] = xmemdupz(path, len);
+
+	CALLOC_ARRAY(workers, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		struct dir_struct *copy = &workers[i].dir;
+
+		copy->flags = dir->flags;
+		copy->exclude_per_dir = dir->exclude_per_dir;
+		/* command line and fallback patterns are only ever read */
+		copy->internal.exclude_list_group[EXC_CMDL] =
+			dir->internal.exclude_list_group[EXC_CMDL];
+		copy->internal.exclude_list_group[EXC_FILE] =
+			dir->internal.exclude_list_group[EXC_FILE];
+		copy->internal.shards = &shards;
+		workers[i].istate = istate;
+		workers[i].pathspec = pathspec;
+
+		err = pthread_create(&workers[i].thread, NULL,
+				     dir_shard_thread, &workers[i]);
+		if (err)
+			die(_("unable to create threaded directory scan: %s"),
+			    strerror(err));
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		struct dir_struct *copy = &workers[i].dir;
+		struct exclude_list_group *group;
+		struct exclude_stack *stk;
+
+		if (pthread_join(workers[i].thread, NULL))
+			die("unable to join threaded directory scan");
+
+		ALLOC_GROW(dir->entries, dir->nr + copy->nr, dir->internal.alloc);
+		COPY_ARRAY(dir->entries + dir->nr, copy->entries, copy->nr);
+		dir->nr += copy->nr;
+		ALLOC_GROW(dir->ignored, dir->ignored_nr + copy->ignored_nr,
+			   dir->internal.ignored_alloc);
+		COPY_ARRAY(dir->ignored + dir->ignored_nr, copy->ignored,
+			   copy->ignored_nr);
+		dir->ignored_nr += copy->ignored_nr;
+		dir->internal.visited_paths += copy->internal.visited_paths;
+		dir->internal.visited_directories +=
+			copy->internal.visited_directories;
+
+		free(copy->entries);
+		free(copy->ignored);
+		group = &copy->internal.exclude_list_group[EXC_DIRS];
+		for (int j = 0; j < group->nr; j++) {
+			free((char *)group->pl[j].src);
+			clear_pattern_list(&group->pl[j]);
+		}
+		free(group->pl);
+		while ((stk = copy->internal.exclude_stack)) {
+			copy->internal.exclude_stack = stk->prev;
+			free(stk);
+		}
+		strbuf_release(&copy->internal.basebuf);
+	}
+
+	free(workers);
+	free(shards.queue);
+	pthread_cond_destroy(&shards.cond);
+	pthread_mutex_destroy(&shards.mutex);
+	disable_obj_read_lock();
+}
+
 int read_directory(struct dir_struct *dir, struct index_state *istate,
 		   const char *path, int len, const struct pathspec *pathspec)
 {
@@ -3103,8 +3379,16 @@ int read_directory(struct dir_struct *dir, struct index_state *istate,
 		 * e.g. prep_exclude()
 		 */
 		dir->untracked = NULL;
-	if (!len || treat_leading_path(dir, istate, path, len, pathspec))
-		read_directory_recursive(dir, istate, path, len, untracked, 0, 0, pathspec);
+	if (!len || treat_leading_path(dir, istate, path, len, pathspec)) {
+		int nr_threads = dir_scan_threads(dir, istate, pathspec);
+
+		if (nr_threads > 1)
+			read_directory_threaded(dir, istate, path, len,
+						pathspec, nr_threads);
+		else
+			read_directory_recursive(dir, istate, path, len,
+						 untracked, 0, 0, pathspec);
+	}
 	QSORT(dir->entries, dir->nr, cmp_dir_entry);
 	QSORT(dir->ignored, dir->ignored_nr, cmp_dir_entry);
 
@@ -8,6 +8,8 @@
 #include "strbuf.h"
 
 struct repository;
+struct dir_shards;
+struct pattern_matcher;
 
 /**
  * The directory listing API is used to enumerate paths in the work tree,
@@ -99,6 +101,12 @@ struct pattern_list {
 
 	struct path_pattern **patterns;
 
+	/*
+	 * An index of the patterns above for long lists, to avoid
+	 * trying them all in turn; see pattern-matcher.h.
+	 */
+	struct pattern_matcher *matcher;
+
 	/*
 	 * While scanning the excludes, we attempt to match the patterns
 	 * with a more restricted set that allows us to use hashsets for
@@ -353,6 +361,15 @@ struct dir_struct {
 		/* Stats about the traversal */
 		unsigned visited_paths;
 		unsigned visited_directories;
+
+		/*
+		 * Set while the traversal is spread over several threads,
+		 * each with its own dir_struct; see read_directory_threaded().
+		 * Directories that treat_directory() scans itself (and
+		 * whose results it may take back) are never handed over.
+		 */
+		struct dir_shards *shards;
+		unsigned nested_scan;
 	} internal;
 };
 
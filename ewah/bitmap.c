@@ -18,10 +18,146 @@
  */
 #include "git-compat-util.h"
 #include "ewok.h"
+#include "ewok_rlw.h"
+#include "parse.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define EWAH_AVX2 1
+#endif
 
 #define EWAH_MASK(x) ((eword_t)1 << (x % BITS_IN_EWORD))
 #define EWAH_BLOCK(x) (x / BITS_IN_EWORD)
 
+/*
+ * Kernels operating on runs of uncompressed words. Each has a portable
+ * version and, on x86, an AVX2 version selected at runtime when the
+ * CPU supports it; the results are identical either way. Setting
+ * GIT_TEST_EWAH_NO_SIMD forces the portable versions.
+ */
+static void words_or_scalar(eword_t *dst, const eword_t *src, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		dst[i] |= src[i];
+}
+
+static void words_and_not_scalar(eword_t *dst, const eword_t *src, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		dst[i] &= ~src[i];
+}
+
+static size_t words_popcount_scalar(const eword_t *words, size_t n)
+{
+	size_t i, count = 0;
+	for (i = 0; i < n; i++)
+		count += ewah_bit_popcount64(words[i]);
+	return count;
+}
+
+#ifdef EWAH_AVX2
+__attribute__((target("avx2")))
+static void words_or_avx2(eword_t *dst, const eword_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(a, b));
+	}
+	words_or_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void words_and_not_avx2(eword_t *dst, const eword_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		/* _mm256_andnot_si256(b, a) computes ~b & a */
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_andnot_si256(b, a));
+	}
+	words_and_not_scalar(dst + i, src + i, n - i);
+}
+
+/*
+ * Count bits four words at a time by looking up the popcount of each
+ * nibble with a byte shuffle, then summing the bytes of each 64-bit
+ * lane with SAD against zero.
+ */
+__attribute__((target("avx2")))
+static size_t words_popcount_avx2(const eword_t *words, size_t n)
+{
+	const __m256i lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+		__m256i lo = _mm256_and_si256(v, low_mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+		__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+					      _mm256_shuffle_epi8(lookup, hi));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt,
+							    _mm256_setzero_si256()));
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		words_popcount_scalar(words + i, n - i);
+}
+
+static int use_avx2(void)
+{
+	static int enabled = -1;
+
+	if (enabled < 0)
+		enabled = __builtin_cpu_supports("avx2") &&
+			!git_env_bool("GIT_TEST_EWAH_NO_SIMD", 0);
+	return enabled;
+}
+#endif
+
+static void words_or(eword_t *dst, const eword_t *src, size_t n)
+{
+#ifdef EWAH_AVX2
+	if (use_avx2()) {
+		words_or_avx2(dst, src, n);
+		return;
+	}
+#endif
+	words_or_scalar(dst, src, n);
+}
+
+static void words_and_not(eword_t *dst, const eword_t *src, size_t n)
+{
+#ifdef EWAH_AVX2
+	if (use_avx2()) {
+		words_and_not_avx2(dst, src, n);
+		return;
+	}
+#endif
+	words_and_not_scalar(dst, src, n);
+}
+
+static size_t words_popcount(const eword_t *words, size_t n)
+{
+#ifdef EWAH_AVX2
+	if (use_avx2())
+		return words_popcount_avx2(words, n);
+#endif
+	return words_popcount_scalar(words, n);
+}
+
 struct bitmap *bitmap_word_alloc(size_t word_alloc)
 {
 	struct bitmap *bitmap = xmalloc(sizeof(struct bitmap));
@@ -100,21 +236,73 @@ struct ewah_bitmap *bitmap_to_ewah(struct bitmap *bitmap)
 	return ewah;
 }
 
-struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah)
+/*
+ * Call "fill" for each run of one-words and "literal" for each run of
+ * literal words in "ewah", in order, covering at most "limit" words.
+ * Runs of zero-words are skipped, since none of our callers need to
+ * do anything for them but advance. Returns the number of words
+ * covered.
+ */
+static size_t ewah_each_run(struct ewah_bitmap *ewah, size_t limit,
+			    void (*fill)(size_t pos, size_t len, void *data),
+			    void (*literal)(size_t pos, const eword_t *words,
+					    size_t len, void *data),
+			    void *data)
 {
-	struct bitmap *bitmap = bitmap_new();
-	struct ewah_iterator it;
-	eword_t blowup;
-	size_t i = 0;
+	size_t pointer = 0, pos = 0;
+
+	while (pointer < ewah->buffer_size && pos < limit) {
+		eword_t *rlw = &ewah->buffer[pointer];
+		size_t run = rlw_get_running_len(rlw);
+		size_t literals = rlw_get_literal_words(rlw);
 
-	ewah_iterator_init(&it, ewah);
+		if (pointer + 1 + literals > ewah->buffer_size)
+			literals = ewah->buffer_size - pointer - 1;
 
-	while (ewah_iterator_next(&blowup, &it)) {
-		ALLOC_GROW(bitmap->words, i + 1, bitmap->word_alloc);
-		bitmap->words[i++] = blowup;
+		if (run > limit - pos)
+			run = limit - pos;
+		if (run && rlw_get_run_bit(rlw))
+			fill(pos, run, data);
+		pos += run;
+
+		if (literals > limit - pos)
+			literals = limit - pos;
+		if (literals)
+			literal(pos, ewah->buffer + pointer + 1, literals, data);
+		pos += literals;
+
+		pointer += 1 + rlw_get_literal_words(rlw);
 	}
 
-	bitmap->word_alloc = i;
+	return pos;
+}
+
+static void fill_ones(size_t pos, size_t len, void *data)
+{
+	struct bitmap *bitmap = data;
+	memset(bitmap->words + pos, 0xff, st_mult(len, sizeof(eword_t)));
+}
+
+static void copy_literals(size_t pos, const eword_t *words, size_t len,
+			  void *data)
+{
+	struct bitmap *bitmap = data;
+	COPY_ARRAY(bitmap->words + pos, words, len);
+}
+
+static void or_literals(size_t pos, const eword_t *words, size_t len,
+			void *data)
+{
+	struct bitmap *bitmap = data;
+	words_or(bitmap->words + pos, words, len);
+}
+
+struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah)
+{
+	struct bitmap *bitmap = bitmap_word_alloc(ewah->bit_size / BITS_IN_EWORD + 1);
+
+	bitmap->word_alloc = ewah_each_run(ewah, bitmap->word_alloc,
+					   fill_ones, copy_literals, bitmap);
 	return bitmap;
 }
 
@@ -123,19 +311,13 @@ void bitmap_and_not(struct bitmap *self, struct bitmap *other)
 	const size_t count = (self->word_alloc < other->word_alloc) ?
 		self->word_alloc : other->word_alloc;
 
-	size_t i;
-
-	for (i = 0; i < count; ++i)
-		self->words[i] &= ~other->words[i];
+	words_and_not(self->words, other->words, count);
 }
 
 void bitmap_or(struct bitmap *self, const struct bitmap *other)
 {
-	size_t i;
-
 	bitmap_grow(self, other->word_alloc);
-	for (i = 0; i < other->word_alloc; i++)
-		self->words[i] |= other->words[i];
+	words_or(self->words, other->words, other->word_alloc);
 }
 
 int ewah_bitmap_is_subset(struct ewah_bitmap *self, struct bitmap *other)
@@ -185,9 +367,6 @@ void bitmap_or_ewah(struct bitmap *self, struct ewah_bitmap *other)
 {
 	size_t original_size = self->word_alloc;
 	size_t other_final = (other->bit_size / BITS_IN_EWORD) + 1;
-	size_t i = 0;
-	struct ewah_iterator it;
-	eword_t word;
 
 	if (self->word_alloc < other_final) {
 		self->word_alloc = other_final;
@@ -196,34 +375,42 @@ void bitmap_or_ewah(struct bitmap *self, struct ewah_bitmap *other)
 			(self->word_alloc - original_size) * sizeof(eword_t));
 	}
 
-	ewah_iterator_init(&it, other);
-
-	while (ewah_iterator_next(&word, &it))
-		self->words[i++] |= word;
+	/*
+	 * Merge whole runs at a time rather than word by word: runs of
+	 * ones become a memset(), runs of zeroes are skipped and literal
+	 * words are OR-ed in bulk.
+	 */
+	ewah_each_run(other, self->word_alloc, fill_ones, or_literals, self);
 }
 
 size_t bitmap_popcount(struct bitmap *self)
 {
-	size_t i, count = 0;
+	return words_popcount(self->words, self->word_alloc);
+}
 
-	for (i = 0; i < self->word_alloc; ++i)
-		count += ewah_bit_popcount64(self->words[i]);
+struct popcount_data {
+	size_t count;
+};
 
-	return count;
+static void count_fill(size_t pos UNUSED, size_t len, void *data)
+{
+	struct popcount_data *pd = data;
+	pd->count += len * BITS_IN_EWORD;
 }
 
-size_t ewah_bitmap_popcount(struct ewah_bitmap *self)
+static void count_literals(size_t pos UNUSED, const eword_t *words,
+			   size_t len, void *data)
 {
-	struct ewah_iterator it;
-	eword_t word;
-	size_t count = 0;
-
-	ewah_iterator_init(&it, self);
+	struct popcount_data *pd = data;
+	pd->count += words_popcount(words, len);
+}
 
-	while (ewah_iterator_next(&word, &it))
-		count += ewah_bit_popcount64(word);
+size_t ewah_bitmap_popcount(struct ewah_bitmap *self)
+{
+	struct popcount_data pd = { 0 };
 
-	return count;
+	ewah_each_run(self, SIZE_MAX, count_fill, count_literals, &pd);
+	return pd.count;
 }
 
 int bitmap_is_empty(struct bitmap *self)
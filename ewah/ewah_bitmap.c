@@ -267,6 +267,34 @@ void ewah_each_bit(struct ewah_bitmap *self, void (*callback)(size_t, void*), vo
 	}
 }
 
+int ewah_bitmap_get(struct ewah_bitmap *self, size_t pos)
+{
+	size_t pointer = 0;
+	size_t word = pos / BITS_IN_EWORD;
+
+	if (pos >= self->bit_size)
+		return 0;
+
+	while (pointer < self->buffer_size) {
+		eword_t *rlw = &self->buffer[pointer];
+		size_t run = rlw_get_running_len(rlw);
+		size_t literals = rlw_get_literal_words(rlw);
+
+		if (word < run)
+			return rlw_get_run_bit(rlw);
+		word -= run;
+
+		if (word < literals)
+			return !!(self->buffer[pointer + 1 + word] &
+				  ((eword_t)1 << (pos % BITS_IN_EWORD)));
+		word -= literals;
+
+		pointer += 1 + literals;
+	}
+
+	return 0;
+}
+
 /**
  * Clear all the bits in the bitmap. Does not free or resize
  * memory.
@@ -89,6 +89,28 @@ int ewah_serialize_strbuf(struct ewah_bitmap *self, struct strbuf *sb)
 	return ewah_serialize_to(self, write_strbuf, sb);
 }
 
+ssize_t ewah_mmap_size(const void *map, size_t len)
+{
+	const uint8_t *ptr = map;
+	size_t size;
+
+	if (len < sizeof(uint32_t))
+		return error("corrupt ewah bitmap: eof before bit size");
+	if (len < 2 * sizeof(uint32_t))
+		return error("corrupt ewah bitmap: eof before length");
+
+	size = st_mult(get_be32(ptr + sizeof(uint32_t)), sizeof(eword_t));
+	len -= 2 * sizeof(uint32_t);
+	if (len < size)
+		return error("corrupt ewah bitmap: eof in data "
+			     "(%"PRIuMAX" bytes short)",
+			     (uintmax_t)(size - len));
+	if (len - size < sizeof(uint32_t))
+		return error("corrupt ewah bitmap: eof before rlw");
+
+	return st_add(size, 3 * sizeof(uint32_t));
+}
+
 ssize_t ewah_read_mmap(struct ewah_bitmap *self, const void *map, size_t len)
 {
 	const uint8_t *ptr = map;
@@ -84,6 +84,12 @@ int ewah_serialize_strbuf(struct ewah_bitmap *self, struct strbuf *);
 
 ssize_t ewah_read_mmap(struct ewah_bitmap *self, const void *map, size_t len);
 
+/*
+ * Return the size of the serialized bitmap at "map" without reading
+ * it, or a negative value if it is truncated.
+ */
+ssize_t ewah_mmap_size(const void *map, size_t len);
+
 uint32_t ewah_checksum(struct ewah_bitmap *self);
 
 /**
@@ -114,6 +120,14 @@ void ewah_each_bit(struct ewah_bitmap *self, ewah_callback callback, void *paylo
  */
 void ewah_set(struct ewah_bitmap *self, size_t i);
 
+/**
+ * Return whether the bit at position `pos` is set, without
+ * decompressing the bitmap. This walks the run-length words, so it
+ * costs time proportional to the number of RLWs preceding `pos`
+ * rather than to the number of bits.
+ */
+int ewah_bitmap_get(struct ewah_bitmap *self, size_t pos);
+
 struct ewah_iterator {
 	const eword_t *buffer;
 	size_t buffer_size;
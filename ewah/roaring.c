@@ -0,0 +1,529 @@
+#include "git-compat-util.h"
+#include "ewok.h"
+#include "roaring.h"
+#include "strbuf.h"
+
+#define CHUNK_WORDS 1024
+#define ARRAY_MAX_CARDINALITY 4096
+
+enum roaring_container_type {
+	ROARING_ARRAY = 1,
+	ROARING_BITSET = 2,
+	ROARING_RUN = 3,
+};
+
+static size_t container_size(uint16_t type, uint32_t n)
+{
+	switch (type) {
+	case ROARING_ARRAY:
+		return st_mult(n, 2);
+	case ROARING_BITSET:
+		return CHUNK_WORDS * sizeof(eword_t);
+	case ROARING_RUN:
+		return st_mult(n, 4);
+	}
+	return 0;
+}
+
+static void add_be16(struct strbuf *sb, uint16_t v)
+{
+	v = htons(v);
+	strbuf_add(sb, &v, sizeof(v));
+}
+
+static void add_be32(struct strbuf *sb, uint32_t v)
+{
+	v = htonl(v);
+	strbuf_add(sb, &v, sizeof(v));
+}
+
+static void add_be64(struct strbuf *sb, uint64_t v)
+{
+	v = htonll(v);
+	strbuf_add(sb, &v, sizeof(v));
+}
+
+static void encode_array(struct strbuf *out, const eword_t *w, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		eword_t word = w[i];
+		while (word) {
+			add_be16(out, i * BITS_IN_EWORD + ewah_bit_ctz64(word));
+			word &= word - 1;
+		}
+	}
+}
+
+static void encode_bitset(struct strbuf *out, const eword_t *w, size_t len)
+{
+	for (size_t i = 0; i < CHUNK_WORDS; i++)
+		add_be64(out, i < len ? w[i] : 0);
+}
+
+static void encode_runs(struct strbuf *out, const eword_t *w, size_t len)
+{
+	size_t start = 0;
+	int in_run = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		eword_t word = w[i];
+
+		/* whole words that neither start nor end a run */
+		if (!in_run && !word)
+			continue;
+		if (in_run && word == ~(eword_t)0)
+			continue;
+
+		for (size_t b = 0; b < BITS_IN_EWORD; b++) {
+			int bit = (word >> b) & 1;
+
+			if (bit && !in_run) {
+				start = i * BITS_IN_EWORD + b;
+				in_run = 1;
+			} else if (!bit && in_run) {
+				add_be16(out, start);
+				add_be16(out, i * BITS_IN_EWORD + b - 1);
+				in_run = 0;
+			}
+		}
+	}
+	if (in_run) {
+		add_be16(out, start);
+		add_be16(out, len * BITS_IN_EWORD - 1);
+	}
+}
+
+void roaring_from_bitmap(struct roaring_bitmap *self, struct bitmap *bitmap,
+			 uint32_t bit_size)
+{
+	struct strbuf headers = STRBUF_INIT;
+	struct strbuf payload = STRBUF_INIT;
+	struct strbuf out = STRBUF_INIT;
+	uint32_t nr = 0;
+	char *raw;
+	size_t len;
+
+	for (size_t base = 0; base < bitmap->word_alloc; base += CHUNK_WORDS) {
+		const eword_t *w = bitmap->words + base;
+		size_t words = bitmap->word_alloc - base;
+		uint32_t card = 0, runs = 0;
+		eword_t carry = 0;
+		uint16_t type;
+		size_t best;
+
+		if (words > CHUNK_WORDS)
+			words = CHUNK_WORDS;
+
+		for (size_t i = 0; i < words; i++) {
+			card += ewah_bit_popcount64(w[i]);
+			/* count the bits that start a run of ones */
+			runs += ewah_bit_popcount64(w[i] & ~((w[i] << 1) | carry));
+			carry = w[i] >> (BITS_IN_EWORD - 1);
+		}
+		if (!card)
+			continue;
+
+		if (base / CHUNK_WORDS > UINT16_MAX)
+			BUG("bitmap too large for roaring encoding");
+
+		type = ROARING_BITSET;
+		best = container_size(ROARING_BITSET, card);
+		if (card <= ARRAY_MAX_CARDINALITY &&
+		    container_size(ROARING_ARRAY, card) < best) {
+			type = ROARING_ARRAY;
+			best = container_size(ROARING_ARRAY, card);
+		}
+		if (container_size(ROARING_RUN, runs) < best)
+			type = ROARING_RUN;
+
+		add_be16(&headers, base / CHUNK_WORDS);
+		add_be16(&headers, type);
+		add_be32(&headers, type == ROARING_RUN ? runs : card);
+
+		switch (type) {
+		case ROARING_ARRAY:
+			encode_array(&payload, w, words);
+			break;
+		case ROARING_BITSET:
+			encode_bitset(&payload, w, words);
+			break;
+		case ROARING_RUN:
+			encode_runs(&payload, w, words);
+			break;
+		}
+		nr++;
+	}
+
+	add_be32(&out, bit_size);
+	add_be32(&out, nr);
+	strbuf_addbuf(&out, &headers);
+	strbuf_addbuf(&out, &payload);
+
+	raw = strbuf_detach(&out, &len);
+	if (roaring_read_mmap(self, raw, len) < 0)
+		BUG("unable to parse freshly encoded roaring bitmap");
+	self->owned = 1;
+
+	strbuf_release(&headers);
+	strbuf_release(&payload);
+}
+
+void roaring_from_ewah(struct roaring_bitmap *self, struct ewah_bitmap *ewah)
+{
+	struct bitmap *bitmap = ewah_to_bitmap(ewah);
+
+	roaring_from_bitmap(self, bitmap, ewah->bit_size);
+	bitmap_free(bitmap);
+}
+
+ssize_t roaring_read_mmap(struct roaring_bitmap *self, const void *map,
+			  size_t len)
+{
+	const unsigned char *ptr = map;
+	const unsigned char *data;
+	size_t remaining;
+	uint32_t nr;
+
+	roaring_release(self);
+
+	if (len < 2 * sizeof(uint32_t))
+		return error("corrupt roaring bitmap: eof before header");
+	self->bit_size = get_be32(ptr);
+	nr = get_be32(ptr + 4);
+	ptr += 2 * sizeof(uint32_t);
+	len -= 2 * sizeof(uint32_t);
+
+	if (nr > len / 8)
+		return error("corrupt roaring bitmap: eof in container headers");
+	data = ptr + st_mult(nr, 8);
+	remaining = len - st_mult(nr, 8);
+
+	ALLOC_ARRAY(self->containers, nr);
+	for (uint32_t i = 0; i < nr; i++, ptr += 8) {
+		struct roaring_container *c = &self->containers[i];
+		size_t size;
+
+		c->key = get_be16(ptr);
+		c->type = get_be16(ptr + 2);
+		c->n = get_be32(ptr + 4);
+
+		if (i && c->key <= self->containers[i - 1].key)
+			goto corrupt;
+		if (!c->n)
+			goto corrupt;
+		switch (c->type) {
+		case ROARING_ARRAY:
+			if (c->n > ARRAY_MAX_CARDINALITY)
+				goto corrupt;
+			break;
+		case ROARING_BITSET:
+			if (c->n > CHUNK_WORDS * BITS_IN_EWORD)
+				goto corrupt;
+			break;
+		case ROARING_RUN:
+			if (c->n > CHUNK_WORDS * BITS_IN_EWORD / 2)
+				goto corrupt;
+			break;
+		default:
+			goto corrupt;
+		}
+
+		size = container_size(c->type, c->n);
+		if (size > remaining) {
+			roaring_release(self);
+			return error("corrupt roaring bitmap: eof in data");
+		}
+		c->data = data;
+		data += size;
+		remaining -= size;
+		self->nr++;
+	}
+
+	self->raw = map;
+	self->raw_len = data - (const unsigned char *)map;
+	return self->raw_len;
+
+corrupt:
+	roaring_release(self);
+	return error("corrupt roaring bitmap: invalid container");
+}
+
+int roaring_serialize_to(const struct roaring_bitmap *self,
+			 int (*write_fun)(void *, const void *, size_t),
+			 void *out)
+{
+	int ret = write_fun(out, self->raw, self->raw_len);
+
+	if (ret < 0 || (size_t)ret != self->raw_len)
+		return -1;
+	return ret;
+}
+
+void roaring_release(struct roaring_bitmap *self)
+{
+	if (self->owned)
+		free((void *)self->raw);
+	free(self->containers);
+	memset(self, 0, sizeof(*self));
+}
+
+static void fill_range(eword_t *words, size_t start, size_t end)
+{
+	/* set bits [start, end], inclusive */
+	while (start <= end) {
+		size_t bit = start % BITS_IN_EWORD;
+		size_t nr = end - start + 1;
+
+		if (!bit && nr >= BITS_IN_EWORD) {
+			words[start / BITS_IN_EWORD] = ~(eword_t)0;
+			start += BITS_IN_EWORD;
+			continue;
+		}
+		if (nr > BITS_IN_EWORD - bit)
+			nr = BITS_IN_EWORD - bit;
+		words[start / BITS_IN_EWORD] |=
+			(nr == BITS_IN_EWORD ? ~(eword_t)0 :
+			 (((eword_t)1 << nr) - 1)) << bit;
+		start += nr;
+	}
+}
+
+/*
+ * OR the bits of a container into the CHUNK_WORDS words at "words".
+ */
+static void container_fill(const struct roaring_container *c, eword_t *words)
+{
+	const unsigned char *p = c->data;
+
+	switch (c->type) {
+	case ROARING_ARRAY:
+		for (uint32_t i = 0; i < c->n; i++, p += 2) {
+			uint16_t v = get_be16(p);
+			words[v / BITS_IN_EWORD] |= (eword_t)1 << (v % BITS_IN_EWORD);
+		}
+		break;
+	case ROARING_BITSET:
+		for (size_t i = 0; i < CHUNK_WORDS; i++, p += 8)
+			words[i] |= get_be64(p);
+		break;
+	case ROARING_RUN:
+		for (uint32_t i = 0; i < c->n; i++, p += 4)
+			fill_range(words, get_be16(p), get_be16(p + 2));
+		break;
+	}
+}
+
+static void grow_words(struct bitmap *bitmap, size_t word_alloc)
+{
+	size_t old = bitmap->word_alloc;
+
+	if (old >= word_alloc)
+		return;
+	REALLOC_ARRAY(bitmap->words, word_alloc);
+	memset(bitmap->words + old, 0, (word_alloc - old) * sizeof(eword_t));
+	bitmap->word_alloc = word_alloc;
+}
+
+void roaring_or_into(const struct roaring_bitmap *self, struct bitmap *dst)
+{
+	if (!self->nr)
+		return;
+	grow_words(dst, (self->containers[self->nr - 1].key + 1) * CHUNK_WORDS);
+	for (size_t i = 0; i < self->nr; i++) {
+		const struct roaring_container *c = &self->containers[i];
+		container_fill(c, dst->words + c->key * CHUNK_WORDS);
+	}
+}
+
+void roaring_xor_into(const struct roaring_bitmap *self, struct bitmap *dst)
+{
+	eword_t chunk[CHUNK_WORDS];
+
+	if (!self->nr)
+		return;
+	grow_words(dst, (self->containers[self->nr - 1].key + 1) * CHUNK_WORDS);
+	for (size_t i = 0; i < self->nr; i++) {
+		const struct roaring_container *c = &self->containers[i];
+		eword_t *words = dst->words + c->key * CHUNK_WORDS;
+
+		memset(chunk, 0, sizeof(chunk));
+		container_fill(c, chunk);
+		for (size_t j = 0; j < CHUNK_WORDS; j++)
+			words[j] ^= chunk[j];
+	}
+}
+
+static int container_get(const struct roaring_container *c, uint16_t v)
+{
+	size_t lo = 0, hi = c->n;
+
+	switch (c->type) {
+	case ROARING_ARRAY:
+		while (lo < hi) {
+			size_t mi = lo + (hi - lo) / 2;
+			uint16_t got = get_be16(c->data + mi * 2);
+
+			if (got == v)
+				return 1;
+			if (got < v)
+				lo = mi + 1;
+			else
+				hi = mi;
+		}
+		return 0;
+	case ROARING_BITSET:
+		return (get_be64(c->data + (v / BITS_IN_EWORD) * 8) >>
+			(v % BITS_IN_EWORD)) & 1;
+	case ROARING_RUN:
+		/* find the last run starting at or before "v" */
+		while (lo < hi) {
+			size_t mi = lo + (hi - lo) / 2;
+
+			if (get_be16(c->data + mi * 4) <= v)
+				lo = mi + 1;
+			else
+				hi = mi;
+		}
+		return lo && v <= get_be16(c->data + (lo - 1) * 4 + 2);
+	}
+	return 0;
+}
+
+static const struct roaring_container *find_container(const struct roaring_bitmap *self,
+						      uint16_t key)
+{
+	size_t lo = 0, hi = self->nr;
+
+	while (lo < hi) {
+		size_t mi = lo + (hi - lo) / 2;
+		const struct roaring_container *c = &self->containers[mi];
+
+		if (c->key == key)
+			return c;
+		if (c->key < key)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return NULL;
+}
+
+int roaring_get(const struct roaring_bitmap *self, size_t pos)
+{
+	const struct roaring_container *c;
+
+	if (pos >= self->bit_size)
+		return 0;
+	c = find_container(self, pos >> 16);
+	return c && container_get(c, pos & 0xffff);
+}
+
+static size_t container_popcount(const struct roaring_container *c)
+{
+	size_t count = 0;
+
+	if (c->type != ROARING_RUN)
+		return c->n;
+	for (uint32_t i = 0; i < c->n; i++)
+		count += get_be16(c->data + i * 4 + 2) -
+			 get_be16(c->data + i * 4) + 1;
+	return count;
+}
+
+size_t roaring_popcount(const struct roaring_bitmap *self)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < self->nr; i++)
+		count += container_popcount(&self->containers[i]);
+	return count;
+}
+
+static size_t container_and_popcount(const struct roaring_container *x,
+				     const struct roaring_container *y)
+{
+	eword_t wx[CHUNK_WORDS], wy[CHUNK_WORDS];
+	size_t count = 0;
+
+	if (x->type == ROARING_ARRAY && y->type == ROARING_ARRAY) {
+		uint32_t i = 0, j = 0;
+
+		while (i < x->n && j < y->n) {
+			uint16_t a = get_be16(x->data + i * 2);
+			uint16_t b = get_be16(y->data + j * 2);
+
+			count += a == b;
+			i += a <= b;
+			j += b <= a;
+		}
+		return count;
+	}
+
+	if (y->type == ROARING_ARRAY)
+		SWAP(x, y);
+	if (x->type == ROARING_ARRAY) {
+		for (uint32_t i = 0; i < x->n; i++)
+			count += container_get(y, get_be16(x->data + i * 2));
+		return count;
+	}
+
+	memset(wx, 0, sizeof(wx));
+	memset(wy, 0, sizeof(wy));
+	container_fill(x, wx);
+	container_fill(y, wy);
+	for (size_t i = 0; i < CHUNK_WORDS; i++)
+		count += ewah_bit_popcount64(wx[i] & wy[i]);
+	return count;
+}
+
+size_t roaring_and_popcount(const struct roaring_bitmap *a,
+			    const struct roaring_bitmap *b)
+{
+	size_t i = 0, j = 0, count = 0;
+
+	while (i < a->nr && j < b->nr) {
+		const struct roaring_container *x = &a->containers[i];
+		const struct roaring_container *y = &b->containers[j];
+
+		if (x->key < y->key) {
+			i++;
+		} else if (x->key > y->key) {
+			j++;
+		} else {
+			count += container_and_popcount(x, y);
+			i++;
+			j++;
+		}
+	}
+	return count;
+}
+
+struct ewah_bitmap *roaring_to_ewah(const struct roaring_bitmap *self)
+{
+	struct bitmap *bitmap;
+	struct ewah_bitmap *ewah;
+	size_t words;
+
+	words = self->nr ? (self->containers[self->nr - 1].key + 1) * CHUNK_WORDS : 1;
+	bitmap = bitmap_word_alloc(words);
+	for (size_t i = 0; i < self->nr; i++) {
+		const struct roaring_container *c = &self->containers[i];
+		container_fill(c, bitmap->words + c->key * CHUNK_WORDS);
+	}
+
+	ewah = bitmap_to_ewah(bitmap);
+	bitmap_free(bitmap);
+
+	/*
+	 * bitmap_to_ewah() stops at the last non-empty word; pad the
+	 * result so that its size matches the bitmap we encoded.
+	 */
+	words = DIV_ROUND_UP(self->bit_size, BITS_IN_EWORD);
+	if (ewah->bit_size < words * BITS_IN_EWORD)
+		ewah_add_empty_words(ewah, 0,
+				     words - ewah->bit_size / BITS_IN_EWORD);
+	if (self->bit_size)
+		ewah->bit_size = self->bit_size;
+
+	return ewah;
+}
@@ -0,0 +1,91 @@
+#ifndef EWAH_ROARING_H
+#define EWAH_ROARING_H
+
+struct ewah_bitmap;
+struct bitmap;
+
+/*
+ * A roaring-style compressed bitmap: the bit space is split into
+ * chunks of 2^16 bits, and every non-empty chunk is stored in
+ * whichever of three containers is smallest for its contents:
+ *
+ *   - an array of sorted 16-bit offsets (sparse chunks),
+ *   - a plain 8KiB bitset (dense, irregular chunks), or
+ *   - a list of [start, end] runs (chunks made of long runs).
+ *
+ * Unlike EWAH, a single bit can be tested without decompressing
+ * everything before it, and two bitmaps can be intersected chunk
+ * by chunk, skipping chunks that only one side has.
+ *
+ * See Documentation/technical/bitmap-format.adoc for the on-disk
+ * encoding.
+ */
+struct roaring_container {
+	uint16_t key;
+	uint16_t type;
+	uint32_t n;
+	const unsigned char *data;
+};
+
+struct roaring_bitmap {
+	uint32_t bit_size;
+
+	struct roaring_container *containers;
+	size_t nr;
+
+	/*
+	 * The serialized form; containers point into it. It is either
+	 * owned by the bitmap ("owned" is set), or points into a memory
+	 * map which must outlive the bitmap.
+	 */
+	const unsigned char *raw;
+	size_t raw_len;
+	unsigned owned : 1;
+};
+
+#define ROARING_BITMAP_INIT { 0 }
+
+void roaring_release(struct roaring_bitmap *self);
+
+/*
+ * Encode "ewah" into "self", choosing the smallest container for
+ * each chunk.
+ */
+void roaring_from_ewah(struct roaring_bitmap *self, struct ewah_bitmap *ewah);
+void roaring_from_bitmap(struct roaring_bitmap *self, struct bitmap *bitmap,
+			 uint32_t bit_size);
+
+/*
+ * Decompress "self" into a newly allocated EWAH bitmap.
+ */
+struct ewah_bitmap *roaring_to_ewah(const struct roaring_bitmap *self);
+
+/*
+ * OR (or XOR) the bits of "self" into the uncompressed bitmap "dst",
+ * growing it as needed, without going through EWAH.
+ */
+void roaring_or_into(const struct roaring_bitmap *self, struct bitmap *dst);
+void roaring_xor_into(const struct roaring_bitmap *self, struct bitmap *dst);
+
+int roaring_serialize_to(const struct roaring_bitmap *self,
+			 int (*write_fun)(void *out, const void *buf, size_t len),
+			 void *out);
+
+/*
+ * Parse the serialized bitmap at "map" without copying it. Returns
+ * the number of bytes consumed, or a negative value if the data is
+ * corrupt.
+ */
+ssize_t roaring_read_mmap(struct roaring_bitmap *self, const void *map,
+			  size_t len);
+
+int roaring_get(const struct roaring_bitmap *self, size_t pos);
+size_t roaring_popcount(const struct roaring_bitmap *self);
+
+/*
+ * Return the number of bits set in both "a" and "b".
+ */
+size_t roaring_and_popcount(const struct roaring_bitmap *a,
+			    const struct roaring_bitmap *b);
+
+#endif
@@ -4,6 +4,7 @@
 #include "gettext.h"
 #include "config.h"
 #include "commit.h"
+#include "commit-slab.h"
 #include "color.h"
 #include "graph.h"
 #include "revision.h"
@@ -151,6 +152,17 @@ static void graph_line_write_column(struct graph_line *line, const struct column
 		graph_line_addcolor(line, column_colors_max);
 }
 
+/*
+ * Where a commit was placed in new_columns, valid only for the call to
+ * graph_update_columns() numbered "round".
+ */
+struct column_pos {
+	unsigned int round;
+	int index;
+};
+
+define_commit_slab(column_pos_slab, struct column_pos);
+
 struct git_graph {
 	/*
 	 * The commit currently being processed
@@ -310,6 +322,15 @@ struct git_graph {
 	 */
 	unsigned short default_column_color;
 
+	/*
+	 * The position of each commit in new_columns, so that placing a
+	 * branch line does not need to scan every other one. Entries
+	 * written during the previous round give the commit's position
+	 * in columns.
+	 */
+	struct column_pos_slab column_pos;
+	unsigned int round;
+
 	/*
 	 * Scratch buffer for generating prefixes to be used with
 	 * diff_output_prefix_callback().
@@ -379,6 +400,8 @@ struct git_graph *graph_init(struct rev_info *opt)
 	graph->num_columns = 0;
 	graph->num_new_columns = 0;
 	graph->mapping_size = 0;
+	init_column_pos_slab(&graph->column_pos);
+	graph->round = 1;
 	/*
 	 * Start the column color at the maximum value, since we'll
 	 * always increment it for the first commit we output.
@@ -416,6 +439,7 @@ void graph_clear(struct git_graph *graph)
 	free(graph->new_columns);
 	free(graph->mapping);
 	free(graph->old_mapping);
+	clear_column_pos_slab(&graph->column_pos);
 	strbuf_release(&graph->prefix_buf);
 	free(graph);
 }
@@ -526,25 +550,27 @@ static void graph_increment_column_color(struct git_graph *graph)
 		column_colors_max;
 }
 
-static unsigned short graph_find_commit_color(const struct git_graph *graph,
+/*
+ * Only called for commits that are not yet in new_columns, so their
+ * position is still the one recorded in the previous round.
+ */
+static unsigned short graph_find_commit_color(struct git_graph *graph,
 					      const struct commit *commit)
 {
-	int i;
-	for (i = 0; i < graph->num_columns; i++) {
-		if (graph->columns[i].commit == commit)
-			return graph->columns[i].color;
-	}
+	struct column_pos *pos = column_pos_slab_peek(&graph->column_pos, commit);
+
+	if (pos && pos->round == graph->round - 1)
+		return graph->columns[pos->index].color;
 	return graph_get_current_column_color(graph);
 }
 
 static int graph_find_new_column_by_commit(struct git_graph *graph,
 					   struct commit *commit)
 {
-	int i;
-	for (i = 0; i < graph->num_new_columns; i++) {
-		if (graph->new_columns[i].commit == commit)
-			return i;
-	}
+	struct column_pos *pos = column_pos_slab_peek(&graph->column_pos, commit);
+
+	if (pos && pos->round == graph->round)
+		return pos->index;
 	return -1;
 }
 
@@ -560,9 +586,15 @@ static void graph_insert_into_new_columns(struct git_graph *graph,
 	 * and record it as being in the final column.
 	 */
 	if (i < 0) {
+		struct column_pos *pos;
+
 		i = graph->num_new_columns++;
 		graph->new_columns[i].commit = commit;
 		graph->new_columns[i].color = graph_find_commit_color(graph, commit);
+
+		pos = column_pos_slab_at(&graph->column_pos, commit);
+		pos->round = graph->round;
+		pos->index = i;
 	}
 
 	if (graph->num_parents > 1 && idx > -1 && graph->merge_layout == -1) {
@@ -621,6 +653,18 @@ static void graph_update_columns(struct git_graph *graph)
 	graph->num_columns = graph->num_new_columns;
 	graph->num_new_columns = 0;
 
+	/*
+	 * Start a new round, so that the positions recorded for
+	 * new_columns now describe columns. Zeroed slab entries must
+	 * never look current, so rounds start at 2; should the counter
+	 * ever wrap, forget every position rather than misread them.
+	 */
+	if (!++graph->round) {
+		clear_column_pos_slab(&graph->column_pos);
+		init_column_pos_slab(&graph->column_pos);
+		graph->round = 2;
+	}
+
 	/*
 	 * Now update new_columns and mapping with the information for the
 	 * commit after this one.
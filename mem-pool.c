@@ -46,6 +46,7 @@ static struct mp_block *mem_pool_alloc_block(struct mem_pool *pool,
 
 	p->next_free = (char *)p->space;
 	p->end = p->next_free + block_alloc;
+	p->map = NULL;
 
 	if (insert_after) {
 		p->next_block = insert_after->next_block;
@@ -77,6 +78,13 @@ void mem_pool_discard(struct mem_pool *pool, int invalidate_memory)
 		block_to_free = block;
 		block = block->next_block;
 
+		if (block_to_free->map) {
+			munmap(block_to_free->map,
+			       block_to_free->end - block_to_free->map);
+			free(block_to_free);
+			continue;
+		}
+
 		if (invalidate_memory)
 			memset(block_to_free->space, 0xDD, ((char *)block_to_free->end) - ((char *)block_to_free->space));
 
@@ -183,13 +191,31 @@ int mem_pool_contains(struct mem_pool *pool, void *mem)
 
 	/* Check if memory is allocated in a block */
 	for (p = pool->mp_block; p; p = p->next_block)
-		if ((mem >= ((void *)p->space)) &&
+		if ((mem >= (p->map ? (void *)p->map : (void *)p->space)) &&
 		    (mem < ((void *)p->end)))
 			return 1;
 
 	return 0;
 }
 
+void mem_pool_add_mapping(struct mem_pool *pool, void *map, size_t len)
+{
+	struct mp_block *p = xmalloc(sizeof(*p));
+
+	pool->pool_alloc += sizeof(*p);
+	p->map = map;
+	p->next_free = p->end = p->map + len;
+
+	/* Keep the head block, which is where allocations are carved from. */
+	if (pool->mp_block) {
+		p->next_block = pool->mp_block->next_block;
+		pool->mp_block->next_block = p;
+	} else {
+		p->next_block = NULL;
+		pool->mp_block = p;
+	}
+}
+
 void mem_pool_combine(struct mem_pool *dst, struct mem_pool *src)
 {
 	struct mp_block *p;
@@ -5,6 +5,13 @@ struct mp_block {
 	struct mp_block *next_block;
 	char *next_free;
 	char *end;
+
+	/*
+	 * Non-NULL if the block wraps a memory map handed over with
+	 * mem_pool_add_mapping() instead of owning "space"; the mapping
+	 * runs from "map" to "end" and is always full.
+	 */
+	char *map;
 	uintmax_t space[FLEX_ARRAY]; /* more */
 };
 
@@ -53,6 +60,14 @@ char *mem_pool_strndup(struct mem_pool *pool, const char *str, size_t len);
 __attribute__((format (printf, 2, 3)))
 char *mem_pool_strfmt(struct mem_pool *pool, const char *fmt, ...);
 
+/*
+ * Hand the memory map at "map" of "len" bytes over to the pool, so that
+ * objects living in it are owned like any other pool allocation: they
+ * are reported by mem_pool_contains(), follow the pool through
+ * mem_pool_combine(), and the map is unmapped by mem_pool_discard().
+ */
+void mem_pool_add_mapping(struct mem_pool *pool, void *map, size_t len);
+
 /*
  * Move the memory associated with the 'src' pool to the 'dst' pool. The 'src'
  * pool will be empty and not contain any memory. It still needs to be free'd
@@ -19,11 +19,14 @@
 #include "list-objects.h"
 #include "path.h"
 #include "pack-revindex.h"
+#include "prio-queue.h"
+#include "thread-utils.h"
 
 #define PACK_EXPIRED UINT_MAX
 #define BITMAP_POS_UNKNOWN (~((uint32_t)0))
 #define MIDX_CHUNK_FANOUT_SIZE (sizeof(uint32_t) * 256)
 #define MIDX_CHUNK_LARGE_OFFSET_WIDTH (sizeof(uint64_t))
+#define MIDX_OBJECTS_PER_THREAD 100000
 
 extern int midx_checksum_valid(struct multi_pack_index *m);
 extern void clear_midx_files_ext(const char *object_dir, const char *ext,
@@ -239,91 +242,183 @@ static void fill_pack_entry(uint32_t pack_int_id,
 	entry->preferred = !!preferred;
 }
 
-struct midx_fanout {
-	struct pack_midx_entry *entries;
-	size_t nr, alloc;
+/*
+ * One sorted run of objects taking part in the merge: the objects of a
+ * pack, or of a layer of an existing MIDX, within a range of fanout
+ * values. "entry" holds the object before "pos".
+ */
+struct midx_merge_source {
+	struct pack_midx_entry entry;
+	uint64_t key; /* the leading bytes of entry.oid, for quick compares */
+	uint32_t pos, end;
+
+	/* either a pack ... */
+	struct packed_git *p;
+	uint32_t pack_int_id;
+	int preferred;
+
+	/* ... or a MIDX layer, from which "preferred_pack" is skipped */
+	struct multi_pack_index *m;
+	int preferred_pack;
 };
 
-static void midx_fanout_grow(struct midx_fanout *fanout, size_t nr)
+static int midx_merge_source_next(struct midx_merge_source *src)
 {
-	if (nr < fanout->nr)
-		BUG("negative growth in midx_fanout_grow() (%"PRIuMAX" < %"PRIuMAX")",
-		    (uintmax_t)nr, (uintmax_t)fanout->nr);
-	ALLOC_GROW(fanout->entries, nr, fanout->alloc);
+	while (src->pos < src->end) {
+		uint32_t pos = src->pos++;
+
+		if (src->p) {
+			fill_pack_entry(src->pack_int_id, src->p, pos,
+					&src->entry, src->preferred);
+			src->key = get_be64(src->entry.oid.hash);
+			return 1;
+		}
+
+		if (src->preferred_pack > -1 &&
+		    src->preferred_pack == nth_midxed_pack_int_id(src->m, pos)) {
+			/*
+			 * Objects from preferred packs are added
+			 * separately.
+			 */
+			continue;
+		}
+
+		nth_midxed_pack_midx_entry(src->m, &src->entry, pos);
+		src->entry.preferred = 0;
+		src->key = get_be64(src->entry.oid.hash);
+		return 1;
+	}
+	return 0;
 }
 
-static void midx_fanout_sort(struct midx_fanout *fanout)
+static int midx_merge_source_cmp(const void *va, const void *vb,
+				 void *cb_data UNUSED)
 {
-	QSORT(fanout->entries, fanout->nr, midx_oid_compare);
+	const struct midx_merge_source *a = va, *b = vb;
+
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	return midx_oid_compare(&a->entry, &b->entry);
 }
 
-static void midx_fanout_add_midx_fanout(struct midx_fanout *fanout,
-					struct multi_pack_index *m,
-					uint32_t cur_fanout,
-					int preferred_pack)
-{
-	uint32_t start = m->num_objects_in_base, end;
-	uint32_t cur_object;
+/*
+ * The objects whose first byte is in [fanout_start, fanout_end), merged
+ * and de-duplicated, possibly by a thread of their own.
+ */
+struct midx_merge_range {
+	struct write_midx_context *ctx;
+	uint32_t start_pack;
+	uint32_t fanout_start, fanout_end;
 
-	if (m->base_midx)
-		midx_fanout_add_midx_fanout(fanout, m->base_midx, cur_fanout,
-					    preferred_pack);
+	struct pack_midx_entry *entries;
+	size_t nr, alloc;
+};
 
-	if (cur_fanout)
-		start += ntohl(m->chunk_oid_fanout[cur_fanout - 1]);
-	end = m->num_objects_in_base + ntohl(m->chunk_oid_fanout[cur_fanout]);
+static void *merge_fanout_range(void *data)
+{
+	struct midx_merge_range *range = data;
+	struct write_midx_context *ctx = range->ctx;
+	struct prio_queue queue = { .compare = midx_merge_source_cmp };
+	struct midx_merge_source *sources = NULL, *src;
+	size_t sources_nr = 0, sources_alloc = 0, i;
+	uint32_t first = range->fanout_start, last = range->fanout_end - 1;
+	uint32_t cur_pack;
+
+	if (range->fanout_start == range->fanout_end)
+		return NULL;
+
+	if (ctx->m && !ctx->incremental) {
+		struct multi_pack_index *m;
+
+		for (m = ctx->m; m; m = m->base_midx) {
+			ALLOC_GROW(sources, sources_nr + 1, sources_alloc);
+			src = &sources[sources_nr++];
+			memset(src, 0, sizeof(*src));
+			src->m = m;
+			src->preferred_pack = ctx->preferred_pack_idx;
+			src->pos = m->num_objects_in_base;
+			if (first)
+				src->pos += ntohl(m->chunk_oid_fanout[first - 1]);
+			src->end = m->num_objects_in_base +
+				ntohl(m->chunk_oid_fanout[last]);
+		}
+	}
 
-	for (cur_object = start; cur_object < end; cur_object++) {
-		if ((preferred_pack > -1) &&
-		    (preferred_pack == nth_midxed_pack_int_id(m, cur_object))) {
-			/*
-			 * Objects from preferred packs are added
-			 * separately.
-			 */
+	for (cur_pack = 0; cur_pack < ctx->nr; cur_pack++) {
+		int preferred = cur_pack == ctx->preferred_pack_idx;
+
+		/*
+		 * Objects in packs from the existing MIDX are read from
+		 * it, except for those of the preferred pack.
+		 */
+		if (cur_pack < range->start_pack && !preferred)
 			continue;
+
+		ALLOC_GROW(sources, sources_nr + 1, sources_alloc);
+		src = &sources[sources_nr++];
+		memset(src, 0, sizeof(*src));
+		src->p = ctx->info[cur_pack].p;
+		src->pack_int_id = cur_pack;
+		src->preferred = preferred;
+		src->pos = first ? get_pack_fanout(src->p, first - 1) : 0;
+		src->end = get_pack_fanout(src->p, last);
+	}
+
+	/* "sources" does not move anymore; queue up its members */
+	for (i = 0; i < sources_nr; i++)
+		if (midx_merge_source_next(&sources[i]))
+			prio_queue_put(&queue, &sources[i]);
+
+	/*
+	 * Every source is sorted by OID, and the queue breaks ties in
+	 * favor of the copy we want (see midx_oid_compare()), so take
+	 * only the first of each run of duplicates.
+	 */
+	while ((src = prio_queue_peek(&queue))) {
+		if (!(range->nr && oideq(&range->entries[range->nr - 1].oid,
+					 &src->entry.oid)) &&
+		    !(ctx->incremental && ctx->base_midx &&
+		      midx_has_oid(ctx->base_midx, &src->entry.oid))) {
+			ALLOC_GROW(range->entries, st_add(range->nr, 1),
+				   range->alloc);
+			memcpy(&range->entries[range->nr++], &src->entry,
+			       sizeof(struct pack_midx_entry));
 		}
 
-		midx_fanout_grow(fanout, fanout->nr + 1);
-		nth_midxed_pack_midx_entry(m,
-					   &fanout->entries[fanout->nr],
-					   cur_object);
-		fanout->entries[fanout->nr].preferred = 0;
-		fanout->nr++;
+		if (midx_merge_source_next(src))
+			prio_queue_replace(&queue, src);
+		else
+			prio_queue_get(&queue);
 	}
+
+	clear_prio_queue(&queue);
+	free(sources);
+	return NULL;
 }
 
-static void midx_fanout_add_pack_fanout(struct midx_fanout *fanout,
-					struct pack_info *info,
-					uint32_t cur_pack,
-					int preferred,
-					uint32_t cur_fanout)
+static int midx_write_threads(uint64_t nr_objects)
 {
-	struct packed_git *pack = info[cur_pack].p;
-	uint32_t start = 0, end;
-	uint32_t cur_object;
-
-	if (cur_fanout)
-		start = get_pack_fanout(pack, cur_fanout - 1);
-	end = get_pack_fanout(pack, cur_fanout);
-
-	for (cur_object = start; cur_object < end; cur_object++) {
-		midx_fanout_grow(fanout, fanout->nr + 1);
-		fill_pack_entry(cur_pack,
-				info[cur_pack].p,
-				cur_object,
-				&fanout->entries[fanout->nr],
-				preferred);
-		fanout->nr++;
+	int threads = git_env_ulong("GIT_TEST_MIDX_WRITE_THREADS", 0);
+
+	if (!HAVE_THREADS)
+		return 1;
+	if (!threads) {
+		threads = online_cpus();
+		if (nr_objects / MIDX_OBJECTS_PER_THREAD < threads)
+			threads = nr_objects / MIDX_OBJECTS_PER_THREAD;
 	}
+	return threads < 1 ? 1 : threads > 256 ? 256 : threads;
 }
 
 /*
+ * The .idx files and existing MIDX layers we read are each sorted by
+ * OID already, so merge them with a priority queue instead of sorting
+ * everything again. The fanout values are split into ranges holding
+ * about as many objects each, and the ranges are merged in parallel.
+ *
  * It is possible to artificially get into a state where there are many
- * duplicate copies of objects. That can create high memory pressure if
- * we are to create a list of all objects before de-duplication. To reduce
- * this memory pressure without a significant performance drop, automatically
- * group objects by the first byte of their object id. Use the IDX fanout
- * tables to group the data, copy to a local array, then sort.
+ * duplicate copies of objects; since we de-duplicate while merging,
+ * these never make it into memory.
  *
  * Copy only the de-duplicated entries (selected by most-recent modified time
  * of a packfile containing the object).
@@ -331,69 +426,89 @@ static void midx_fanout_add_pack_fanout(struct midx_fanout *fanout,
 static void compute_sorted_entries(struct write_midx_context *ctx,
 				   uint32_t start_pack)
 {
-	uint32_t cur_fanout, cur_pack, cur_object;
-	size_t alloc_objects, total_objects = 0;
-	struct midx_fanout fanout = { 0 };
-
-	for (cur_pack = start_pack; cur_pack < ctx->nr; cur_pack++)
-		total_objects = st_add(total_objects,
-				       ctx->info[cur_pack].p->num_objects);
-
-	/*
-	 * As we de-duplicate by fanout value, we expect the fanout
-	 * slices to be evenly distributed, with some noise. Hence,
-	 * allocate slightly more than one 256th.
-	 */
-	alloc_objects = fanout.alloc = total_objects > 3200 ? total_objects / 200 : 16;
-
-	ALLOC_ARRAY(fanout.entries, fanout.alloc);
-	ALLOC_ARRAY(ctx->entries, alloc_objects);
-	ctx->entries_nr = 0;
-
-	for (cur_fanout = 0; cur_fanout < 256; cur_fanout++) {
-		fanout.nr = 0;
+	uint64_t counts[256] = { 0 }, total = 0, seen = 0;
+	struct midx_merge_range *ranges;
+	uint32_t cur_fanout = 0, cur_pack;
+	pthread_t *threads;
+	int nr_threads, i;
+
+	for (cur_pack = 0; cur_pack < ctx->nr; cur_pack++) {
+		struct packed_git *p = ctx->info[cur_pack].p;
+		uint32_t prev = 0, f;
+
+		if (cur_pack < start_pack &&
+		    cur_pack != ctx->preferred_pack_idx)
+			continue;
+		for (f = 0; f < 256; f++) {
+			uint32_t cur = get_pack_fanout(p, f);
+			counts[f] += cur - prev;
+			prev = cur;
+		}
+	}
+	if (ctx->m && !ctx->incremental) {
+		struct multi_pack_index *m;
 
-		if (ctx->m && !ctx->incremental)
-			midx_fanout_add_midx_fanout(&fanout, ctx->m, cur_fanout,
-						    ctx->preferred_pack_idx);
+		for (m = ctx->m; m; m = m->base_midx) {
+			uint32_t prev = 0, f;
 
-		for (cur_pack = start_pack; cur_pack < ctx->nr; cur_pack++) {
-			int preferred = cur_pack == ctx->preferred_pack_idx;
-			midx_fanout_add_pack_fanout(&fanout,
-						    ctx->info, cur_pack,
-						    preferred, cur_fanout);
+			for (f = 0; f < 256; f++) {
+				uint32_t cur = ntohl(m->chunk_oid_fanout[f]);
+				counts[f] += cur - prev;
+				prev = cur;
+			}
 		}
+	}
+	for (i = 0; i < 256; i++)
+		total += counts[i];
+
+	nr_threads = midx_write_threads(total);
+	trace2_data_intmax("midx", ctx->repo, "compute_sorted_entries/threads",
+			   nr_threads);
+
+	CALLOC_ARRAY(ranges, nr_threads);
+	CALLOC_ARRAY(threads, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		uint64_t target = total * (i + 1) / nr_threads;
+
+		ranges[i].ctx = ctx;
+		ranges[i].start_pack = start_pack;
+		ranges[i].fanout_start = cur_fanout;
+		while (cur_fanout < 256 &&
+		       (i == nr_threads - 1 || seen < target))
+			seen += counts[cur_fanout++];
+		ranges[i].fanout_end = cur_fanout;
+	}
 
-		if (-1 < ctx->preferred_pack_idx && ctx->preferred_pack_idx < start_pack)
-			midx_fanout_add_pack_fanout(&fanout, ctx->info,
-						    ctx->preferred_pack_idx, 1,
-						    cur_fanout);
-
-		midx_fanout_sort(&fanout);
+	for (i = 1; i < nr_threads; i++) {
+		int err = pthread_create(&threads[i], NULL, merge_fanout_range,
+					 &ranges[i]);
+		if (err)
+			die(_("unable to create thread: %s"), strerror(err));
+	}
+	merge_fanout_range(&ranges[0]);
+	for (i = 1; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
 
-		/*
-		 * The batch is now sorted by OID and then mtime (descending).
-		 * Take only the first duplicate.
-		 */
-		for (cur_object = 0; cur_object < fanout.nr; cur_object++) {
-			if (cur_object && oideq(&fanout.entries[cur_object - 1].oid,
-						&fanout.entries[cur_object].oid))
-				continue;
-			if (ctx->incremental && ctx->base_midx &&
-			    midx_has_oid(ctx->base_midx,
-					 &fanout.entries[cur_object].oid))
-				continue;
-
-			ALLOC_GROW(ctx->entries, st_add(ctx->entries_nr, 1),
-				   alloc_objects);
-			memcpy(&ctx->entries[ctx->entries_nr],
-			       &fanout.entries[cur_object],
-			       sizeof(struct pack_midx_entry));
-			ctx->entries_nr++;
+	if (nr_threads == 1) {
+		ctx->entries = ranges[0].entries;
+		ctx->entries_nr = ranges[0].nr;
+	} else {
+		ctx->entries_nr = 0;
+		for (i = 0; i < nr_threads; i++)
+			ctx->entries_nr = st_add(ctx->entries_nr, ranges[i].nr);
+		ALLOC_ARRAY(ctx->entries, ctx->entries_nr);
+
+		ctx->entries_nr = 0;
+		for (i = 0; i < nr_threads; i++) {
+			COPY_ARRAY(ctx->entries + ctx->entries_nr,
+				   ranges[i].entries, ranges[i].nr);
+			ctx->entries_nr += ranges[i].nr;
+			free(ranges[i].entries);
 		}
 	}
 
-	free(fanout.entries);
+	free(ranges);
+	free(threads);
 }
 
 static int write_midx_pack_names(struct hashfile *f, void *data)
@@ -1070,6 +1185,7 @@ static int write_midx_internal(struct repository *r, const char *object_dir,
 			       struct string_list *packs_to_drop,
 			       const char *preferred_pack_name,
 			       const char *refs_snapshot,
+			       const char *incremental_base,
 			       unsigned flags)
 {
 	struct strbuf midx_name = STRBUF_INIT;
@@ -1121,6 +1237,18 @@ static int write_midx_internal(struct repository *r, const char *object_dir,
 			else if (!packs_to_include)
 				ctx.m = m;
 		}
+
+		while (incremental_base && ctx.base_midx &&
+		       strcmp(hash_to_hex_algop(get_midx_checksum(ctx.base_midx),
+						r->hash_algo),
+			      incremental_base))
+			ctx.base_midx = ctx.base_midx->base_midx;
+		if (incremental_base && !ctx.base_midx) {
+			error(_("could not find base multi-pack-index layer '%s'"),
+			      incremental_base);
+			result = 1;
+			goto cleanup;
+		}
 	}
 
 	ctx.nr = 0;
@@ -1529,20 +1657,23 @@ static int write_midx_internal(struct repository *r, const char *object_dir,
 
 int write_midx_file(struct repository *r, const char *object_dir,
 		    const char *preferred_pack_name,
-		    const char *refs_snapshot, unsigned flags)
+		    const char *refs_snapshot, const char *incremental_base,
+		    unsigned flags)
 {
 	return write_midx_internal(r, object_dir, NULL, NULL,
 				   preferred_pack_name, refs_snapshot,
-				   flags);
+				   incremental_base, flags);
 }
 
 int write_midx_file_only(struct repository *r, const char *object_dir,
 			 struct string_list *packs_to_include,
 			 const char *preferred_pack_name,
-			 const char *refs_snapshot, unsigned flags)
+			 const char *refs_snapshot,
+			 const char *incremental_base, unsigned flags)
 {
 	return write_midx_internal(r, object_dir, packs_to_include, NULL,
-				   preferred_pack_name, refs_snapshot, flags);
+				   preferred_pack_name, refs_snapshot,
+				   incremental_base, flags);
 }
 
 int expire_midx_packs(struct repository *r, const char *object_dir, unsigned flags)
@@ -1603,7 +1734,8 @@ int expire_midx_packs(struct repository *r, const char *object_dir, unsigned fla
 
 	if (packs_to_drop.nr)
 		result = write_midx_internal(r, object_dir, NULL,
-					     &packs_to_drop, NULL, NULL, flags);
+					     &packs_to_drop, NULL, NULL, NULL,
+					     flags);
 
 	string_list_clear(&packs_to_drop, 0);
 
@@ -1801,7 +1933,7 @@ int midx_repack(struct repository *r, const char *object_dir, size_t batch_size,
 	}
 
 	result = write_midx_internal(r, object_dir, NULL, NULL, NULL, NULL,
-				     flags);
+				     NULL, flags);
 
 cleanup:
 	free(include_pack);
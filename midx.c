@@ -827,6 +827,7 @@ void clear_midx_file(struct repository *r)
 	get_midx_filename(r->hash_algo, &midx, r->objects->odb->path);
 
 	if (r->objects && r->objects->multi_pack_index) {
+		close_reachability_bitmap(r->objects);
 		close_midx(r->objects->multi_pack_index);
 		r->objects->multi_pack_index = NULL;
 	}
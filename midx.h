@@ -128,14 +128,20 @@ int prepare_multi_pack_index_one(struct repository *r, const char *object_dir, i
 /*
  * Variant of write_midx_file which writes a MIDX containing only the packs
  * specified in packs_to_include.
+ *
+ * With MIDX_WRITE_INCREMENTAL, the new layer is written on top of the
+ * layer whose checksum is given in hex as "incremental_base", and the
+ * layers above that one are removed from the chain. The new layer is
+ * written on top of the whole chain when it is NULL.
  */
 int write_midx_file(struct repository *r, const char *object_dir,
 		    const char *preferred_pack_name, const char *refs_snapshot,
-		    unsigned flags);
+		    const char *incremental_base, unsigned flags);
 int write_midx_file_only(struct repository *r, const char *object_dir,
 			 struct string_list *packs_to_include,
 			 const char *preferred_pack_name,
-			 const char *refs_snapshot, unsigned flags);
+			 const char *refs_snapshot,
+			 const char *incremental_base, unsigned flags);
 void clear_midx_file(struct repository *r);
 int verify_midx_file(struct repository *r, const char *object_dir, unsigned flags);
 int expire_midx_packs(struct repository *r, const char *object_dir, unsigned flags);
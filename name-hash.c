@@ -20,10 +20,29 @@
 #include "trace2.h"
 #include "sparse-index.h"
 
+/*
+ * The entries are hashed one directory at a time, when a lookup first
+ * reaches that directory; a 'git add' of one file need not hash the
+ * whole index.
+ *
+ * Each directory known to "dir_hash" counts the entries below it, at
+ * any depth, so that it knows whether it still exists. A directory is
+ * "filled" once its entries are in "name_hash" and its subdirectories
+ * in "dir_hash"; only the subdirectories of filled directories are
+ * known. As the index is sorted, the entries of a directory which is
+ * not filled yet are found with a binary search; "alias" lists the
+ * other spellings it has in the index (with core.ignoreCase), as each
+ * of them has its own range.
+ *
+ * The top-level directory is the entry with an empty name.
+ */
 struct dir_entry {
 	struct hashmap_entry ent;
 	struct dir_entry *parent;
 	int nr;
+	unsigned filled : 1;
+	char **alias;
+	int alias_nr, alias_alloc;
 	unsigned int namelen;
 	char name[FLEX_ARRAY];
 };
@@ -58,61 +77,52 @@ static struct dir_entry *find_dir_entry(struct index_state *istate,
 	return find_dir_entry__hash(istate, name, namelen, memihash(name, namelen));
 }
 
-static struct dir_entry *hash_dir_entry(struct index_state *istate,
-		struct cache_entry *ce, int namelen)
+static struct dir_entry *root_dir(struct index_state *istate)
+{
+	return find_dir_entry(istate, "", 0);
+}
+
+static struct dir_entry *new_dir_entry(struct index_state *istate,
+		const char *name, unsigned int namelen, struct dir_entry *parent)
 {
-	/*
-	 * Throw each directory component in the hash for quick lookup
-	 * during a git status. Directory components are stored without their
-	 * closing slash.  Despite submodules being a directory, they never
-	 * reach this point, because they are stored
-	 * in index_state.name_hash (as ordinary cache_entries).
-	 */
 	struct dir_entry *dir;
 
-	/* get length of parent directory */
-	while (namelen > 0 && !is_dir_sep(ce->name[namelen - 1]))
-		namelen--;
-	if (namelen <= 0)
-		return NULL;
-	namelen--;
+	FLEX_ALLOC_MEM(dir, name, name, namelen);
+	hashmap_entry_init(&dir->ent, memihash(name, namelen));
+	dir->namelen = namelen;
+	dir->parent = parent && parent->namelen ? parent : NULL;
+	hashmap_add(&istate->dir_hash, &dir->ent);
+	return dir;
+}
 
-	/* lookup existing entry for that directory */
-	dir = find_dir_entry(istate, ce->name, namelen);
-	if (!dir) {
-		/* not found, create it and add to hash table */
-		FLEX_ALLOC_MEM(dir, name, ce->name, namelen);
-		hashmap_entry_init(&dir->ent, memihash(ce->name, namelen));
-		dir->namelen = namelen;
-		hashmap_add(&istate->dir_hash, &dir->ent);
+static void free_dir_aliases(struct dir_entry *dir)
+{
+	int i;
 
-		/* recursively add missing parent directories */
-		dir->parent = hash_dir_entry(istate, ce, namelen);
-	}
-	return dir;
+	for (i = 0; i < dir->alias_nr; i++)
+		free(dir->alias[i]);
+	FREE_AND_NULL(dir->alias);
+	dir->alias_nr = dir->alias_alloc = 0;
 }
 
-static void add_dir_entry(struct index_state *istate, struct cache_entry *ce)
+static void free_dir_entry(struct index_state *istate, struct dir_entry *dir)
 {
-	/* Add reference to the directory entry (and parents if 0). */
-	struct dir_entry *dir = hash_dir_entry(istate, ce, ce_namelen(ce));
-	while (dir && !(dir->nr++))
-		dir = dir->parent;
+	hashmap_remove(&istate->dir_hash, &dir->ent, NULL);
+	free_dir_aliases(dir);
+	free(dir);
 }
 
-static void remove_dir_entry(struct index_state *istate, struct cache_entry *ce)
+static void add_dir_alias(struct dir_entry *dir, const char *name)
 {
-	/*
-	 * Release reference to the directory entry. If 0, remove and continue
-	 * with parent directory.
-	 */
-	struct dir_entry *dir = hash_dir_entry(istate, ce, ce_namelen(ce));
-	while (dir && !(--dir->nr)) {
-		struct dir_entry *parent = dir->parent;
-		hashmap_remove(&istate->dir_hash, &dir->ent, NULL);
-		free(dir);
-		dir = parent;
-	}
+	int i;
+
+	if (!memcmp(dir->name, name, dir->namelen))
+		return;
+	for (i = 0; i < dir->alias_nr; i++)
+		if (!memcmp(dir->alias[i], name, dir->namelen))
+			return;
+	ALLOC_GROW(dir->alias, dir->alias_nr + 1, dir->alias_alloc);
+	dir->alias[dir->alias_nr++] = xmemdupz(name, dir->namelen);
 }
 
 static void hash_index_entry(struct index_state *istate, struct cache_entry *ce)
@@ -125,9 +135,169 @@ static void hash_index_entry(struct index_state *istate, struct cache_entry *ce)
 		hashmap_entry_init(&ce->ent, memihash(ce->name, ce_namelen(ce)));
 		hashmap_add(&istate->name_hash, &ce->ent);
 	}
+}
+
+/*
+ * Return the first position in [begin, end) whose name sorts after
+ * (with "past") or not before the first "len" bytes of "prefix".
+ */
+static int find_prefix_bound(struct index_state *istate, int begin, int end,
+			     const char *prefix, int len, int past)
+{
+	while (begin < end) {
+		int mid = begin + ((end - begin) >> 1);
+		int cmp = strncmp(istate->cache[mid]->name, prefix, len);
+
+		if (cmp < 0 || (past && !cmp))
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+/*
+ * Hash the entries in [begin, end), which all start with the "len"
+ * bytes naming "dir" (and its slash), and count the ones in each of
+ * its subdirectories; with "recurse", fill the subdirectories too.
+ */
+static void fill_range(struct index_state *istate, struct dir_entry *dir,
+		       int begin, int end, int len, int recurse)
+{
+	int k = begin;
+
+	while (k < end) {
+		struct cache_entry *ce = istate->cache[k];
+		const char *slash = strchr(ce->name + len, '/');
+		struct dir_entry *sub;
+		int sublen, next;
+
+		if (!slash) {
+			hash_index_entry(istate, ce);
+			k++;
+			continue;
+		}
+
+		sublen = slash - ce->name;
+		next = find_prefix_bound(istate, k + 1, end, ce->name, sublen + 1, 1);
+		sub = find_dir_entry(istate, ce->name, sublen);
+		if (!sub)
+			sub = new_dir_entry(istate, ce->name, sublen, dir);
+		else if (!sub->filled)
+			add_dir_alias(sub, ce->name);
+		sub->nr += next - k;
+		if (recurse)
+			fill_range(istate, sub, k, next, sublen + 1, 1);
+		k = next;
+	}
+	dir->filled = 1;
+}
+
+static void fill_dir_spelling(struct index_state *istate, struct dir_entry *dir,
+			      const char *name)
+{
+	struct strbuf prefix = STRBUF_INIT;
+	int begin, end;
+
+	if (!dir->namelen) {
+		fill_range(istate, dir, 0, istate->cache_nr, 0, 0);
+		return;
+	}
+	strbuf_add(&prefix, name, dir->namelen);
+	strbuf_addch(&prefix, '/');
+	begin = find_prefix_bound(istate, 0, istate->cache_nr,
+				  prefix.buf, prefix.len, 0);
+	end = find_prefix_bound(istate, begin, istate->cache_nr,
+				prefix.buf, prefix.len, 1);
+	fill_range(istate, dir, begin, end, prefix.len, 0);
+	strbuf_release(&prefix);
+}
+
+static void fill_dir(struct index_state *istate, struct dir_entry *dir)
+{
+	int i;
+
+	if (dir->filled)
+		return;
+	fill_dir_spelling(istate, dir, dir->name);
+	for (i = 0; i < dir->alias_nr; i++)
+		fill_dir_spelling(istate, dir, dir->alias[i]);
+	free_dir_aliases(dir);
+}
+
+/*
+ * Fill the directories leading to "name" and return the one it is
+ * in, or NULL if the index has no such directory.
+ */
+static struct dir_entry *fill_leading_dirs(struct index_state *istate,
+					   const char *name, int namelen)
+{
+	struct dir_entry *dir = root_dir(istate);
+	const char *p = name, *end = name + namelen, *slash;
+
+	for (;;) {
+		fill_dir(istate, dir);
+		slash = memchr(p, '/', end - p);
+		if (!slash)
+			return dir;
+		dir = find_dir_entry(istate, name, slash - name);
+		if (!dir)
+			return NULL;
+		p = slash + 1;
+	}
+}
 
-	if (ignore_case)
-		add_dir_entry(istate, ce);
+/*
+ * Count a new entry in the directories leading to it, and hash it if
+ * its directory is filled.
+ */
+static void add_dir_entries(struct index_state *istate, struct cache_entry *ce)
+{
+	struct dir_entry *dir = root_dir(istate), *sub;
+	const char *slash = ce->name;
+
+	dir->nr++;
+	while (dir->filled) {
+		slash = strchr(slash, '/');
+		if (!slash) {
+			hash_index_entry(istate, ce);
+			return;
+		}
+		sub = find_dir_entry(istate, ce->name, slash - ce->name);
+		if (!sub) {
+			sub = new_dir_entry(istate, ce->name, slash - ce->name, dir);
+			istate->name_hash_complete = 0;
+		} else if (!sub->filled) {
+			add_dir_alias(sub, ce->name);
+		}
+		sub->nr++;
+		dir = sub;
+		slash++;
+	}
+}
+
+/*
+ * Stop counting an entry, and drop the directories with nothing left
+ * in them (except the top-level one).
+ */
+static void remove_dir_entries(struct index_state *istate, struct cache_entry *ce)
+{
+	struct dir_entry *root = root_dir(istate), *dir = root, *sub;
+	const char *slash = ce->name;
+
+	dir->nr--;
+	while (dir->filled && (slash = strchr(slash, '/'))) {
+		sub = find_dir_entry(istate, ce->name, slash - ce->name);
+		if (dir != root && !dir->nr)
+			free_dir_entry(istate, dir);
+		if (!sub)
+			return;
+		dir = sub;
+		dir->nr--;
+		slash++;
+	}
+	if (dir != root && !dir->nr)
+		free_dir_entry(istate, dir);
 }
 
 static int cache_entry_cmp(const void *cmp_data UNUSED,
@@ -303,16 +473,8 @@ static struct dir_entry *hash_dir_entry_with_parent_and_prefix(
 		hashmap_entry_init(&dir->ent, hash);
 		dir->namelen = prefix->len;
 		dir->parent = parent;
+		dir->filled = 1;
 		hashmap_add(&istate->dir_hash, &dir->ent);
-
-		if (parent) {
-			unlock_dir_mutex(lock_nr);
-
-			/* All I really need here is an InterlockedIncrement(&(parent->nr)) */
-			lock_nr = compute_dir_lock_nr(&istate->dir_hash, parent->ent.hash);
-			lock_dir_mutex(lock_nr);
-			parent->nr++;
-		}
 	}
 
 	unlock_dir_mutex(lock_nr);
@@ -499,16 +661,38 @@ static void *lazy_name_thread_proc(void *_data)
 	return NULL;
 }
 
+static int dir_entry_deeper(const void *a_, const void *b_)
+{
+	const struct dir_entry *a = *(const struct dir_entry **)a_;
+	const struct dir_entry *b = *(const struct dir_entry **)b_;
+
+	return a->namelen < b->namelen ? 1 : a->namelen > b->namelen ? -1 : 0;
+}
+
 static inline void lazy_update_dir_ref_counts(
 	struct index_state *istate,
 	struct lazy_entry *lazy_entries)
 {
-	int k;
+	struct dir_entry **dirs = NULL;
+	struct dir_entry *dir;
+	struct hashmap_iter iter;
+	int k, nr = 0, alloc = 0;
 
 	for (k = 0; k < istate->cache_nr; k++) {
 		if (lazy_entries[k].dir)
 			lazy_entries[k].dir->nr++;
 	}
+
+	/* add what is in the subdirectories, deepest first */
+	hashmap_for_each_entry(&istate->dir_hash, &iter, dir, ent) {
+		ALLOC_GROW(dirs, nr + 1, alloc);
+		dirs[nr++] = dir;
+	}
+	QSORT(dirs, nr, dir_entry_deeper);
+	for (k = 0; k < nr; k++)
+		if (dirs[k]->parent)
+			dirs[k]->parent->nr += dirs[k]->nr;
+	free(dirs);
 }
 
 static void threaded_lazy_init_name_hash(
@@ -586,13 +770,30 @@ static void threaded_lazy_init_name_hash(
 	free(lazy_entries);
 }
 
-static void lazy_init_name_hash(struct index_state *istate)
+/*
+ * Start an empty name hash, which lookups fill as they need.
+ */
+static void init_name_hash(struct index_state *istate)
 {
-
 	if (istate->name_hash_initialized)
 		return;
+	hashmap_init(&istate->name_hash, cache_entry_cmp, NULL, 0);
+	hashmap_init(&istate->dir_hash, dir_entry_cmp, NULL, 0);
+	new_dir_entry(istate, "", 0, NULL)->nr = istate->cache_nr;
+	istate->name_hash_initialized = 1;
+}
+
+void lazy_init_name_hash(struct index_state *istate)
+{
+	struct dir_entry *root;
+
+	if (istate->name_hash_complete)
+		return;
 	trace_performance_enter();
 	trace2_region_enter("index", "name-hash-init", istate->repo);
+
+	/* start over rather than find out what is filled already */
+	free_name_hash(istate);
 	hashmap_init(&istate->name_hash, cache_entry_cmp, NULL, istate->cache_nr);
 	hashmap_init(&istate->dir_hash, dir_entry_cmp, NULL, istate->cache_nr);
 
@@ -606,13 +807,16 @@ static void lazy_init_name_hash(struct index_state *istate)
 		hashmap_disable_item_counting(&istate->dir_hash);
 		threaded_lazy_init_name_hash(istate);
 		hashmap_enable_item_counting(&istate->dir_hash);
+		root = new_dir_entry(istate, "", 0, NULL);
+		root->filled = 1;
 	} else {
-		int nr;
-		for (nr = 0; nr < istate->cache_nr; nr++)
-			hash_index_entry(istate, istate->cache[nr]);
+		root = new_dir_entry(istate, "", 0, NULL);
+		fill_range(istate, root, 0, istate->cache_nr, 0, 1);
 	}
+	root->nr = istate->cache_nr;
 
 	istate->name_hash_initialized = 1;
+	istate->name_hash_complete = 1;
 	trace2_region_leave("index", "name-hash-init", istate->repo);
 	trace_performance_leave("initialize name hash");
 }
@@ -639,18 +843,18 @@ int test_lazy_init_name_hash(struct index_state *istate, int try_threaded)
 void add_name_hash(struct index_state *istate, struct cache_entry *ce)
 {
 	if (istate->name_hash_initialized)
-		hash_index_entry(istate, ce);
+		add_dir_entries(istate, ce);
 }
 
 void remove_name_hash(struct index_state *istate, struct cache_entry *ce)
 {
-	if (!istate->name_hash_initialized || !(ce->ce_flags & CE_HASHED))
+	if (!istate->name_hash_initialized)
 		return;
-	ce->ce_flags &= ~CE_HASHED;
-	hashmap_remove(&istate->name_hash, &ce->ent, ce);
-
-	if (ignore_case)
-		remove_dir_entry(istate, ce);
+	if (ce->ce_flags & CE_HASHED) {
+		ce->ce_flags &= ~CE_HASHED;
+		hashmap_remove(&istate->name_hash, &ce->ent, ce);
+	}
+	remove_dir_entries(istate, ce);
 }
 
 static int slow_same_name(const char *name1, int len1, const char *name2, int len2)
@@ -694,8 +898,12 @@ int index_dir_find(struct index_state *istate, const char *name, int namelen,
 {
 	struct dir_entry *dir;
 
-	lazy_init_name_hash(istate);
+	if (!namelen)
+		return 0;
 	expand_to_path(istate, name, namelen, 0);
+	init_name_hash(istate);
+	if (!fill_leading_dirs(istate, name, namelen))
+		return 0;
 	dir = find_dir_entry(istate, name, namelen);
 
 	if (canonical_path && dir && dir->nr) {
@@ -710,21 +918,22 @@ void adjust_dirname_case(struct index_state *istate, char *name)
 {
 	const char *startPtr = name;
 	const char *ptr = startPtr;
+	struct dir_entry *dir;
 
-	lazy_init_name_hash(istate);
 	expand_to_path(istate, name, strlen(name), 0);
+	init_name_hash(istate);
+	dir = root_dir(istate);
 	while (*ptr) {
 		while (*ptr && *ptr != '/')
 			ptr++;
 
 		if (*ptr == '/') {
-			struct dir_entry *dir;
-
+			fill_dir(istate, dir);
 			dir = find_dir_entry(istate, name, ptr - name);
-			if (dir) {
-				memcpy((void *)startPtr, dir->name + (startPtr - name), ptr - startPtr);
-				startPtr = ptr + 1;
-			}
+			if (!dir)
+				break;
+			memcpy((void *)startPtr, dir->name + (startPtr - name), ptr - startPtr);
+			startPtr = ptr + 1;
 			ptr++;
 		}
 	}
@@ -735,8 +944,10 @@ struct cache_entry *index_file_exists(struct index_state *istate, const char *na
 	struct cache_entry *ce;
 	unsigned int hash = memihash(name, namelen);
 
-	lazy_init_name_hash(istate);
 	expand_to_path(istate, name, namelen, icase);
+	init_name_hash(istate);
+	if (!fill_leading_dirs(istate, name, namelen))
+		return NULL;
 
 	ce = hashmap_get_entry_from_hash(&istate->name_hash, hash, NULL,
 					 struct cache_entry, ent);
@@ -749,10 +960,21 @@ struct cache_entry *index_file_exists(struct index_state *istate, const char *na
 
 void free_name_hash(struct index_state *istate)
 {
+	struct hashmap_iter iter;
+	struct dir_entry *dir;
+	int i;
+
 	if (!istate->name_hash_initialized)
 		return;
 	istate->name_hash_initialized = 0;
+	istate->name_hash_complete = 0;
+
+	/* so that the entries can be hashed again */
+	for (i = 0; i < istate->cache_nr; i++)
+		istate->cache[i]->ce_flags &= ~CE_HASHED;
 
 	hashmap_clear(&istate->name_hash);
+	hashmap_for_each_entry(&istate->dir_hash, &iter, dir, ent)
+		free_dir_aliases(dir);
 	hashmap_clear_and_free(&istate->dir_hash, struct dir_entry, ent);
 }
@@ -13,6 +13,13 @@ int index_dir_find(struct index_state *istate, const char *name, int namelen,
 void adjust_dirname_case(struct index_state *istate, char *name);
 struct cache_entry *index_file_exists(struct index_state *istate, const char *name, int namelen, int igncase);
 
+/*
+ * The name hash is normally filled one directory at a time, as
+ * lookups reach them; fill all of it now, e.g. before looking names
+ * up from several threads (lookups only read a filled hash).
+ */
+void lazy_init_name_hash(struct index_state *istate);
+
 int test_lazy_init_name_hash(struct index_state *istate, int try_threaded);
 void add_name_hash(struct index_state *istate, struct cache_entry *ce);
 void remove_name_hash(struct index_state *istate, struct cache_entry *ce);
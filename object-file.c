@@ -996,6 +996,11 @@ static int freshen_packed_object(const struct object_id *oid)
 	return 1;
 }
 
+int freshen_object(const struct object_id *oid)
+{
+	return freshen_packed_object(oid) || freshen_loose_object(oid);
+}
+
 int stream_loose_object(struct input_stream *in_stream, size_t len,
 			struct object_id *oid)
 {
@@ -1137,7 +1142,7 @@ int write_object_file_flags(const void *buf, unsigned long len,
 	 * it out into .git/objects/??/?{38} file.
 	 */
 	write_object_file_prepare(algo, buf, len, type, oid, hdr, &hdrlen);
-	if (freshen_packed_object(oid) || freshen_loose_object(oid))
+	if (freshen_object(oid))
 		return 0;
 	if (write_loose_object(oid, hdr, hdrlen, buf, len, 0, flags))
 		return -1;
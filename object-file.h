@@ -238,6 +238,13 @@ void hash_object_file(const struct git_hash_algo *algo, const void *buf,
 /* Helper to check and "touch" a file */
 int check_and_freshen_file(const char *fn, int freshen);
 
+/*
+ * If the object "oid" is in the repository, "touch" it like writing it
+ * again would, and return 1; otherwise return 0. Callers which hashed
+ * an object themselves can use this to write it only if needed.
+ */
+int freshen_object(const struct object_id *oid);
+
 /*
  * Open the loose object at path, check its hash, and return the contents,
  * use the "oi" argument to assert things about the object, or e.g. populate its
@@ -86,6 +86,7 @@ void restore_primary_odb(struct object_directory *restore_odb, const char *old_p
 struct packed_git;
 struct multi_pack_index;
 struct cached_object_entry;
+struct bitmap_index;
 
 struct raw_object_store {
 	/*
@@ -117,6 +118,21 @@ struct raw_object_store {
 	struct commit_graph *commit_graph;
 	unsigned commit_graph_attempted : 1; /* if loading has been attempted */
 
+	/*
+	 * Bitmap index consulted by commit-reach.c; see
+	 * repo_reachability_bitmap().
+	 */
+	struct bitmap_index *reachability_bitmap;
+	unsigned reachability_bitmap_attempted : 1;
+
+	/*
+	 * Bitmap indexes replaced after the packs were reprepared. A
+	 * caller may still be using one, so they are only released by
+	 * close_object_store().
+	 */
+	struct bitmap_index **stale_reachability_bitmaps;
+	size_t stale_reachability_bitmaps_nr, stale_reachability_bitmaps_alloc;
+
 	/*
 	 * private data
 	 *
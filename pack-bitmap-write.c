@@ -27,6 +27,7 @@
 #include "strmap.h"
 #include "midx.h"
 #include "pack-revindex.h"
+#include "ewah/roaring.h"
 
 struct bitmapped_commit {
 	struct commit *commit;
@@ -47,6 +48,8 @@ void bitmap_writer_init(struct bitmap_writer *writer, struct repository *r,
 			struct packing_data *pdata,
 			struct multi_pack_index *midx)
 {
+	const char *format;
+
 	memset(writer, 0, sizeof(struct bitmap_writer));
 	if (writer->bitmaps)
 		BUG("bitmap writer already initialized");
@@ -56,6 +59,14 @@ void bitmap_writer_init(struct bitmap_writer *writer, struct repository *r,
 	writer->to_pack = pdata;
 	writer->midx = midx;
 
+	writer->format = BITMAP_FORMAT_EWAH;
+	if (!repo_config_get_string_tmp(r, "pack.bitmapformat", &format)) {
+		if (!strcmp(format, "roaring"))
+			writer->format = BITMAP_FORMAT_ROARING;
+		else if (strcmp(format, "ewah"))
+			die(_("unknown bitmap format '%s'"), format);
+	}
+
 	string_list_init_dup(&writer->pseudo_merge_groups);
 
 	load_pseudo_merges_from_config(r, &writer->pseudo_merge_groups);
@@ -789,9 +800,22 @@ static int hashwrite_ewah_helper(void *f, const void *buf, size_t len)
 /**
  * Write the bitmap index to disk
  */
-static inline void dump_bitmap(struct hashfile *f, struct ewah_bitmap *bitmap)
+static inline void dump_bitmap(struct bitmap_writer *writer,
+			       struct hashfile *f, struct ewah_bitmap *bitmap)
 {
-	if (ewah_serialize_to(bitmap, hashwrite_ewah_helper, f) < 0)
+	int ret;
+
+	if (writer->format == BITMAP_FORMAT_ROARING) {
+		struct roaring_bitmap roaring = ROARING_BITMAP_INIT;
+
+		roaring_from_ewah(&roaring, bitmap);
+		ret = roaring_serialize_to(&roaring, hashwrite_ewah_helper, f);
+		roaring_release(&roaring);
+	} else {
+		ret = ewah_serialize_to(bitmap, hashwrite_ewah_helper, f);
+	}
+
+	if (ret < 0)
 		die("Failed to write bitmap index");
 }
 
@@ -819,7 +843,7 @@ static void write_selected_commits_v1(struct bitmap_writer *writer,
 		hashwrite_u8(f, stored->xor_offset);
 		hashwrite_u8(f, stored->flags);
 
-		dump_bitmap(f, stored->write_as);
+		dump_bitmap(writer, f, stored->write_as);
 	}
 }
 
@@ -859,8 +883,8 @@ static void write_pseudo_merges(struct bitmap_writer *writer,
 
 		pseudo_merge_ofs[i] = hashfile_total(f);
 
-		dump_bitmap(f, commits_ewah);
-		dump_bitmap(f, writer->selected[base+i].write_as);
+		dump_bitmap(writer, f, commits_ewah);
+		dump_bitmap(writer, f, writer->selected[base+i].write_as);
 
 		ewah_free(commits_ewah);
 	}
@@ -1043,7 +1067,6 @@ void bitmap_writer_finish(struct bitmap_writer *writer,
 			  const char *filename,
 			  uint16_t options)
 {
-	static uint16_t default_version = 1;
 	static uint16_t flags = BITMAP_OPT_FULL_DAG;
 	struct strbuf tmp_file = STRBUF_INIT;
 	struct hashfile *f;
@@ -1060,16 +1083,16 @@ void bitmap_writer_finish(struct bitmap_writer *writer,
 	f = hashfd(writer->repo->hash_algo, fd, tmp_file.buf);
 
 	memcpy(header.magic, BITMAP_IDX_SIGNATURE, sizeof(BITMAP_IDX_SIGNATURE));
-	header.version = htons(default_version);
+	header.version = htons(writer->format);
 	header.options = htons(flags | options);
 	header.entry_count = htonl(bitmap_writer_nr_selected_commits(writer));
 	hashcpy(header.checksum, writer->pack_checksum, writer->repo->hash_algo);
 
 	hashwrite(f, &header, sizeof(header) - GIT_MAX_RAWSZ + writer->repo->hash_algo->rawsz);
-	dump_bitmap(f, writer->commits);
-	dump_bitmap(f, writer->trees);
-	dump_bitmap(f, writer->blobs);
-	dump_bitmap(f, writer->tags);
+	dump_bitmap(writer, f, writer->commits);
+	dump_bitmap(writer, f, writer->trees);
+	dump_bitmap(writer, f, writer->blobs);
+	dump_bitmap(writer, f, writer->tags);
 
 	if (options & BITMAP_OPT_LOOKUP_TABLE)
 		CALLOC_ARRAY(offsets, writer->to_pack->nr_objects);
@@ -16,12 +16,14 @@
 #include "pack-objects.h"
 #include "packfile.h"
 #include "repository.h"
+#include "trace.h"
 #include "trace2.h"
 #include "object-store.h"
 #include "list-objects-filter-options.h"
 #include "midx.h"
 #include "config.h"
 #include "pseudo-merge.h"
+#include "ewah/roaring.h"
 
 /*
  * An entry on the bitmap index, representing the bitmap for a given
@@ -29,7 +31,17 @@
  */
 struct stored_bitmap {
 	struct object_id oid;
+	/*
+	 * Decoded only when first needed; until then "root" is NULL
+	 * and "map_pos" is the offset of its serialized form.
+	 *
+	 * In a roaring .bitmap, queries use "roaring" in place (see
+	 * lookup_stored_roaring()), and "root" is only filled in for
+	 * callers asking for an EWAH bitmap.
+	 */
 	struct ewah_bitmap *root;
+	struct roaring_bitmap *roaring;
+	size_t map_pos;
 	struct stored_bitmap *xor;
 	int flags;
 };
@@ -148,33 +160,41 @@ static int existing_bitmaps_hits_nr;
 static int existing_bitmaps_misses_nr;
 static int roots_with_bitmaps_nr;
 static int roots_without_bitmaps_nr;
+static int bitmaps_decoded_nr;
 
-static struct ewah_bitmap *lookup_stored_bitmap(struct stored_bitmap *st)
+static struct ewah_bitmap *read_roaring_bitmap(const unsigned char *map,
+					       size_t map_size, size_t *map_pos)
 {
-	struct ewah_bitmap *parent;
-	struct ewah_bitmap *composed;
+	struct roaring_bitmap roaring = ROARING_BITMAP_INIT;
+	struct ewah_bitmap *b;
+	ssize_t bitmap_size = roaring_read_mmap(&roaring, map + *map_pos,
+						map_size - *map_pos);
 
-	if (!st->xor)
-		return st->root;
+	if (bitmap_size < 0) {
+		error(_("failed to load bitmap index (corrupted?)"));
+		return NULL;
+	}
 
-	composed = ewah_pool_new();
-	parent = lookup_stored_bitmap(st->xor);
-	ewah_xor(st->root, parent, composed);
+	b = roaring_to_ewah(&roaring);
+	roaring_release(&roaring);
 
-	ewah_pool_free(st->root);
-	st->root = composed;
-	st->xor = NULL;
+	*map_pos += bitmap_size;
 
-	return composed;
+	return b;
 }
 
 struct ewah_bitmap *read_bitmap(const unsigned char *map,
-				size_t map_size, size_t *map_pos)
+				size_t map_size, size_t *map_pos,
+				enum bitmap_format format)
 {
-	struct ewah_bitmap *b = ewah_pool_new();
+	struct ewah_bitmap *b;
+	ssize_t bitmap_size;
+
+	if (format == BITMAP_FORMAT_ROARING)
+		return read_roaring_bitmap(map, map_size, map_pos);
 
-	ssize_t bitmap_size = ewah_read_mmap(b, map + *map_pos,
-					     map_size - *map_pos);
+	b = ewah_pool_new();
+	bitmap_size = ewah_read_mmap(b, map + *map_pos, map_size - *map_pos);
 
 	if (bitmap_size < 0) {
 		error(_("failed to load bitmap index (corrupted?)"));
@@ -193,7 +213,160 @@ struct ewah_bitmap *read_bitmap(const unsigned char *map,
  */
 static struct ewah_bitmap *read_bitmap_1(struct bitmap_index *index)
 {
-	return read_bitmap(index->map, index->map_size, &index->map_pos);
+	return read_bitmap(index->map, index->map_size, &index->map_pos,
+			   index->version);
+}
+
+/*
+ * Return the size of the bitmap at the current read position of the
+ * mmaped index without decoding it, or a negative value if it is
+ * truncated.
+ */
+static ssize_t bitmap_serialized_size(struct bitmap_index *index)
+{
+	const unsigned char *p = index->map + index->map_pos;
+	size_t left = index->map_size - index->map_pos;
+
+	if (index->version == BITMAP_FORMAT_ROARING) {
+		struct roaring_bitmap roaring = ROARING_BITMAP_INIT;
+		ssize_t ret = roaring_read_mmap(&roaring, p, left);
+
+		roaring_release(&roaring);
+		return ret;
+	}
+
+	return ewah_mmap_size(p, left);
+}
+
+/*
+ * Return the bitmap for "st", decoding it and composing it with the
+ * bitmap it was XOR'd against if that has not yet been done. The
+ * result replaces the stored bitmap, so each entry along an XOR chain
+ * is decoded and composed at most once.
+ */
+static struct roaring_bitmap *lookup_stored_roaring(struct bitmap_index *index,
+						   struct stored_bitmap *st);
+
+static struct ewah_bitmap *lookup_stored_bitmap(struct bitmap_index *index,
+						struct stored_bitmap *st)
+{
+	struct ewah_bitmap *parent;
+	struct ewah_bitmap *composed;
+
+	if (index->version == BITMAP_FORMAT_ROARING) {
+		if (!st->root) {
+			struct roaring_bitmap *roaring;
+
+			roaring = lookup_stored_roaring(index, st);
+			if (!roaring)
+				return NULL;
+			st->root = roaring_to_ewah(roaring);
+		}
+		return st->root;
+	}
+
+	if (!st->root) {
+		size_t pos = st->map_pos;
+
+		st->root = read_bitmap(index->map, index->map_size, &pos,
+				       index->version);
+		if (!st->root) {
+			error(_("unable to decode bitmap for commit '%s'"),
+			      oid_to_hex(&st->oid));
+			return NULL;
+		}
+		bitmaps_decoded_nr++;
+	}
+
+	if (!st->xor)
+		return st->root;
+
+	parent = lookup_stored_bitmap(index, st->xor);
+	if (!parent)
+		return NULL;
+
+	composed = ewah_pool_new();
+	ewah_xor(st->root, parent, composed);
+
+	ewah_pool_free(st->root);
+	st->root = composed;
+	st->xor = NULL;
+
+	return composed;
+}
+
+/*
+ * The same as lookup_stored_bitmap() for a roaring .bitmap, but
+ * without decompressing: the bitmap is used where it is mapped, and
+ * only an XOR'd one is composed into a new roaring bitmap.
+ */
+static struct roaring_bitmap *lookup_stored_roaring(struct bitmap_index *index,
+						   struct stored_bitmap *st)
+{
+	struct roaring_bitmap *parent;
+	struct bitmap *composed;
+	uint32_t bit_size;
+
+	if (!st->roaring) {
+		CALLOC_ARRAY(st->roaring, 1);
+		if (roaring_read_mmap(st->roaring, index->map + st->map_pos,
+				      index->map_size - st->map_pos) < 0) {
+			FREE_AND_NULL(st->roaring);
+			error(_("unable to decode bitmap for commit '%s'"),
+			      oid_to_hex(&st->oid));
+			return NULL;
+		}
+		bitmaps_decoded_nr++;
+	}
+
+	if (!st->xor)
+		return st->roaring;
+
+	parent = lookup_stored_roaring(index, st->xor);
+	if (!parent)
+		return NULL;
+
+	composed = bitmap_new();
+	roaring_xor_into(st->roaring, composed);
+	roaring_xor_into(parent, composed);
+	bit_size = st->roaring->bit_size > parent->bit_size ?
+		st->roaring->bit_size : parent->bit_size;
+
+	roaring_release(st->roaring);
+	roaring_from_bitmap(st->roaring, composed, bit_size);
+	bitmap_free(composed);
+	st->xor = NULL;
+
+	return st->roaring;
+}
+
+/*
+ * Make sure "st" can be decoded, so that stored_bitmap_get() and
+ * stored_bitmap_or_into() can be used on it.
+ */
+static int decode_stored_bitmap(struct bitmap_index *index,
+				struct stored_bitmap *st)
+{
+	if (index->version == BITMAP_FORMAT_ROARING)
+		return lookup_stored_roaring(index, st) ? 0 : -1;
+	return lookup_stored_bitmap(index, st) ? 0 : -1;
+}
+
+static int stored_bitmap_get(struct bitmap_index *index,
+			     struct stored_bitmap *st, size_t pos)
+{
+	if (index->version == BITMAP_FORMAT_ROARING)
+		return roaring_get(lookup_stored_roaring(index, st), pos);
+	return ewah_bitmap_get(lookup_stored_bitmap(index, st), pos);
+}
+
+static void stored_bitmap_or_into(struct bitmap_index *index,
+				  struct stored_bitmap *st, struct bitmap *dst)
+{
+	if (index->version == BITMAP_FORMAT_ROARING)
+		roaring_or_into(lookup_stored_roaring(index, st), dst);
+	else
+		bitmap_or_ewah(dst, lookup_stored_bitmap(index, st));
 }
 
 static uint32_t bitmap_num_objects_total(struct bitmap_index *index)
@@ -233,7 +406,8 @@ static int load_bitmap_header(struct bitmap_index *index)
 		return error(_("corrupted bitmap index file (wrong header)"));
 
 	index->version = ntohs(header->version);
-	if (index->version != 1)
+	if (index->version != BITMAP_FORMAT_EWAH &&
+	    index->version != BITMAP_FORMAT_ROARING)
 		return error(_("unsupported version '%d' for bitmap index file"), index->version);
 
 	/* Parse known bitmap format options */
@@ -280,6 +454,7 @@ static int load_bitmap_header(struct bitmap_index *index)
 
 				index->pseudo_merges.map = index->map;
 				index->pseudo_merges.map_size = index->map_size;
+				index->pseudo_merges.format = index->version;
 				index->pseudo_merges.commits = ext + get_be64(index_end - 16);
 				index->pseudo_merges.commits_nr = get_be32(index_end - 20);
 				index->pseudo_merges.nr = get_be32(index_end - 24);
@@ -312,6 +487,7 @@ static int load_bitmap_header(struct bitmap_index *index)
 
 static struct stored_bitmap *store_bitmap(struct bitmap_index *index,
 					  struct ewah_bitmap *root,
+					  size_t map_pos,
 					  const struct object_id *oid,
 					  struct stored_bitmap *xor_with,
 					  int flags)
@@ -322,6 +498,8 @@ static struct stored_bitmap *store_bitmap(struct bitmap_index *index,
 
 	stored = xmalloc(sizeof(struct stored_bitmap));
 	stored->root = root;
+	stored->roaring = NULL;
+	stored->map_pos = map_pos;
 	stored->xor = xor_with;
 	stored->flags = flags;
 	oidcpy(&stored->oid, oid);
@@ -365,6 +543,11 @@ static int nth_bitmap_object_oid(struct bitmap_index *index,
 	return nth_packed_object_id(oid, index->pack, n);
 }
 
+/*
+ * Index the commit bitmaps by reading the header of each entry in
+ * turn. The bitmaps themselves are only skipped over, and decoded by
+ * lookup_stored_bitmap() once a query needs them.
+ */
 static int load_bitmap_entries_v1(struct bitmap_index *index)
 {
 	uint32_t i;
@@ -372,10 +555,11 @@ static int load_bitmap_entries_v1(struct bitmap_index *index)
 
 	for (i = 0; i < index->entry_count; ++i) {
 		int xor_offset, flags;
-		struct ewah_bitmap *bitmap = NULL;
 		struct stored_bitmap *xor_bitmap = NULL;
 		uint32_t commit_idx_pos;
 		struct object_id oid;
+		size_t bitmap_pos;
+		ssize_t bitmap_size;
 
 		if (index->map_size - index->map_pos < 6)
 			return error(_("corrupt ewah bitmap: truncated header for entry %d"), i);
@@ -398,12 +582,14 @@ static int load_bitmap_entries_v1(struct bitmap_index *index)
 				return error(_("invalid XOR offset in bitmap pack index"));
 		}
 
-		bitmap = read_bitmap_1(index);
-		if (!bitmap)
-			return -1;
+		bitmap_pos = index->map_pos;
+		bitmap_size = bitmap_serialized_size(index);
+		if (bitmap_size < 0)
+			return error(_("failed to load bitmap index (corrupted?)"));
+		index->map_pos += bitmap_size;
 
 		recent_bitmaps[i % MAX_XOR_OFFSET] = store_bitmap(
-			index, bitmap, &oid, xor_bitmap, flags);
+			index, NULL, bitmap_pos, &oid, xor_bitmap, flags);
 	}
 
 	return 0;
@@ -865,11 +1051,37 @@ static int bitmap_bsearch_triplet_by_pos(uint32_t commit_pos,
 	return bitmap_lookup_table_get_triplet_by_pointer(triplet, p);
 }
 
+/*
+ * Read the bitmap of the entry at the current position. An EWAH
+ * bitmap is decoded right away; a roaring one is only skipped over,
+ * to be used in place by lookup_stored_roaring().
+ */
+static int read_entry_bitmap(struct bitmap_index *index,
+			     struct ewah_bitmap **bitmap)
+{
+	if (index->version == BITMAP_FORMAT_ROARING) {
+		ssize_t size = bitmap_serialized_size(index);
+
+		if (size < 0)
+			return error(_("failed to load bitmap index (corrupted?)"));
+		index->map_pos += size;
+		*bitmap = NULL;
+		return 0;
+	}
+
+	*bitmap = read_bitmap_1(index);
+	if (!*bitmap)
+		return -1;
+	bitmaps_decoded_nr++;
+	return 0;
+}
+
 static struct stored_bitmap *lazy_bitmap_for_commit(struct bitmap_index *bitmap_git,
 						    struct commit *commit)
 {
 	uint32_t commit_pos, xor_row;
 	uint64_t offset;
+	size_t bitmap_pos;
 	int flags;
 	struct bitmap_lookup_table_triplet triplet;
 	struct object_id *oid = &commit->object.oid;
@@ -943,12 +1155,12 @@ static struct stored_bitmap *lazy_bitmap_for_commit(struct bitmap_index *bitmap_
 
 		bitmap_git->map_pos += sizeof(uint32_t) + sizeof(uint8_t);
 		xor_flags = read_u8(bitmap_git->map, &bitmap_git->map_pos);
-		bitmap = read_bitmap_1(bitmap_git);
-
-		if (!bitmap)
+		bitmap_pos = bitmap_git->map_pos;
+		if (read_entry_bitmap(bitmap_git, &bitmap) < 0)
 			goto corrupt;
 
-		xor_bitmap = store_bitmap(bitmap_git, bitmap, &xor_item->oid, xor_bitmap, xor_flags);
+		xor_bitmap = store_bitmap(bitmap_git, bitmap, bitmap_pos,
+					  &xor_item->oid, xor_bitmap, xor_flags);
 		xor_items_nr--;
 	}
 
@@ -984,12 +1196,12 @@ static struct stored_bitmap *lazy_bitmap_for_commit(struct bitmap_index *bitmap_
 	 */
 	bitmap_git->map_pos += sizeof(uint32_t) + sizeof(uint8_t);
 	flags = read_u8(bitmap_git->map, &bitmap_git->map_pos);
-	bitmap = read_bitmap_1(bitmap_git);
-
-	if (!bitmap)
+	bitmap_pos = bitmap_git->map_pos;
+	if (read_entry_bitmap(bitmap_git, &bitmap) < 0)
 		goto corrupt;
 
-	return store_bitmap(bitmap_git, bitmap, oid, xor_bitmap, flags);
+	return store_bitmap(bitmap_git, bitmap, bitmap_pos, oid, xor_bitmap,
+			    flags);
 
 corrupt:
 	free(xor_items);
@@ -997,34 +1209,54 @@ static struct stored_bitmap *lazy_bitmap_for_commit(struct bitmap_index *bitmap_
 	return NULL;
 }
 
-static struct ewah_bitmap *find_bitmap_for_commit(struct bitmap_index *bitmap_git,
-						  struct commit *commit,
-						  struct bitmap_index **found)
+/*
+ * Find the stored bitmap for "commit" in "bitmap_git" or one of its
+ * bases, and make sure it can be decoded. "*found" is set to the
+ * bitmap index it belongs to.
+ */
+static struct stored_bitmap *find_stored_bitmap(struct bitmap_index *bitmap_git,
+						struct commit *commit,
+						struct bitmap_index **found)
 {
+	struct stored_bitmap *bitmap;
 	khiter_t hash_pos;
 	if (!bitmap_git)
 		return NULL;
 
 	hash_pos = kh_get_oid_map(bitmap_git->bitmaps, commit->object.oid);
 	if (hash_pos >= kh_end(bitmap_git->bitmaps)) {
-		struct stored_bitmap *bitmap = NULL;
 		if (!bitmap_git->table_lookup)
-			return find_bitmap_for_commit(bitmap_git->base, commit,
-						      found);
+			return find_stored_bitmap(bitmap_git->base, commit,
+						  found);
 
 		/* this is a fairly hot codepath - no trace2_region please */
 		/* NEEDSWORK: cache misses aren't recorded */
 		bitmap = lazy_bitmap_for_commit(bitmap_git, commit);
 		if (!bitmap)
-			return find_bitmap_for_commit(bitmap_git->base, commit,
-						      found);
-		if (found)
-			*found = bitmap_git;
-		return lookup_stored_bitmap(bitmap);
+			return find_stored_bitmap(bitmap_git->base, commit,
+						  found);
+	} else {
+		bitmap = kh_value(bitmap_git->bitmaps, hash_pos);
 	}
+	if (decode_stored_bitmap(bitmap_git, bitmap) < 0)
+		return NULL;
+	*found = bitmap_git;
+	return bitmap;
+}
+
+static struct ewah_bitmap *find_bitmap_for_commit(struct bitmap_index *bitmap_git,
+						  struct commit *commit,
+						  struct bitmap_index **found)
+{
+	struct bitmap_index *in;
+	struct stored_bitmap *bitmap = find_stored_bitmap(bitmap_git, commit,
+							  &in);
+
+	if (!bitmap)
+		return NULL;
 	if (found)
-		*found = bitmap_git;
-	return lookup_stored_bitmap(kh_value(bitmap_git->bitmaps, hash_pos));
+		*found = in;
+	return lookup_stored_bitmap(in, bitmap);
 }
 
 struct ewah_bitmap *bitmap_for_commit(struct bitmap_index *bitmap_git,
@@ -1033,6 +1265,19 @@ struct ewah_bitmap *bitmap_for_commit(struct bitmap_index *bitmap_git,
 	return find_bitmap_for_commit(bitmap_git, commit, NULL);
 }
 
+int or_bitmap_for_commit(struct bitmap_index *bitmap_git,
+			 struct commit *commit, struct bitmap *dst)
+{
+	struct bitmap_index *in;
+	struct stored_bitmap *bitmap = find_stored_bitmap(bitmap_git, commit,
+							  &in);
+
+	if (!bitmap)
+		return 0;
+	stored_bitmap_or_into(in, bitmap, dst);
+	return 1;
+}
+
 static inline int bitmap_position_extended(struct bitmap_index *bitmap_git,
 					   const struct object_id *oid)
 {
@@ -1162,19 +1407,14 @@ static int add_to_include_set(struct bitmap_index *bitmap_git,
 			      struct commit *commit,
 			      int bitmap_pos)
 {
-	struct ewah_bitmap *partial;
-
 	if (data->seen && bitmap_get(data->seen, bitmap_pos))
 		return 0;
 
 	if (bitmap_get(data->base, bitmap_pos))
 		return 0;
 
-	partial = bitmap_for_commit(bitmap_git, commit);
-	if (partial) {
+	if (or_bitmap_for_commit(bitmap_git, commit, data->base)) {
 		existing_bitmaps_hits_nr++;
-
-		bitmap_or_ewah(data->base, partial);
 		return 0;
 	}
 
@@ -1233,7 +1473,9 @@ static int add_commit_to_bitmap(struct bitmap_index *bitmap_git,
 				struct bitmap **base,
 				struct commit *commit)
 {
-	struct ewah_bitmap *or_with = bitmap_for_commit(bitmap_git, commit);
+	struct bitmap_index *in;
+	struct stored_bitmap *or_with = find_stored_bitmap(bitmap_git, commit,
+							   &in);
 
 	if (!or_with) {
 		existing_bitmaps_misses_nr++;
@@ -1243,9 +1485,8 @@ static int add_commit_to_bitmap(struct bitmap_index *bitmap_git,
 	existing_bitmaps_hits_nr++;
 
 	if (!*base)
-		*base = ewah_to_bitmap(or_with);
-	else
-		bitmap_or_ewah(*base, or_with);
+		*base = bitmap_new();
+	stored_bitmap_or_into(in, or_with, *base);
 
 	return 1;
 }
@@ -2228,6 +2469,8 @@ struct bitmap_index *prepare_bitmap_walk(struct rev_info *revs,
 			   roots_with_bitmaps_nr);
 	trace2_data_intmax("bitmap", repo, "bitmap/roots_without_bitmap",
 			   roots_without_bitmaps_nr);
+	trace2_data_intmax("bitmap", repo, "bitmap/decoded",
+			   bitmaps_decoded_nr);
 
 	return bitmap_git;
 
@@ -2238,6 +2481,51 @@ struct bitmap_index *prepare_bitmap_walk(struct rev_info *revs,
 	return NULL;
 }
 
+/*
+ * Find the pseudo-pack position of the copy the MIDX picked for the
+ * object at "pack_pos" in "p", which lives in a different pack.
+ */
+static int cross_pack_base_pos(struct multi_pack_index *m,
+			       struct packed_git *p, uint32_t pack_pos,
+			       uint32_t *bitmap_pos)
+{
+	struct object_id oid;
+	uint32_t midx_pos;
+
+	if (nth_packed_object_id(&oid, p, pack_pos_to_index(p, pack_pos)) < 0)
+		return -1;
+	if (!bsearch_midx(&oid, m, &midx_pos))
+		return -1;
+	return midx_to_pack_pos(m, midx_pos, bitmap_pos);
+}
+
+/*
+ * Whether the copy the MIDX picked for the object at pseudo-pack
+ * position "bitmap_pos" is stored whole, and not as a delta.
+ */
+static int midx_object_is_whole(struct bitmap_index *bitmap_git,
+				uint32_t bitmap_pos)
+{
+	struct multi_pack_index *m = bitmap_git->midx;
+	uint32_t midx_pos = pack_pos_to_midx(m, bitmap_pos);
+	uint32_t pack_int_id = nth_midxed_pack_int_id(m, midx_pos);
+	off_t offset = nth_midxed_offset(m, midx_pos);
+	struct pack_window *w_curs = NULL;
+	struct packed_git *p;
+	enum object_type type;
+	unsigned long size;
+
+	if (prepare_midx_pack(bitmap_repo(bitmap_git), m, pack_int_id))
+		return 0;
+	p = nth_midxed_pack(m, pack_int_id);
+	if (!p || !is_pack_valid(p))
+		return 0;
+
+	type = unpack_object_header(p, &w_curs, &offset, &size);
+	unuse_pack(&w_curs);
+	return type > 0 && type != OBJ_OFS_DELTA && type != OBJ_REF_DELTA;
+}
+
 /*
  * -1 means "stop trying further objects"; 0 means we may or may not have
  * reused, but you can keep feeding bits.
@@ -2280,25 +2568,23 @@ static int try_partial_reuse(struct bitmap_index *bitmap_git,
 		if (!base_offset)
 			return 0;
 
-		offset_to_pack_pos(pack->p, base_offset, &base_pos);
-
 		if (bitmap_is_midx(bitmap_git)) {
 			/*
-			 * Cross-pack deltas are rejected for now, but could
-			 * theoretically be supported in the future.
-			 *
-			 * We would need to ensure that we're sending both
-			 * halves of the delta/base pair, regardless of whether
-			 * or not the two cross a pack boundary. If they do,
-			 * then we must convert the delta to an REF_DELTA to
-			 * refer back to the base in the other pack.
-			 * */
+			 * If the MIDX picked the copy of the base from
+			 * another pack, we can still send the delta, as long
+			 * as that copy is sent, too. The writer then turns
+			 * the delta into a REF_DELTA (see
+			 * write_reused_pack_one() in pack-objects).
+			 */
 			if (midx_pair_to_pack_pos(bitmap_git->midx,
 						  pack->pack_int_id,
 						  base_offset,
-						  &base_bitmap_pos) < 0) {
+						  &base_bitmap_pos) < 0 &&
+			    (offset_to_pack_pos(pack->p, base_offset,
+						&base_pos) < 0 ||
+			     cross_pack_base_pos(bitmap_git->midx, pack->p,
+						 base_pos, &base_bitmap_pos) < 0))
 				return 0;
-			}
 		} else {
 			if (offset_to_pack_pos(pack->p, base_offset,
 					       &base_pos) < 0)
@@ -2325,8 +2611,17 @@ static int try_partial_reuse(struct bitmap_index *bitmap_git,
 		 * necessarily in the pack, which means we'd need to convert
 		 * to REF_DELTA on the fly. Better to just let the normal
 		 * object_entry code path handle it.
+		 *
+		 * With a MIDX, we do convert to REF_DELTA on the fly when
+		 * the delta crosses packs anyway, so a base that is sent
+		 * later is fine, too. But only take one that is stored
+		 * whole: two packs storing a pair of objects as deltas
+		 * of each other must not turn into a cycle.
 		 */
-		if (!bitmap_get(reuse, base_bitmap_pos))
+		if (!bitmap_get(reuse, base_bitmap_pos) &&
+		    !(bitmap_is_midx(bitmap_git) &&
+		      bitmap_get(bitmap_git->result, base_bitmap_pos) &&
+		      midx_object_is_whole(bitmap_git, base_bitmap_pos)))
 			return 0;
 	}
 
@@ -2570,6 +2865,86 @@ int bitmap_walk_contains(struct bitmap_index *bitmap_git,
 	return idx >= 0 && bitmap_get(bitmap, idx);
 }
 
+int bitmap_commit_reachable_from(struct bitmap_index *bitmap_git,
+				 struct commit *commit, struct commit *tip)
+{
+	struct stored_bitmap *reach;
+	struct bitmap_index *curr, *in;
+	uint32_t total = bitmap_num_objects_total(bitmap_git);
+	int pos, tip_pos;
+
+	if (commit == tip)
+		return 1;
+
+	/*
+	 * Bitmaps have full closure, so an object missing from the
+	 * bitmapped pack(s) cannot be reachable from a bitmapped tip.
+	 */
+	pos = bitmap_position(bitmap_git, &commit->object.oid);
+	if (pos >= 0 && pos >= total)
+		pos = -1;
+
+	reach = find_stored_bitmap(bitmap_git, tip, &in);
+	if (reach)
+		return pos >= 0 && stored_bitmap_get(in, reach, pos);
+
+	/*
+	 * Without a bitmap of its own, "tip" may still be a parent of
+	 * a pseudo-merge which does not reach "commit".
+	 */
+	if (pos < 0)
+		return -1;
+	tip_pos = bitmap_position(bitmap_git, &tip->object.oid);
+	if (tip_pos < 0 || tip_pos >= total)
+		return -1;
+	for (curr = bitmap_git; curr; curr = curr->base)
+		if (pseudo_merges_exclude(&curr->pseudo_merges, tip,
+					  tip_pos, pos))
+			return 0;
+
+	return -1;
+}
+
+struct bitmap_index *repo_reachability_bitmap(struct repository *r)
+{
+	struct raw_object_store *o = r->objects;
+
+	if (!o->reachability_bitmap_attempted) {
+		o->reachability_bitmap_attempted = 1;
+		o->reachability_bitmap = prepare_bitmap_git(r);
+	}
+
+	return o->reachability_bitmap;
+}
+
+void invalidate_reachability_bitmap(struct raw_object_store *o)
+{
+	if (o->reachability_bitmap) {
+		ALLOC_GROW(o->stale_reachability_bitmaps,
+			   o->stale_reachability_bitmaps_nr + 1,
+			   o->stale_reachability_bitmaps_alloc);
+		o->stale_reachability_bitmaps[o->stale_reachability_bitmaps_nr++] =
+			o->reachability_bitmap;
+	}
+	o->reachability_bitmap = NULL;
+	o->reachability_bitmap_attempted = 0;
+}
+
+void close_reachability_bitmap(struct raw_object_store *o)
+{
+	size_t i;
+
+	for (i = 0; i < o->stale_reachability_bitmaps_nr; i++)
+		free_bitmap_index(o->stale_reachability_bitmaps[i]);
+	FREE_AND_NULL(o->stale_reachability_bitmaps);
+	o->stale_reachability_bitmaps_nr = 0;
+	o->stale_reachability_bitmaps_alloc = 0;
+
+	free_bitmap_index(o->reachability_bitmap);
+	o->reachability_bitmap = NULL;
+	o->reachability_bitmap_attempted = 0;
+}
+
 void traverse_bitmap_commit_list(struct bitmap_index *bitmap_git,
 				 struct rev_info *revs,
 				 show_reachable_fn show_reachable)
@@ -3022,6 +3397,113 @@ int test_bitmap_pseudo_merge_objects(struct repository *r, uint32_t n)
 	return ret;
 }
 
+static int count_bytes(void *data, const void *buf UNUSED, size_t len)
+{
+	*(size_t *)data += len;
+	return len;
+}
+
+static size_t ewah_and_popcount(struct ewah_bitmap *a, struct ewah_bitmap *b)
+{
+	struct ewah_iterator ia, ib;
+	eword_t wa, wb;
+	size_t count = 0;
+
+	ewah_iterator_init(&ia, a);
+	ewah_iterator_init(&ib, b);
+	while (ewah_iterator_next(&wa, &ia) && ewah_iterator_next(&wb, &ib))
+		count += ewah_bit_popcount64(wa & wb);
+	return count;
+}
+
+#define COMPARE_FORMATS_PROBES 1000
+
+int test_bitmap_compare_formats(struct repository *r)
+{
+	struct bitmap_index *bitmap_git = prepare_bitmap_git(r);
+	struct ewah_bitmap **ewah = NULL;
+	struct roaring_bitmap *roaring;
+	struct stored_bitmap *stored;
+	size_t nr = 0, alloc = 0, i, j;
+	size_t ewah_bytes = 0, roaring_bytes = 0;
+	uint64_t ewah_get_ns, roaring_get_ns, ewah_and_ns, roaring_and_ns;
+	size_t ewah_hits = 0, roaring_hits = 0;
+	size_t ewah_common = 0, roaring_common = 0;
+	uint32_t bits;
+
+	if (!bitmap_git)
+		die(_("failed to load bitmap indexes"));
+	if (bitmap_git->table_lookup &&
+	    load_bitmap_entries_v1(bitmap_git) < 0)
+		die(_("failed to load bitmap indexes"));
+
+	kh_foreach_value(bitmap_git->bitmaps, stored, {
+		ALLOC_GROW(ewah, nr + 1, alloc);
+		ewah[nr] = lookup_stored_bitmap(bitmap_git, stored);
+		if (!ewah[nr])
+			die(_("failed to decode bitmap for commit '%s'"),
+			    oid_to_hex(&stored->oid));
+		nr++;
+	});
+
+	CALLOC_ARRAY(roaring, nr);
+	for (i = 0; i < nr; i++) {
+		roaring_from_ewah(&roaring[i], ewah[i]);
+		ewah_serialize_to(ewah[i], count_bytes, &ewah_bytes);
+		roaring_serialize_to(&roaring[i], count_bytes, &roaring_bytes);
+	}
+
+	/*
+	 * Probe the same pseudo-random positions in each bitmap, and
+	 * intersect each bitmap with its neighbor, in both encodings.
+	 */
+	bits = bitmap_num_objects_total(bitmap_git);
+
+	ewah_get_ns = getnanotime();
+	for (i = 0; i < nr; i++)
+		for (j = 0; j < COMPARE_FORMATS_PROBES; j++)
+			ewah_hits += ewah_bitmap_get(ewah[i],
+						     (j * 2654435761u) % bits);
+	ewah_get_ns = getnanotime() - ewah_get_ns;
+
+	roaring_get_ns = getnanotime();
+	for (i = 0; i < nr; i++)
+		for (j = 0; j < COMPARE_FORMATS_PROBES; j++)
+			roaring_hits += roaring_get(&roaring[i],
+						    (j * 2654435761u) % bits);
+	roaring_get_ns = getnanotime() - roaring_get_ns;
+
+	ewah_and_ns = getnanotime();
+	for (i = 0; i + 1 < nr; i++)
+		ewah_common += ewah_and_popcount(ewah[i], ewah[i + 1]);
+	ewah_and_ns = getnanotime() - ewah_and_ns;
+
+	roaring_and_ns = getnanotime();
+	for (i = 0; i + 1 < nr; i++)
+		roaring_common += roaring_and_popcount(&roaring[i],
+						       &roaring[i + 1]);
+	roaring_and_ns = getnanotime() - roaring_and_ns;
+
+	if (ewah_hits != roaring_hits || ewah_common != roaring_common)
+		die(_("EWAH and roaring bitmaps disagree"));
+
+	printf("bitmaps: %"PRIuMAX"\n", (uintmax_t)nr);
+	printf("ewah: %"PRIuMAX" bytes, get %"PRIuMAX" ns, and %"PRIuMAX" ns\n",
+	       (uintmax_t)ewah_bytes, (uintmax_t)ewah_get_ns,
+	       (uintmax_t)ewah_and_ns);
+	printf("roaring: %"PRIuMAX" bytes, get %"PRIuMAX" ns, and %"PRIuMAX" ns\n",
+	       (uintmax_t)roaring_bytes, (uintmax_t)roaring_get_ns,
+	       (uintmax_t)roaring_and_ns);
+
+	for (i = 0; i < nr; i++)
+		roaring_release(&roaring[i]);
+	free(roaring);
+	free(ewah);
+	free_bitmap_index(bitmap_git);
+
+	return 0;
+}
+
 int rebuild_bitmap(const uint32_t *reposition,
 		   struct ewah_bitmap *source,
 		   struct bitmap *dest)
@@ -3110,6 +3592,9 @@ void free_bitmap_index(struct bitmap_index *b)
 		struct stored_bitmap *sb;
 		kh_foreach_value(b->bitmaps, sb, {
 			ewah_pool_free(sb->root);
+			if (sb->roaring)
+				roaring_release(sb->roaring);
+			free(sb->roaring);
 			free(sb);
 		});
 	}
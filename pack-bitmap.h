@@ -8,6 +8,7 @@
 #include "string-list.h"
 
 struct commit;
+struct raw_object_store;
 struct repository;
 struct rev_info;
 
@@ -40,6 +41,15 @@ enum pack_bitmap_opts {
 	BITMAP_OPT_PSEUDO_MERGES = 0x20,
 };
 
+/*
+ * The encoding used for the individual bitmaps in a .bitmap file,
+ * recorded as the version number in its header.
+ */
+enum bitmap_format {
+	BITMAP_FORMAT_EWAH = 1,
+	BITMAP_FORMAT_ROARING = 2,
+};
+
 enum pack_bitmap_flags {
 	BITMAP_FLAG_REUSE = 0x1
 };
@@ -85,6 +95,7 @@ int test_bitmap_hashes(struct repository *r);
 int test_bitmap_pseudo_merges(struct repository *r);
 int test_bitmap_pseudo_merge_commits(struct repository *r, uint32_t n);
 int test_bitmap_pseudo_merge_objects(struct repository *r, uint32_t n);
+int test_bitmap_compare_formats(struct repository *r);
 
 struct list_objects_filter_options;
 
@@ -114,6 +125,32 @@ void free_bitmap_index(struct bitmap_index *);
 int bitmap_walk_contains(struct bitmap_index *,
 			 struct bitmap *bitmap, const struct object_id *oid);
 
+/*
+ * Answer whether "commit" is reachable from "tip" using the
+ * reachability bitmaps alone: either the bitmap stored for "tip", or
+ * a pseudo-merge having "tip" as a parent. Returns 1 if it is
+ * reachable, 0 if it is not, and -1 if the bitmaps cannot tell and a
+ * commit walk is needed.
+ */
+int bitmap_commit_reachable_from(struct bitmap_index *bitmap_git,
+				 struct commit *commit, struct commit *tip);
+
+/*
+ * Return the bitmap index used for answering reachability queries in
+ * "r" (see commit-reach.c), loading it on first use, or NULL if the
+ * repository has none. It is owned by the object store and released
+ * by close_object_store().
+ */
+struct bitmap_index *repo_reachability_bitmap(struct repository *r);
+void close_reachability_bitmap(struct raw_object_store *o);
+
+/*
+ * Forget the bitmap index loaded by repo_reachability_bitmap(), so
+ * that the next call looks for one again; used when the set of packs
+ * may have changed.
+ */
+void invalidate_reachability_bitmap(struct raw_object_store *o);
+
 /*
  * After a traversal has been performed by prepare_bitmap_walk(), this can be
  * queried to see if a particular object was reachable from any of the
@@ -144,6 +181,8 @@ struct bitmap_writer {
 	struct progress *progress;
 	int show_progress;
 	unsigned char pack_checksum[GIT_MAX_RAWSZ];
+
+	enum bitmap_format format; /* from pack.bitmapFormat */
 };
 
 void bitmap_writer_init(struct bitmap_writer *writer, struct repository *r,
@@ -165,6 +204,13 @@ int rebuild_bitmap(const uint32_t *reposition,
 		   struct bitmap *dest);
 struct ewah_bitmap *bitmap_for_commit(struct bitmap_index *bitmap_git,
 				      struct commit *commit);
+
+/*
+ * OR the bitmap stored for "commit" into "dst", without decoding it
+ * into EWAH first. Returns 1 if there is such a bitmap, 0 otherwise.
+ */
+int or_bitmap_for_commit(struct bitmap_index *bitmap_git,
+			 struct commit *commit, struct bitmap *dst);
 struct ewah_bitmap *pseudo_merge_bitmap_for_commit(struct bitmap_index *bitmap_git,
 						   struct commit *commit);
 void bitmap_writer_select_commits(struct bitmap_writer *writer,
@@ -186,6 +232,11 @@ int bitmap_is_preferred_refname(struct repository *r, const char *refname);
 
 int verify_bitmap_files(struct repository *r);
 
+/*
+ * Read a single bitmap encoded in the given format from "map" at
+ * "*map_pos", advancing "*map_pos" past it.
+ */
 struct ewah_bitmap *read_bitmap(const unsigned char *map,
-				size_t map_size, size_t *map_pos);
+				size_t map_size, size_t *map_pos,
+				enum bitmap_format format);
 #endif
@@ -1,4 +1,5 @@
 #include "git-compat-util.h"
+#include "gettext.h"
 #include "object.h"
 #include "pack.h"
 #include "pack-objects.h"
@@ -148,6 +149,9 @@ void prepare_packing_data(struct repository *r, struct packing_data *pdata)
 					     1U << OE_SIZE_BITS);
 	pdata->oe_delta_size_limit = git_env_ulong("GIT_TEST_OE_DELTA_SIZE",
 						   1UL << OE_DELTA_SIZE_BITS);
+	pdata->oe_offset_limit = git_env_ulong("GIT_TEST_OE_OFFSET", 0);
+	if (!pdata->oe_offset_limit)
+		pdata->oe_offset_limit = (uintmax_t)1 << (32 + OE_IN_PACK_OFFSET_HI_BITS);
 	init_recursive_mutex(&pdata->odb_lock);
 }
 
@@ -160,6 +164,14 @@ void clear_packing_data(struct packing_data *pdata)
 	free(pdata->in_pack);
 	free(pdata->in_pack_by_idx);
 	free(pdata->in_pack_pos);
+	free(pdata->in_pack_offset);
+	free(pdata->delta_size);
+	if (pdata->delta_data) {
+		for (size_t i = 0; i <= pdata->nr_delta_data >> OE_DELTA_DATA_CHUNK_BITS; i++)
+			free(pdata->delta_data[i]);
+		free(pdata->delta_data);
+	}
+	free(pdata->free_delta_data);
 	free(pdata->index);
 	free(pdata->layer);
 	free(pdata->objects);
@@ -179,6 +191,8 @@ struct object_entry *packlist_alloc(struct packing_data *pdata,
 			REALLOC_ARRAY(pdata->in_pack, pdata->nr_alloc);
 		if (pdata->delta_size)
 			REALLOC_ARRAY(pdata->delta_size, pdata->nr_alloc);
+		if (pdata->in_pack_offset)
+			REALLOC_ARRAY(pdata->in_pack_offset, pdata->nr_alloc);
 
 		if (pdata->tree_depth)
 			REALLOC_ARRAY(pdata->tree_depth, pdata->nr_alloc);
@@ -222,6 +236,86 @@ struct object_entry *packlist_alloc(struct packing_data *pdata,
 	return new_entry;
 }
 
+void oe_set_delta_data(struct packing_data *pack,
+		       struct object_entry *e,
+		       void *data)
+{
+	uint32_t slot = e->delta_data_slot;
+
+	if (!data) {
+		if (!slot)
+			return;
+		/* forget the slot before anybody else can be handed it */
+		e->delta_data_slot = 0;
+		pack->delta_data[slot >> OE_DELTA_DATA_CHUNK_BITS]
+				[slot & OE_DELTA_DATA_CHUNK_MASK] = NULL;
+		packing_data_lock(pack);
+		ALLOC_GROW(pack->free_delta_data, pack->nr_free_delta_data + 1,
+			   pack->alloc_free_delta_data);
+		pack->free_delta_data[pack->nr_free_delta_data++] = slot;
+		packing_data_unlock(pack);
+		return;
+	}
+
+	if (!slot) {
+		packing_data_lock(pack);
+		if (pack->nr_free_delta_data) {
+			slot = pack->free_delta_data[--pack->nr_free_delta_data];
+		} else {
+			void ***chunk;
+
+			if (!pack->delta_data)
+				CALLOC_ARRAY(pack->delta_data,
+					     1U << (32 - OE_DELTA_DATA_CHUNK_BITS));
+			/* slot 0 means "none" */
+			if (!pack->nr_delta_data)
+				pack->nr_delta_data = 1;
+			if (pack->nr_delta_data == UINT32_MAX)
+				die(_("too many cached deltas"));
+			slot = pack->nr_delta_data++;
+
+			chunk = &pack->delta_data[slot >> OE_DELTA_DATA_CHUNK_BITS];
+			if (!*chunk)
+				CALLOC_ARRAY(*chunk, 1U << OE_DELTA_DATA_CHUNK_BITS);
+		}
+		packing_data_unlock(pack);
+		e->delta_data_slot = slot;
+	}
+
+	pack->delta_data[slot >> OE_DELTA_DATA_CHUNK_BITS]
+			[slot & OE_DELTA_DATA_CHUNK_MASK] = data;
+}
+
+size_t packing_data_memory(const struct packing_data *pdata)
+{
+	size_t total = 0;
+
+	total += st_mult(pdata->nr_alloc, sizeof(*pdata->objects));
+	total += st_mult(pdata->index_size, sizeof(*pdata->index));
+	if (pdata->in_pack)
+		total += st_mult(pdata->nr_alloc, sizeof(*pdata->in_pack));
+	if (pdata->in_pack_pos)
+		total += st_mult(pdata->nr_objects, sizeof(*pdata->in_pack_pos));
+	if (pdata->delta_size)
+		total += st_mult(pdata->nr_alloc, sizeof(*pdata->delta_size));
+	if (pdata->in_pack_offset)
+		total += st_mult(pdata->nr_alloc, sizeof(*pdata->in_pack_offset));
+	if (pdata->tree_depth)
+		total += st_mult(pdata->nr_alloc, sizeof(*pdata->tree_depth));
+	if (pdata->layer)
+		total += st_mult(pdata->nr_alloc, sizeof(*pdata->layer));
+	if (pdata->cruft_mtime)
+		total += st_mult(pdata->nr_alloc, sizeof(*pdata->cruft_mtime));
+	if (pdata->delta_data) {
+		size_t chunks = (pdata->nr_delta_data >> OE_DELTA_DATA_CHUNK_BITS) + 1;
+		total += sizeof(void **) << (32 - OE_DELTA_DATA_CHUNK_BITS);
+		total += st_mult(chunks, sizeof(void *) << OE_DELTA_DATA_CHUNK_BITS);
+	}
+	total += st_mult(pdata->alloc_free_delta_data, sizeof(*pdata->free_delta_data));
+	total += st_mult(pdata->alloc_ext, sizeof(*pdata->ext_bases));
+	return total;
+}
+
 void oe_set_delta_ext(struct packing_data *pdata,
 		      struct object_entry *delta,
 		      const struct object_id *oid)
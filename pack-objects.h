@@ -10,6 +10,7 @@ struct repository;
 
 #define DEFAULT_DELTA_CACHE_SIZE       (256 * 1024 * 1024)
 #define DEFAULT_DELTA_BASE_CACHE_LIMIT (96 * 1024 * 1024)
+#define DEFAULT_DELTA_INDEX_CACHE_LIMIT (64 * 1024 * 1024)
 
 #define OE_DFS_STATE_BITS	2
 #define OE_DEPTH_BITS		12
@@ -21,6 +22,13 @@ struct repository;
  */
 #define OE_SIZE_BITS		31
 #define OE_DELTA_SIZE_BITS	23
+/*
+ * Offsets into the source pack are stored in 32 + OE_IN_PACK_OFFSET_HI_BITS
+ * bits; larger ones go to a separate array.
+ */
+#define OE_IN_PACK_OFFSET_HI_BITS	7
+/* cached delta slots are allocated in chunks of this many bits */
+#define OE_DELTA_DATA_CHUNK_BITS	16
 
 /*
  * State flags for depth-first search used for analyzing delta cycles.
@@ -62,7 +70,9 @@ enum dfs_state {
  * ----------------
  * The (in_pack, in_pack_offset) tuple contains the location of the
  * object in the source pack. in_pack_header_size allows quickly
- * skipping the header and going straight to the zlib stream.
+ * skipping the header and going straight to the zlib stream. The
+ * offset is only accessed through oe_in_pack_offset(), as offsets past
+ * 2^(32 + OE_IN_PACK_OFFSET_HI_BITS) are not stored in the entry.
  *
  * "type" and "in_pack_type" both describe object type. in_pack_type
  * may contain a delta type, while type is always the canonical type.
@@ -77,19 +87,21 @@ enum dfs_state {
  * compute_write_order(). "delta" and "delta_size" must remain valid
  * at object writing phase in case the delta is not cached.
  *
- * If a delta is cached in memory and is compressed, delta_data points
- * to the data and z_delta_size contains the compressed size. If it's
- * uncompressed [1], z_delta_size must be zero. delta_size is always
- * the uncompressed size and must be valid even if the delta is not
- * cached.
+ * If a delta is cached in memory and is compressed, oe_delta_data()
+ * returns the data and z_delta_size contains the compressed size. If
+ * it's uncompressed [1], z_delta_size must be zero. delta_size is
+ * always the uncompressed size and must be valid even if the delta is
+ * not cached. Only few objects have a cached delta at any time, so the
+ * entry only stores the number of a slot in packing_data holding the
+ * pointer.
  *
  * [1] during try_delta phase we don't bother with compressing because
  * the delta could be quickly replaced with a better one.
  */
 struct object_entry {
 	struct pack_idx_entry idx;
-	void *delta_data;	/* cached delta (uncompressed) */
-	off_t in_pack_offset;
+	uint32_t delta_data_slot;	/* cached delta, see oe_delta_data() */
+	uint32_t in_pack_offset_;	/* low 32 bits, see oe_in_pack_offset() */
 	uint32_t hash;			/* name hint hash */
 	unsigned size_:OE_SIZE_BITS;
 	unsigned size_valid:1;
@@ -118,6 +130,8 @@ struct object_entry {
 	unsigned dfs_state:OE_DFS_STATE_BITS;
 	unsigned depth:OE_DEPTH_BITS;
 	unsigned ext_base:1; /* delta_idx points outside packlist */
+	unsigned in_pack_offset_hi_:OE_IN_PACK_OFFSET_HI_BITS;
+	unsigned in_pack_offset_big:1; /* offset is in in_pack_offset[] */
 };
 
 struct packing_data {
@@ -130,6 +144,18 @@ struct packing_data {
 
 	unsigned int *in_pack_pos;
 	unsigned long *delta_size;
+	off_t *in_pack_offset;
+
+	/*
+	 * Cached deltas, indexed by object_entry.delta_data_slot. Slots
+	 * live in chunks of 2^OE_DELTA_DATA_CHUNK_BITS that never move
+	 * once allocated, so that threads may read their own slots while
+	 * others allocate new ones (under packing_data_lock()).
+	 */
+	void ***delta_data;
+	uint32_t nr_delta_data;
+	uint32_t *free_delta_data;
+	uint32_t nr_free_delta_data, alloc_free_delta_data;
 
 	/*
 	 * Only one of these can be non-NULL and they have different
@@ -156,6 +182,7 @@ struct packing_data {
 
 	uintmax_t oe_size_limit;
 	uintmax_t oe_delta_size_limit;
+	uintmax_t oe_offset_limit;
 
 	/* delta islands */
 	unsigned int *tree_depth;
@@ -173,6 +200,12 @@ struct packing_data {
 void prepare_packing_data(struct repository *r, struct packing_data *pdata);
 void clear_packing_data(struct packing_data *pdata);
 
+/*
+ * Return the number of bytes allocated for the bookkeeping of the
+ * objects in "pdata", not counting cached deltas.
+ */
+size_t packing_data_memory(const struct packing_data *pdata);
+
 /* Protect access to object database */
 static inline void packing_data_lock(struct packing_data *pdata)
 {
@@ -301,6 +334,54 @@ void oe_set_delta_ext(struct packing_data *pack,
 		      struct object_entry *e,
 		      const struct object_id *oid);
 
+static inline off_t oe_in_pack_offset(const struct packing_data *pack,
+				      const struct object_entry *e)
+{
+	if (e->in_pack_offset_big)
+		return pack->in_pack_offset[e - pack->objects];
+	return ((off_t)e->in_pack_offset_hi_ << 32) | e->in_pack_offset_;
+}
+
+static inline void oe_set_in_pack_offset(struct packing_data *pack,
+					 struct object_entry *e,
+					 off_t offset)
+{
+	if ((uintmax_t)offset < pack->oe_offset_limit) {
+		e->in_pack_offset_ = (uint32_t)offset;
+		e->in_pack_offset_hi_ = (uintmax_t)offset >> 32;
+		e->in_pack_offset_big = 0;
+	} else {
+		packing_data_lock(pack);
+		if (!pack->in_pack_offset)
+			ALLOC_ARRAY(pack->in_pack_offset, pack->nr_alloc);
+		packing_data_unlock(pack);
+
+		pack->in_pack_offset[e - pack->objects] = offset;
+		e->in_pack_offset_big = 1;
+	}
+}
+
+#define OE_DELTA_DATA_CHUNK_MASK ((1U << OE_DELTA_DATA_CHUNK_BITS) - 1)
+
+static inline void *oe_delta_data(const struct packing_data *pack,
+				  const struct object_entry *e)
+{
+	uint32_t slot = e->delta_data_slot;
+
+	if (!slot)
+		return NULL;
+	return pack->delta_data[slot >> OE_DELTA_DATA_CHUNK_BITS]
+			       [slot & OE_DELTA_DATA_CHUNK_MASK];
+}
+
+/*
+ * Cache "data" as the delta of "e", or forget the cached delta if "data"
+ * is NULL. The caller owns the memory of the previous one, if any.
+ */
+void oe_set_delta_data(struct packing_data *pack,
+		       struct object_entry *e,
+		       void *data);
+
 static inline unsigned int oe_tree_depth(struct packing_data *pack,
 					 struct object_entry *e)
 {
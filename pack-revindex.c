@@ -9,6 +9,7 @@
 #include "repository.h"
 #include "midx.h"
 #include "csum-file.h"
+#include "chunk-format.h"
 
 struct revindex_entry {
 	off_t offset;
@@ -253,7 +254,7 @@ static int load_revindex_from_disk(const struct git_hash_algo *algo,
 			    revindex_name, ntohl(hdr->version));
 		goto cleanup;
 	}
-	if (!(ntohl(hdr->hash_id) == 1 || ntohl(hdr->hash_id) == 2)) {
+	if (ntohl(hdr->hash_id) != oid_version(algo)) {
 		ret = error(_("reverse-index file %s has unsupported hash id %"PRIu32),
 			    revindex_name, ntohl(hdr->hash_id));
 		goto cleanup;
@@ -25,6 +25,7 @@
 #include "pack-revindex.h"
 #include "promisor-remote.h"
 #include "pack-mtimes.h"
+#include "pack-bitmap.h"
 
 char *odb_pack_name(struct repository *r, struct strbuf *buf,
 		    const unsigned char *hash, const char *ext)
@@ -363,6 +364,9 @@ void close_object_store(struct raw_object_store *o)
 {
 	struct packed_git *p;
 
+	/* the bitmaps still refer to the packs and the MIDX */
+	close_reachability_bitmap(o);
+
 	for (p = o->packed_git; p; p = p->next)
 		if (p->do_not_close)
 			BUG("want to close pack marked 'do-not-close'");
@@ -1055,6 +1059,7 @@ void reprepare_packed_git(struct repository *r)
 
 	r->objects->approximate_object_count_valid = 0;
 	r->objects->packed_git_initialized = 0;
+	invalidate_reachability_bitmap(r->objects);
 	prepare_packed_git(r);
 	obj_read_unlock();
 }
@@ -3,9 +3,11 @@
 
 #include "git-compat-util.h"
 #include "config.h"
+#include "copy.h"
 #include "entry.h"
 #include "gettext.h"
 #include "hash.h"
+#include "hashmap.h"
 #include "hex.h"
 #include "parallel-checkout.h"
 #include "pkt-line.h"
@@ -27,6 +29,11 @@ struct parallel_checkout {
 	enum pc_status status;
 	struct parallel_checkout_item *items; /* The parallel checkout queue. */
 	size_t nr, alloc;
+	/*
+	 * The order in which the items are sent to the workers, as
+	 * positions in items[]; see group_identical_items().
+	 */
+	size_t *order;
 	struct progress *progress;
 	unsigned int *progress_cnt;
 };
@@ -74,13 +81,72 @@ void init_parallel_checkout(void)
 	parallel_checkout.status = PC_ACCEPTING_ENTRIES;
 }
 
+/*
+ * The item written last by this process. Items with the same contents
+ * (e.g. vendored copies of the same files) are often written one after
+ * the other (see group_identical_items()), and then only the first one
+ * needs to be inflated and converted; the others are cloned or copied
+ * from the file written for it.
+ */
+static struct {
+	char *path;
+	struct object_id oid;
+	enum convert_crlf_action crlf_action;
+	int ident;
+	char *working_tree_encoding;
+} last_written;
+
+static int clone_unsupported;
+static intmax_t nr_cloned, nr_copied;
+
+void finish_writing_pc_items(void)
+{
+	if (nr_cloned)
+		trace2_data_intmax("pcheckout", NULL, "reuse/cloned", nr_cloned);
+	if (nr_copied)
+		trace2_data_intmax("pcheckout", NULL, "reuse/copied", nr_copied);
+	nr_cloned = nr_copied = 0;
+	FREE_AND_NULL(last_written.path);
+	FREE_AND_NULL(last_written.working_tree_encoding);
+}
+
+static int same_encoding(const char *a, const char *b)
+{
+	return !strcmp(a ? a : "", b ? b : "");
+}
+
+static void set_last_written(const struct parallel_checkout_item *pc_item,
+			     const char *path)
+{
+	free(last_written.path);
+	free(last_written.working_tree_encoding);
+	last_written.path = xstrdup(path);
+	oidcpy(&last_written.oid, &pc_item->ce->oid);
+	last_written.crlf_action = pc_item->ca.crlf_action;
+	last_written.ident = pc_item->ca.ident;
+	last_written.working_tree_encoding =
+		xstrdup_or_null(pc_item->ca.working_tree_encoding);
+}
+
+static int same_as_last_written(const struct parallel_checkout_item *pc_item)
+{
+	return last_written.path &&
+	       oideq(&last_written.oid, &pc_item->ce->oid) &&
+	       last_written.crlf_action == pc_item->ca.crlf_action &&
+	       last_written.ident == pc_item->ca.ident &&
+	       same_encoding(last_written.working_tree_encoding,
+			     pc_item->ca.working_tree_encoding);
+}
+
 static void finish_parallel_checkout(void)
 {
 	if (parallel_checkout.status == PC_UNINITIALIZED)
 		BUG("cannot finish parallel checkout: not initialized yet");
 
 	free(parallel_checkout.items);
+	free(parallel_checkout.order);
 	memset(&parallel_checkout, 0, sizeof(parallel_checkout));
+	finish_writing_pc_items();
 }
 
 static int is_eligible_for_parallel_checkout(const struct cache_entry *ce,
@@ -266,6 +332,38 @@ static int reset_fd(int fd, const char *path)
 	return 0;
 }
 
+/*
+ * Fill "fd" with the contents of the file written last, cloning it if
+ * the file system allows. Returns 0 on success, 1 if the item should
+ * be written the usual way instead, or -1 on error.
+ */
+static int reuse_last_written(int fd, const char *path)
+{
+	int src, ret;
+
+	src = open(last_written.path, O_RDONLY);
+	if (src < 0)
+		return 1;
+
+	if (!clone_unsupported) {
+		if (!xclone_fd(fd, src)) {
+			close(src);
+			nr_cloned++;
+			return 0;
+		}
+		/* e.g. EOPNOTSUPP or EXDEV; do not try again */
+		clone_unsupported = 1;
+	}
+
+	ret = copy_fd(src, fd);
+	close(src);
+	if (!ret) {
+		nr_copied++;
+		return 0;
+	}
+	return reset_fd(fd, path) ? -1 : 1;
+}
+
 static int write_pc_item_to_fd(struct parallel_checkout_item *pc_item, int fd,
 			       const char *path)
 {
@@ -279,6 +377,12 @@ static int write_pc_item_to_fd(struct parallel_checkout_item *pc_item, int fd,
 	/* Sanity check */
 	ASSERT(is_eligible_for_parallel_checkout(pc_item->ce, &pc_item->ca));
 
+	if (same_as_last_written(pc_item)) {
+		ret = reuse_last_written(fd, path);
+		if (ret <= 0)
+			return ret;
+	}
+
 	filter = get_stream_filter_ca(&pc_item->ca, &pc_item->ce->oid);
 	if (filter) {
 		if (stream_blob_to_fd(fd, &pc_item->ce->oid, filter, 1)) {
@@ -401,6 +505,7 @@ void write_pc_item(struct parallel_checkout_item *pc_item,
 	}
 
 	pc_item->status = PC_ITEM_WRITTEN;
+	set_last_written(pc_item, path.buf);
 
 out:
 	strbuf_release(&path);
@@ -446,12 +551,87 @@ static void send_one_item(int fd, struct parallel_checkout_item *pc_item)
 	free(data);
 }
 
+struct pc_item_group {
+	struct hashmap_entry ent;
+	const struct parallel_checkout_item *first;
+	size_t last; /* the position of the latest item of the group */
+};
+
+static int pc_item_group_cmp(const void *cmp_data UNUSED,
+			     const struct hashmap_entry *eptr,
+			     const struct hashmap_entry *entry_or_key,
+			     const void *keydata UNUSED)
+{
+	const struct parallel_checkout_item *a, *b;
+
+	a = container_of(eptr, const struct pc_item_group, ent)->first;
+	b = container_of(entry_or_key, const struct pc_item_group, ent)->first;
+	return !oideq(&a->ce->oid, &b->ce->oid) ||
+	       a->ca.crlf_action != b->ca.crlf_action ||
+	       a->ca.ident != b->ca.ident ||
+	       !same_encoding(a->ca.working_tree_encoding,
+			      b->ca.working_tree_encoding);
+}
+
+/*
+ * Decide the order in which the items are handed to the workers: the
+ * queue order, except that items which would be written with the same
+ * contents are moved up right behind the first of them. They then
+ * (mostly) go to the same worker, one after the other, which only has
+ * to inflate and convert the blob once.
+ */
+static void group_identical_items(void)
+{
+	struct hashmap groups = HASHMAP_INIT(pc_item_group_cmp, NULL);
+	struct pc_item_group *group;
+	struct hashmap_iter iter;
+	size_t *next, i, j, nr = 0;
+	char *is_duplicate;
+
+	ALLOC_ARRAY(next, parallel_checkout.nr);
+	CALLOC_ARRAY(is_duplicate, parallel_checkout.nr);
+	for (i = 0; i < parallel_checkout.nr; i++) {
+		struct pc_item_group key, *found;
+
+		next[i] = SIZE_MAX;
+		key.first = &parallel_checkout.items[i];
+		hashmap_entry_init(&key.ent, oidhash(&key.first->ce->oid));
+		found = hashmap_get_entry(&groups, &key, ent, NULL);
+		if (found) {
+			next[found->last] = i;
+			found->last = i;
+			is_duplicate[i] = 1;
+		} else {
+			group = xmalloc(sizeof(*group));
+			*group = key;
+			group->last = i;
+			hashmap_add(&groups, &group->ent);
+		}
+	}
+
+	ALLOC_ARRAY(parallel_checkout.order, parallel_checkout.nr);
+	for (i = 0; i < parallel_checkout.nr; i++) {
+		if (is_duplicate[i])
+			continue;
+		for (j = i; j != SIZE_MAX; j = next[j])
+			parallel_checkout.order[nr++] = j;
+	}
+
+	hashmap_for_each_entry(&groups, &iter, group, ent)
+		free(group);
+	hashmap_clear(&groups);
+	free(next);
+	free(is_duplicate);
+}
+
 static void send_batch(int fd, size_t start, size_t nr)
 {
 	size_t i;
 	sigchain_push(SIGPIPE, SIG_IGN);
-	for (i = 0; i < nr; i++)
-		send_one_item(fd, &parallel_checkout.items[start + i]);
+	for (i = 0; i < nr; i++) {
+		size_t pos = parallel_checkout.order[start + i];
+		send_one_item(fd, &parallel_checkout.items[pos]);
+	}
 	packet_flush(fd);
 	sigchain_pop(SIGPIPE);
 }
@@ -564,9 +744,10 @@ static void parse_and_save_result(const char *buffer, int len,
 
 	if (!worker->nr_items_to_complete)
 		BUG("received result from supposedly finished checkout worker");
-	if (res->id != worker->next_item_to_complete)
+	if (res->id != parallel_checkout.order[worker->next_item_to_complete])
 		BUG("unexpected item id from checkout worker (got %"PRIuMAX", exp %"PRIuMAX")",
-		    (uintmax_t)res->id, (uintmax_t)worker->next_item_to_complete);
+		    (uintmax_t)res->id,
+		    (uintmax_t)parallel_checkout.order[worker->next_item_to_complete]);
 
 	worker->next_item_to_complete++;
 	worker->nr_items_to_complete--;
@@ -665,7 +846,10 @@ int run_parallel_checkout(struct checkout *state, int num_workers, int threshold
 	if (num_workers <= 1 || parallel_checkout.nr < threshold) {
 		write_items_sequentially(state);
 	} else {
-		struct pc_worker *workers = setup_workers(state, num_workers);
+		struct pc_worker *workers;
+
+		group_identical_items();
+		workers = setup_workers(state, num_workers);
 		gather_results_from_workers(workers, num_workers);
 		finish_workers(workers, num_workers);
 	}
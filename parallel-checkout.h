@@ -110,4 +110,12 @@ struct pc_item_result {
 void write_pc_item(struct parallel_checkout_item *pc_item,
 		   struct checkout *state);
 
+/*
+ * To be called after the last write_pc_item() of a process. Items
+ * with the same contents as the one written just before them are
+ * cloned or copied from its file; this reports how many were, and
+ * forgets the last item.
+ */
+void finish_writing_pc_items(void);
+
 #endif /* PARALLEL_CHECKOUT_H */
@@ -0,0 +1,284 @@
+#include "git-compat-util.h"
+#include "dir.h"
+#include "hashmap.h"
+#include "parse.h"
+#include "pattern-matcher.h"
+
+/*
+ * Lists shorter than this are scanned as they are.
+ */
+#define PATTERN_MATCHER_MIN_PATTERNS 16
+
+/*
+ * The positions of the patterns filed under one key, in increasing
+ * order. In the directory trie, a bucket is also a node and
+ * "children" holds the buckets for its subdirectories.
+ */
+struct pattern_bucket {
+	struct hashmap_entry ent;
+	struct hashmap children;
+	int *pos;
+	size_t nr, alloc;
+	size_t keylen;
+	char key[FLEX_ARRAY];
+};
+
+/*
+ * Buckets keyed by a part of the basename whose length varies from
+ * pattern to pattern; "lens" lists the lengths in use, so a lookup
+ * only tries those.
+ */
+struct pattern_length_map {
+	struct hashmap map;
+	size_t *lens;
+	size_t lens_nr, lens_alloc;
+};
+
+struct pattern_matcher {
+	struct hashmap basenames;
+	struct pattern_length_map suffixes;
+	struct pattern_length_map prefixes;
+	struct pattern_bucket *root;
+	int *fallback;
+	size_t fallback_nr, fallback_alloc;
+};
+
+int pattern_matcher_wanted(int nr)
+{
+	static int min_patterns = -1;
+
+	if (min_patterns < 0)
+		min_patterns = git_env_bool("GIT_TEST_PATTERN_MATCHER", 0) ?
+			1 : PATTERN_MATCHER_MIN_PATTERNS;
+	return nr >= min_patterns;
+}
+
+static int bucket_cmp(const void *cmp_data UNUSED,
+		      const struct hashmap_entry *eptr,
+		      const struct hashmap_entry *entry_or_key,
+		      const void *keydata)
+{
+	const struct pattern_bucket *a, *b;
+
+	a = container_of(eptr, const struct pattern_bucket, ent);
+	b = container_of(entry_or_key, const struct pattern_bucket, ent);
+	if (a->keylen != b->keylen)
+		return 1;
+	return strncasecmp(a->key, keydata ? keydata : b->key, a->keylen);
+}
+
+static struct pattern_bucket *find_bucket(const struct hashmap *map,
+					  const char *key, size_t keylen)
+{
+	struct pattern_bucket k;
+
+	if (!map->tablesize)
+		return NULL;
+	hashmap_entry_init(&k.ent, memihash(key, keylen));
+	k.keylen = keylen;
+	return hashmap_get_entry(map, &k, ent, key);
+}
+
+static struct pattern_bucket *get_bucket(struct hashmap *map,
+					 const char *key, size_t keylen)
+{
+	struct pattern_bucket *b;
+
+	if (!map->tablesize)
+		hashmap_init(map, bucket_cmp, NULL, 0);
+	b = find_bucket(map, key, keylen);
+	if (!b) {
+		FLEX_ALLOC_MEM(b, key, key, keylen);
+		b->keylen = keylen;
+		hashmap_entry_init(&b->ent, memihash(key, keylen));
+		hashmap_add(map, &b->ent);
+	}
+	return b;
+}
+
+static void bucket_add(struct pattern_bucket *b, int pos)
+{
+	if (b->nr && b->pos[b->nr - 1] >= pos)
+		BUG("patterns must be added in order");
+	ALLOC_GROW(b->pos, b->nr + 1, b->alloc);
+	b->pos[b->nr++] = pos;
+}
+
+static void free_buckets(struct hashmap *map);
+
+static void free_bucket(struct pattern_bucket *b)
+{
+	if (!b)
+		return;
+	free_buckets(&b->children);
+	free(b->pos);
+	free(b);
+}
+
+static void free_buckets(struct hashmap *map)
+{
+	struct hashmap_iter iter;
+	struct pattern_bucket *b;
+
+	if (!map->tablesize)
+		return;
+	hashmap_for_each_entry(map, &iter, b, ent)
+		free_bucket(b);
+	hashmap_clear(map);
+}
+
+static void length_map_add(struct pattern_length_map *lm,
+			   const char *key, size_t keylen, int pos)
+{
+	size_t i;
+
+	for (i = 0; i < lm->lens_nr && lm->lens[i] < keylen; i++)
+		; /* keep the lengths sorted */
+	if (i == lm->lens_nr || lm->lens[i] != keylen) {
+		ALLOC_GROW(lm->lens, lm->lens_nr + 1, lm->lens_alloc);
+		MOVE_ARRAY(lm->lens + i + 1, lm->lens + i, lm->lens_nr - i);
+		lm->lens[i] = keylen;
+		lm->lens_nr++;
+	}
+	bucket_add(get_bucket(&lm->map, key, keylen), pos);
+}
+
+struct pattern_matcher *pattern_matcher_new(void)
+{
+	struct pattern_matcher *m;
+
+	CALLOC_ARRAY(m, 1);
+	FLEX_ALLOC_MEM(m->root, key, "", 0);
+	return m;
+}
+
+void pattern_matcher_free(struct pattern_matcher *m)
+{
+	if (!m)
+		return;
+	free_buckets(&m->basenames);
+	free_buckets(&m->suffixes.map);
+	free(m->suffixes.lens);
+	free_buckets(&m->prefixes.map);
+	free(m->prefixes.lens);
+	free_bucket(m->root);
+	free(m->fallback);
+	free(m);
+}
+
+/*
+ * File a pattern containing a slash under the directories leading
+ * to its first wildcard, e.g. "/doc/api-*.html" from "sub/.gitignore"
+ * under "sub/doc/".
+ */
+static void add_anchored(struct pattern_matcher *m, int pos,
+			 const char *base, int baselen,
+			 const char *pattern, int prefix)
+{
+	struct pattern_bucket *node = m->root;
+	struct strbuf dir = STRBUF_INIT;
+	const char *p, *slash;
+
+	if (*pattern == '/') {
+		pattern++;
+		prefix--;
+	}
+	if (baselen) {
+		strbuf_add(&dir, base, baselen);
+		strbuf_addch(&dir, '/');
+	}
+	strbuf_add(&dir, pattern, prefix);
+
+	for (p = dir.buf; (slash = memchr(p, '/', dir.buf + dir.len - p)); p = slash + 1)
+		node = get_bucket(&node->children, p, slash - p);
+	bucket_add(node, pos);
+	strbuf_release(&dir);
+}
+
+void pattern_matcher_add(struct pattern_matcher *m, int pos,
+			 const char *base, int baselen,
+			 const char *pattern, int patternlen,
+			 int nowildcardlen, unsigned flags)
+{
+	if (!(flags & PATTERN_FLAG_NODIR))
+		add_anchored(m, pos, base, baselen, pattern, nowildcardlen);
+	else if (nowildcardlen == patternlen)
+		bucket_add(get_bucket(&m->basenames, pattern, patternlen), pos);
+	else if (flags & PATTERN_FLAG_ENDSWITH)
+		length_map_add(&m->suffixes, pattern + 1, patternlen - 1, pos);
+	else if (nowildcardlen)
+		length_map_add(&m->prefixes, pattern, nowildcardlen, pos);
+	else {
+		ALLOC_GROW(m->fallback, m->fallback_nr + 1, m->fallback_alloc);
+		m->fallback[m->fallback_nr++] = pos;
+	}
+}
+
+/*
+ * Return the highest position in "pos" (sorted in increasing order)
+ * which is above "best", below "limit" and accepted by "match", or
+ * "best" if there is none.
+ */
+static int find_in(const int *pos, size_t nr, int best, int limit,
+		   pattern_matcher_fn match, void *data)
+{
+	while (nr--) {
+		if (pos[nr] <= best)
+			break;
+		if (pos[nr] < limit && match(pos[nr], data))
+			return pos[nr];
+	}
+	return best;
+}
+
+static int find_in_bucket(const struct pattern_bucket *b, int best, int limit,
+			  pattern_matcher_fn match, void *data)
+{
+	if (!b)
+		return best;
+	return find_in(b->pos, b->nr, best, limit, match, data);
+}
+
+static int find_in_length_map(const struct pattern_length_map *lm,
+			      const char *name, size_t namelen, int suffix,
+			      int best, int limit,
+			      pattern_matcher_fn match, void *data)
+{
+	size_t i;
+
+	for (i = 0; i < lm->lens_nr && lm->lens[i] <= namelen; i++) {
+		const char *key = suffix ? name + namelen - lm->lens[i] : name;
+		best = find_in_bucket(find_bucket(&lm->map, key, lm->lens[i]),
+				      best, limit, match, data);
+	}
+	return best;
+}
+
+int pattern_matcher_find(const struct pattern_matcher *m,
+			 const char *path, int pathlen, int basename_offset,
+			 int limit, pattern_matcher_fn match, void *data)
+{
+	const char *basename = path + basename_offset;
+	size_t basenamelen = pathlen - basename_offset;
+	const struct pattern_bucket *node = m->root;
+	const char *p = path, *end = path + pathlen, *slash;
+	int best = -1;
+
+	best = find_in_bucket(find_bucket(&m->basenames, basename, basenamelen),
+			      best, limit, match, data);
+	best = find_in_length_map(&m->suffixes, basename, basenamelen, 1,
+				  best, limit, match, data);
+	best = find_in_length_map(&m->prefixes, basename, basenamelen, 0,
+				  best, limit, match, data);
+	best = find_in(m->fallback, m->fallback_nr, best, limit, match, data);
+
+	while (node) {
+		best = find_in_bucket(node, best, limit, match, data);
+		slash = memchr(p, '/', end - p);
+		if (!slash)
+			break;
+		node = find_bucket(&node->children, p, slash - p);
+		p = slash + 1;
+	}
+	return best;
+}
@@ -0,0 +1,64 @@
+#ifndef PATTERN_MATCHER_H
+#define PATTERN_MATCHER_H
+
+/*
+ * An index over an ordered list of .gitignore-style patterns (see
+ * parse_path_pattern()), used to find the last pattern in the list
+ * that matches a path without trying every pattern in turn.
+ *
+ * Patterns are filed by the part of them that must appear literally
+ * in a matching path:
+ *
+ *   - "name" (no slash, no wildcard): by the whole basename;
+ *   - "*literal": by the end of the basename;
+ *   - "literal*glob" (no slash): by the start of the basename;
+ *   - patterns with a slash: in a trie of the leading directories
+ *     they are anchored to (including the directory of the file
+ *     they come from);
+ *
+ * and everything else (e.g. "*.[oa]", or a pattern starting with
+ * "**") is tried for every path.
+ *
+ * The index only narrows down the candidates; whether a candidate
+ * really matches is up to the caller, so the result is exactly the
+ * same as scanning the whole list backwards. Lookups fold ASCII case,
+ * so the index works with and without core.ignoreCase.
+ *
+ * Patterns must be added in increasing order of their position in
+ * the list. Once built, the index is only read and may be used by
+ * several threads at once.
+ */
+struct pattern_matcher;
+
+/*
+ * Whether a list of "nr" patterns is long enough to be worth
+ * indexing; short lists are faster to scan.
+ */
+int pattern_matcher_wanted(int nr);
+
+struct pattern_matcher *pattern_matcher_new(void);
+void pattern_matcher_free(struct pattern_matcher *m);
+
+/*
+ * Add the pattern at position "pos" in the list. "base" is the
+ * directory the pattern is relative to, without a trailing slash;
+ * "pattern", "patternlen", "nowildcardlen" and "flags" are as
+ * returned by parse_path_pattern().
+ */
+void pattern_matcher_add(struct pattern_matcher *m, int pos,
+			 const char *base, int baselen,
+			 const char *pattern, int patternlen,
+			 int nowildcardlen, unsigned flags);
+
+/*
+ * Return the highest position below "limit" of a pattern which
+ * might match "path" (without a trailing slash; its basename starts
+ * at "basename_offset") and for which "match" returns non-zero, or
+ * -1 if there is none.
+ */
+typedef int (*pattern_matcher_fn)(int pos, void *data);
+int pattern_matcher_find(const struct pattern_matcher *m,
+			 const char *path, int pathlen, int basename_offset,
+			 int limit, pattern_matcher_fn match, void *data);
+
+#endif
@@ -6,6 +6,8 @@
 #define DISABLE_SIGN_COMPARE_WARNINGS
 
 #include "git-compat-util.h"
+#include "batch-stat.h"
+#include "config.h"
 #include "pathspec.h"
 #include "dir.h"
 #include "environment.h"
@@ -29,6 +31,11 @@
 #define MAX_PARALLEL (20)
 #define THREAD_COST (500)
 
+/*
+ * How many paths to hand to stat_batch_run() at once.
+ */
+#define PRELOAD_BATCH (8192)
+
 struct progress_data {
 	unsigned long n;
 	struct progress *progress;
@@ -44,6 +51,33 @@ struct thread_data {
 	int t2_nr_lstat;
 };
 
+/*
+ * Whether the stat data of "ce" is worth checking at all.
+ */
+static int preload_wanted(const struct cache_entry *ce)
+{
+	if (ce_stage(ce))
+		return 0;
+	if (S_ISGITLINK(ce->ce_mode))
+		return 0;
+	if (ce_uptodate(ce))
+		return 0;
+	if (ce_skip_worktree(ce))
+		return 0;
+	if (ce->ce_flags & CE_FSMONITOR_VALID)
+		return 0;
+	return 1;
+}
+
+static void preload_stat_result(struct index_state *index,
+				struct cache_entry *ce, struct stat *st)
+{
+	if (ie_match_stat(index, ce, st, CE_MATCH_RACY_IS_DIRTY|CE_MATCH_IGNORE_FSMONITOR))
+		return;
+	ce_mark_uptodate(ce);
+	mark_fsmonitor_valid(index, ce);
+}
+
 static void *preload_thread(void *_data)
 {
 	int nr, last_nr;
@@ -61,15 +95,7 @@ static void *preload_thread(void *_data)
 		struct cache_entry *ce = *cep++;
 		struct stat st;
 
-		if (ce_stage(ce))
-			continue;
-		if (S_ISGITLINK(ce->ce_mode))
-			continue;
-		if (ce_uptodate(ce))
-			continue;
-		if (ce_skip_worktree(ce))
-			continue;
-		if (ce->ce_flags & CE_FSMONITOR_VALID)
+		if (!preload_wanted(ce))
 			continue;
 		if (p->progress && !(nr & 31)) {
 			struct progress_data *pd = p->progress;
@@ -87,10 +113,7 @@ static void *preload_thread(void *_data)
 		p->t2_nr_lstat++;
 		if (lstat(ce->name, &st))
 			continue;
-		if (ie_match_stat(index, ce, &st, CE_MATCH_RACY_IS_DIRTY|CE_MATCH_IGNORE_FSMONITOR))
-			continue;
-		ce_mark_uptodate(ce);
-		mark_fsmonitor_valid(index, ce);
+		preload_stat_result(index, ce, &st);
 	} while (--nr > 0);
 	if (p->progress) {
 		struct progress_data *pd = p->progress;
@@ -103,41 +126,78 @@ static void *preload_thread(void *_data)
 	return NULL;
 }
 
-void preload_index(struct index_state *index,
-		   const struct pathspec *pathspec,
-		   unsigned int refresh_flags)
+/*
+ * Check the whole index from this thread, handing the lstat() calls
+ * to the kernel in large batches. Returns the number of paths
+ * checked, or -1 if batching is not enabled or not available.
+ */
+static int preload_batched(struct index_state *index,
+			   const struct pathspec *pathspec,
+			   struct progress *progress)
 {
-	int threads, i, work, offset;
-	struct thread_data data[MAX_PARALLEL];
-	struct progress_data pd;
-	int t2_sum_lstat = 0;
+	struct stat_batch *sb;
+	struct cache_def cache = CACHE_DEF_INIT;
+	struct lstat_request *req;
+	struct cache_entry **ces;
+	int i = 0, sum_lstat = 0, batch = 0;
 
-	if (!HAVE_THREADS || !core_preload_index)
-		return;
+	repo_config_get_bool(the_repository, "index.batchstat", &batch);
+	if (!git_env_bool("GIT_TEST_BATCH_STAT", batch))
+		return -1;
+	sb = stat_batch_new();
+	if (!sb)
+		return -1;
 
-	threads = index->cache_nr / THREAD_COST;
-	if ((index->cache_nr > 1) && (threads < 2) && git_env_bool("GIT_TEST_PRELOAD_INDEX", 0))
-		threads = 2;
-	if (threads < 2)
-		return;
+	ALLOC_ARRAY(req, PRELOAD_BATCH);
+	ALLOC_ARRAY(ces, PRELOAD_BATCH);
+	while (i < index->cache_nr) {
+		size_t nr = 0, j;
 
-	trace2_region_enter("index", "preload", NULL);
+		for (; i < index->cache_nr && nr < PRELOAD_BATCH; i++) {
+			struct cache_entry *ce = index->cache[i];
+
+			if (!preload_wanted(ce))
+				continue;
+			if (pathspec && !ce_path_match(index, ce, pathspec, NULL))
+				continue;
+			if (threaded_has_symlink_leading_path(&cache, ce->name, ce_namelen(ce)))
+				continue;
+			req[nr].path = ce->name;
+			ces[nr++] = ce;
+		}
+
+		stat_batch_run(sb, req, nr);
+		for (j = 0; j < nr; j++)
+			if (!req[j].err)
+				preload_stat_result(index, ces[j], &req[j].st);
+		sum_lstat += nr;
+		display_progress(progress, i);
+	}
+
+	free(req);
+	free(ces);
+	cache_def_clear(&cache);
+	stat_batch_free(sb);
+	return sum_lstat;
+}
+
+static int preload_threaded(struct index_state *index,
+			    const struct pathspec *pathspec,
+			    int threads, struct progress_data *pd)
+{
+	int i, work, offset;
+	struct thread_data data[MAX_PARALLEL];
+	int sum_lstat = 0;
+
+	if (pd->progress)
+		pthread_mutex_init(&pd->mutex, NULL);
 
-	trace_performance_enter();
 	if (threads > MAX_PARALLEL)
 		threads = MAX_PARALLEL;
 	offset = 0;
 	work = DIV_ROUND_UP(index->cache_nr, threads);
 	memset(&data, 0, sizeof(data));
 
-	memset(&pd, 0, sizeof(pd));
-	if (refresh_flags & REFRESH_PROGRESS && isatty(2)) {
-		pd.progress = start_delayed_progress(the_repository,
-						     _("Refreshing index"),
-						     index->cache_nr);
-		pthread_mutex_init(&pd.mutex, NULL);
-	}
-
 	for (i = 0; i < threads; i++) {
 		struct thread_data *p = data+i;
 		int err;
@@ -147,8 +207,8 @@ void preload_index(struct index_state *index,
 			copy_pathspec(&p->pathspec, pathspec);
 		p->offset = offset;
 		p->nr = work;
-		if (pd.progress)
-			p->progress = &pd;
+		if (pd->progress)
+			p->progress = pd;
 		offset += work;
 		err = pthread_create(&p->pthread, NULL, preload_thread, p);
 
@@ -159,18 +219,55 @@ void preload_index(struct index_state *index,
 		struct thread_data *p = data+i;
 		if (pthread_join(p->pthread, NULL))
 			die("unable to join threaded lstat");
-		t2_sum_lstat += p->t2_nr_lstat;
+		sum_lstat += p->t2_nr_lstat;
 	}
-	stop_progress(&pd.progress);
 
 	if (pathspec) {
 		/* earlier we made deep copies for each thread to work with */
 		for (i = 0; i < threads; i++)
 			clear_pathspec(&data[i].pathspec);
 	}
+	return sum_lstat;
+}
+
+void preload_index(struct index_state *index,
+		   const struct pathspec *pathspec,
+		   unsigned int refresh_flags)
+{
+	int threads;
+	struct progress_data pd;
+	const char *method = "batched";
+	int t2_sum_lstat;
+
+	if (!core_preload_index)
+		return;
+
+	threads = index->cache_nr / THREAD_COST;
+	if ((index->cache_nr > 1) && (threads < 2) && git_env_bool("GIT_TEST_PRELOAD_INDEX", 0))
+		threads = 2;
+	if (threads < 2)
+		return;
+
+	trace2_region_enter("index", "preload", NULL);
+
+	trace_performance_enter();
+	memset(&pd, 0, sizeof(pd));
+	if (refresh_flags & REFRESH_PROGRESS && isatty(2))
+		pd.progress = start_delayed_progress(the_repository,
+						     _("Refreshing index"),
+						     index->cache_nr);
+
+	t2_sum_lstat = preload_batched(index, pathspec, pd.progress);
+	if (t2_sum_lstat < 0) {
+		method = HAVE_THREADS ? "threads" : "none";
+		t2_sum_lstat = HAVE_THREADS ?
+			preload_threaded(index, pathspec, threads, &pd) : 0;
+	}
+	stop_progress(&pd.progress);
 
 	trace_performance_leave("preload index");
 
+	trace2_data_string("index", NULL, "preload/method", method);
 	trace2_data_intmax("index", NULL, "preload/sum_lstat", t2_sum_lstat);
 	trace2_region_leave("index", "preload", NULL);
 }
@@ -528,7 +528,8 @@ struct ewah_bitmap *pseudo_merge_bitmap(const struct pseudo_merge_map *pm,
 	if (!merge->loaded_bitmap) {
 		size_t at = merge->bitmap_at;
 
-		merge->bitmap = read_bitmap(pm->map, pm->map_size, &at);
+		merge->bitmap = read_bitmap(pm->map, pm->map_size, &at,
+					     pm->format);
 		merge->loaded_bitmap = 1;
 	}
 
@@ -541,7 +542,8 @@ struct pseudo_merge *use_pseudo_merge(const struct pseudo_merge_map *pm,
 	if (!merge->loaded_commits) {
 		size_t pos = merge->at;
 
-		merge->commits = read_bitmap(pm->map, pm->map_size, &pos);
+		merge->commits = read_bitmap(pm->map, pm->map_size, &pos,
+					     pm->format);
 		merge->bitmap_at = pos;
 		merge->loaded_commits = 1;
 	}
@@ -705,6 +707,59 @@ int apply_pseudo_merges_for_commit(const struct pseudo_merge_map *pm,
 	return ret;
 }
 
+static int pseudo_merge_lacks(const struct pseudo_merge_map *pm,
+			      struct pseudo_merge *merge, uint32_t pos)
+{
+	struct ewah_bitmap *bitmap;
+
+	if (!merge)
+		return 0;
+
+	bitmap = pseudo_merge_bitmap(pm, merge);
+	return bitmap && !ewah_bitmap_get(bitmap, pos);
+}
+
+int pseudo_merges_exclude(const struct pseudo_merge_map *pm,
+			  struct commit *commit, uint32_t commit_pos,
+			  uint32_t pos)
+{
+	struct pseudo_merge_commit *found;
+	struct pseudo_merge_commit merge_commit;
+
+	found = find_pseudo_merge(pm, commit_pos);
+	if (!found)
+		return 0;
+
+	read_pseudo_merge_commit_at(&merge_commit,
+				    (const unsigned char *)found);
+
+	if (merge_commit.pseudo_merge_ofs & ((uint64_t)1<<63)) {
+		struct pseudo_merge_commit_ext ext = { 0 };
+		off_t ofs = merge_commit.pseudo_merge_ofs & ~((uint64_t)1<<63);
+		uint32_t i;
+
+		if (pseudo_merge_ext_at(pm, &ext, ofs) < 0)
+			return 0;
+
+		for (i = 0; i < ext.nr; i++) {
+			struct pseudo_merge_commit nth;
+
+			if (nth_pseudo_merge_ext(pm, &ext, &nth, i) < 0)
+				return 0;
+			if (pseudo_merge_lacks(pm, pseudo_merge_at(pm, &commit->object.oid,
+								   nth.pseudo_merge_ofs),
+					       pos))
+				return 1;
+		}
+
+		return 0;
+	}
+
+	return pseudo_merge_lacks(pm, pseudo_merge_at(pm, &commit->object.oid,
+						      merge_commit.pseudo_merge_ofs),
+				  pos);
+}
+
 int cascade_pseudo_merges(const struct pseudo_merge_map *pm,
 			  struct bitmap *result,
 			  struct bitmap *roots)
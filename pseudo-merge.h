@@ -124,6 +124,12 @@ struct pseudo_merge_map {
 	const unsigned char *commits;
 
 	size_t map_size;
+
+	/*
+	 * The bitmap encoding (an "enum bitmap_format") of the .bitmap
+	 * file.
+	 */
+	uint16_t format;
 };
 
 /*
@@ -190,6 +196,18 @@ int apply_pseudo_merges_for_commit(const struct pseudo_merge_map *pm,
 				   struct bitmap *result,
 				   struct commit *commit, uint32_t commit_pos);
 
+/*
+ * Returns 1 if "commit" (at bitmap position "commit_pos") is a parent
+ * of at least one pseudo-merge whose reachability bitmap does not
+ * have the bit at position "pos" set. Since a pseudo-merge reaches
+ * everything its parents do, the object at "pos" is then known not
+ * to be reachable from "commit". Returns 0 if no such pseudo-merge
+ * exists.
+ */
+int pseudo_merges_exclude(const struct pseudo_merge_map *pm,
+			  struct commit *commit, uint32_t commit_pos,
+			  uint32_t pos);
+
 /*
  * Applies pseudo-merge(s) which are satisfied according to the
  * current bitmap in result (or roots, see below). If any
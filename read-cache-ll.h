@@ -17,7 +17,7 @@ struct cache_header {
 };
 
 #define INDEX_FORMAT_LB 2
-#define INDEX_FORMAT_UB 4
+#define INDEX_FORMAT_UB 5
 
 struct cache_entry {
 	struct hashmap_entry ent;
@@ -139,6 +139,7 @@ struct split_index;
 struct untracked_cache;
 struct progress;
 struct pattern_list;
+struct index_journal;
 
 enum sparse_index_mode {
 	/*
@@ -172,6 +173,7 @@ struct index_state {
 	struct split_index *split_index;
 	struct cache_time timestamp;
 	unsigned name_hash_initialized : 1,
+		 name_hash_complete : 1,
 		 initialized : 1,
 		 drop_cache_tree : 1,
 		 updated_workdir : 1,
@@ -188,6 +190,7 @@ struct index_state {
 	struct progress *progress;
 	struct repository *repo;
 	struct pattern_list *sparse_checkout_patterns;
+	struct index_journal *journal;
 };
 
 /**
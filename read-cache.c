@@ -48,6 +48,7 @@
 #include "csum-file.h"
 #include "promisor-remote.h"
 #include "hook.h"
+#include "ewah/ewok.h"
 
 /* Mask for the name length in ce_flags in the on-disk index */
 
@@ -71,12 +72,45 @@
 #define CACHE_EXT_ENDOFINDEXENTRIES 0x454F4945	/* "EOIE" */
 #define CACHE_EXT_INDEXENTRYOFFSETTABLE 0x49454F54 /* "IEOT" */
 #define CACHE_EXT_SPARSE_DIRECTORIES 0x73646972 /* "sdir" */
+#define CACHE_EXT_JOURNAL 0x6a726e6c /* "jrnl" */
 
 /* changes that can be kept in $GIT_DIR/index (basically all extensions) */
 #define EXTMASK (RESOLVE_UNDO_CHANGED | CACHE_TREE_CHANGED | \
 		 CE_ENTRY_ADDED | CE_ENTRY_REMOVED | CE_ENTRY_CHANGED | \
 		 SPLIT_INDEX_ORDERED | UNTRACKED_CHANGED | FSMONITOR_CHANGED)
 
+/*
+ * The state of the journal of an index that carries the "jrnl"
+ * extension; see "Index journal" below.
+ */
+struct index_journal {
+	/* size of the base index file, and of the valid part of the journal */
+	size_t base_size;
+	size_t size;
+	struct stat_validity validity;
+	enum sparse_index_mode sparse_index;
+
+	/* one fingerprint per slot, and which slots are still in the index */
+	uint64_t *fingerprint;
+	struct bitmap *live;
+	uint32_t nr, alloc;
+};
+
+static void discard_index_journal(struct index_state *istate)
+{
+	struct index_journal *j = istate->journal;
+
+	if (!j)
+		return;
+	free(j->fingerprint);
+	bitmap_free(j->live);
+	stat_validity_clear(&j->validity);
+	FREE_AND_NULL(istate->journal);
+}
+
+static void read_index_journal(struct index_state *istate, const char *path,
+			       size_t base_size);
+
 
 /*
  * This is an estimate of the pathname length in the index.  We use
@@ -1709,6 +1743,79 @@ struct ondisk_cache_entry {
 #define ondisk_data_size_max(len) (ondisk_data_size(CE_EXTENDED, len))
 #define ondisk_ce_size(ce) (ondisk_cache_entry_size(ondisk_data_size((ce)->ce_flags, ce_namelen(ce))))
 
+/*
+ * Version 5 stores every entry as a fixed record of little-endian
+ * 32-bit words, which is how a "struct cache_entry" is laid out in
+ * memory on common 64-bit hosts.  There the entries are used straight
+ * out of a private, writable memory map of the file: nothing is parsed
+ * or copied on load, and the kernel copies a page only once an entry
+ * on it is modified.  Any other build converts each record into a
+ * cache entry as it loads it.  A record is
+ *
+ *     0  16 bytes of zero, the room of the in-core hashmap link
+ *    16  ctime sec, ctime nsec, mtime sec, mtime nsec,
+ *        dev, ino, uid, gid, size, mode, flags
+ *    60  1, the in-core mark of an entry allocated from a pool
+ *    64  length of the name
+ *    68  position of the entry in the index, or 0
+ *    72  object name, zero-padded to 32 bytes
+ *   104  hash algorithm id
+ *   108  name, NUL-terminated and zero-padded to a multiple of 8
+ *
+ * and the word after the header is the format id of the records.
+ */
+#define MAPPED_CE_FORMAT 1
+#define MAPPED_CE_HEAD 108
+#define MAPPED_CE_HASH 72
+#define MAPPED_CE_HASHSZ 32
+#define mapped_ce_size(len) ((MAPPED_CE_HEAD + (len) + 8) & ~7)
+#define MAPPED_CE_ONDISK_FLAGS (CE_STAGEMASK | CE_VALID | CE_EXTENDED | CE_EXTENDED_FLAGS)
+
+#ifdef MMAP_PREVENTS_DELETE
+/* The index could not be replaced while we keep it mapped. */
+#define KEEP_INDEX_MAPPED 0
+#else
+#define KEEP_INDEX_MAPPED 1
+#endif
+
+#define CE_WORD_AT(field, offset) \
+	(offsetof(struct cache_entry, field) == (offset) && \
+	 sizeof(((struct cache_entry *)NULL)->field) == 4)
+
+/* Whether a version 5 record is the image of a "struct cache_entry". */
+static int mapped_ce_native(void)
+{
+	const uint32_t one = 1;
+
+	return *(const unsigned char *)&one &&
+		CE_WORD_AT(ce_stat_data.sd_ctime.sec, 16) &&
+		CE_WORD_AT(ce_stat_data.sd_ctime.nsec, 20) &&
+		CE_WORD_AT(ce_stat_data.sd_mtime.sec, 24) &&
+		CE_WORD_AT(ce_stat_data.sd_mtime.nsec, 28) &&
+		CE_WORD_AT(ce_stat_data.sd_dev, 32) &&
+		CE_WORD_AT(ce_stat_data.sd_ino, 36) &&
+		CE_WORD_AT(ce_stat_data.sd_uid, 40) &&
+		CE_WORD_AT(ce_stat_data.sd_gid, 44) &&
+		CE_WORD_AT(ce_stat_data.sd_size, 48) &&
+		CE_WORD_AT(ce_mode, 52) &&
+		CE_WORD_AT(ce_flags, 56) &&
+		CE_WORD_AT(mem_pool_allocated, 60) &&
+		CE_WORD_AT(ce_namelen, 64) &&
+		CE_WORD_AT(index, 68) &&
+		offsetof(struct cache_entry, oid.hash) == MAPPED_CE_HASH &&
+		sizeof(((struct cache_entry *)NULL)->oid.hash) == MAPPED_CE_HASHSZ &&
+		CE_WORD_AT(oid.algo, 104) &&
+		offsetof(struct cache_entry, name) == MAPPED_CE_HEAD;
+}
+
+#undef CE_WORD_AT
+
+/* Whether the index keeps the map of a version 5 file as its entries. */
+static int mapped_ce_in_place(void)
+{
+	return KEEP_INDEX_MAPPED && mapped_ce_native();
+}
+
 /* Allow fsck to force verification of the index checksum. */
 int verify_index_checksum;
 
@@ -1774,6 +1881,11 @@ static int read_index_extension(struct index_state *istate,
 		/* no content, only an indicator */
 		istate->sparse_index = INDEX_COLLAPSED;
 		break;
+	case CACHE_EXT_JOURNAL:
+		/* no content; the journal is replayed by do_read_index() */
+		if (!istate->journal)
+			CALLOC_ARRAY(istate->journal, 1);
+		break;
 	default:
 		if (*ext < 'A' || 'Z' < *ext)
 			return error(_("index uses %.4s extension, which we do not understand"),
@@ -2085,6 +2197,92 @@ static unsigned long load_all_cache_entries(struct index_state *istate,
 	return consumed;
 }
 
+/* Build a cache entry from a version 5 record on a non-native host. */
+static struct cache_entry *mapped_ce_convert(struct mem_pool *ce_mem_pool,
+					     const unsigned char *rec,
+					     unsigned int namelen)
+{
+	struct cache_entry *ce = mem_pool__ce_alloc(ce_mem_pool, namelen);
+	const unsigned char *p = rec + 16;
+
+	ce->ce_stat_data.sd_ctime.sec = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_ctime.nsec = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_mtime.sec = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_mtime.nsec = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_dev = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_ino = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_uid = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_gid = get_le32(p); p += 4;
+	ce->ce_stat_data.sd_size = get_le32(p); p += 4;
+	ce->ce_mode = get_le32(p); p += 4;
+	ce->ce_flags = get_le32(p);
+	ce->ce_namelen = namelen;
+	ce->index = get_le32(rec + 68);
+	oidread(&ce->oid, rec + MAPPED_CE_HASH, the_repository->hash_algo);
+	memcpy(ce->name, rec + MAPPED_CE_HEAD, namelen + 1);
+	return ce;
+}
+
+/*
+ * Point the cache at the version 5 entries in "mmap" without parsing
+ * them where the records are native; the caller then hands the map
+ * over to the index's memory pool.
+ */
+static unsigned long load_mapped_cache_entries(struct index_state *istate,
+			const char *mmap, size_t mmap_size, unsigned long start_offset)
+{
+	size_t end = mmap_size - the_hash_algo->rawsz;
+	unsigned long src_offset = start_offset;
+	int native = mapped_ce_native();
+	char *base = (char *)mmap;
+	uint32_t format;
+	int i;
+
+	istate->ce_mem_pool = xmalloc(sizeof(*istate->ce_mem_pool));
+	mem_pool_init(istate->ce_mem_pool, native ? 0 : mmap_size);
+
+	if (end < src_offset + sizeof(format))
+		die(_("index file corrupt"));
+	format = get_le32(mmap + src_offset);
+	if (format != MAPPED_CE_FORMAT)
+		die(_("index file has entries in an unknown format %"PRIu32"; "
+		      "remove it and run 'git reset' to rebuild it from HEAD"),
+		    format);
+	src_offset += sizeof(format);
+
+	if (native && !KEEP_INDEX_MAPPED) {
+		/* Still a single copy rather than parsing every entry. */
+		base = mem_pool_alloc(istate->ce_mem_pool, mmap_size);
+		memcpy(base, mmap, mmap_size);
+	}
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		unsigned char *rec = (unsigned char *)base + src_offset;
+		struct cache_entry *ce;
+		uint32_t namelen, flags;
+
+		if (end - src_offset < mapped_ce_size(0))
+			die(_("index file corrupt"));
+		namelen = get_le32(rec + 64);
+		if (end - src_offset <= namelen ||
+		    end - src_offset < mapped_ce_size(namelen) ||
+		    rec[MAPPED_CE_HEAD + namelen] ||
+		    get_le32(rec + 104) != hash_algo_by_ptr(the_hash_algo))
+			die(_("index file corrupt"));
+		flags = get_le32(rec + 56);
+		if (flags & ~MAPPED_CE_ONDISK_FLAGS)
+			die(_("unknown index entry format 0x%08x"), flags);
+
+		if (native)
+			ce = (struct cache_entry *)rec;
+		else
+			ce = mapped_ce_convert(istate->ce_mem_pool, rec, namelen);
+		set_index_entry(istate, i, ce);
+		src_offset += mapped_ce_size(namelen);
+	}
+	return src_offset - start_offset;
+}
+
 /*
  * Mostly randomly chosen maximum thread counts: we
  * cap the parallelism to online_cpus() threads, and we want
@@ -2218,8 +2416,10 @@ int do_read_index(struct index_state *istate, const char *path, int must_exist)
 	struct stat st;
 	unsigned long src_offset;
 	const struct cache_header *hdr;
+	struct cache_header hdr_buf;
 	const char *mmap;
 	size_t mmap_size;
+	int prot = PROT_READ;
 	struct load_index_extensions p;
 	size_t extension_offset = 0;
 	int nr_threads, cpus;
@@ -2247,7 +2447,12 @@ int do_read_index(struct index_state *istate, const char *path, int must_exist)
 	if (mmap_size < sizeof(struct cache_header) + the_hash_algo->rawsz)
 		die(_("%s: index file smaller than expected"), path);
 
-	mmap = xmmap_gently(NULL, mmap_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* Writable for version 5, so that its entries can be modified in place. */
+	if (pread_in_full(fd, &hdr_buf, sizeof(hdr_buf), 0) != sizeof(hdr_buf))
+		die_errno(_("%s: unable to read index header"), path);
+	if (hdr_buf.hdr_version == htonl(5))
+		prot |= PROT_WRITE;
+	mmap = xmmap_gently(NULL, mmap_size, prot, MAP_PRIVATE, fd, 0);
 	if (mmap == MAP_FAILED)
 		die_errno(_("%s: unable to map index file%s"), path,
 			mmap_os_err());
@@ -2303,10 +2508,12 @@ int do_read_index(struct index_state *istate, const char *path, int must_exist)
 	 * Locate and read the index entry offset table so that we can use it
 	 * to multi-thread the reading of the cache entries.
 	 */
-	if (extension_offset && nr_threads > 1)
+	if (extension_offset && nr_threads > 1 && istate->version != 5)
 		ieot = read_ieot_extension(mmap, mmap_size, extension_offset);
 
-	if (ieot) {
+	if (istate->version == 5) {
+		src_offset += load_mapped_cache_entries(istate, mmap, mmap_size, src_offset);
+	} else if (ieot) {
 		src_offset += load_cache_entries_threaded(istate, mmap, mmap_size, nr_threads, ieot);
 		free(ieot);
 	} else {
@@ -2325,7 +2532,13 @@ int do_read_index(struct index_state *istate, const char *path, int must_exist)
 		p.src_offset = src_offset;
 		load_index_extensions(&p);
 	}
-	munmap((void *)mmap, mmap_size);
+	if (istate->version == 5 && mapped_ce_in_place())
+		mem_pool_add_mapping(istate->ce_mem_pool, (void *)mmap, mmap_size);
+	else
+		munmap((void *)mmap, mmap_size);
+
+	if (istate->journal)
+		read_index_journal(istate, path, mmap_size);
 
 	/*
 	 * TODO trace2: replace "the_repository" with the actual repo instance
@@ -2465,6 +2678,7 @@ void release_index(struct index_state *istate)
 	free(istate->fsmonitor_last_update);
 	free(istate->cache);
 	discard_split_index(istate);
+	discard_index_journal(istate);
 	free_untracked_cache(istate->untracked);
 
 	if (istate->sparse_checkout_patterns) {
@@ -2711,9 +2925,48 @@ static int ce_write_entry(struct hashfile *f, struct cache_entry *ce,
 	return 0;
 }
 
+static int ce_write_mapped_entry(struct hashfile *f, struct cache_entry *ce,
+				 unsigned int index)
+{
+	static unsigned char padding[8] = { 0x00 };
+	const struct stat_data *sd = &ce->ce_stat_data;
+	unsigned char rec[MAPPED_CE_HEAD] = { 0 };
+	unsigned char *p = rec + 16;
+	unsigned int len = ce_namelen(ce);
+
+	if (ce->ce_flags & CE_STRIP_NAME) {
+		len = 0;
+		ce->ce_flags &= ~CE_STRIP_NAME;
+	}
+
+	/* Only the on-disk state; the rest is that of a fresh entry. */
+	put_le32(p, sd->sd_ctime.sec); p += 4;
+	put_le32(p, sd->sd_ctime.nsec); p += 4;
+	put_le32(p, sd->sd_mtime.sec); p += 4;
+	put_le32(p, sd->sd_mtime.nsec); p += 4;
+	put_le32(p, sd->sd_dev); p += 4;
+	put_le32(p, sd->sd_ino); p += 4;
+	put_le32(p, sd->sd_uid); p += 4;
+	put_le32(p, sd->sd_gid); p += 4;
+	put_le32(p, sd->sd_size); p += 4;
+	put_le32(p, ce->ce_mode); p += 4;
+	put_le32(p, ce->ce_flags & MAPPED_CE_ONDISK_FLAGS); p += 4;
+	put_le32(p, 1); p += 4;
+	put_le32(p, len); p += 4;
+	put_le32(p, index);
+	memcpy(rec + MAPPED_CE_HASH, ce->oid.hash, the_hash_algo->rawsz);
+	put_le32(rec + 104, hash_algo_by_ptr(the_hash_algo));
+
+	hashwrite(f, rec, sizeof(rec));
+	hashwrite(f, ce->name, len);
+	hashwrite(f, padding, mapped_ce_size(len) - sizeof(rec) - len);
+	return 0;
+}
+
 /*
  * This function verifies if index_state has the correct sha1 of the
- * index file.  Don't die if we have any other failure, just return 0.
+ * index file, and that nothing was appended to its journal since it was
+ * read.  Don't die if we have any other failure, just return 0.
  */
 static int verify_index_from(const struct index_state *istate, const char *path)
 {
@@ -2725,6 +2978,16 @@ static int verify_index_from(const struct index_state *istate, const char *path)
 	if (!istate->initialized)
 		return 0;
 
+	if (istate->journal) {
+		char *journal_path = xstrfmt("%s.journal", path);
+		int unchanged = stat_validity_check(&istate->journal->validity,
+						    journal_path);
+
+		free(journal_path);
+		if (!unchanged)
+			return 0;
+	}
+
 	fd = open(path, O_RDONLY);
 	if (fd < 0)
 		return 0;
@@ -2809,6 +3072,657 @@ static int record_ieot(void)
 	return !repo_config_get_index_threads(the_repository, &val) && val != 1;
 }
 
+/*****************************************************************
+ * Index journal
+ *****************************************************************/
+
+/*
+ * With "index.journal" enabled, an update that changes only a few
+ * entries is appended as a batch to "<index>.journal" instead of
+ * rewriting the whole index file, which stays the base of the journal.
+ * The base carries the "jrnl" extension, so that a Git that does not
+ * know to replay the journal refuses to use it.
+ *
+ * Every entry the journal knows of has a "slot": the entries of the
+ * base come first, in order, followed by those of every batch in the
+ * order they were appended.  A batch removes slots by number and adds
+ * new ones; replaying all batches over the base yields the live slots,
+ * i.e. the index.  A batch also carries the extensions that changed;
+ * paths touched by later batches are invalidated in the cache tree
+ * and the untracked cache instead.
+ *
+ * In memory, ce->index names the slot an entry was read from (it is
+ * otherwise only used by the split index, which cannot be combined
+ * with the journal), and the fingerprint of each slot lets the writer
+ * tell which entries changed since.
+ */
+#define INDEX_JOURNAL_SIGNATURE 0x494a4e4c	/* "IJNL" */
+#define INDEX_JOURNAL_VERSION 1
+#define INDEX_JOURNAL_MAX_PERCENT 20
+
+static int index_journal_enabled(struct repository *r)
+{
+	int val;
+
+	if (git_env_bool("GIT_TEST_INDEX_JOURNAL", 0))
+		return 1;
+	return !repo_config_get_bool(r, "index.journal", &val) && val;
+}
+
+static size_t index_journal_header_size(void)
+{
+	return 2 * sizeof(uint32_t) + the_hash_algo->rawsz;
+}
+
+static inline uint64_t fingerprint_mix(uint64_t h, uint64_t v)
+{
+	h ^= v;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static uint64_t fingerprint_bytes(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	for (size_t i = 0; i < len; i += 8) {
+		uint64_t v = 0;
+
+		memcpy(&v, p + i, len - i < 8 ? len - i : 8);
+		h = fingerprint_mix(h, v);
+	}
+	return h;
+}
+
+/*
+ * A cheap fingerprint of what the index file records of an entry, to
+ * tell whether it changed since it was read.
+ */
+static uint64_t journal_fingerprint(const struct cache_entry *ce)
+{
+	const struct stat_data *sd = &ce->ce_stat_data;
+	uint64_t h = ce->ce_namelen;
+
+	h = fingerprint_mix(h, ((uint64_t)sd->sd_ctime.sec << 32) | sd->sd_ctime.nsec);
+	h = fingerprint_mix(h, ((uint64_t)sd->sd_mtime.sec << 32) | sd->sd_mtime.nsec);
+	h = fingerprint_mix(h, ((uint64_t)sd->sd_dev << 32) | sd->sd_ino);
+	h = fingerprint_mix(h, ((uint64_t)sd->sd_uid << 32) | sd->sd_gid);
+	h = fingerprint_mix(h, ((uint64_t)sd->sd_size << 32) | ce->ce_mode);
+	h = fingerprint_mix(h, ce->ce_flags & (CE_STAGEMASK | CE_VALID | CE_EXTENDED_FLAGS));
+	h = fingerprint_bytes(h, ce->oid.hash, the_hash_algo->rawsz);
+	return fingerprint_bytes(h, ce->name, ce->ce_namelen);
+}
+
+static void journal_add_slot(struct index_journal *j, struct cache_entry *ce)
+{
+	ALLOC_GROW(j->fingerprint, j->nr + 1, j->alloc);
+	j->fingerprint[j->nr] = journal_fingerprint(ce);
+	bitmap_set(j->live, j->nr);
+	j->nr++;
+	/* do not needlessly dirty the pages of a mapped version 5 index */
+	if (ce->index != j->nr)
+		ce->index = j->nr;
+}
+
+/*
+ * Start a journal over the entries of "istate", which are those of a
+ * base index file of "base_size" bytes.
+ */
+static void init_index_journal(struct index_state *istate, size_t base_size)
+{
+	struct index_journal *j = istate->journal;
+
+	free(j->fingerprint);
+	bitmap_free(j->live);
+	j->fingerprint = NULL;
+	j->nr = j->alloc = 0;
+	j->size = 0;
+	j->base_size = base_size;
+	j->sparse_index = istate->sparse_index;
+	j->live = bitmap_word_alloc(DIV_ROUND_UP(istate->cache_nr, BITS_IN_EWORD));
+	ALLOC_GROW(j->fingerprint, istate->cache_nr, j->alloc);
+	for (unsigned int i = 0; i < istate->cache_nr; i++)
+		if (!(istate->cache[i]->ce_flags & CE_REMOVE))
+			journal_add_slot(j, istate->cache[i]);
+}
+
+struct journal_extension {
+	const char *data;
+	uint32_t sz;
+	/* number of paths changed before this copy was written */
+	size_t changed_nr;
+};
+
+struct journal_replay {
+	struct index_state *istate;
+	struct cache_entry **base;
+	uint32_t base_nr;
+	struct cache_entry **extra;
+	size_t extra_nr, extra_alloc;
+
+	/* paths changed by the batches, in order */
+	const char **changed;
+	size_t changed_nr, changed_alloc;
+
+	/* the last copy of each extension */
+	struct journal_extension tree, resolve_undo, untracked, fsmonitor;
+
+	uint32_t slots;
+	int corrupt;
+};
+
+static void journal_remove_slot(size_t pos, void *data)
+{
+	struct journal_replay *rp = data;
+	struct index_journal *j = rp->istate->journal;
+	struct cache_entry *ce;
+
+	if (pos >= rp->slots || !bitmap_get(j->live, pos)) {
+		rp->corrupt = 1;
+		return;
+	}
+	bitmap_unset(j->live, pos);
+	ce = pos < rp->base_nr ? rp->base[pos] : rp->extra[pos - rp->base_nr];
+	ALLOC_GROW(rp->changed, rp->changed_nr + 1, rp->changed_alloc);
+	rp->changed[rp->changed_nr++] = ce->name;
+}
+
+static void journal_extension_seen(struct journal_replay *rp,
+				   struct journal_extension *ext,
+				   const char *data, uint32_t sz)
+{
+	ext->data = data;
+	ext->sz = sz;
+	ext->changed_nr = rp->changed_nr;
+}
+
+static int replay_journal_batch(struct journal_replay *rp,
+				const char *data, size_t len)
+{
+	struct index_state *istate = rp->istate;
+	const char *end = data + len;
+	struct ewah_bitmap *removed;
+	uint32_t nr, ewah_len;
+	int ret = -1;
+
+	if (len < 2 * sizeof(uint32_t))
+		return -1;
+	nr = get_be32(data);
+	ewah_len = get_be32(data + 4);
+	data += 8;
+	if (ewah_len > end - data)
+		return -1;
+
+	removed = ewah_new();
+	if (ewah_read_mmap(removed, data, ewah_len) != ewah_len)
+		goto out;
+	data += ewah_len;
+
+	rp->slots = istate->journal->nr;
+	ewah_each_bit(removed, journal_remove_slot, rp);
+	if (rp->corrupt)
+		goto out;
+
+	while (nr--) {
+		struct cache_entry *ce;
+		unsigned long consumed;
+
+		if (end - data < ondisk_cache_entry_size(ondisk_data_size(0, 0)))
+			goto out;
+		ce = create_from_disk(istate->ce_mem_pool, 3, data, &consumed, NULL);
+		if (consumed > end - data)
+			goto out;
+		data += consumed;
+
+		ALLOC_GROW(rp->extra, rp->extra_nr + 1, rp->extra_alloc);
+		rp->extra[rp->extra_nr++] = ce;
+		journal_add_slot(istate->journal, ce);
+		ALLOC_GROW(rp->changed, rp->changed_nr + 1, rp->changed_alloc);
+		rp->changed[rp->changed_nr++] = ce->name;
+	}
+
+	while (end - data >= 8) {
+		uint32_t sz = get_be32(data + 4);
+
+		if (sz > end - data - 8)
+			goto out;
+		switch (CACHE_EXT(data)) {
+		case CACHE_EXT_TREE:
+			journal_extension_seen(rp, &rp->tree, data + 8, sz);
+			break;
+		case CACHE_EXT_RESOLVE_UNDO:
+			journal_extension_seen(rp, &rp->resolve_undo, data + 8, sz);
+			break;
+		case CACHE_EXT_UNTRACKED:
+			journal_extension_seen(rp, &rp->untracked, data + 8, sz);
+			break;
+		case CACHE_EXT_FSMONITOR:
+			journal_extension_seen(rp, &rp->fsmonitor, data + 8, sz);
+			break;
+		default:
+			if (*data < 'A' || 'Z' < *data)
+				goto out;
+			break;
+		}
+		data += 8 + sz;
+	}
+	if (data == end)
+		ret = 0;
+out:
+	ewah_free(removed);
+	return ret;
+}
+
+/*
+ * Rebuild the cache from the live slots, and bring the extensions up
+ * to date with the journal.
+ */
+static void finish_journal_replay(struct journal_replay *rp)
+{
+	struct index_state *istate = rp->istate;
+	struct index_journal *j = istate->journal;
+	struct cache_entry **cache;
+	size_t i, b = 0, e = 0, nr = 0;
+
+	/* the base is sorted already, the entries of the batches are not */
+	for (i = 0; i < rp->extra_nr; i++)
+		if (bitmap_get(j->live, rp->base_nr + i))
+			rp->extra[e++] = rp->extra[i];
+	rp->extra_nr = e;
+	QSORT(rp->extra, rp->extra_nr, cmp_cache_name_compare);
+
+	ALLOC_ARRAY(cache, alloc_nr(j->nr));
+	for (e = 0;;) {
+		struct cache_entry *ce;
+
+		while (b < rp->base_nr && !bitmap_get(j->live, b))
+			b++;
+		if (b < rp->base_nr &&
+		    (e == rp->extra_nr ||
+		     cmp_cache_name_compare(&rp->base[b], &rp->extra[e]) < 0))
+			ce = rp->base[b++];
+		else if (e < rp->extra_nr)
+			ce = rp->extra[e++];
+		else
+			break;
+
+		if (nr && cmp_cache_name_compare(&cache[nr - 1], &ce) >= 0)
+			die(_("index journal is corrupt"));
+		if (S_ISSPARSEDIR(ce->ce_mode))
+			istate->sparse_index = INDEX_COLLAPSED;
+		cache[nr++] = ce;
+	}
+	free(istate->cache);
+	istate->cache = cache;
+	istate->cache_nr = nr;
+	istate->cache_alloc = alloc_nr(j->nr);
+
+	if (rp->tree.data) {
+		cache_tree_free(&istate->cache_tree);
+		istate->cache_tree = cache_tree_read(rp->tree.data, rp->tree.sz);
+	}
+	for (i = rp->tree.changed_nr; i < rp->changed_nr; i++)
+		cache_tree_invalidate_path(istate, rp->changed[i]);
+
+	if (rp->resolve_undo.data) {
+		resolve_undo_clear_index(istate);
+		if (rp->resolve_undo.sz)
+			istate->resolve_undo = resolve_undo_read(rp->resolve_undo.data,
+								 rp->resolve_undo.sz,
+								 the_hash_algo);
+	}
+
+	if (rp->untracked.data) {
+		free_untracked_cache(istate->untracked);
+		istate->untracked = read_untracked_extension(rp->untracked.data,
+							     rp->untracked.sz);
+	}
+	for (i = rp->untracked.changed_nr; i < rp->changed_nr; i++)
+		untracked_cache_invalidate_path(istate, rp->changed[i], 0);
+
+	/* the fsmonitor bitmap is by position, which later changes shift */
+	FREE_AND_NULL(istate->fsmonitor_last_update);
+	ewah_free(istate->fsmonitor_dirty);
+	istate->fsmonitor_dirty = NULL;
+	if (rp->fsmonitor.data && rp->fsmonitor.changed_nr == rp->changed_nr)
+		read_fsmonitor_extension(istate, rp->fsmonitor.data,
+					 rp->fsmonitor.sz);
+
+	/* what we just read is what is on disk */
+	istate->cache_changed = 0;
+}
+
+/*
+ * Replay the journal of the index at "path" over its base, which was
+ * just read into "istate" from a file of "base_size" bytes.
+ */
+static void read_index_journal(struct index_state *istate, const char *path,
+			       size_t base_size)
+{
+	struct index_journal *j = istate->journal;
+	struct journal_replay rp = { .istate = istate };
+	const size_t hdr_size = index_journal_header_size();
+	const size_t rawsz = the_hash_algo->rawsz;
+	char *journal_path = xstrfmt("%s.journal", path);
+	const char *map = NULL;
+	struct stat st;
+	size_t size = 0, off = 0;
+	int fd;
+
+	trace2_region_enter("index", "journal/read", the_repository);
+
+	init_index_journal(istate, base_size);
+	rp.base = istate->cache;
+	rp.base_nr = istate->cache_nr;
+
+	fd = open(journal_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			die_errno(_("could not open '%s'"), journal_path);
+		goto done;
+	}
+	if (fstat(fd, &st))
+		die_errno(_("could not stat '%s'"), journal_path);
+	stat_validity_update(&j->validity, fd);
+	size = xsize_t(st.st_size);
+	if (size >= hdr_size)
+		map = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	/* a journal over some other base is stale, and will be overwritten */
+	if (!map ||
+	    get_be32(map) != INDEX_JOURNAL_SIGNATURE ||
+	    get_be32(map + 4) != INDEX_JOURNAL_VERSION ||
+	    !hasheq((const unsigned char *)map + 8, istate->oid.hash, the_hash_algo))
+		goto done;
+
+	for (off = hdr_size; size - off >= sizeof(uint32_t) + rawsz; ) {
+		const char *batch = map + off + sizeof(uint32_t);
+		uint32_t len = get_be32(map + off);
+		unsigned char hash[GIT_MAX_RAWSZ];
+		struct git_hash_ctx c;
+
+		if (len > size - off - sizeof(uint32_t) - rawsz)
+			break;
+
+		/* a batch that was not completely written is ignored */
+		the_hash_algo->init_fn(&c);
+		git_hash_update(&c, map + off, sizeof(uint32_t) + len);
+		git_hash_final(hash, &c);
+		if (!hasheq(hash, (const unsigned char *)batch + len, the_hash_algo))
+			break;
+
+		if (replay_journal_batch(&rp, batch, len) < 0)
+			die(_("index journal is corrupt"));
+		off += sizeof(uint32_t) + len + rawsz;
+	}
+	j->size = off;
+
+	if (j->size > hdr_size) {
+		finish_journal_replay(&rp);
+		istate->timestamp.sec = st.st_mtime;
+		istate->timestamp.nsec = ST_MTIME_NSEC(st);
+	}
+	trace2_data_intmax("index", the_repository, "journal/size", j->size);
+	trace2_data_intmax("index", the_repository, "journal/entries",
+			   j->nr - rp.base_nr);
+
+done:
+	if (map)
+		munmap((void *)map, size);
+	j->sparse_index = istate->sparse_index;
+	free(rp.extra);
+	free(rp.changed);
+	free(journal_path);
+	trace2_region_leave("index", "journal/read", the_repository);
+}
+
+static void journal_unset_slot(size_t pos, void *live)
+{
+	bitmap_unset(live, pos);
+}
+
+static void journal_add_extension(struct strbuf *sb, uint32_t ext,
+				  const struct strbuf *data)
+{
+	uint32_t hdr[2] = { htonl(ext), htonl(data->len) };
+
+	strbuf_add(sb, hdr, sizeof(hdr));
+	strbuf_addbuf(sb, data);
+}
+
+/*
+ * Build the batch that takes the journal of "istate" from the slots it
+ * knows of to the current entries and extensions.  Returns -1 if the
+ * changes cannot be journaled.
+ */
+static int prepare_journal_batch(struct index_state *istate, struct strbuf *sb,
+				 struct ewah_bitmap *removed,
+				 struct cache_entry ***changed, size_t *changed_nr)
+{
+	struct index_journal *j = istate->journal;
+	struct bitmap *claimed;
+	struct strbuf ext = STRBUF_INIT;
+	size_t alloc = 0, removed_nr = 0, start;
+	uint32_t nr = 0;
+	int ret = -1;
+
+	claimed = bitmap_word_alloc(DIV_ROUND_UP(j->nr, BITS_IN_EWORD));
+	for (unsigned int i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		uint32_t slot = ce->index - 1;
+
+		if (ce->ce_flags & CE_REMOVE)
+			continue;
+		if (!ce_uptodate(ce) && is_racy_timestamp(istate, ce))
+			ce_smudge_racily_clean_entry(istate, ce);
+		ce->ce_flags &= ~CE_EXTENDED;
+		if (ce->ce_flags & CE_EXTENDED_FLAGS)
+			ce->ce_flags |= CE_EXTENDED;
+
+		if (ce->index && slot < j->nr &&
+		    bitmap_get(j->live, slot) && !bitmap_get(claimed, slot) &&
+		    journal_fingerprint(ce) == j->fingerprint[slot]) {
+			bitmap_set(claimed, slot);
+			continue;
+		}
+		/* leave it to do_write_index() to complain */
+		if (is_null_oid(&ce->oid))
+			goto out;
+		ALLOC_GROW(*changed, *changed_nr + 1, alloc);
+		(*changed)[(*changed_nr)++] = ce;
+	}
+
+	for (uint32_t i = 0; i < j->nr; i++)
+		if (bitmap_get(j->live, i) && !bitmap_get(claimed, i)) {
+			ewah_set(removed, i);
+			removed_nr++;
+		}
+
+	strbuf_add(sb, &nr, sizeof(nr));
+	put_be32(sb->buf + sb->len - sizeof(nr), *changed_nr);
+	ewah_serialize_strbuf(removed, &ext);
+	nr = htonl(ext.len);
+	strbuf_add(sb, &nr, sizeof(nr));
+	strbuf_addbuf(sb, &ext);
+
+	for (size_t i = 0; i < *changed_nr; i++) {
+		struct cache_entry *ce = (*changed)[i];
+		struct ondisk_cache_entry ondisk;
+		unsigned int len = ce_namelen(ce);
+		size_t size = offsetof(struct ondisk_cache_entry, data) +
+			ondisk_data_size(ce->ce_flags, 0);
+
+		copy_cache_entry_to_ondisk(&ondisk, ce);
+		strbuf_add(sb, &ondisk, size);
+		strbuf_add(sb, ce->name, len);
+		strbuf_addchars(sb, 0, align_padding_size(size, len));
+	}
+	start = sb->len;
+
+	if (istate->cache_changed & CACHE_TREE_CHANGED) {
+		if (!istate->cache_tree)
+			goto out;
+		strbuf_reset(&ext);
+		cache_tree_write(&ext, istate->cache_tree);
+		journal_add_extension(sb, CACHE_EXT_TREE, &ext);
+	}
+	/* entries are recorded for resolve-undo without marking it changed */
+	if ((istate->cache_changed & RESOLVE_UNDO_CHANGED) ||
+	    (istate->resolve_undo && (*changed_nr || removed_nr))) {
+		/* an empty copy records that there is none */
+		strbuf_reset(&ext);
+		if (istate->resolve_undo)
+			resolve_undo_write(&ext, istate->resolve_undo, the_hash_algo);
+		journal_add_extension(sb, CACHE_EXT_RESOLVE_UNDO, &ext);
+	}
+	if (istate->cache_changed & UNTRACKED_CHANGED) {
+		if (!istate->untracked)
+			goto out;
+		strbuf_reset(&ext);
+		write_untracked_extension(&ext, istate->untracked);
+		journal_add_extension(sb, CACHE_EXT_UNTRACKED, &ext);
+	}
+	if (!*changed_nr && !removed_nr && sb->len == start &&
+	    !(istate->cache_changed & FSMONITOR_CHANGED)) {
+		strbuf_reset(sb);
+		ret = 0;
+		goto out;
+	}
+	if (istate->fsmonitor_last_update) {
+		strbuf_reset(&ext);
+		write_fsmonitor_extension(&ext, istate);
+		journal_add_extension(sb, CACHE_EXT_FSMONITOR, &ext);
+	}
+	ret = 0;
+
+out:
+	bitmap_free(claimed);
+	strbuf_release(&ext);
+	return ret;
+}
+
+/*
+ * Record the changes made to "istate" since it was read by appending
+ * a batch to its journal.  Returns 0 when done, 1 if the index has to
+ * be written in full instead, or -1 if the index was changed by
+ * somebody else since we read it, which writing it would undo.
+ */
+static int write_index_journal(struct index_state *istate, struct lock_file *lock)
+{
+	struct repository *r = istate->repo;
+	struct index_journal *j = istate->journal;
+	struct ewah_bitmap *removed = NULL;
+	struct cache_entry **changed = NULL;
+	size_t changed_nr = 0, end;
+	struct strbuf batch = STRBUF_INIT;
+	char *path = NULL, *journal_path = NULL;
+	int was_full = istate->sparse_index == INDEX_EXPANDED;
+	unsigned char hash[GIT_MAX_RAWSZ];
+	struct git_hash_ctx c;
+	struct stat st;
+	int max_percent, fd = -1, ret = 1;
+
+	if (!j || istate->split_index || istate->drop_cache_tree ||
+	    (istate->cache_changed & ~EXTMASK) ||
+	    is_null_oid(&istate->oid) || !index_journal_enabled(r))
+		return 1;
+
+	/* nobody else may have updated the index since we read it */
+	path = get_locked_file_path(lock);
+	journal_path = xstrfmt("%s.journal", path);
+	if (!verify_index_from(istate, path)) {
+		ret = error(_("index file '%s' changed since it was read"), path);
+		goto out;
+	}
+
+	if (convert_to_sparse(istate, 0) || istate->sparse_index != j->sparse_index)
+		goto out;
+
+	trace2_region_enter("index", "journal/write", r);
+
+	strbuf_add(&batch, "\0\0\0\0", 4); /* length, filled in below */
+	removed = ewah_new();
+	if (prepare_journal_batch(istate, &batch, removed, &changed, &changed_nr))
+		goto leave;
+	if (!batch.len) {
+		ret = 0;
+		goto leave;
+	}
+
+	put_be32(batch.buf, batch.len - 4);
+	the_hash_algo->init_fn(&c);
+	git_hash_update(&c, batch.buf, batch.len);
+	git_hash_final(hash, &c);
+	strbuf_add(&batch, hash, the_hash_algo->rawsz);
+
+	/* compact the journal into a new base once it gets too large */
+	if (repo_config_get_int(r, "index.journalmaxpercent", &max_percent))
+		max_percent = INDEX_JOURNAL_MAX_PERCENT;
+	end = (j->size ? j->size : index_journal_header_size()) + batch.len;
+	if ((uint64_t)end * 100 > (uint64_t)j->base_size * max_percent)
+		goto leave;
+
+	fd = open(journal_path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		error_errno(_("could not open '%s'"), journal_path);
+		goto leave;
+	}
+	if (!j->size) {
+		struct strbuf hdr = STRBUF_INIT;
+		uint32_t word;
+
+		word = htonl(INDEX_JOURNAL_SIGNATURE);
+		strbuf_add(&hdr, &word, sizeof(word));
+		word = htonl(INDEX_JOURNAL_VERSION);
+		strbuf_add(&hdr, &word, sizeof(word));
+		strbuf_add(&hdr, istate->oid.hash, the_hash_algo->rawsz);
+		strbuf_insert(&batch, 0, hdr.buf, hdr.len);
+		strbuf_release(&hdr);
+		adjust_shared_perm(r, journal_path);
+	}
+
+	/* drop what is left of a torn write, and append */
+	if (ftruncate(fd, j->size) < 0 ||
+	    lseek(fd, j->size, SEEK_SET) < 0 ||
+	    write_in_full(fd, batch.buf, batch.len) < 0) {
+		error_errno(_("could not write '%s'"), journal_path);
+		goto leave;
+	}
+	fsync_component_or_die(FSYNC_COMPONENT_INDEX, fd, journal_path);
+	stat_validity_update(&j->validity, fd);
+	j->size = end;
+
+	/* racy entries are now judged against the journal we just wrote */
+	if (!fstat(fd, &st)) {
+		istate->timestamp.sec = (unsigned int)st.st_mtime;
+		istate->timestamp.nsec = ST_MTIME_NSEC(st);
+	}
+
+	ewah_each_bit(removed, journal_unset_slot, j->live);
+	for (size_t i = 0; i < changed_nr; i++)
+		journal_add_slot(j, changed[i]);
+	trace2_data_intmax("index", r, "journal/append", batch.len);
+	ret = 0;
+
+leave:
+	trace2_region_leave("index", "journal/write", r);
+out:
+	/* the fsmonitor bitmap went into the batch; a full write needs it again */
+	if (ret && istate->fsmonitor_last_update && !istate->fsmonitor_dirty)
+		fill_fsmonitor_bitmap(istate);
+	if (fd >= 0)
+		close(fd);
+	if (was_full)
+		ensure_full_index(istate);
+	ewah_free(removed);
+	free(changed);
+	strbuf_release(&batch);
+	free(journal_path);
+	free(path);
+	return ret;
+}
+
 enum write_extensions {
 	WRITE_NO_EXTENSION =              0,
 	WRITE_SPLIT_INDEX_EXTENSION =     1<<0,
@@ -2816,6 +3730,7 @@ enum write_extensions {
 	WRITE_RESOLVE_UNDO_EXTENSION =    1<<2,
 	WRITE_UNTRACKED_CACHE_EXTENSION = 1<<3,
 	WRITE_FSMONITOR_EXTENSION =       1<<4,
+	WRITE_JOURNAL_EXTENSION =         1<<5,
 };
 #define WRITE_ALL_EXTENSIONS ((enum write_extensions)-1)
 
@@ -2846,13 +3761,18 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 	struct index_entry_offset_table *ieot = NULL;
 	struct repository *r = istate->repo;
 	struct strbuf sb = STRBUF_INIT;
-	int nr, nr_threads, ret;
+	int nr, nr_threads, ret, journal, written = 0;
 
 	f = hashfd(the_repository->hash_algo, tempfile->fd, tempfile->filename.buf);
 
 	prepare_repo_settings(r);
 	f->skip_hash = r->settings.index_skip_hash;
 
+	/* the journal names its base by checksum, and cannot do without */
+	journal = (write_extensions & WRITE_JOURNAL_EXTENSION) &&
+		!istate->split_index && !f->skip_hash &&
+		index_journal_enabled(r);
+
 	for (i = removed = extended = 0; i < entries; i++) {
 		if (cache[i]->ce_flags & CE_REMOVE)
 			removed++;
@@ -2879,11 +3799,18 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 	hdr.hdr_entries = htonl(entries - removed);
 
 	hashwrite(f, &hdr, sizeof(hdr));
+	if (hdr_version == 5) {
+		unsigned char format[4];
+
+		put_le32(format, MAPPED_CE_FORMAT);
+		hashwrite(f, format, sizeof(format));
+	}
 
 	if (!HAVE_THREADS || repo_config_get_index_threads(the_repository, &nr_threads))
 		nr_threads = 1;
 
-	if (nr_threads != 1 && record_ieot()) {
+	/* version 5 entries are not parsed, so there is nothing to thread */
+	if (nr_threads != 1 && hdr_version != 5 && record_ieot()) {
 		int ieot_blocks, cpus;
 
 		/*
@@ -2952,7 +3879,11 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 
 			offset = hashfile_total(f);
 		}
-		if (ce_write_entry(f, ce, previous_name, (struct ondisk_cache_entry *)&ondisk) < 0)
+		written++;
+		if (hdr_version == 5) {
+			if (ce_write_mapped_entry(f, ce, journal ? written : 0) < 0)
+				err = -1;
+		} else if (ce_write_entry(f, ce, previous_name, (struct ondisk_cache_entry *)&ondisk) < 0)
 			err = -1;
 
 		if (err)
@@ -3073,6 +4004,12 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 			goto out;
 		}
 	}
+	if (journal) {
+		if (write_index_ext_header(f, eoie_c, CACHE_EXT_JOURNAL, 0) < 0) {
+			ret = -1;
+			goto out;
+		}
+	}
 
 	/*
 	 * CACHE_EXT_ENDOFINDEXENTRIES must be written as the last entry before the SHA1
@@ -3112,6 +4049,16 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 	istate->timestamp.nsec = ST_MTIME_NSEC(st);
 	trace_performance_since(start, "write index, changed mask = %x", istate->cache_changed);
 
+	/* what we wrote is the base of a new, empty journal */
+	if (journal) {
+		if (!istate->journal)
+			CALLOC_ARRAY(istate->journal, 1);
+		stat_validity_clear(&istate->journal->validity);
+		init_index_journal(istate, xsize_t(st.st_size));
+	} else {
+		discard_index_journal(istate);
+	}
+
 	/*
 	 * TODO trace2: replace "the_repository" with the actual repo instance
 	 * that is associated with the given "istate".
@@ -3145,6 +4092,15 @@ static int commit_locked_index(struct lock_file *lk)
 		return commit_lock_file(lk);
 }
 
+static void run_post_index_change_hook(struct index_state *istate)
+{
+	run_hooks_l(the_repository, "post-index-change",
+		    istate->updated_workdir ? "1" : "0",
+		    istate->updated_skipworktree ? "1" : "0", NULL);
+	istate->updated_workdir = 0;
+	istate->updated_skipworktree = 0;
+}
+
 static int do_write_locked_index(struct index_state *istate,
 				 struct lock_file *lock,
 				 unsigned flags,
@@ -3152,6 +4108,7 @@ static int do_write_locked_index(struct index_state *istate,
 {
 	int ret;
 	int was_full = istate->sparse_index == INDEX_EXPANDED;
+	char *journal_path = NULL;
 
 	ret = convert_to_sparse(istate, 0);
 
@@ -3175,16 +4132,24 @@ static int do_write_locked_index(struct index_state *istate,
 
 	if (ret)
 		return ret;
-	if (flags & COMMIT_LOCK)
+	if (flags & COMMIT_LOCK) {
+		/* a full write leaves the journal of the old index stale */
+		if (alternate_index_output) {
+			journal_path = xstrfmt("%s.journal", alternate_index_output);
+		} else {
+			char *path = get_locked_file_path(lock);
+			journal_path = xstrfmt("%s.journal", path);
+			free(path);
+		}
 		ret = commit_locked_index(lock);
-	else
+		if (!ret)
+			unlink_or_warn(journal_path);
+		free(journal_path);
+	} else {
 		ret = close_lock_file_gently(lock);
+	}
 
-	run_hooks_l(the_repository, "post-index-change",
-		    istate->updated_workdir ? "1" : "0",
-		    istate->updated_skipworktree ? "1" : "0", NULL);
-	istate->updated_workdir = 0;
-	istate->updated_skipworktree = 0;
+	run_post_index_change_hook(istate);
 
 	return ret;
 }
@@ -3358,6 +4323,15 @@ int write_locked_index(struct index_state *istate, struct lock_file *lock,
 
 	test_split_index_env = git_env_bool("GIT_TEST_SPLIT_INDEX", 0);
 
+	if (!si && !test_split_index_env && !alternate_index_output &&
+	    (flags & COMMIT_LOCK)) {
+		ret = write_index_journal(istate, lock);
+		if (!ret)
+			run_post_index_change_hook(istate);
+		if (ret <= 0)
+			goto out;
+	}
+
 	if ((!si && !test_split_index_env) ||
 	    alternate_index_output ||
 	    (istate->cache_changed & ~EXTMASK)) {
@@ -3531,6 +4505,9 @@ void move_index_extensions(struct index_state *dst, struct index_state *src)
 	src->untracked = NULL;
 	dst->cache_tree = src->cache_tree;
 	src->cache_tree = NULL;
+	discard_index_journal(dst);
+	dst->journal = src->journal;
+	src->journal = NULL;
 }
 
 struct cache_entry *dup_cache_entry(const struct cache_entry *ce,
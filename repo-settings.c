@@ -81,6 +81,8 @@ void prepare_repo_settings(struct repository *r)
 		      &r->settings.pack_use_bitmap_boundary_traversal,
 		      r->settings.pack_use_bitmap_boundary_traversal);
 	repo_cfg_bool(r, "core.usereplacerefs", &r->settings.read_replace_refs, 1);
+	repo_cfg_bool(r, "core.reachabilitybitmaps",
+		      &r->settings.core_reachability_bitmaps, 1);
 
 	/*
 	 * The GIT_TEST_MULTI_PACK_INDEX variable is special in that
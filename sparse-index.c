@@ -233,6 +233,7 @@ int convert_to_sparse(struct index_state *istate, int flags)
 	}
 
 	remove_fsmonitor(istate);
+	free_name_hash(istate);
 
 	trace2_region_enter("index", "convert_to_sparse", istate->repo);
 	istate->cache_nr = convert_to_sparse_rec(istate,
@@ -316,7 +317,8 @@ static int add_path_to_index(const struct object_id *oid,
 	return 0;
 }
 
-void expand_index(struct index_state *istate, struct pattern_list *pl)
+void expand_index_fl(struct index_state *istate, struct pattern_list *pl,
+		     const char *file, int line)
 {
 	int i;
 	struct index_state *full;
@@ -370,6 +372,19 @@ void expand_index(struct index_state *istate, struct pattern_list *pl)
 	 */
 	tr_region = pl ? "expand_index" : "ensure_full_index";
 	trace2_region_enter("index", tr_region, istate->repo);
+	trace2_counter_add(TRACE2_COUNTER_ID_INDEX_EXPANSIONS, 1);
+	if (trace2_is_enabled()) {
+		char *caller = xstrfmt("%s:%d", file, line);
+
+		trace2_data_string("index", istate->repo, "expand/caller", caller);
+		free(caller);
+	}
+
+	/*
+	 * The name hash counts the entries in each directory; start it
+	 * over rather than count the entries we keep a second time.
+	 */
+	free_name_hash(istate);
 
 	/* initialize basics of new index */
 	full = xcalloc(1, sizeof(struct index_state));
@@ -433,8 +448,6 @@ void expand_index(struct index_state *istate, struct pattern_list *pl)
 	}
 
 	/* Copy back into original index. */
-	memcpy(&istate->name_hash, &full->name_hash, sizeof(full->name_hash));
-	memcpy(&istate->dir_hash, &full->dir_hash, sizeof(full->dir_hash));
 	istate->sparse_index = pl ? INDEX_PARTIALLY_SPARSE : INDEX_EXPANDED;
 	free(istate->cache);
 	istate->cache = full->cache;
@@ -452,14 +465,16 @@ void expand_index(struct index_state *istate, struct pattern_list *pl)
 	cache_tree_free(&istate->cache_tree);
 	cache_tree_update(istate, 0);
 
+	trace2_data_intmax("index", istate->repo, "expand/entries",
+			   istate->cache_nr);
 	trace2_region_leave("index", tr_region, istate->repo);
 }
 
-void ensure_full_index(struct index_state *istate)
+void ensure_full_index_fl(struct index_state *istate, const char *file, int line)
 {
 	if (!istate)
 		BUG("ensure_full_index() must get an index!");
-	expand_index(istate, NULL);
+	expand_index_fl(istate, NULL, file, line);
 }
 
 void ensure_correct_sparsity(struct index_state *istate)
@@ -42,8 +42,18 @@ struct pattern_list;
  * If the pattern list is NULL or does not use cone mode patterns, then the
  * index is expanded to a full index.
  */
-void expand_index(struct index_state *istate, struct pattern_list *pl);
+void expand_index_fl(struct index_state *istate, struct pattern_list *pl,
+		     const char *file, int line);
+#define expand_index(istate, pl) \
+	expand_index_fl((istate), (pl), __FILE__, __LINE__)
 
-void ensure_full_index(struct index_state *istate);
+/*
+ * Expand all sparse directories. Each expansion is counted in the
+ * "index/expansions" trace2 counter, and the place it was asked for
+ * is logged in the "expand/caller" trace2 data.
+ */
+void ensure_full_index_fl(struct index_state *istate, const char *file, int line);
+#define ensure_full_index(istate) \
+	ensure_full_index_fl((istate), __FILE__, __LINE__)
 
 #endif
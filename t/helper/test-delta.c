@@ -11,9 +11,59 @@
 #include "test-tool.h"
 #include "git-compat-util.h"
 #include "delta.h"
+#include "trace.h"
 
 static const char usage_str[] =
-	"test-tool delta (-d|-p) <from_file> <data_file> <out_file>";
+	"test-tool delta (-d|-p) <from_file> <data_file> <out_file>\n"
+	"   or: test-tool delta -b <from_file> <data_file> [<rounds>]";
+
+static double mb_per_sec(unsigned long size, int rounds, uint64_t ns)
+{
+	if (!ns)
+		ns = 1;
+	return (double)size * rounds / (1024 * 1024) / (ns / 1e9);
+}
+
+/*
+ * Time index construction over <from_file> and delta generation
+ * against <data_file>, and report the throughput of each.
+ */
+static int bench_delta(const void *from_buf, unsigned long from_size,
+		       const void *data_buf, unsigned long data_size,
+		       int rounds)
+{
+	uint64_t index_ns = 0, delta_ns = 0, start;
+	unsigned long delta_size = 0;
+	int i;
+
+	for (i = 0; i < rounds; i++) {
+		struct delta_index *index;
+		void *delta;
+
+		start = getnanotime();
+		index = create_delta_index(from_buf, from_size);
+		index_ns += getnanotime() - start;
+		if (!index) {
+			fprintf(stderr, "delta operation failed (returned NULL)\n");
+			return 1;
+		}
+
+		start = getnanotime();
+		delta = create_delta(index, data_buf, data_size, &delta_size, 0);
+		delta_ns += getnanotime() - start;
+		free_delta_index(index);
+		if (!delta) {
+			fprintf(stderr, "delta operation failed (returned NULL)\n");
+			return 1;
+		}
+		free(delta);
+	}
+
+	printf("index: %.1f MB/s\n", mb_per_sec(from_size, rounds, index_ns));
+	printf("delta: %.1f MB/s\n", mb_per_sec(data_size, rounds, delta_ns));
+	printf("size: %lu\n", delta_size);
+	return 0;
+}
 
 int cmd__delta(int argc, const char **argv)
 {
@@ -21,9 +71,11 @@ int cmd__delta(int argc, const char **argv)
 	struct stat st;
 	void *from_buf = NULL, *data_buf = NULL, *out_buf = NULL;
 	unsigned long from_size, data_size, out_size;
+	int bench = argc > 1 && !strcmp(argv[1], "-b");
 	int ret = 1;
 
-	if (argc != 5 || (strcmp(argv[1], "-d") && strcmp(argv[1], "-p"))) {
+	if (bench ? (argc != 4 && argc != 5) :
+	    (argc != 5 || (strcmp(argv[1], "-d") && strcmp(argv[1], "-p")))) {
 		fprintf(stderr, "usage: %s\n", usage_str);
 		return 1;
 	}
@@ -56,6 +108,13 @@ int cmd__delta(int argc, const char **argv)
 	}
 	close(fd);
 
+	if (bench) {
+		int rounds = argc > 4 ? atoi(argv[4]) : 10;
+		ret = bench_delta(from_buf, from_size, data_buf, data_size,
+				  rounds > 0 ? rounds : 1);
+		goto cleanup;
+	}
+
 	if (argv[1][1] == 'd')
 		out_buf = diff_delta(from_buf, from_size,
 				     data_buf, data_size,
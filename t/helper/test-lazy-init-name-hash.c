@@ -32,6 +32,9 @@ static void dump_run(void)
 		struct hashmap_entry ent;
 		struct dir_entry *parent;
 		int nr;
+		unsigned filled : 1;
+		char **alias;
+		int alias_nr, alias_alloc;
 		unsigned int namelen;
 		char name[FLEX_ARRAY];
 	};
@@ -216,7 +219,7 @@ int cmd__lazy_init_name_hash(int argc, const char **argv)
 	argc = parse_options(argc, argv, prefix, options, usage, 0);
 
 	/*
-	 * istate->dir_hash is only created when ignore_case is set.
+	 * The threaded code is only used when ignore_case is set.
 	 */
 	ignore_case = 1;
 
@@ -6,6 +6,7 @@
 #include "gettext.h"
 #include "hex.h"
 #include "object-name.h"
+#include "packfile.h"
 #include "ref-filter.h"
 #include "setup.h"
 #include "string-list.h"
@@ -181,6 +182,9 @@ int cmd__reach(int ac, const char **av)
 		free_commit_list(list);
 	}
 
+	/* release what the query loaded, e.g. the reachability bitmap */
+	close_object_store(the_repository->objects);
+
 	object_array_clear(&X_obj);
 	strbuf_release(&buf);
 	free_commit_list(X);
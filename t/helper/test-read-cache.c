@@ -2,14 +2,44 @@
 
 #include "test-tool.h"
 #include "config.h"
+#include "lockfile.h"
 #include "read-cache-ll.h"
 #include "repository.h"
+#include "run-command.h"
 #include "setup.h"
 
+/*
+ * Read the index without holding its lock, as "git status" does, let
+ * "cmd" update it in the meantime, and then write ours if still able.
+ */
+static int update_after(const char *cmd)
+{
+	struct lock_file lock = LOCK_INIT;
+	struct child_process cp = CHILD_PROCESS_INIT;
+
+	repo_read_index(the_repository);
+	the_repository->index->cache_changed |= CE_ENTRY_CHANGED;
+
+	cp.use_shell = 1;
+	strvec_push(&cp.args, cmd);
+	if (run_command(&cp))
+		die("'%s' failed", cmd);
+
+	repo_hold_locked_index(the_repository, &lock, LOCK_DIE_ON_ERROR);
+	repo_update_index_if_able(the_repository, &lock);
+	return 0;
+}
+
 int cmd__read_cache(int argc, const char **argv)
 {
 	int i, cnt = 1;
-	const char *name = NULL;
+	const char *name = NULL, *cmd;
+
+	if (argc == 2 && skip_prefix(argv[1], "--update-after=", &cmd)) {
+		setup_git_directory();
+		git_config(git_default_config, NULL);
+		return update_after(cmd);
+	}
 
 	if (argc > 1 && skip_prefix(argv[1], "--print-and-refresh=", &name)) {
 		argc--;
@@ -0,0 +1,20 @@
+#include "test-tool.h"
+#include "batch-stat.h"
+
+/*
+ * Exit with 0 if paths can be stat()ed in batches here, i.e. whether
+ * "index.batchStat" has any effect.
+ */
+int cmd__stat_batch(int argc, const char **argv)
+{
+	struct stat_batch *sb;
+
+	if (argc != 2 || strcmp(argv[1], "supported"))
+		die("usage: test-tool stat-batch supported");
+
+	sb = stat_batch_new();
+	if (!sb)
+		return 1;
+	stat_batch_free(sb);
+	return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+
+test_description='Tests the performance of log --graph'
+
+. ./perf-lib.sh
+
+test_perf_large_repo
+
+test_expect_success 'setup' '
+	git commit-graph write --reachable
+'
+
+test_perf 'log --graph --oneline --all' '
+	git log --graph --oneline --all >/dev/null
+'
+
+test_perf 'log --graph --oneline --all, first page' '
+	git log --graph --oneline --all -n 50 >/dev/null
+'
+
+test_perf 'log --graph --oneline --all --color' '
+	git log --graph --oneline --all --color=always >/dev/null
+'
+
+test_done
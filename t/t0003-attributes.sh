@@ -321,6 +321,76 @@ EOF
 	test_must_be_empty err
 '
 
+test_expect_success 'long attributes files match like short ones' '
+	test_when_finished "rm -rf long" &&
+	git init long &&
+	(
+		cd long &&
+		mkdir sub &&
+		cat >.gitattributes <<-\EOF &&
+		* text
+		*.c diff=cpp
+		*.C -diff
+		Makefile* eol=lf
+		README merge=union
+		/top-only export-ignore
+		doc/**/*.html linguist
+		doc/api-*.txt -text
+		[ab]*.sh eol=crlf
+		EOF
+		cat >sub/.gitattributes <<-\EOF &&
+		/anchored foo
+		nested/*.tmp bar
+		*.c -diff
+		EOF
+		cat >paths <<-\EOF &&
+		a.c
+		x/B.C
+		Makefile
+		x/Makefile.in
+		README
+		x/readme
+		top-only
+		x/top-only
+		doc/a/b/c.html
+		x/doc/c.html
+		doc/api-1.txt
+		Doc/API-1.txt
+		a.sh
+		x/b2.sh
+		sub/anchored
+		sub/x/anchored
+		sub/nested/a.tmp
+		sub/x/nested/a.tmp
+		sub/f.c
+		plain
+		EOF
+		for ignorecase in false true
+		do
+			git -c core.ignorecase=$ignorecase \
+				check-attr --stdin -a <paths >expect.$ignorecase ||
+			return 1
+		done &&
+		for i in $(test_seq 1 50)
+		do
+			cat >>.gitattributes <<-EOF &&
+			filler-$i foo
+			*.filler$i foo
+			filler$i*.c foo
+			/filler/$i/* foo
+			EOF
+			echo "/filler/$i/* foo" >>sub/.gitattributes || return 1
+		done &&
+		for ignorecase in false true
+		do
+			git -c core.ignorecase=$ignorecase \
+				check-attr --stdin -a <paths >actual.$ignorecase &&
+			test_cmp expect.$ignorecase actual.$ignorecase ||
+			return 1
+		done
+	)
+'
+
 test_expect_success 'using --git-dir and --work-tree' '
 	mkdir unreal real &&
 	git init real &&
@@ -944,6 +944,88 @@ test_expect_success SYMLINKS 'symlinks not respected in-tree' '
 	test_grep "unable to access.*gitignore" err
 '
 
+test_expect_success 'long ignore files match like short ones' '
+	test_when_finished "rm -rf long" &&
+	git init long &&
+	(
+		cd long &&
+		mkdir -p build x/build sub &&
+		cat >.gitignore <<-\EOF &&
+		*.o
+		!keep.o
+		build/
+		/top-only
+		doc/**/*.html
+		doc/api-*.txt
+		sub*dir
+		*~
+		Makefile.[ch]
+		**/cache
+		EOF
+		cat >sub/.gitignore <<-\EOF &&
+		/anchored
+		nested/*.tmp
+		name
+		!*.o
+		EOF
+		cat >paths <<-\EOF &&
+		a.o
+		A.O
+		keep.o
+		x/keep.o
+		build
+		BUILD
+		x/build
+		build-file
+		top-only
+		x/top-only
+		doc/a/b/c.html
+		doc/c.html
+		x/doc/c.html
+		doc/api-1.txt
+		Doc/API-1.txt
+		doc/x/api-1.txt
+		subXdir
+		file~
+		Makefile.c
+		Makefile.o
+		cache
+		x/y/cache
+		sub/anchored
+		sub/x/anchored
+		sub/nested/a.tmp
+		sub/x/nested/a.tmp
+		sub/name
+		sub/x/NAME
+		sub/a.o
+		plain
+		EOF
+		for ignorecase in false true
+		do
+			git -c core.ignorecase=$ignorecase \
+				check-ignore -v -n --stdin <paths >expect.$ignorecase ||
+			return 1
+		done &&
+		for i in $(test_seq 1 50)
+		do
+			cat >>.gitignore <<-EOF &&
+			filler-$i
+			*.filler$i
+			filler$i*.c
+			/filler/$i/*
+			EOF
+			echo "/filler/$i/*" >>sub/.gitignore || return 1
+		done &&
+		for ignorecase in false true
+		do
+			git -c core.ignorecase=$ignorecase \
+				check-ignore -v -n --stdin <paths >actual.$ignorecase &&
+			test_cmp expect.$ignorecase actual.$ignorecase ||
+			return 1
+		done
+	)
+'
+
 test_expect_success EXPENSIVE 'large exclude file ignored in tree' '
 	test_when_finished "rm .gitignore" &&
 	dd if=/dev/zero of=.gitignore bs=101M count=1 &&
@@ -278,4 +278,56 @@ test_expect_success 'switching trees does not invalidate shared index' '
 	)
 '
 
+test_expect_success 'cache-tree built on several threads' '
+	git init threads &&
+	(
+		cd threads &&
+		for d in a b c d
+		do
+			for e in 1 2 3
+			do
+				mkdir -p $d/$e/sub &&
+				echo $d$e >$d/$e/file &&
+				echo $d$e >$d/$e/sub/file || return 1
+			done
+		done &&
+		for threads in 1 4
+		do
+			(
+				GIT_TEST_CACHE_TREE_THREADS=$threads &&
+				export GIT_TEST_CACHE_TREE_THREADS &&
+				rm -f .git/index &&
+				git add . &&
+				git write-tree &&
+				test-tool dump-cache-tree &&
+				echo changed >c/2/sub/file &&
+				git add c/2/sub/file &&
+				echo new >b/1/sub/new &&
+				git add -N b/1/sub/new &&
+				GIT_TRACE2_EVENT="$(pwd)/../trace.$threads" \
+				git write-tree &&
+				test-tool dump-cache-tree &&
+				echo c2 >c/2/sub/file &&
+				rm b/1/sub/new
+			) >../out.$threads || return 1
+		done
+	) &&
+	test_cmp out.1 out.4 &&
+	test_grep "\"key\":\"build/threads\"" trace.4
+'
+
+test_expect_success 'cache-tree on several threads reports broken entries' '
+	(
+		cd threads &&
+		broken=$(echo broken | git hash-object --stdin | sed "s/./1/g") &&
+		git update-index --add --cacheinfo 100644,$broken,d/3/sub/broken &&
+		git update-index --add --cacheinfo 100644,$broken,b/2/broken &&
+		test_must_fail git -c core.cacheTreeThreads=1 write-tree 2>../expect &&
+		test_must_fail env GIT_TEST_CACHE_TREE_THREADS=4 \
+			git write-tree 2>../actual
+	) &&
+	test_cmp expect actual &&
+	test_grep "b/2/broken" actual
+'
+
 test_done
@@ -1647,6 +1647,39 @@ test_expect_success 'sparse index is not expanded: blame' '
 	done
 '
 
+test_expect_success 'sparse index is not expanded: add -p' '
+	init_repos &&
+
+	echo more >>sparse-index/deep/a &&
+	echo y >in &&
+	ensure_not_expanded add -p <in &&
+	git -C sparse-index diff --cached --name-only >actual &&
+	echo deep/a >expect &&
+	test_cmp expect actual &&
+
+	git -C sparse-index diff --cached >patch &&
+	git -C sparse-index reset -q &&
+	ensure_not_expanded apply --cached ../patch &&
+	git -C sparse-index diff --cached --name-only >actual &&
+	test_cmp expect actual &&
+
+	git -C sparse-index reset -q --hard &&
+	ensure_not_expanded apply --index ../patch &&
+	git -C sparse-index diff --cached --name-only >actual &&
+	test_cmp expect actual &&
+	git -C sparse-index diff --name-only >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'expansions are counted with their caller' '
+	init_repos &&
+
+	GIT_TRACE2_EVENT="$(pwd)/trace2.txt" \
+		git -C sparse-index ls-files >/dev/null &&
+	grep "\"key\":\"expand/caller\",\"value\":\"[^\"]*ls-files.c:[0-9]*\"" trace2.txt &&
+	grep "\"category\":\"index\",\"name\":\"expansions\",\"count\":1" trace2.txt
+'
+
 test_expect_success 'sparse index is not expanded: fetch/pull' '
 	init_repos &&
 
@@ -133,4 +133,76 @@ test_expect_success 'index version config precedence' '
 	test_index_version 0 true 2 2
 '
 
+test_expect_success 'index version 5 round-trips entries and flags' '
+	git init v5 &&
+	(
+		cd v5 &&
+		test_commit one &&
+		test_commit two &&
+		echo new >ita &&
+		git add -N ita &&
+		git update-index --skip-worktree one.t &&
+		git ls-files -s -t --debug >expect &&
+
+		git update-index --index-version 5 &&
+		echo 5 >expect.version &&
+		git update-index --show-index-version >actual.version &&
+		test_cmp expect.version actual.version &&
+		git ls-files -s -t --debug >actual &&
+		test_cmp expect actual &&
+
+		git update-index --index-version 3 &&
+		git ls-files -s -t --debug >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'entries of a version 5 index can be modified' '
+	(
+		cd v5 &&
+		git update-index --index-version 5 &&
+		echo changed >two.t &&
+		echo " M two.t" >expect &&
+		git status --porcelain -uno -- two.t >actual &&
+		test_cmp expect actual &&
+		git add two.t &&
+		echo two.t >expect &&
+		git diff --cached --name-only -- two.t >actual &&
+		test_cmp expect actual &&
+		git update-index --show-index-version >actual.version &&
+		test_cmp expect.version actual.version &&
+
+		git update-index --split-index &&
+		git rm -q --cached ita &&
+		git diff --cached --name-only >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'version 5 index records its entry format little-endian' '
+	(
+		cd v5 &&
+		git update-index --no-split-index &&
+		echo "01 00 00 00" >expect &&
+		test_copy_bytes 16 <.git/index | tail -c 4 |
+		od -An -tx1 | tr -s " " | sed "s/^ //" >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'version 5 index with an unknown entry format is rejected' '
+	(
+		cd v5 &&
+		printf "\377\377\377\377" |
+		dd of=.git/index bs=1 seek=12 count=4 conv=notrunc &&
+		test_must_fail git ls-files 2>err &&
+		test_grep "unknown format 4294967295" err &&
+		test_grep "git reset" err &&
+		rm .git/index &&
+		git reset -q &&
+		git ls-files >actual &&
+		test_grep one.t actual
+	)
+'
+
 test_done
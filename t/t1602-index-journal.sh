@@ -0,0 +1,166 @@
+#!/bin/sh
+
+test_description='appending index updates to a journal'
+
+. ./test-lib.sh
+
+sane_unset GIT_TEST_SPLIT_INDEX GIT_TEST_INDEX_JOURNAL
+
+test_expect_success 'setup' '
+	for i in $(test_seq 1 100)
+	do
+		echo $i >file$i || return 1
+	done &&
+	git add . &&
+	git commit -q -m initial &&
+	git config index.journal true &&
+	rm .git/index &&
+	git reset -q &&
+	test_path_is_missing .git/index.journal
+'
+
+test_expect_success 'adding a file leaves the index file alone' '
+	cp .git/index base &&
+	echo new >new &&
+	git add new &&
+	test_cmp_bin base .git/index &&
+	test_path_is_file .git/index.journal &&
+	git ls-files -s new >actual &&
+	echo "100644 $(git hash-object new) 0	new" >expect &&
+	test_cmp expect actual &&
+	git diff --cached --name-status >actual &&
+	printf "A\tnew\n" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modifications and removals are journaled' '
+	echo changed >>file5 &&
+	git add file5 &&
+	git rm -q --cached file7 &&
+	test_cmp_bin base .git/index &&
+	git diff --cached --name-status >actual &&
+	cat >expect <<-\EOF &&
+	M	file5
+	D	file7
+	A	new
+	EOF
+	test_cmp expect actual &&
+	git ls-files >actual &&
+	git ls-files --with-tree=HEAD >all &&
+	grep -v -e "^file7$" all >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'an entry can be changed again' '
+	echo again >>file5 &&
+	git add file5 &&
+	git add file7 &&
+	git diff --cached --name-status >actual &&
+	cat >expect <<-\EOF &&
+	M	file5
+	A	new
+	EOF
+	test_cmp expect actual &&
+	git ls-files -s file5 >actual &&
+	echo "100644 $(git hash-object file5) 0	file5" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'write-tree sees the journaled entries' '
+	git write-tree >expect &&
+	git -c index.journal=false update-index --force-write-index &&
+	test_path_is_missing .git/index.journal &&
+	! test_cmp_bin base .git/index &&
+	git write-tree >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a large update compacts the journal' '
+	cp .git/index base &&
+	echo more >>file1 &&
+	git add file1 &&
+	test_path_is_file .git/index.journal &&
+	for i in $(test_seq 10 60)
+	do
+		echo more >>file$i || return 1
+	done &&
+	git add -u &&
+	test_path_is_missing .git/index.journal &&
+	! test_cmp_bin base .git/index &&
+	git diff --cached --name-only >actual &&
+	test_line_count = 54 actual
+'
+
+test_expect_success 'an incomplete batch is ignored' '
+	git commit -q -m update &&
+	echo torn >>file2 &&
+	git add file2 &&
+	cp .git/index.journal complete &&
+	echo partial >>.git/index.journal &&
+	git diff --cached --name-only >actual &&
+	echo file2 >expect &&
+	test_cmp expect actual &&
+	echo torn >>file3 &&
+	git add file3 &&
+	test_grep ! partial .git/index.journal &&
+	git diff --cached --name-only >actual &&
+	test_write_lines file2 file3 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a journal over another base is ignored' '
+	cp .git/index.journal stale &&
+	git -c index.journalMaxPercent=0 reset -q &&
+	test_path_is_missing .git/index.journal &&
+	cp stale .git/index.journal &&
+	git diff --cached --name-only >actual &&
+	test_must_be_empty actual &&
+	echo fresh >>file4 &&
+	git add file4 &&
+	git diff --cached --name-only >actual &&
+	echo file4 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'writing the index in full drops the journal' '
+	test_path_is_file .git/index.journal &&
+	git -c index.journal=false add file3 &&
+	test_path_is_missing .git/index.journal &&
+	git diff --cached --name-only >actual &&
+	test_write_lines file3 file4 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'resolve-undo and cache-tree survive in the journal' '
+	git config index.journal true &&
+	git reset -q --hard &&
+	git checkout -q -b side &&
+	echo side >file1 &&
+	git commit -q -a -m side &&
+	git checkout -q - &&
+	echo main >file1 &&
+	git commit -q -a -m main &&
+	test_must_fail git merge side &&
+	echo resolved >file1 &&
+	git add file1 &&
+	test_path_is_file .git/index.journal &&
+	git ls-files --resolve-undo >actual &&
+	test_line_count = 3 actual &&
+	git commit -q --no-edit &&
+	test-tool dump-cache-tree >actual &&
+	git -c index.journal=false update-index --force-write-index &&
+	test-tool dump-cache-tree >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'an update journaled after the index was read is kept' '
+	git update-index --force-write-index &&
+	echo racing >>file6 &&
+	test-tool read-cache --update-after="git add file6" &&
+	test_path_is_file .git/index.journal &&
+	git diff --cached --name-only >actual &&
+	echo file6 >expect &&
+	test_cmp expect actual
+'
+
+test_done
@@ -285,4 +285,77 @@ test_expect_success 'checkout -b rejects an extra path argument' '
 	test_grep "Cannot update paths and switch to branch" err
 '
 
+test_expect_success 'setup for checkout on several threads' '
+	git init unpack &&
+	(
+		cd unpack &&
+		for d in a b c d
+		do
+			mkdir -p $d/sub &&
+			for i in $(test_seq 1 20)
+			do
+				echo $d$i >$d/file$i &&
+				echo $d$i >$d/sub/file$i || return 1
+			done
+		done &&
+		echo top >top &&
+		git add . &&
+		git commit -q -m one &&
+		git branch one &&
+		git checkout -q -b two &&
+		echo changed >>a/file3 &&
+		echo changed >>c/sub/file7 &&
+		git rm -q -r d &&
+		mkdir e &&
+		echo new >e/file &&
+		git add . &&
+		git commit -q -m two &&
+		git checkout -q one
+	)
+'
+
+test_expect_success 'checkout on several threads' '
+	(
+		cd unpack &&
+		GIT_TRACE2_EVENT="$(pwd)/../trace.event" \
+		GIT_TEST_UNPACK_THREADS=4 git checkout two &&
+		test_path_is_missing d &&
+		git diff --quiet two &&
+		git ls-files -o >../untracked &&
+		test_must_be_empty ../untracked &&
+		test-tool dump-cache-tree >actual &&
+		git -c core.unpackThreads=1 read-tree two &&
+		test-tool dump-cache-tree >expect &&
+		test_cmp expect actual
+	) &&
+	test_grep "\"key\":\"partitions\"" trace.event
+'
+
+test_expect_success 'threads do not add up their tree depths' '
+	(
+		cd unpack &&
+		git checkout -q one &&
+		GIT_TEST_UNPACK_THREADS=4 \
+			git -c core.maxTreeDepth=2 checkout -q two 2>err &&
+		test_must_be_empty err &&
+		git diff --quiet two &&
+		git checkout -q one
+	)
+'
+
+test_expect_success 'checkout on several threads reports problems in order' '
+	(
+		cd unpack &&
+		git checkout -q one &&
+		echo local >>a/file3 &&
+		echo local >>c/sub/file7 &&
+		test_must_fail git -c core.unpackThreads=1 checkout two 2>expect &&
+		test_must_fail env GIT_TEST_UNPACK_THREADS=4 git checkout two 2>actual &&
+		test_cmp expect actual &&
+		git diff --name-only >actual &&
+		test_write_lines a/file3 c/sub/file7 >expect &&
+		test_cmp expect actual
+	)
+'
+
 test_done
@@ -229,6 +229,38 @@ test_expect_success SYMLINKS 'parallel checkout checks for symlinks in leading d
 	)
 '
 
+test_expect_success 'identical blobs are written once per worker' '
+	set_checkout_config 2 0 &&
+	git init identical &&
+	(
+		cd identical &&
+		echo "crlf/* text eol=crlf" >.gitattributes &&
+		for d in a b c crlf
+		do
+			mkdir $d &&
+			test_write_lines 1 2 3 >$d/same &&
+			echo $d >$d/unique || return 1
+		done &&
+		git add -A &&
+		git commit -q -m identical &&
+		rm -rf a b c crlf &&
+
+		GIT_TRACE2_EVENT="$(pwd)/../identical.trace" \
+			test_checkout_workers 2 git checkout . &&
+		for d in a b c
+		do
+			test_write_lines 1 2 3 >../expect &&
+			test_cmp ../expect $d/same &&
+			echo $d >../expect &&
+			test_cmp ../expect $d/unique || return 1
+		done &&
+		printf "1\r\n2\r\n3\r\n" >../expect &&
+		test_cmp ../expect crlf/same
+	) &&
+	verify_checkout identical &&
+	grep -E "\"key\":\"reuse/(cloned|copied)\"" identical.trace
+'
+
 # This test is here (and not in e.g. t2022-checkout-paths.sh), because we
 # check the final report including sequential, parallel, and delayed entries
 # all at the same time. So we must have finer control of the parallel checkout
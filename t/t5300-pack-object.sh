@@ -222,6 +222,27 @@ test_expect_success PERL_TEST_HELPERS 'compare delta flavors' '
 	'\'' test-2-$packname_2.pack test-3-$packname_3.pack
 '
 
+test_expect_success 'portable and SIMD delta kernels agree' '
+	test_when_finished "rm -f delta-*" &&
+	{
+		head -c 100003 a_big &&
+		printf "inserted text" &&
+		tail -c 1000000 a_big &&
+		head -c 5000 b_big &&
+		cat d a_big
+	} >delta-target &&
+	for pair in "a_big delta-target" "delta-target a_big" "a d" "c d" "a b"
+	do
+		set -- $pair &&
+		test-tool delta -d $1 $2 delta-simd &&
+		GIT_TEST_DIFF_DELTA_NO_SIMD=1 \
+			test-tool delta -d $1 $2 delta-portable &&
+		test_cmp_bin delta-portable delta-simd &&
+		test-tool delta -p $1 delta-simd delta-out &&
+		test_cmp_bin $2 delta-out || return 1
+	done
+'
+
 check_use_objects () {
 	test_when_finished "rm -rf git2" &&
 	git init --bare git2 &&
@@ -581,6 +602,98 @@ test_expect_success !PTHREADS,!FAIL_PREREQS \
 	grep -F "no threads support, ignoring pack.threads" err
 '
 
+test_expect_success PTHREADS 'threaded write phase produces the same pack' '
+	git init threaded-write &&
+	(
+		cd threaded-write &&
+		for i in $(test_seq 300)
+		do
+			echo "content $i" >file$i || return 1
+		done &&
+		git add . &&
+		git commit -m many &&
+		git rev-list --objects --all >objs &&
+
+		git pack-objects --threads=1 --window=0 --no-reuse-object \
+			--stdout <objs >single.pack &&
+		GIT_TRACE2_EVENT="$(pwd)/trace2" \
+			git pack-objects --threads=4 --window=0 --no-reuse-object \
+			--stdout <objs >threaded.pack &&
+		test_cmp_bin single.pack threaded.pack &&
+		grep "\"write_pack_file/compressed_ahead\",\"value\":\"302\"" trace2 &&
+
+		git pack-objects --threads=4 --no-reuse-object \
+			--stdout <objs >delta.pack &&
+		git index-pack delta.pack &&
+		git verify-pack delta.idx &&
+		git show-index <delta.idx >actual &&
+		test_line_count = 302 actual
+	)
+'
+
+test_expect_success 'delta index cache is used by threaded searches' '
+	git init delta-index-cache &&
+	(
+		cd delta-index-cache &&
+		test_seq 1000 >base &&
+		for i in $(test_seq 80)
+		do
+			{ cat base && echo "variant $i"; } >file$i || return 1
+		done &&
+		git add . &&
+		git commit -m similar &&
+		git rev-list --objects --all >objs &&
+
+		GIT_TRACE2_EVENT="$(pwd)/trace2" \
+			git -c pack.deltaIndexCacheLimit=1m pack-objects \
+			--threads=2 --window=4 --no-reuse-delta \
+			--stdout <objs >cached.pack &&
+		git index-pack cached.pack &&
+		git verify-pack cached.idx &&
+		git show-index <cached.idx >actual &&
+		test_line_count = $(wc -l <objs) actual &&
+		grep "\"delta_index_cache/hits\",\"value\":\"[1-9]" trace2
+	)
+'
+
+test_expect_success 'out-of-line pack offsets do not change the pack' '
+	(
+		cd delta-index-cache &&
+		git repack -adf &&
+		git pack-objects --stdout <objs >inline.pack &&
+		GIT_TEST_OE_OFFSET=1 \
+			git pack-objects --stdout <objs >out-of-line.pack &&
+		test_cmp_bin inline.pack out-of-line.pack
+	)
+'
+
+test_expect_success 'zero-copy pack reuse produces the same pack' '
+	git init zero-copy &&
+	(
+		cd zero-copy &&
+		test-tool genrandom "zero copy" 262144 >big &&
+		git add big &&
+		git commit -m big &&
+		test_commit small &&
+		git repack -adb &&
+
+		echo HEAD >in &&
+		GIT_TEST_NO_ZERO_COPY=1 \
+			git pack-objects --revs --stdout <in >copied.pack &&
+		git pack-objects --revs --stdout <in >sent.pack &&
+		git pack-objects --revs --stdout <in | cat >piped.pack &&
+		test_cmp_bin copied.pack sent.pack &&
+		test_cmp_bin copied.pack piped.pack
+	) &&
+	git init --bare zero-copy.git &&
+	git -C zero-copy.git index-pack --stdin <zero-copy/sent.pack &&
+	git -C zero-copy rev-parse HEAD >head &&
+	git -C zero-copy.git update-ref HEAD "$(cat head)" &&
+	git -C zero-copy rev-list --objects HEAD >expect &&
+	git -C zero-copy.git rev-list --objects HEAD >actual &&
+	test_cmp expect actual
+'
+
 test_expect_success 'pack-objects in too-many-packs mode' '
 	GIT_TEST_FULL_IN_PACK_ARRAY=1 git repack -ad &&
 	git fsck
@@ -568,4 +568,59 @@ test_expect_success 'truncated bitmap fails gracefully (lookup table)' '
 	test_grep corrupted.bitmap.index stderr
 '
 
+test_expect_success 'pack.bitmapFormat=roaring writes a usable bitmap' '
+	git repack -adb &&
+	tip=$(test-tool bitmap list-commits | head -n 1) &&
+	git rev-list --test-bitmap $tip 2>stderr &&
+	test_grep "Bitmap v1 test" stderr &&
+	git rev-list --use-bitmap-index --objects --all | sort >expect &&
+
+	for lookup in false true
+	do
+		git -c pack.bitmapFormat=roaring \
+			-c pack.writeBitmapLookupTable=$lookup repack -adb &&
+		git rev-list --test-bitmap $tip 2>stderr &&
+		test_grep "Bitmap v2 test" stderr &&
+		git rev-list --use-bitmap-index --objects --all |
+			sort >actual &&
+		test_cmp expect actual || return 1
+	done
+'
+
+test_expect_success 'roaring bitmaps answer range and reachability queries' '
+	git -c pack.bitmapFormat=roaring repack -adb &&
+	git rev-list --objects HEAD~5..HEAD | cut -d" " -f1 | sort >expect &&
+	git rev-list --use-bitmap-index --objects HEAD~5..HEAD |
+		cut -d" " -f1 | sort >actual &&
+	test_cmp expect actual &&
+	git merge-base --is-ancestor HEAD~5 HEAD &&
+	test_must_fail git merge-base --is-ancestor HEAD HEAD~5 &&
+	git -c core.reachabilityBitmaps=false branch --merged HEAD >expect &&
+	git branch --merged HEAD >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'test-tool bitmap compare-formats' '
+	test-tool bitmap compare-formats >out &&
+	grep "^ewah: [0-9]* bytes" out &&
+	grep "^roaring: [0-9]* bytes" out
+'
+
+test_expect_success 'unknown pack.bitmapFormat is rejected' '
+	test_must_fail git -c pack.bitmapFormat=bogus repack -adb 2>err &&
+	test_grep "unknown bitmap format .bogus." err
+'
+
+test_expect_success 'commit bitmaps are decoded on demand' '
+	git -c pack.writeBitmapLookupTable=false repack -adb &&
+	test-tool bitmap list-commits >commits &&
+	test_line_count -gt 1 commits &&
+	tip=$(head -n 1 commits) &&
+
+	GIT_TRACE2_EVENT="$(pwd)/trace2" \
+		git rev-list --use-bitmap-index --count $tip &&
+	decoded=$(sed -n "s/.*\"key\":\"bitmap\/decoded\",\"value\":\"\([0-9]*\)\".*/\1/p" trace2) &&
+	test "$decoded" -lt $(wc -l <commits)
+'
+
 test_done
@@ -117,4 +117,21 @@ test_expect_success 'negative depth disables deltas' '
 	test_cmp expect actual
 '
 
+test_expect_success PTHREADS 'threaded search keeps --depth across split lists' '
+	test_seq 3000 >versioned &&
+	for i in $(test_seq 200)
+	do
+		echo "line $i" >>versioned &&
+		git hash-object -w versioned || return 1
+	done >versions &&
+	GIT_TRACE2_EVENT="$(pwd)/threads.trace" \
+		git pack-objects --threads=4 --window=10 --depth=3 \
+		--no-reuse-delta threaded <versions >name &&
+	pack=$(cat name) &&
+	max_chain threaded-$pack.pack >actual &&
+	test 3 -ge $(cat actual) &&
+	git verify-pack threaded-$pack.idx &&
+	grep "th0[1-4]:find_deltas.*\"find_deltas/objects\"" threads.trace
+'
+
 test_done
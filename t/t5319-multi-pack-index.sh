@@ -209,6 +209,28 @@ test_expect_success 'write midx with twelve packs' '
 
 compare_results_with_midx "twelve packs"
 
+test_expect_success 'threaded MIDX write matches single-threaded one' '
+	rm -f $objdir/pack/multi-pack-index* &&
+	GIT_TEST_MIDX_WRITE_THREADS=1 \
+		git multi-pack-index --object-dir=$objdir write &&
+	cp $objdir/pack/multi-pack-index midx.one &&
+
+	rm -f $objdir/pack/multi-pack-index* &&
+	GIT_TEST_MIDX_WRITE_THREADS=5 \
+		git multi-pack-index --object-dir=$objdir write &&
+	test_cmp_bin midx.one $objdir/pack/multi-pack-index &&
+
+	# merge with the objects of an existing MIDX, too
+	rm -f $objdir/pack/multi-pack-index* &&
+	pack=$(ls $objdir/pack/*.idx | head -n 1) &&
+	echo "$(basename $pack)" >one-pack &&
+	git multi-pack-index --object-dir=$objdir write --stdin-packs <one-pack &&
+	GIT_TEST_MIDX_WRITE_THREADS=5 \
+		git multi-pack-index --object-dir=$objdir write &&
+	test_cmp_bin midx.one $objdir/pack/multi-pack-index &&
+	git multi-pack-index --object-dir=$objdir verify
+'
+
 test_expect_success 'multi-pack-index *.rev cleanup with --object-dir' '
 	git init repo &&
 	git clone -s repo alternate &&
@@ -280,4 +280,36 @@ test_expect_success 'duplicate objects with verbatim reuse' '
 	)
 '
 
+test_expect_success 'reuse delta whose base is picked from another pack' '
+	git init cross-pack-delta &&
+	(
+		cd cross-pack-delta &&
+
+		git config pack.allowPackReuse multi &&
+
+		test_seq 64 >f &&
+		git add f &&
+		test_tick &&
+		git commit -m base &&
+		test_seq 65 >f &&
+		test_tick &&
+		git commit -a -m delta &&
+		git repack -adf &&
+
+		have_delta $(git rev-parse HEAD^:f) $(git rev-parse HEAD:f) &&
+
+		# Put a second copy of the base into its own, preferred
+		# pack. The delta can only be sent as a REF_DELTA then.
+		p="$(git rev-parse HEAD:f | git pack-objects $packdir/pack)" &&
+		git multi-pack-index write --bitmap --preferred-pack=pack-$p.idx &&
+
+		objects_nr="$(git rev-list --count --all --objects)" &&
+		test_pack_objects_reused_all $objects_nr 2 &&
+		test_trace2_data pack-objects pack-reused/ref-delta 1 <trace2.txt &&
+
+		git verify-pack -v got.idx >verify &&
+		grep "^$(git rev-parse HEAD^:f) blob .* 1 $(git rev-parse HEAD:f)\$" verify
+	)
+'
+
 test_done
@@ -0,0 +1,108 @@
+#!/bin/sh
+
+test_description='upload-pack caches packs for full clones'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	test_commit one &&
+	test_commit two &&
+	git tag -a -m annotated annotated &&
+	git config uploadpack.packCache true
+'
+
+cache_status () {
+	test_when_finished "rm -f trace" &&
+	GIT_TRACE2_EVENT="$(pwd)/trace" "$@" &&
+	grep "\"key\":\"pack-cache\",\"value\":\"$cache_expect\"" trace
+}
+
+test_expect_success 'first clone stores its pack' '
+	cache_expect=miss cache_status \
+		git clone --no-local --bare . first.git &&
+	ls .git/objects/pack-cache/*.pack >packs &&
+	test_line_count = 1 packs
+'
+
+test_expect_success 'identical clone is served from the cache' '
+	cache_expect=hit cache_status \
+		git clone --no-local --bare . second.git &&
+	git -C second.git rev-parse one two annotated >actual &&
+	git rev-parse one two annotated >expect &&
+	test_cmp expect actual &&
+	git -C second.git cat-file -t annotated >type &&
+	echo tag >expect &&
+	test_cmp expect type
+'
+
+test_expect_success 'protocol v0 clone is served from the same cache' '
+	cache_expect=hit cache_status \
+		git -c protocol.version=0 clone --no-local --bare . v0.git &&
+	git -C v0.git rev-parse two >actual &&
+	git rev-parse two >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a pack being generated is not waited for' '
+	pack=$(ls .git/objects/pack-cache/*.pack) &&
+	mv "$pack" "$pack.lock" &&
+	test_when_finished "rm -f \"$pack.lock\"" &&
+	cache_expect=busy cache_status \
+		git clone --no-local --bare . busy.git &&
+	test_path_is_missing "$pack" &&
+	git -C busy.git rev-parse two >actual &&
+	git rev-parse two >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a lock left behind by a killed upload-pack is removed' '
+	pack=$(ls .git/objects/pack-cache/*.pack) &&
+	mv "$pack" "$pack.lock" &&
+	test-tool chmtime =-7200 "$pack.lock" &&
+	cache_expect=miss cache_status \
+		git clone --no-local --bare . stale.git &&
+	test_path_is_missing "$pack.lock" &&
+	test_path_is_file "$pack"
+'
+
+test_expect_success POSIXPERM 'cache directory follows core.sharedRepository' '
+	test_when_finished "rm -rf .git/objects/pack-cache" &&
+	rm -rf .git/objects/pack-cache &&
+	test_config core.sharedRepository 0660 &&
+	git clone --no-local --bare . shared.git &&
+	echo drwxrws--- >expect &&
+	test_modebits .git/objects/pack-cache >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'updated refs are not served from the cache' '
+	test_commit three &&
+	cache_expect=miss cache_status \
+		git clone --no-local --bare . third.git &&
+	git -C third.git rev-parse three >actual &&
+	git rev-parse three >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'fetches with haves are not cached' '
+	test_commit four &&
+	test_when_finished "rm -f trace" &&
+	GIT_TRACE2_EVENT="$(pwd)/trace" git -C third.git fetch origin &&
+	! grep "\"pack-cache\"" trace
+'
+
+test_expect_success 'expired packs are not served' '
+	git clone --no-local --bare . fresh.git &&
+	test_config uploadpack.packCacheExpiry now &&
+	cache_expect=miss cache_status \
+		git clone --no-local --bare . expired.git
+'
+
+test_expect_success 'cache is pruned to its size limit' '
+	test_config uploadpack.packCacheSize 1 &&
+	git clone --no-local --bare . small.git &&
+	ls .git/objects/pack-cache >packs &&
+	test_must_be_empty packs
+'
+
+test_done
@@ -762,4 +762,75 @@ test_expect_success 'for-each-ref is-base: --sort' '
 		--sort=refname --sort=-is-base:commit-2-3
 '
 
+test_expect_success 'setup reachability bitmaps' '
+	git repack -adb &&
+	test_path_is_file $(ls .git/objects/pack/pack-*.bitmap)
+'
+
+test_expect_success 'in_merge_bases_many and commit_contains with bitmaps' '
+	cat >input <<-\EOF &&
+	A:commit-6-8
+	X:commit-7-7
+	X:commit-8-6
+	X:commit-6-9
+	EOF
+	echo "in_merge_bases_many(A,X):1" >expect &&
+	test-tool reach in_merge_bases_many <input >actual &&
+	test_cmp expect actual &&
+
+	cat >input <<-\EOF &&
+	A:commit-6-8
+	X:commit-7-7
+	X:commit-8-6
+	EOF
+	echo "in_merge_bases_many(A,X):0" >expect &&
+	test-tool reach in_merge_bases_many <input >actual &&
+	test_cmp expect actual &&
+
+	cat >input <<-\EOF &&
+	A:commit-7-7
+	X:commit-2-10
+	X:commit-10-2
+	EOF
+	echo "commit_contains(_,A,X,_):0" >expect &&
+	test-tool reach commit_contains --tag <input >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'tag --contains and branch --merged agree with and without bitmaps' '
+	git -c core.reachabilityBitmaps=false tag --contains commit-5-5 >expect &&
+	git tag --contains commit-5-5 >actual &&
+	test_cmp expect actual &&
+
+	git -c core.reachabilityBitmaps=false branch --no-contains commit-3-7 >expect &&
+	git branch --no-contains commit-3-7 >actual &&
+	test_cmp expect actual &&
+
+	git -c core.reachabilityBitmaps=false branch --merged commit-6-6 >expect &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.txt" git branch --merged commit-6-6 >actual &&
+	test_cmp expect actual &&
+	grep "\"key\":\"tips_reachable_from_bases/bitmap-found\",\"value\":\"36\"" trace.txt &&
+
+	git merge-base --is-ancestor commit-3-3 commit-6-6 &&
+	test_must_fail git merge-base --is-ancestor commit-3-7 commit-6-6
+'
+
+test_expect_success 'queries from a multi-pack bitmap, then closing the object store' '
+	test_when_finished "rm -f .git/objects/pack/multi-pack-index*" &&
+	git multi-pack-index write --bitmap &&
+	ls .git/objects/pack/multi-pack-index-*.bitmap &&
+
+	cat >input <<-\EOF &&
+	A:commit-6-8
+	X:commit-7-7
+	X:commit-8-6
+	X:commit-6-9
+	EOF
+	echo "in_merge_bases_many(A,X):1" >expect &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.txt" \
+		test-tool reach in_merge_bases_many <input >actual &&
+	test_cmp expect actual &&
+	grep "ignoring extra bitmap file" trace.txt
+'
+
 test_done
@@ -313,4 +313,26 @@ test_expect_success 'status ignores submodule in excluded directory' '
 	test_cmp expected actual
 '
 
+test_expect_success 'scanning with several threads finds the same paths' '
+	mkdir -p wide/a/b/c wide/d/e wide/f &&
+	echo "*.o" >wide/.gitignore &&
+	echo "!keep.o" >wide/a/.gitignore &&
+	echo "e/" >wide/d/.gitignore &&
+	touch wide/a/b/c/file wide/a/keep.o wide/a/b/drop.o \
+		wide/d/e/ignored wide/d/file wide/f/file &&
+	for args in "" "-uall" "--ignored" "--ignored=matching -uall" \
+		    "--ignored=no -unormal"
+	do
+		git -c core.dirScanThreads=1 status --porcelain $args >expect &&
+		GIT_TEST_DIR_SCAN_THREADS=4 git status --porcelain $args >actual &&
+		test_cmp expect actual || return 1
+	done &&
+	git -c core.dirScanThreads=1 ls-files -o --directory --exclude-standard >expect &&
+	GIT_TEST_DIR_SCAN_THREADS=4 git ls-files -o --directory --exclude-standard >actual &&
+	test_cmp expect actual &&
+	git -c core.dirScanThreads=1 clean -n -d -x >expect &&
+	GIT_TEST_DIR_SCAN_THREADS=4 git clean -n -d -x >actual &&
+	test_cmp expect actual
+'
+
 test_done
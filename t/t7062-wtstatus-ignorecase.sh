@@ -17,4 +17,41 @@ test_expect_success 'status with hash collisions' '
 	git status
 '
 
+test_expect_success !CASE_INSENSITIVE_FS 'add into a directory spelled differently in the index' '
+	git init spelled &&
+	(
+		cd spelled &&
+		mkdir -p Dir dir/sub DIR/SUB &&
+		echo a >Dir/a &&
+		echo b >dir/b &&
+		echo c >dir/sub/c &&
+		git -c core.ignorecase=false add Dir dir &&
+		echo d >DIR/SUB/d &&
+		echo e >DIR/e &&
+		git -c core.ignorecase=true add DIR/SUB/d DIR/e &&
+		git ls-files >../actual &&
+		cat >../expect <<-\EOF &&
+		Dir/a
+		Dir/e
+		Dir/sub/d
+		dir/b
+		dir/sub/c
+		EOF
+		test_cmp ../expect ../actual
+	)
+'
+
+test_expect_success !CASE_INSENSITIVE_FS 'add into a directory which was just emptied' '
+	(
+		cd spelled &&
+		rm -r Dir dir DIR &&
+		mkdir DIR &&
+		echo h >DIR/h &&
+		git -c core.ignorecase=true add -A &&
+		git ls-files >../actual &&
+		echo DIR/h >../expect &&
+		test_cmp ../expect ../actual
+	)
+'
+
 test_done
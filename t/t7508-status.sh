@@ -1658,6 +1658,9 @@ test_expect_success '"Initial commit" should not be noted in commit template' '
 	test_grep ! "Initial commit" output
 '
 
+# The tests below look at whether the index file itself gets rewritten.
+sane_unset GIT_TEST_INDEX_JOURNAL
+
 test_expect_success '--no-optional-locks prevents index update' '
 	test_set_magic_mtime .git/index &&
 	git --no-optional-locks status &&
@@ -1758,6 +1761,47 @@ test_expect_success 'slow status advice when core.untrackedCache true, and fsmon
 	)
 '
 
+test_lazy_prereq IO_URING '
+	test-tool stat-batch supported
+'
+
+test_expect_success 'batched preload sees the same changes' '
+	test_when_finished "rm -rf batch-stat trace method" &&
+	git init batch-stat &&
+	(
+		cd batch-stat &&
+		mkdir dir &&
+		for i in $(test_seq 1 20)
+		do
+			echo $i >file$i &&
+			echo $i >dir/file$i || return 1
+		done &&
+		test-tool chmtime =-60 file* dir/file* &&
+		git add . &&
+		git commit -q -m initial &&
+		echo changed >file3 &&
+		echo changed >dir/file7 &&
+		rm file5 &&
+		rm dir/file9 &&
+		rm file11 &&
+		mkdir file11 &&
+		test-tool chmtime =-60 file3 &&
+		GIT_TEST_PRELOAD_INDEX=1 \
+			git -c index.batchStat=false status --porcelain -uno >expect &&
+		GIT_TRACE2_EVENT="$(pwd)/../trace" GIT_TEST_PRELOAD_INDEX=1 \
+			git -c index.batchStat=true status --porcelain -uno >actual &&
+		test_cmp expect actual &&
+		test_line_count = 5 actual
+	) &&
+	grep "\"preload/method\"" trace >method &&
+	if test_have_prereq IO_URING
+	then
+		test_grep "\"batched\"" method
+	else
+		test_grep -e "\"batched\"" -e "\"threads\"" method
+	fi
+'
+
 test_expect_success EXPENSIVE 'status does not re-read unchanged 4 or 8 GiB file' '
 	(
 		mkdir large-file &&
@@ -445,4 +445,62 @@ test_expect_success '--geometric -l disables writing bitmaps with non-local pack
 	test_path_is_file member/.git/objects/pack/multi-pack-index-*.bitmap
 '
 
+test_expect_success '--geometric --write-midx=incremental appends MIDX layers' '
+	git init geometric &&
+	test_when_finished "rm -fr geometric" &&
+	(
+		cd geometric &&
+		chain=$packdir/multi-pack-index.d/multi-pack-index-chain &&
+
+		test_commit_bulk --start=1 100 &&
+		git repack -ad --write-midx --write-bitmap-index &&
+		test_path_is_file $midx &&
+
+		# The new pack is too small to be rolled up with the big
+		# one, so the existing MIDX becomes the base of a chain.
+		test_commit_bulk --start=101 1 &&
+		git repack -d --geometric=2 --write-midx=incremental \
+			--write-bitmap-index &&
+		test_line_count = 2 $chain &&
+		test_path_is_missing $midx &&
+		ls $packdir/multi-pack-index.d/*.bitmap >bitmaps &&
+		test_line_count = 2 bitmaps &&
+		git rev-list --test-bitmap HEAD &&
+		git multi-pack-index verify &&
+
+		# The top layer gets replaced once its pack is rolled up.
+		test_commit_bulk --start=102 2 &&
+		git repack -d --geometric=2 --write-midx=incremental \
+			--write-bitmap-index &&
+		test_line_count = 2 $chain &&
+		git rev-list --test-bitmap HEAD &&
+
+		# With a large split factor, the new layer absorbs the
+		# whole chain.
+		test_commit_bulk --start=104 1 &&
+		git -c repack.midxSplitFactor=1000 repack -d --geometric=2 \
+			--write-midx=incremental --write-bitmap-index &&
+		test_path_is_missing $chain &&
+		test_path_is_file $midx &&
+		git rev-list --test-bitmap HEAD
+	)
+'
+
+test_expect_success 'multi-pack-index write --base with an unknown layer' '
+	git init geometric &&
+	test_when_finished "rm -fr geometric" &&
+	(
+		cd geometric &&
+		test_commit base &&
+		git repack -d --write-midx &&
+		test_commit other &&
+		git repack -d &&
+		test_must_fail git multi-pack-index write --incremental \
+			--base=$(test_oid zero) 2>err &&
+		test_grep "could not find base multi-pack-index layer" err &&
+		test_must_fail git multi-pack-index write --base=$(test_oid zero) 2>err &&
+		test_grep "requires" err
+	)
+'
+
 test_done
@@ -0,0 +1,236 @@
+#include "unit-test.h"
+#include "ewah/ewok.h"
+#include "ewah/roaring.h"
+
+#define NR_BITS 20000
+
+/*
+ * Fill "ewah" (and the uncompressed reference "ref") with a pattern
+ * mixing sparse bits, long runs of ones and long runs of zeroes, so
+ * that both fill and literal words are exercised.
+ */
+static void fill_pattern(struct ewah_bitmap *ewah, struct bitmap *ref,
+			 unsigned seed)
+{
+	size_t pos = 0;
+
+	while (pos < NR_BITS) {
+		seed = seed * 1103515245 + 12345;
+
+		switch ((seed >> 16) % 4) {
+		case 0: /* a run of ones spanning several words */
+			for (size_t end = pos + 64 * 5 + (seed % 64); pos < end; pos++) {
+				ewah_set(ewah, pos);
+				bitmap_set(ref, pos);
+			}
+			break;
+		case 1: /* a gap spanning several words */
+			pos += 64 * 7 + (seed % 64);
+			break;
+		default: /* a sparse bit */
+			ewah_set(ewah, pos);
+			bitmap_set(ref, pos);
+			pos += 1 + (seed >> 8) % 13;
+			break;
+		}
+	}
+}
+
+static size_t count_bits(struct bitmap *bitmap)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < bitmap->word_alloc * BITS_IN_EWORD; i++)
+		count += bitmap_get(bitmap, i);
+	return count;
+}
+
+void test_ewah__get(void)
+{
+	struct ewah_bitmap *ewah = ewah_new();
+	struct bitmap *ref = bitmap_new();
+
+	fill_pattern(ewah, ref, 1);
+	for (size_t i = 0; i < NR_BITS + 128; i++)
+		cl_assert_equal_i(ewah_bitmap_get(ewah, i), bitmap_get(ref, i));
+
+	ewah_free(ewah);
+	bitmap_free(ref);
+}
+
+void test_ewah__to_bitmap(void)
+{
+	struct ewah_bitmap *ewah = ewah_new();
+	struct bitmap *ref = bitmap_new();
+	struct bitmap *got;
+
+	fill_pattern(ewah, ref, 2);
+	got = ewah_to_bitmap(ewah);
+	cl_assert(bitmap_equals(got, ref));
+
+	ewah_free(ewah);
+	bitmap_free(ref);
+	bitmap_free(got);
+}
+
+void test_ewah__or_ewah(void)
+{
+	struct ewah_bitmap *ewah = ewah_new();
+	struct bitmap *ewah_ref = bitmap_new();
+	struct bitmap *other = bitmap_new();
+	struct ewah_bitmap *unused = ewah_new();
+	struct bitmap *result;
+
+	fill_pattern(ewah, ewah_ref, 3);
+	fill_pattern(unused, other, 4);
+
+	result = bitmap_dup(other);
+	bitmap_or_ewah(result, ewah);
+
+	for (size_t i = 0; i < NR_BITS + 128; i++)
+		cl_assert_equal_i(bitmap_get(result, i),
+				  bitmap_get(other, i) || bitmap_get(ewah_ref, i));
+
+	ewah_free(ewah);
+	ewah_free(unused);
+	bitmap_free(ewah_ref);
+	bitmap_free(other);
+	bitmap_free(result);
+}
+
+void test_ewah__or_and_not(void)
+{
+	struct ewah_bitmap *e1 = ewah_new(), *e2 = ewah_new();
+	struct bitmap *a = bitmap_new(), *b = bitmap_new();
+	struct bitmap *or, *and_not;
+
+	fill_pattern(e1, a, 5);
+	fill_pattern(e2, b, 6);
+
+	or = bitmap_dup(a);
+	bitmap_or(or, b);
+	and_not = bitmap_dup(a);
+	bitmap_and_not(and_not, b);
+
+	for (size_t i = 0; i < NR_BITS + 128; i++) {
+		cl_assert_equal_i(bitmap_get(or, i),
+				  bitmap_get(a, i) || bitmap_get(b, i));
+		cl_assert_equal_i(bitmap_get(and_not, i),
+				  bitmap_get(a, i) && !bitmap_get(b, i));
+	}
+
+	ewah_free(e1);
+	ewah_free(e2);
+	bitmap_free(a);
+	bitmap_free(b);
+	bitmap_free(or);
+	bitmap_free(and_not);
+}
+
+void test_ewah__popcount(void)
+{
+	struct ewah_bitmap *ewah = ewah_new();
+	struct bitmap *ref = bitmap_new();
+	size_t expect;
+
+	fill_pattern(ewah, ref, 7);
+	expect = count_bits(ref);
+
+	cl_assert_equal_i(bitmap_popcount(ref), expect);
+	cl_assert_equal_i(ewah_bitmap_popcount(ewah), expect);
+
+	ewah_free(ewah);
+	bitmap_free(ref);
+}
+
+/*
+ * Spread bits over several 2^16-bit chunks so that each kind of
+ * roaring container is used: a sparse chunk (array), a chunk made
+ * of long runs (run), and a dense irregular chunk (bitset).
+ */
+static void fill_chunks(struct ewah_bitmap *ewah, struct bitmap *ref)
+{
+	unsigned seed = 8;
+
+	for (size_t pos = 0; pos < 65536; pos += 97) {
+		ewah_set(ewah, pos);
+		bitmap_set(ref, pos);
+	}
+	for (size_t pos = 65536 + 10; pos < 2 * 65536; pos += 1000) {
+		for (size_t i = 0; i < 500; i++) {
+			ewah_set(ewah, pos + i);
+			bitmap_set(ref, pos + i);
+		}
+	}
+	for (size_t pos = 3 * 65536; pos < 4 * 65536; pos++) {
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) & 1) {
+			ewah_set(ewah, pos);
+			bitmap_set(ref, pos);
+		}
+	}
+}
+
+void test_ewah__roaring(void)
+{
+	struct ewah_bitmap *ewah = ewah_new(), *other = ewah_new();
+	struct bitmap *ref = bitmap_new(), *other_ref = bitmap_new();
+	struct roaring_bitmap roaring = ROARING_BITMAP_INIT;
+	struct roaring_bitmap roaring_other = ROARING_BITMAP_INIT;
+	struct roaring_bitmap parsed = ROARING_BITMAP_INIT;
+	struct ewah_bitmap *decoded;
+	struct bitmap *got, *expect, *combined;
+	size_t common = 0;
+
+	fill_chunks(ewah, ref);
+	fill_pattern(other, other_ref, 9);
+
+	roaring_from_ewah(&roaring, ewah);
+	roaring_from_ewah(&roaring_other, other);
+	cl_assert_equal_i(roaring.nr, 3);
+
+	for (size_t i = 0; i < 5 * 65536; i++)
+		cl_assert_equal_i(roaring_get(&roaring, i), bitmap_get(ref, i));
+	cl_assert_equal_i(roaring_popcount(&roaring), count_bits(ref));
+
+	for (size_t i = 0; i < NR_BITS; i++)
+		common += bitmap_get(ref, i) && bitmap_get(other_ref, i);
+	cl_assert_equal_i(roaring_and_popcount(&roaring, &roaring_other), common);
+	cl_assert_equal_i(roaring_and_popcount(&roaring_other, &roaring), common);
+
+	cl_assert_equal_i(roaring_read_mmap(&parsed, roaring.raw, roaring.raw_len),
+			  roaring.raw_len);
+	decoded = roaring_to_ewah(&parsed);
+	cl_assert_equal_i(decoded->bit_size, ewah->bit_size);
+	got = ewah_to_bitmap(decoded);
+	cl_assert(bitmap_equals(got, ref));
+
+	combined = bitmap_dup(other_ref);
+	roaring_or_into(&roaring, combined);
+	expect = bitmap_dup(other_ref);
+	bitmap_or(expect, ref);
+	cl_assert(bitmap_equals(combined, expect));
+	bitmap_free(combined);
+	bitmap_free(expect);
+
+	combined = bitmap_new();
+	roaring_xor_into(&roaring, combined);
+	roaring_xor_into(&roaring_other, combined);
+	for (size_t i = 0; i < 5 * 65536; i++)
+		cl_assert_equal_i(bitmap_get(combined, i),
+				  bitmap_get(ref, i) ^ bitmap_get(other_ref, i));
+	bitmap_free(combined);
+
+	cl_assert(roaring_read_mmap(&parsed, roaring.raw,
+				    roaring.raw_len - 1) < 0);
+
+	roaring_release(&roaring);
+	roaring_release(&roaring_other);
+	roaring_release(&parsed);
+	ewah_free(ewah);
+	ewah_free(other);
+	ewah_free(decoded);
+	bitmap_free(ref);
+	bitmap_free(other_ref);
+	bitmap_free(got);
+}
@@ -23,3 +23,35 @@ void test_mem_pool__tiny_block(void)
 {
 	test_many_pool_allocations(1);
 }
+
+void test_mem_pool__mapping(void)
+{
+	struct mem_pool pool, other;
+	char path[] = "mem-pool-XXXXXX";
+	char buf[4096] = { 0 };
+	int fd = xmkstemp(path);
+	char *map, *str;
+
+	cl_assert_equal_i(write_in_full(fd, buf, sizeof(buf)), sizeof(buf));
+	map = xmmap(NULL, sizeof(buf), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	unlink(path);
+
+	mem_pool_init(&pool, 0);
+	mem_pool_init(&other, 0);
+	str = mem_pool_strdup(&pool, "before");
+	mem_pool_add_mapping(&other, map, sizeof(buf));
+	mem_pool_combine(&pool, &other);
+
+	cl_assert(mem_pool_contains(&pool, map));
+	cl_assert(mem_pool_contains(&pool, map + sizeof(buf) - 1));
+	cl_assert(!mem_pool_contains(&pool, map + sizeof(buf)));
+	cl_assert(!mem_pool_contains(&other, map));
+
+	/* the mapping is full; allocations still come from real blocks */
+	cl_assert_equal_s(mem_pool_strdup(&pool, "after"), "after");
+	cl_assert_equal_s(str, "before");
+
+	mem_pool_discard(&pool, 1);
+	mem_pool_discard(&other, 0);
+}
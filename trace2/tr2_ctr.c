@@ -46,6 +46,11 @@ static struct tr2_counter_metadata tr2_counter_metadata[TRACE2_NUMBER_OF_COUNTER
 		.name = "hardware-flush",
 		.want_per_thread_events = 0,
 	},
+	[TRACE2_COUNTER_ID_INDEX_EXPANSIONS] = {
+		.category = "index",
+		.name = "expansions",
+		.want_per_thread_events = 0,
+	},
 
 	/* Add additional metadata before here. */
 };
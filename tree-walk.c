@@ -170,17 +170,15 @@ int tree_entry_gently(struct tree_desc *desc, struct name_entry *entry)
 }
 
 static int traverse_trees_atexit_registered;
-static int traverse_trees_count;
-static int traverse_trees_cur_depth;
-static int traverse_trees_max_depth;
+static struct traverse_depth traverse_trees_depth;
 
 static void trace2_traverse_trees_statistics_atexit(void)
 {
 	struct json_writer jw = JSON_WRITER_INIT;
 
 	jw_object_begin(&jw, 0);
-	jw_object_intmax(&jw, "traverse_trees_count", traverse_trees_count);
-	jw_object_intmax(&jw, "traverse_trees_max_depth", traverse_trees_max_depth);
+	jw_object_intmax(&jw, "traverse_trees_count", traverse_trees_depth.count);
+	jw_object_intmax(&jw, "traverse_trees_max_depth", traverse_trees_depth.max);
 	jw_end(&jw);
 
 	trace2_data_json("traverse_trees", the_repository, "statistics", &jw);
@@ -188,6 +186,13 @@ static void trace2_traverse_trees_statistics_atexit(void)
 	jw_release(&jw);
 }
 
+void traverse_depth_account(const struct traverse_depth *depth)
+{
+	traverse_trees_depth.count += depth->count;
+	if (depth->max > traverse_trees_depth.max)
+		traverse_trees_depth.max = depth->max;
+}
+
 void setup_traverse_info(struct traverse_info *info, const char *base)
 {
 	size_t pathlen = strlen(base);
@@ -441,15 +446,17 @@ int traverse_trees(struct index_state *istate,
 	struct strbuf base = STRBUF_INIT;
 	int interesting = 1;
 	char *traverse_path;
+	struct traverse_depth *depth = info->depth ? info->depth :
+						     &traverse_trees_depth;
 
-	if (traverse_trees_cur_depth > max_allowed_tree_depth)
+	if (depth->cur > max_allowed_tree_depth)
 		return error("exceeded maximum allowed tree depth");
 
-	traverse_trees_count++;
-	traverse_trees_cur_depth++;
+	depth->count++;
+	depth->cur++;
 
-	if (traverse_trees_cur_depth > traverse_trees_max_depth)
-		traverse_trees_max_depth = traverse_trees_cur_depth;
+	if (depth->cur > depth->max)
+		depth->max = depth->cur;
 
 	ALLOC_ARRAY(entry, n);
 	ALLOC_ARRAY(tx, n);
@@ -553,7 +560,7 @@ int traverse_trees(struct index_state *istate,
 	info->traverse_path = NULL;
 	strbuf_release(&base);
 
-	traverse_trees_cur_depth--;
+	depth->cur--;
 	return ret;
 }
 
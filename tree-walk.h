@@ -120,6 +120,22 @@ int traverse_trees(struct index_state *istate, int n, struct tree_desc *t, struc
 
 enum get_oid_result get_tree_entry_follow_symlinks(struct repository *r, struct object_id *tree_oid, const char *name, struct object_id *result, struct strbuf *result_path, unsigned short *mode);
 
+/**
+ * How deep the traversals sharing it have gone into the trees, and what
+ * they add to the "traverse_trees" trace2 statistics.
+ */
+struct traverse_depth {
+	int cur;
+	int max;
+	int count;
+};
+
+/**
+ * Add what the traversals that used "depth" did to the statistics
+ * reported at exit.
+ */
+void traverse_depth_account(const struct traverse_depth *depth);
+
 /**
  * A structure used to maintain the state of a traversal.
  */
@@ -173,6 +189,14 @@ struct traverse_info {
 
 	/* tells whether to stop at the first error or not. */
 	int show_all_errors;
+
+	/*
+	 * where the depth of the traversal is counted against
+	 * `max_allowed_tree_depth`; traversals running on other
+	 * threads at the same time need their own. Defaults to one
+	 * shared by all other traversals when NULL.
+	 */
+	struct traverse_depth *depth;
 };
 
 /**
@@ -31,6 +31,9 @@
 #include "entry.h"
 #include "parallel-checkout.h"
 #include "setup.h"
+#include "config.h"
+#include "mem-pool.h"
+#include "thread-utils.h"
 
 /*
  * Error messages expected by scripts out of plumbing commands such as
@@ -863,6 +866,9 @@ static int traverse_by_cache_tree(int pos, int nr_entries, int nr_names,
 	return 0;
 }
 
+static int use_partition(struct name_entry *names,
+			 struct unpack_trees_options *o);
+
 static int traverse_trees_recursive(int n, unsigned long dirmask,
 				    unsigned long df_conflicts,
 				    struct name_entry *names,
@@ -877,6 +883,12 @@ static int traverse_trees_recursive(int n, unsigned long dirmask,
 	struct name_entry *p;
 	int nr_entries;
 
+	if (!info->prev && o->internal.partitions) {
+		ret = use_partition(names, o);
+		if (ret <= 0)
+			return ret;
+	}
+
 	nr_entries = all_trees_same_as_cache_tree(n, dirmask, names, info);
 	if (nr_entries > 0) {
 		int pos = index_pos_by_traverse_info(names, info);
@@ -1600,6 +1612,386 @@ static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, str
 	return mask;
 }
 
+/*
+ * Unpacking top-level directories on other threads.
+ *
+ * In a one- or two-way merge (switching branches, "reset"), what
+ * happens under a top-level directory depends only on the trees and
+ * on the index entries under it. So such a directory can be unpacked
+ * by another thread ahead of the traversal, as long as that thread
+ * shares nothing the traversal writes to: it sees the index entries
+ * under the directory as an index of their own, collects what it
+ * unpacks in a result of its own, and only notes the paths whose
+ * cache-tree and untracked cache data are to be invalidated. When the
+ * traversal reaches the directory, it takes the result over (see
+ * use_partition()) instead of descending into it, and ends up exactly
+ * where it would have by itself.
+ *
+ * A thread gives up on the first problem it runs into, quietly; the
+ * traversal then descends into the directory as usual, and reports
+ * the problem the usual way.
+ */
+struct unpack_worker;
+
+struct unpack_partition {
+	char *path;
+	struct name_entry names[MAX_UNPACK_TREES];
+	unsigned long dirmask;
+
+	/* the source index entries under "path/" */
+	struct index_state src;
+	struct unpack_trees_options o;
+	struct string_list invalidated;
+	int ret;
+
+	struct unpack_partitions *all;
+	struct unpack_worker *worker;
+};
+
+struct unpack_partitions {
+	struct unpack_partition *p;
+	size_t nr, alloc;
+	size_t next_to_run, next_to_use;
+	struct index_state *src_index;
+
+	/* guards next_to_run, and what the threads cannot do at once */
+	pthread_mutex_t mutex;
+};
+
+struct unpack_worker {
+	pthread_t thread;
+	struct unpack_partitions *all;
+	struct dir_struct dir;
+	struct cache_def lstat_cache;
+	struct traverse_depth depth;
+};
+
+/*
+ * The number of index entries below which another thread is not
+ * worth starting.
+ */
+#define UNPACK_THREAD_COST 2000
+
+static int unpack_threads(struct unpack_trees_options *o)
+{
+	struct index_state *istate = o->src_index;
+	int i, nr;
+
+	if (!HAVE_THREADS || !o->merge || o->diff_index_cached ||
+	    (o->fn != oneway_merge && o->fn != twoway_merge) ||
+	    o->prefix || (o->pathspec && o->pathspec->nr) ||
+	    o->internal.debug_unpack || !o->skip_sparse_checkout ||
+	    istate->sparse_index || ignore_case || should_update_submodules())
+		return 1;
+
+	nr = git_env_ulong("GIT_TEST_UNPACK_THREADS", 0);
+	if (!nr) {
+		if (repo_config_get_int(the_repository, "core.unpackthreads", &nr) ||
+		    nr <= 0)
+			nr = online_cpus();
+		if (nr > istate->cache_nr / UNPACK_THREAD_COST)
+			nr = istate->cache_nr / UNPACK_THREAD_COST;
+	}
+	if (nr < 2)
+		return 1;
+
+	/* conflicts are left to the traversal */
+	for (i = 0; i < istate->cache_nr; i++)
+		if (ce_stage(istate->cache[i]))
+			return 1;
+	return nr;
+}
+
+static int index_pos_or_next(struct index_state *istate,
+			     const char *name, int namelen)
+{
+	int pos = index_name_pos(istate, name, namelen);
+	return pos < 0 ? -pos - 1 : pos;
+}
+
+/*
+ * Traversal callback, for the top level only: note the directories to
+ * hand out to the threads. These are directories in all trees that
+ * have the path, that are not a file in the index, and that the
+ * cache-tree does not let us skip anyway.
+ */
+static int find_partition(int n, unsigned long mask, unsigned long dirmask,
+			  struct name_entry *names, struct traverse_info *info)
+{
+	struct unpack_trees_options *o = info->data;
+	struct unpack_partitions *all = o->internal.partitions;
+	struct index_state *istate = o->src_index;
+	const struct name_entry *p = names;
+	struct unpack_partition *part;
+	struct strbuf name = STRBUF_INIT;
+	int i, first, end;
+
+	while (!p->mode)
+		p++;
+	if (mask != dirmask ||
+	    index_name_pos(istate, p->path, p->pathlen) >= 0 ||
+	    all_trees_same_as_cache_tree(n, dirmask, names, info) > 0)
+		return mask;
+
+	/* the entries under "path/" are followed by "path0" or later */
+	strbuf_add(&name, p->path, p->pathlen);
+	strbuf_addch(&name, '/');
+	first = index_pos_or_next(istate, name.buf, name.len);
+	name.buf[name.len - 1] = '0';
+	end = index_pos_or_next(istate, name.buf, name.len);
+	strbuf_release(&name);
+
+	ALLOC_GROW(all->p, all->nr + 1, all->alloc);
+	part = &all->p[all->nr++];
+	memset(part, 0, sizeof(*part));
+	part->path = xmemdupz(p->path, p->pathlen);
+	for (i = 0; i < n; i++) {
+		part->names[i] = names[i];
+		part->names[i].path = part->path;
+	}
+	part->dirmask = dirmask;
+
+	part->src = *istate;
+	part->src.cache = istate->cache + first;
+	part->src.cache_nr = end - first;
+	part->src.cache_alloc = part->src.cache_nr;
+	part->src.untracked = NULL;
+	return mask;
+}
+
+static void init_partition(struct unpack_partition *p,
+			   struct unpack_trees_options *o)
+{
+	int i;
+
+	p->o = *o;
+	p->o.quiet = 1;
+	p->o.src_index = &p->src;
+	p->o.internal.cache_bottom = 0;
+	strvec_init(&p->o.internal.msgs_to_free);
+	for (i = 0; i < NB_UNPACK_TREES_WARNING_TYPES; i++)
+		string_list_init_dup(&p->o.internal.unpack_rejects[i]);
+	index_state_init(&p->o.internal.result, o->src_index->repo);
+	p->o.internal.partitions = NULL;
+	p->o.internal.partition = p;
+	string_list_init_dup(&p->invalidated);
+	p->all = o->internal.partitions;
+}
+
+static void partition_lock(struct unpack_trees_options *o)
+{
+	if (o->internal.partition)
+		pthread_mutex_lock(&o->internal.partition->all->mutex);
+}
+
+static void partition_unlock(struct unpack_trees_options *o)
+{
+	if (o->internal.partition)
+		pthread_mutex_unlock(&o->internal.partition->all->mutex);
+}
+
+static void *unpack_partitions_thread(void *data)
+{
+	struct unpack_worker *w = data;
+	struct unpack_partitions *all = w->all;
+
+	trace2_thread_start("unpack_trees");
+	for (;;) {
+		struct unpack_partition *p = NULL;
+		struct traverse_info info;
+
+		pthread_mutex_lock(&all->mutex);
+		if (all->next_to_run < all->nr)
+			p = &all->p[all->next_to_run++];
+		pthread_mutex_unlock(&all->mutex);
+		if (!p)
+			break;
+
+		p->worker = w;
+		if (p->o.internal.dir)
+			p->o.internal.dir = &w->dir;
+		setup_traverse_info(&info, "");
+		info.fn = unpack_callback;
+		info.data = &p->o;
+		info.depth = &w->depth;
+		p->ret = traverse_trees_recursive(p->o.internal.merge_size,
+						  p->dirmask, 0, p->names, &info);
+	}
+	trace2_thread_exit();
+	return NULL;
+}
+
+static void finish_partitions(struct unpack_trees_options *o)
+{
+	struct unpack_partitions *all = o->internal.partitions;
+	size_t i;
+	int j;
+
+	if (!all)
+		return;
+	for (i = 0; i < all->nr; i++) {
+		struct unpack_partition *p = &all->p[i];
+
+		discard_index(&p->o.internal.result);
+		for (j = 0; j < NB_UNPACK_TREES_WARNING_TYPES; j++)
+			string_list_clear(&p->o.internal.unpack_rejects[j], 0);
+		string_list_clear(&p->invalidated, 0);
+		free(p->path);
+	}
+	free(all->p);
+	FREE_AND_NULL(o->internal.partitions);
+}
+
+/*
+ * Find the top-level directories worth unpacking on other threads, and
+ * have them unpacked. The traversal of the "n" trees "t" then takes
+ * the results over with use_partition().
+ */
+static void start_partitions(unsigned n, struct tree_desc *t,
+			     struct unpack_trees_options *o)
+{
+	struct unpack_partitions *all;
+	struct unpack_worker *workers;
+	struct traverse_info info;
+	int nr_threads = unpack_threads(o);
+	int i, ret, err;
+
+	if (nr_threads < 2)
+		return;
+
+	CALLOC_ARRAY(all, 1);
+	all->src_index = o->src_index;
+	o->internal.partitions = all;
+
+	setup_traverse_info(&info, "");
+	info.fn = find_partition;
+	info.data = o;
+	ret = traverse_trees(o->src_index, n, t, &info);
+	for (i = 0; i < all->nr; i++)
+		init_partition(&all->p[i], o);
+	if (ret < 0 || all->nr < 2) {
+		finish_partitions(o);
+		return;
+	}
+	if (nr_threads > all->nr)
+		nr_threads = all->nr;
+
+	trace2_region_enter("unpack_trees", "partitions", the_repository);
+	/*
+	 * Filled lazily otherwise, and looked up by every thread; the
+	 * partitions were cut from the index before it was built.
+	 */
+	lazy_init_name_hash(o->src_index);
+	for (i = 0; i < all->nr; i++) {
+		struct index_state *src = &all->p[i].src;
+
+		src->name_hash = o->src_index->name_hash;
+		src->dir_hash = o->src_index->dir_hash;
+		src->name_hash_initialized = 1;
+		src->name_hash_complete = 1;
+	}
+	enable_obj_read_lock();
+	pthread_mutex_init(&all->mutex, NULL);
+
+	CALLOC_ARRAY(workers, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		struct unpack_worker *w = &workers[i];
+
+		w->all = all;
+		/* the partitions are one level below the top */
+		w->depth.cur = 1;
+		strbuf_init(&w->lstat_cache.path, 0);
+		if (o->internal.dir) {
+			w->dir.flags |= DIR_SHOW_IGNORED;
+			setup_standard_excludes(&w->dir);
+		}
+		err = pthread_create(&w->thread, NULL,
+				     unpack_partitions_thread, w);
+		if (err)
+			die(_("unable to create threaded unpack: %s"),
+			    strerror(err));
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		traverse_depth_account(&workers[i].depth);
+		dir_clear(&workers[i].dir);
+		cache_def_clear(&workers[i].lstat_cache);
+	}
+	free(workers);
+
+	/*
+	 * The traversal starts over where a thread gave up; it must not
+	 * skip the entries the thread had unpacked.
+	 */
+	for (i = 0; i < all->nr; i++)
+		if (all->p[i].ret < 0)
+			mark_all_ce_unused(&all->p[i].src);
+
+	pthread_mutex_destroy(&all->mutex);
+	disable_obj_read_lock();
+	trace2_data_intmax("unpack_trees", the_repository,
+			   "partitions", all->nr);
+	trace2_data_intmax("unpack_trees", the_repository,
+			   "threads", nr_threads);
+	trace2_region_leave("unpack_trees", "partitions", the_repository);
+}
+
+/*
+ * The traversal is about to descend into the top-level directory
+ * "names"; take over what a thread unpacked there instead. Returns 1
+ * if there is nothing to take over and the traversal has to descend
+ * after all.
+ */
+static int use_partition(struct name_entry *names,
+			 struct unpack_trees_options *o)
+{
+	struct unpack_partitions *all = o->internal.partitions;
+	struct index_state *result = &o->internal.result;
+	struct unpack_partition *p;
+	struct index_state *done;
+	struct string_list_item *item;
+	int i, ret = 0;
+
+	while (!names->mode)
+		names++;
+	if (all->next_to_use == all->nr)
+		return 1;
+	p = &all->p[all->next_to_use];
+	if (strncmp(p->path, names->path, names->pathlen) ||
+	    p->path[names->pathlen])
+		return 1;
+	all->next_to_use++;
+
+	if (p->ret < 0)
+		return 1;
+
+	done = &p->o.internal.result;
+	free_name_hash(done);
+	if (done->ce_mem_pool) {
+		if (!result->ce_mem_pool) {
+			result->ce_mem_pool = xmalloc(sizeof(struct mem_pool));
+			mem_pool_init(result->ce_mem_pool, 0);
+		}
+		mem_pool_combine(result->ce_mem_pool, done->ce_mem_pool);
+	}
+	for (i = 0; i < done->cache_nr && !ret; i++) {
+		struct cache_entry *ce = done->cache[i];
+
+		ce->ce_flags &= ~CE_HASHED;
+		ret = add_index_entry(result, ce, ADD_CACHE_OK_TO_ADD |
+						  ADD_CACHE_OK_TO_REPLACE);
+	}
+	/* the entries belong to the result now */
+	done->cache_nr = 0;
+	discard_index(done);
+
+	for_each_string_list_item(item, &p->invalidated) {
+		cache_tree_invalidate_path(o->src_index, item->string);
+		untracked_cache_invalidate_path(o->src_index, item->string, 1);
+	}
+	return ret;
+}
+
 static int clear_ce_flags_1(struct index_state *istate,
 			    struct cache_entry **cache, int nr,
 			    struct strbuf *prefix,
@@ -2007,7 +2399,9 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 
 		trace_performance_enter();
 		trace2_region_enter("unpack_trees", "traverse_trees", the_repository);
+		start_partitions(len, t, o);
 		ret = traverse_trees(o->src_index, len, t, &info);
+		finish_partitions(o);
 		trace2_region_leave("unpack_trees", "traverse_trees", the_repository);
 		trace_performance_leave("traverse_trees");
 		if (ret < 0)
@@ -2213,6 +2607,25 @@ static int same(const struct cache_entry *a, const struct cache_entry *b)
 }
 
 
+/*
+ * ie_match_stat() for the merge. It may have to convert the file
+ * contents to compare them, which only one thread may do at a time.
+ */
+static unsigned match_stat(const struct cache_entry *ce, struct stat *st,
+			   struct unpack_trees_options *o)
+{
+	struct index_state *istate = o->src_index;
+	unsigned changed;
+
+	if (o->internal.partition)
+		istate = o->internal.partition->all->src_index;
+	partition_lock(o);
+	changed = ie_match_stat(istate, ce, st,
+				CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE);
+	partition_unlock(o);
+	return changed;
+}
+
 /*
  * When a CE gets turned into an unmerged entry, we
  * want it to be up-to-date
@@ -2237,8 +2650,7 @@ static int verify_uptodate_1(const struct cache_entry *ce,
 		return 0;
 
 	if (!lstat(ce->name, &st)) {
-		int flags = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE;
-		unsigned changed = ie_match_stat(o->src_index, ce, &st, flags);
+		unsigned changed = match_stat(ce, &st, o);
 
 		if (submodule_from_ce(ce)) {
 			int r = check_submodule_move_head(ce,
@@ -2297,6 +2709,12 @@ static void invalidate_ce_path(const struct cache_entry *ce,
 {
 	if (!ce)
 		return;
+	if (o->internal.partition) {
+		/* see use_partition() */
+		string_list_append(&o->internal.partition->invalidated,
+				   ce->name);
+		return;
+	}
 	cache_tree_invalidate_path(o->src_index, ce->name);
 	untracked_cache_invalidate_path(o->src_index, ce->name, 1);
 }
@@ -2329,6 +2747,13 @@ static int verify_clean_subdirectory(const struct cache_entry *ce,
 	char *pathbuf;
 	int cnt = 0;
 
+	/*
+	 * Neither looking into submodules nor scanning the directory
+	 * can be done on several threads; leave it to the traversal.
+	 */
+	if (o->internal.partition)
+		return -1;
+
 	if (S_ISGITLINK(ce->ce_mode)) {
 		struct object_id oid;
 		int sub_head = repo_resolve_gitlink_ref(the_repository, ce->name,
@@ -2493,7 +2918,11 @@ static int verify_absent_1(const struct cache_entry *ce,
 		return 0;
 	}
 
-	len = check_leading_path(ce->name, ce_namelen(ce), 0);
+	if (o->internal.partition)
+		len = threaded_check_leading_path(&o->internal.partition->worker->lstat_cache,
+						  ce->name, ce_namelen(ce), 0);
+	else
+		len = check_leading_path(ce->name, ce_namelen(ce), 0);
 	if (!len)
 		return 0;
 	else if (len > 0) {
@@ -3034,8 +3463,7 @@ int oneway_merge(const struct cache_entry * const *src,
 		if (o->reset && o->update && !ce_uptodate(old) && !ce_skip_worktree(old) &&
 			!(old->ce_flags & CE_FSMONITOR_VALID)) {
 			struct stat st;
-			if (lstat(old->name, &st) ||
-			    ie_match_stat(o->src_index, old, &st, CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE))
+			if (lstat(old->name, &st) || match_stat(old, &st, o))
 				update |= CE_UPDATE;
 		}
 		if (o->update && S_ISGITLINK(old->ce_mode) &&
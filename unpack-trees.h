@@ -12,6 +12,8 @@
 struct cache_entry;
 struct unpack_trees_options;
 struct pattern_list;
+struct unpack_partition;
+struct unpack_partitions;
 
 typedef int (*merge_fn_t)(const struct cache_entry * const *src,
 		struct unpack_trees_options *options);
@@ -107,6 +109,13 @@ struct unpack_trees_options {
 
 		struct pattern_list *pl;
 		struct dir_struct *dir;
+
+		/*
+		 * Directories unpacked by other threads ahead of the
+		 * traversal, and in such a thread, the one it works on.
+		 */
+		struct unpack_partitions *partitions;
+		struct unpack_partition *partition;
 	} internal;
 };
 
@@ -33,6 +33,9 @@
 #include "json-writer.h"
 #include "strmap.h"
 #include "promisor-remote.h"
+#include "lockfile.h"
+#include "date.h"
+#include "path.h"
 
 /* Remember to update object flag allocation in object.h */
 #define THEY_HAVE	(1u << 11)
@@ -58,6 +61,11 @@ enum allow_uor {
 	ALLOW_ANY_SHA1 = 0x07
 };
 
+#define PACK_CACHE_DEFAULT_SIZE (1024 * 1024 * 1024)
+#define PACK_CACHE_DEFAULT_EXPIRY "1.hour.ago"
+/* seconds without a write after which a cache lock is considered stale */
+#define PACK_CACHE_LOCK_TIMEOUT (60 * 60)
+
 /*
  * Please annotate, and if possible group together, fields used only
  * for protocol v0 or only for protocol v2.
@@ -100,6 +108,10 @@ struct upload_pack_data {
 
 	char *pack_objects_hook;
 
+	/* see "uploadpack.packCache*" */
+	unsigned long pack_cache_size;
+	timestamp_t pack_cache_expire;
+
 	unsigned stateless_rpc : 1;				/* v0 only */
 	unsigned no_done : 1;					/* v0 only */
 	unsigned daemon_mode : 1;				/* v0 only */
@@ -112,6 +124,7 @@ struct upload_pack_data {
 	unsigned wait_for_done : 1;
 	unsigned allow_filter : 1;
 	unsigned allow_filter_fallback : 1;
+	unsigned pack_cache : 1;
 	unsigned long tree_filter_max_depth;
 
 	unsigned done : 1;					/* v2 only */
@@ -154,6 +167,9 @@ static void upload_pack_data_init(struct upload_pack_data *data)
 
 	data->keepalive = 5;
 	data->advertise_sid = 0;
+	data->pack_cache_size = PACK_CACHE_DEFAULT_SIZE;
+	if (parse_expiry_date(PACK_CACHE_DEFAULT_EXPIRY, &data->pack_cache_expire))
+		BUG("unable to parse '%s'", PACK_CACHE_DEFAULT_EXPIRY);
 }
 
 static void upload_pack_data_clear(struct upload_pack_data *data)
@@ -215,8 +231,97 @@ struct output_state {
 	int used;
 	unsigned packfile_uris_started : 1;
 	unsigned packfile_started : 1;
+
+	/* The input is a cached pack rather than a pipe from pack-objects. */
+	unsigned from_cache : 1;
+
+	/* If set, everything read from pack-objects is also stored here. */
+	struct lock_file *cache;
 };
 
+#ifdef HAVE_SPLICE
+/*
+ * Whether pack data may be spliced from pack-objects straight to our
+ * output, which must then be a pipe or socket. -1 means undecided.
+ */
+static int zero_copy = -1;
+
+static int can_splice_output(void)
+{
+	struct stat st;
+
+	if (zero_copy < 0)
+		zero_copy = !git_env_bool("GIT_TEST_NO_ZERO_COPY", 0) &&
+			    !fstat(1, &st) &&
+			    (S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode));
+	return zero_copy;
+}
+
+/*
+ * Move what pack-objects has written so far (or the next part of a
+ * cached pack) to our output without copying it through user space,
+ * framed in a single sideband packet if needed. The last byte is left
+ * unread, for the same reason relay_pack_data() holds back the last
+ * byte it reads.
+ *
+ * Returns the number of bytes moved, or 0 if there was too little
+ * data for this to be worthwhile.
+ */
+static ssize_t splice_pack_data(int pack_objects_out, struct output_state *os,
+				int use_sideband)
+{
+	int avail;
+	size_t n, left;
+	off_t pos = 0;
+
+	if (ioctl(pack_objects_out, FIONREAD, &avail) < 0 || avail <= 1)
+		return 0;
+
+	/*
+	 * Leave it to the caller to send what is buffered if that
+	 * already fills a sideband packet.
+	 */
+	if (use_sideband && os->used + 5 >= (size_t)use_sideband)
+		return 0;
+
+	n = avail - 1;
+	if (use_sideband && n > use_sideband - 5 - os->used)
+		n = use_sideband - 5 - os->used;
+
+	if (use_sideband) {
+		char hdr[5];
+		xsnprintf(hdr, sizeof(hdr), "%04x", (unsigned)(n + os->used + 5));
+		hdr[4] = 1;
+		write_or_die(1, hdr, 5);
+	}
+	write_or_die(1, os->buffer, os->used);
+	os->used = 0;
+
+	if (os->from_cache &&
+	    (pos = lseek(pack_objects_out, 0, SEEK_CUR)) < 0)
+		die_errno(_("unable to relay pack data"));
+
+	for (left = n; left; ) {
+		ssize_t moved;
+
+		if (os->from_cache)
+			moved = xsendfile(1, pack_objects_out, pos, left);
+		else
+			moved = xsplice(pack_objects_out, 1, left);
+		if (moved < 0)
+			die_errno(_("unable to relay pack data"));
+		if (!moved)
+			die(_("unexpected end of pack data"));
+		pos += moved;
+		left -= moved;
+	}
+
+	if (os->from_cache && lseek(pack_objects_out, pos, SEEK_SET) < 0)
+		die_errno(_("unable to relay pack data"));
+	return n;
+}
+#endif
+
 static int relay_pack_data(int pack_objects_out, struct output_state *os,
 			   int use_sideband, int write_packfile_line)
 {
@@ -232,11 +337,26 @@ static int relay_pack_data(int pack_objects_out, struct output_state *os,
 	 */
 	ssize_t readsz;
 
+#ifdef HAVE_SPLICE
+	if (os->packfile_started && !os->cache && can_splice_output()) {
+		readsz = splice_pack_data(pack_objects_out, os, use_sideband);
+		if (readsz)
+			return readsz;
+	}
+#endif
+
 	readsz = xread(pack_objects_out, os->buffer + os->used,
 		       sizeof(os->buffer) - os->used);
 	if (readsz < 0) {
 		return readsz;
 	}
+	if (os->cache &&
+	    write_in_full(get_lock_file_fd(os->cache),
+			  os->buffer + os->used, readsz) < 0) {
+		warning_errno(_("unable to write to pack cache"));
+		rollback_lock_file(os->cache);
+		os->cache = NULL;
+	}
 	os->used += readsz;
 
 	while (!os->packfile_started) {
@@ -282,6 +402,247 @@ static int relay_pack_data(int pack_objects_out, struct output_state *os,
 	return readsz;
 }
 
+/*
+ * Packs for full clones are cached under "$GIT_OBJECT_DIRECTORY/pack-cache",
+ * named after a hash of everything that determines what pack-objects
+ * sends: its arguments, the objects wanted and the state of all refs
+ * (which matters for --include-tag).
+ */
+static int pack_cache_usable(struct upload_pack_data *data)
+{
+	return data->pack_cache && !data->pack_objects_hook &&
+	       !data->have_obj.nr && !data->extra_edge_obj.nr &&
+	       !data->shallow_nr && !is_repository_shallow(the_repository);
+}
+
+static int hash_one_ref(const char *refname, const char *referent UNUSED,
+			const struct object_id *oid, int flags UNUSED,
+			void *cb_data)
+{
+	struct git_hash_ctx *ctx = cb_data;
+
+	git_hash_update(ctx, refname, strlen(refname) + 1);
+	git_hash_update(ctx, oid->hash, the_hash_algo->rawsz);
+	return 0;
+}
+
+static void pack_cache_key(struct upload_pack_data *data,
+			   const struct strvec *args, struct object_id *key)
+{
+	struct git_hash_ctx ctx;
+
+	the_hash_algo->init_fn(&ctx);
+	for (size_t i = 0; i < args->nr; i++) {
+		/* progress goes to stderr, not to the pack stream */
+		if (!strcmp(args->v[i], "--progress"))
+			continue;
+		git_hash_update(&ctx, args->v[i], strlen(args->v[i]) + 1);
+	}
+	git_hash_update(&ctx, "", 1);
+	for (size_t i = 0; i < data->want_obj.nr; i++)
+		git_hash_update(&ctx, data->want_obj.objects[i].item->oid.hash,
+				the_hash_algo->rawsz);
+	git_hash_update(&ctx, "", 1);
+	refs_for_each_ref(get_main_ref_store(the_repository), hash_one_ref, &ctx);
+	git_hash_final_oid(key, &ctx);
+}
+
+/*
+ * Open the cached pack at "path", unless it has expired.
+ */
+static int pack_cache_open_fresh(struct upload_pack_data *data, const char *path)
+{
+	struct stat st;
+	int fd = git_open(path);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_mtime <= data->pack_cache_expire) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Remove the lock at "path" if it has not been written to for a while,
+ * as left behind by an upload-pack that was killed. Returns 1 if it was
+ * removed.
+ */
+static int pack_cache_remove_stale_lock(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0 ||
+	    st.st_mtime + PACK_CACHE_LOCK_TIMEOUT > time(NULL))
+		return 0;
+	return !unlink_or_warn(path);
+}
+
+/*
+ * Look for a cached pack answering this request. Returns a descriptor
+ * to stream it from, or -1 if there is none. In the latter case, "lock"
+ * may have been taken, and the pack should then be written to it.
+ *
+ * While another upload-pack holds the lock for the same request, the
+ * pack is generated without the cache rather than waiting for it: we
+ * cannot send anything to keep the client alive in the meantime.
+ */
+static int pack_cache_open(struct upload_pack_data *data,
+			   const struct strvec *args,
+			   struct strbuf *path, struct lock_file *lock)
+{
+	struct object_id key;
+	const char *status = "hit";
+	int fd;
+
+	strbuf_addf(path, "%s/pack-cache",
+		    repo_get_object_directory(the_repository));
+	if (mkdir(path->buf, 0777) < 0 && errno != EEXIST)
+		return -1;
+	if (adjust_shared_perm(the_repository, path->buf))
+		return -1;
+
+	pack_cache_key(data, args, &key);
+	strbuf_addf(path, "/%s.pack", oid_to_hex(&key));
+
+	fd = pack_cache_open_fresh(data, path->buf);
+	if (fd >= 0)
+		goto out;
+
+	if (hold_lock_file_for_update(lock, path->buf, 0) < 0) {
+		struct strbuf lock_path = STRBUF_INIT;
+		int stale;
+
+		strbuf_addf(&lock_path, "%s.lock", path->buf);
+		stale = errno == EEXIST &&
+			pack_cache_remove_stale_lock(lock_path.buf);
+		strbuf_release(&lock_path);
+		if (!stale ||
+		    hold_lock_file_for_update(lock, path->buf, 0) < 0) {
+			status = "busy";
+			goto out;
+		}
+	}
+
+	/* somebody else may have stored it before we took the lock */
+	fd = pack_cache_open_fresh(data, path->buf);
+	if (fd >= 0)
+		rollback_lock_file(lock);
+	else
+		status = "miss";
+
+out:
+	trace2_data_string("upload-pack", the_repository, "pack-cache", status);
+	return fd;
+}
+
+struct pack_cache_entry {
+	char *path;
+	off_t size;
+	time_t mtime;
+};
+
+static int pack_cache_entry_cmp(const void *va, const void *vb)
+{
+	const struct pack_cache_entry *a = va, *b = vb;
+
+	/* newest first */
+	if (a->mtime != b->mtime)
+		return a->mtime < b->mtime ? 1 : -1;
+	return strcmp(a->path, b->path);
+}
+
+/*
+ * Drop expired packs and stale locks from the cache, then the oldest
+ * packs until the cache fits into "uploadpack.packCacheSize".
+ */
+static void prune_pack_cache(struct upload_pack_data *data, const char *dirname)
+{
+	struct pack_cache_entry *entries = NULL;
+	size_t nr = 0, alloc = 0;
+	struct strbuf path = STRBUF_INIT;
+	size_t dirlen;
+	uintmax_t total = 0;
+	struct dirent *de;
+	DIR *dir = opendir(dirname);
+
+	if (!dir)
+		return;
+
+	strbuf_addf(&path, "%s/", dirname);
+	dirlen = path.len;
+	while ((de = readdir(dir))) {
+		struct stat st;
+
+		strbuf_setlen(&path, dirlen);
+		strbuf_addstr(&path, de->d_name);
+		if (ends_with(de->d_name, ".pack.lock")) {
+			pack_cache_remove_stale_lock(path.buf);
+			continue;
+		}
+		if (!ends_with(de->d_name, ".pack"))
+			continue;
+		if (stat(path.buf, &st) < 0)
+			continue;
+		if (st.st_mtime <= data->pack_cache_expire) {
+			unlink_or_warn(path.buf);
+			continue;
+		}
+		ALLOC_GROW(entries, nr + 1, alloc);
+		entries[nr].path = xstrdup(path.buf);
+		entries[nr].size = st.st_size;
+		entries[nr].mtime = st.st_mtime;
+		nr++;
+	}
+	closedir(dir);
+
+	QSORT(entries, nr, pack_cache_entry_cmp);
+	for (size_t i = 0; i < nr; i++) {
+		total += entries[i].size;
+		if (total > data->pack_cache_size)
+			unlink_or_warn(entries[i].path);
+		free(entries[i].path);
+	}
+
+	free(entries);
+	strbuf_release(&path);
+}
+
+static void finish_pack_output(struct upload_pack_data *pack_data,
+			       struct output_state *output_state)
+{
+	/* flush the data */
+	if (output_state->used > 0) {
+		send_client_data(1, output_state->buffer, output_state->used,
+				 pack_data->use_sideband);
+		fprintf(stderr, "flushed.\n");
+	}
+	free(output_state);
+	if (pack_data->use_sideband)
+		packet_flush(1);
+}
+
+static void send_cached_pack(struct upload_pack_data *pack_data,
+			     struct output_state *output_state,
+			     const struct string_list *uri_protocols,
+			     int fd)
+{
+	ssize_t sz;
+
+	output_state->from_cache = 1;
+	while ((sz = relay_pack_data(fd, output_state,
+				     pack_data->use_sideband,
+				     !!uri_protocols)) > 0)
+		; /* keep going */
+	if (sz < 0)
+		die_errno(_("unable to read cached pack"));
+	close(fd);
+
+	finish_pack_output(pack_data, output_state);
+}
+
 static void create_pack_file(struct upload_pack_data *pack_data,
 			     const struct string_list *uri_protocols)
 {
@@ -293,6 +654,8 @@ static void create_pack_file(struct upload_pack_data *pack_data,
 	ssize_t sz;
 	int i;
 	FILE *pipe_fd;
+	struct lock_file cache_lock = LOCK_INIT;
+	struct strbuf cache_path = STRBUF_INIT;
 
 	if (!pack_data->pack_objects_hook)
 		pack_objects.git_cmd = 1;
@@ -333,6 +696,20 @@ static void create_pack_file(struct upload_pack_data *pack_data,
 					 uri_protocols->items[i].string);
 	}
 
+	if (pack_cache_usable(pack_data)) {
+		int fd = pack_cache_open(pack_data, &pack_objects.args,
+					 &cache_path, &cache_lock);
+		if (fd >= 0) {
+			child_process_clear(&pack_objects);
+			strbuf_release(&cache_path);
+			send_cached_pack(pack_data, output_state,
+					 uri_protocols, fd);
+			return;
+		}
+		if (is_lock_file_locked(&cache_lock))
+			output_state->cache = &cache_lock;
+	}
+
 	pack_objects.in = -1;
 	pack_objects.out = -1;
 	pack_objects.err = -1;
@@ -456,18 +833,19 @@ static void create_pack_file(struct upload_pack_data *pack_data,
 		goto fail;
 	}
 
-	/* flush the data */
-	if (output_state->used > 0) {
-		send_client_data(1, output_state->buffer, output_state->used,
-				 pack_data->use_sideband);
-		fprintf(stderr, "flushed.\n");
+	if (output_state->cache) {
+		if (commit_lock_file(&cache_lock) < 0)
+			warning_errno(_("unable to store pack in cache"));
+		strbuf_setlen(&cache_path, strrchr(cache_path.buf, '/') - cache_path.buf);
+		prune_pack_cache(pack_data, cache_path.buf);
 	}
-	free(output_state);
-	if (pack_data->use_sideband)
-		packet_flush(1);
+	strbuf_release(&cache_path);
+
+	finish_pack_output(pack_data, output_state);
 	return;
 
  fail:
+	rollback_lock_file(&cache_lock);
 	free(output_state);
 	send_client_data(3, abort_msg, strlen(abort_msg),
 			 pack_data->use_sideband);
@@ -1387,6 +1765,13 @@ static int upload_pack_config(const char *var, const char *value,
 		data->allow_ref_in_want = git_config_bool(var, value);
 	} else if (!strcmp("uploadpack.allowsidebandall", var)) {
 		data->allow_sideband_all = git_config_bool(var, value);
+	} else if (!strcmp("uploadpack.packcache", var)) {
+		data->pack_cache = git_config_bool(var, value);
+	} else if (!strcmp("uploadpack.packcachesize", var)) {
+		data->pack_cache_size = git_config_ulong(var, value, ctx->kvi);
+	} else if (!strcmp("uploadpack.packcacheexpiry", var)) {
+		if (git_config_expiry_date(&data->pack_cache_expire, var, value))
+			return -1;
 	} else if (!strcmp("uploadpack.blobpackfileuri", var)) {
 		if (value)
 			data->allow_packfile_uris = 1;
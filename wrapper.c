@@ -11,6 +11,14 @@
 #include "strbuf.h"
 #include "trace2.h"
 
+#ifdef HAVE_SPLICE
+#include <sys/sendfile.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
 #ifdef HAVE_RTLGENRANDOM
 /* This is required to get access to RtlGenRandom. */
 #define SystemFunction036 NTAPI SystemFunction036
@@ -265,6 +273,81 @@ ssize_t xwrite(int fd, const void *buf, size_t len)
 	}
 }
 
+/*
+ * xsendfile() copies up to "len" bytes at "offset" of "in_fd" to
+ * "out_fd" inside the kernel, restarting on recoverable errors like
+ * xwrite(). Fails with ENOSYS where the platform cannot do that.
+ */
+ssize_t xsendfile(int out_fd, int in_fd, off_t offset, size_t len)
+{
+#ifdef HAVE_SPLICE
+	ssize_t nr;
+	if (len > MAX_IO_SIZE)
+		len = MAX_IO_SIZE;
+	while (1) {
+		nr = sendfile(out_fd, in_fd, &offset, len);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			if (handle_nonblock(out_fd, POLLOUT, errno))
+				continue;
+		}
+
+		return nr;
+	}
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * xsplice() moves up to "len" bytes from the pipe "in_fd" to "out_fd"
+ * without copying them through user space. Same rules as xsendfile().
+ */
+ssize_t xsplice(int in_fd, int out_fd, size_t len)
+{
+#ifdef HAVE_SPLICE
+	ssize_t nr;
+	if (len > MAX_IO_SIZE)
+		len = MAX_IO_SIZE;
+	while (1) {
+		nr = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MORE);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			if (handle_nonblock(out_fd, POLLOUT, errno))
+				continue;
+		}
+
+		return nr;
+	}
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * xclone_fd() makes "dst_fd" share the contents of "src_fd" without
+ * copying them (a "reflink"), where the file system supports it.
+ * Returns 0 on success, or -1 with errno set, e.g. to EOPNOTSUPP or
+ * EXDEV, or to ENOSYS where the platform cannot do this at all.
+ */
+int xclone_fd(int dst_fd, int src_fd)
+{
+#ifdef FICLONE
+	while (ioctl(dst_fd, FICLONE, src_fd)) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 /*
  * xpread() is the same as pread(), but it automatically restarts pread()
  * operations with a recoverable error (EAGAIN and EINTR). xpread() DOES
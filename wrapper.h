@@ -17,6 +17,9 @@ int xopen(const char *path, int flags, ...);
 ssize_t xread(int fd, void *buf, size_t len);
 ssize_t xwrite(int fd, const void *buf, size_t len);
 ssize_t xpread(int fd, void *buf, size_t len, off_t offset);
+ssize_t xsendfile(int out_fd, int in_fd, off_t offset, size_t len);
+ssize_t xsplice(int in_fd, int out_fd, size_t len);
+int xclone_fd(int dst_fd, int src_fd);
 int xdup(int fd);
 FILE *xfopen(const char *path, const char *mode);
 FILE *xfdopen(int fd, const char *mode);